@@ -192,9 +192,16 @@ struct rxe_resize_cq_resp {
 	struct mminfo mi;
 };
 
+enum rxe_create_qp_resp_flags {
+	/* the kernel maintains RXE_SQ_BUSY in the SQ queue header */
+	RXE_CREATE_QP_RESP_SQ_BUSY = 1 << 0,
+};
+
 struct rxe_create_qp_resp {
 	struct mminfo rq_mi;
 	struct mminfo sq_mi;
+	__u32 flags;		/* enum rxe_create_qp_resp_flags */
+	__u32 reserved;
 };
 
 struct rxe_create_srq_resp {
@@ -347,6 +347,7 @@ struct ibv_context *verbs_open_device(struct ibv_device *device, void *private_d
 		return NULL;
 
 	set_lib_ops(context_ex);
+	verbs_stats_init(context_ex);
 	if (verbs_device->sysfs) {
 		if (context_ex->context.async_fd == -1) {
 			ret = ibv_cmd_alloc_async_fd(&context_ex->context);
@@ -416,6 +417,7 @@ struct ibv_context *ibv_import_device(int cmd_fd)
 		goto out;
 
 	set_lib_ops(context_ex);
+	verbs_stats_init(context_ex);
 
 	context_ex->priv->imported = true;
 	ctx = &context_ex->context;
@@ -431,6 +433,7 @@ out:
 
 void verbs_uninit_context(struct verbs_context *context_ex)
 {
+	verbs_stats_uninit(context_ex);
 	free(context_ex->priv);
 	if (context_ex->context.cmd_fd != -1)
 		close(context_ex->context.cmd_fd);
@@ -159,7 +159,7 @@ out:
 	closedir(conf_dir);
 }
 
-static void load_driver(const char *name)
+static void dlopen_driver(const char *name)
 {
 	char *so_name;
 	void *dlhandle;
@@ -209,6 +209,14 @@ out_dlopen:
 	free(so_name);
 }
 
+void load_driver(const char *name)
+{
+	/* Lets verbs_register_driver() record which name loaded a provider */
+	verbs_loading_driver = name;
+	dlopen_driver(name);
+	verbs_loading_driver = NULL;
+}
+
 void load_drivers(void)
 {
 	struct ibv_driver_name *name, *next_name;
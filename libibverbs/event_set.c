@@ -0,0 +1,298 @@
+// SPDX-License-Identifier: (GPL-2.0 OR Linux-OpenIB)
+/*
+ * Wait for the async events and completion channel events of many contexts
+ * through one epoll instance, instead of a select() loop per application.
+ */
+#include <config.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+
+#include <ccan/list.h>
+#include <ccan/minmax.h>
+
+#include "ibverbs.h"
+
+/* Upper bound on the epoll events fetched by one poll call */
+#define EVENT_SET_MAX_BATCH	64
+
+struct event_set_source {
+	struct list_node	entry;
+	struct ibv_context	*context;	/* NULL for a comp channel */
+	struct ibv_comp_channel	*channel;
+	int			fd;
+	bool			armed;
+	bool			removed;
+	unsigned int		busy;		/* polls reading from it */
+};
+
+/*
+ * epoll may hand a poll call a source that is removed concurrently.
+ * Removal waits for the polls reading from the source and, while any poll
+ * is running, parks the source on the dead list instead of freeing it.
+ */
+struct ibv_async_event_set {
+	int			epfd;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	struct list_head	sources;
+	struct list_head	dead;
+	unsigned int		pollers;
+};
+
+struct ibv_async_event_set *ibv_create_async_event_set(void)
+{
+	struct ibv_async_event_set *set;
+
+	set = calloc(1, sizeof(*set));
+	if (!set) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	set->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (set->epfd < 0) {
+		free(set);
+		return NULL;
+	}
+	pthread_mutex_init(&set->lock, NULL);
+	pthread_cond_init(&set->cond, NULL);
+	list_head_init(&set->sources);
+	list_head_init(&set->dead);
+	return set;
+}
+
+int ibv_destroy_async_event_set(struct ibv_async_event_set *set)
+{
+	struct event_set_source *src, *tmp;
+
+	list_for_each_safe(&set->sources, src, tmp, entry) {
+		list_del(&src->entry);
+		free(src);
+	}
+	list_for_each_safe(&set->dead, src, tmp, entry) {
+		list_del(&src->entry);
+		free(src);
+	}
+	close(set->epfd);
+	pthread_cond_destroy(&set->cond);
+	pthread_mutex_destroy(&set->lock);
+	free(set);
+	return 0;
+}
+
+/* Must hold set->lock */
+static int event_set_arm(struct ibv_async_event_set *set,
+			 struct event_set_source *src)
+{
+	struct epoll_event event = { .events = EPOLLIN, .data.ptr = src };
+
+	if (epoll_ctl(set->epfd, EPOLL_CTL_ADD, src->fd, &event))
+		return errno;
+	src->armed = true;
+	return 0;
+}
+
+static int event_set_add(struct ibv_async_event_set *set,
+			 struct ibv_context *context,
+			 struct ibv_comp_channel *channel, int fd)
+{
+	struct event_set_source *src, *new;
+	int ret;
+
+	if (fd < 0)
+		return EINVAL;
+
+	new = calloc(1, sizeof(*new));
+	if (!new)
+		return ENOMEM;
+	new->context = context;
+	new->channel = channel;
+	new->fd = fd;
+
+	pthread_mutex_lock(&set->lock);
+	list_for_each(&set->sources, src, entry) {
+		if (src->context != context || src->channel != channel)
+			continue;
+
+		/* Adding a source again re-arms it after an error */
+		ret = src->armed ? EEXIST : event_set_arm(set, src);
+		pthread_mutex_unlock(&set->lock);
+		free(new);
+		return ret;
+	}
+
+	ret = event_set_arm(set, new);
+	if (ret) {
+		pthread_mutex_unlock(&set->lock);
+		free(new);
+		return ret;
+	}
+	list_add_tail(&set->sources, &new->entry);
+	pthread_mutex_unlock(&set->lock);
+	return 0;
+}
+
+static int event_set_remove(struct ibv_async_event_set *set,
+			    struct ibv_context *context,
+			    struct ibv_comp_channel *channel)
+{
+	struct event_set_source *src;
+
+	pthread_mutex_lock(&set->lock);
+	list_for_each(&set->sources, src, entry) {
+		if (src->context != context || src->channel != channel)
+			continue;
+
+		if (src->armed)
+			epoll_ctl(set->epfd, EPOLL_CTL_DEL, src->fd, NULL);
+		src->armed = false;
+		src->removed = true;
+		list_del(&src->entry);
+
+		/* The caller may destroy the context or channel on return */
+		while (src->busy)
+			pthread_cond_wait(&set->cond, &set->lock);
+
+		if (set->pollers) {
+			list_add_tail(&set->dead, &src->entry);
+			src = NULL;
+		}
+		pthread_mutex_unlock(&set->lock);
+		free(src);
+		return 0;
+	}
+	pthread_mutex_unlock(&set->lock);
+	return ENOENT;
+}
+
+int ibv_async_event_set_add_context(struct ibv_async_event_set *set,
+				    struct ibv_context *context)
+{
+	return event_set_add(set, context, NULL, context->async_fd);
+}
+
+int ibv_async_event_set_remove_context(struct ibv_async_event_set *set,
+				       struct ibv_context *context)
+{
+	return event_set_remove(set, context, NULL);
+}
+
+int ibv_async_event_set_add_comp_channel(struct ibv_async_event_set *set,
+					 struct ibv_comp_channel *channel)
+{
+	return event_set_add(set, NULL, channel, channel->fd);
+}
+
+int ibv_async_event_set_remove_comp_channel(struct ibv_async_event_set *set,
+					    struct ibv_comp_channel *channel)
+{
+	return event_set_remove(set, NULL, channel);
+}
+
+int ibv_async_event_set_get_fd(struct ibv_async_event_set *set)
+{
+	return set->epfd;
+}
+
+/* Returns false if src was removed after epoll_wait() reported it */
+static bool event_set_get_source(struct ibv_async_event_set *set,
+				 struct event_set_source *src)
+{
+	bool ret;
+
+	pthread_mutex_lock(&set->lock);
+	ret = !src->removed;
+	if (ret)
+		src->busy++;
+	pthread_mutex_unlock(&set->lock);
+	return ret;
+}
+
+/*
+ * A source whose fd failed with EIO, as happens after the device is
+ * removed, would be reported ready forever: stop watching it until it is
+ * added again.  Other failures are retried by the next poll.
+ */
+static void event_set_put_source(struct ibv_async_event_set *set,
+				 struct event_set_source *src, bool failed)
+{
+	pthread_mutex_lock(&set->lock);
+	if (failed && errno == EIO && src->armed) {
+		epoll_ctl(set->epfd, EPOLL_CTL_DEL, src->fd, NULL);
+		src->armed = false;
+	}
+	if (!--src->busy && src->removed)
+		pthread_cond_broadcast(&set->cond);
+	pthread_mutex_unlock(&set->lock);
+}
+
+int ibv_async_event_set_poll(struct ibv_async_event_set *set,
+			     struct ibv_async_event_set_event *events,
+			     int num_events, int timeout)
+{
+	struct epoll_event ready[EVENT_SET_MAX_BATCH];
+	struct ibv_async_event_set_event *event;
+	struct event_set_source *src, *tmp;
+	int i, n, err, num = 0;
+	bool failed;
+
+	if (num_events <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&set->lock);
+	set->pollers++;
+	pthread_mutex_unlock(&set->lock);
+
+	n = epoll_wait(set->epfd, ready,
+		       min_t(int, num_events, EVENT_SET_MAX_BATCH), timeout);
+	err = errno;
+
+	/*
+	 * The fds are level triggered, take one event from each ready source
+	 * and leave anything else queued for the next call.
+	 */
+	for (i = 0; i < n; i++) {
+		src = ready[i].data.ptr;
+		event = &events[num];
+		if (!event_set_get_source(set, src))
+			continue;
+		errno = 0;
+
+		if (src->channel) {
+			failed = ibv_get_cq_event(src->channel, &event->comp.cq,
+						  &event->comp.cq_context);
+			event->type = IBV_ASYNC_EVENT_SET_COMP;
+			event->context = src->channel->context;
+			event->comp.channel = src->channel;
+		} else {
+			failed = ibv_get_async_event(src->context,
+						     &event->async);
+			event->type = IBV_ASYNC_EVENT_SET_ASYNC;
+			event->context = src->context;
+		}
+		event_set_put_source(set, src, failed);
+		if (!failed)
+			num++;
+	}
+
+	pthread_mutex_lock(&set->lock);
+	if (!--set->pollers) {
+		list_for_each_safe(&set->dead, src, tmp, entry) {
+			list_del(&src->entry);
+			free(src);
+		}
+	}
+	pthread_mutex_unlock(&set->lock);
+
+	if (n < 0) {
+		errno = err;
+		return -1;
+	}
+	return num;
+}
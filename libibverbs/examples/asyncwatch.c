@@ -84,15 +84,65 @@ static void usage(const char *argv0)
 	printf("\n");
 	printf("Options:\n");
 	printf("  -d, --ib-dev=<dev>     use IB device <dev> (default first device found)\n");
+	printf("  -a, --all              watch all devices\n");
 	printf("  -h, --help             print a help text and exit\n");
 }
 
+static int watch_all(struct ibv_device **dev_list)
+{
+	struct ibv_async_event_set_event events[16];
+	struct ibv_async_event_set *set;
+	struct ibv_context *context;
+	int i, n;
+
+	set = ibv_create_async_event_set();
+	if (!set) {
+		perror("Couldn't create event set");
+		return 1;
+	}
+
+	for (i = 0; dev_list[i]; ++i) {
+		context = ibv_open_device(dev_list[i]);
+		if (!context) {
+			fprintf(stderr, "Couldn't get context for %s\n",
+				ibv_get_device_name(dev_list[i]));
+			return 1;
+		}
+		if (ibv_async_event_set_add_context(set, context)) {
+			fprintf(stderr, "Couldn't watch %s\n",
+				ibv_get_device_name(dev_list[i]));
+			return 1;
+		}
+		printf("%s: async event FD %d\n",
+		       ibv_get_device_name(dev_list[i]), context->async_fd);
+	}
+
+	while (1) {
+		n = ibv_async_event_set_poll(set, events, 16, -1);
+		if (n < 0)
+			return 1;
+
+		for (i = 0; i < n; i++) {
+			printf("%s: event_type %s (%d), port %d\n",
+			       ibv_get_device_name(events[i].context->device),
+			       event_name_str(events[i].async.event_type),
+			       events[i].async.event_type,
+			       events[i].async.element.port_num);
+
+			ibv_ack_async_event(&events[i].async);
+		}
+	}
+
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
 	struct ibv_device **dev_list;
 	struct ibv_context *context;
 	struct ibv_async_event event;
 	char   *ib_devname = NULL;
+	int all = 0;
 	int i = 0;
 
 	/* Force line-buffering in case stdout is redirected */
@@ -103,17 +153,21 @@ int main(int argc, char *argv[])
 		int c;
 		static struct option long_options[] = {
 			{ .name = "ib-dev",    .has_arg = 1, .val = 'd' },
+			{ .name = "all",       .has_arg = 0, .val = 'a' },
 			{ .name = "help",      .has_arg = 0, .val = 'h' },
 			{}
 		};
 
-		c = getopt_long(argc, argv, "d:h", long_options, NULL);
+		c = getopt_long(argc, argv, "d:ah", long_options, NULL);
 		if (c == -1)
 			break;
 		switch (c) {
 		case 'd':
 			ib_devname = strdupa(optarg);
 			break;
+		case 'a':
+			all = 1;
+			break;
 		case 'h':
 			ret = 0;
 			SWITCH_FALLTHROUGH;
@@ -127,6 +181,8 @@ int main(int argc, char *argv[])
 		perror("Failed to get IB devices list");
 		return 1;
 	}
+	if (all)
+		return watch_all(dev_list);
 	if (ib_devname) {
 		for (; dev_list[i]; ++i) {
 			if (!strcmp(ibv_get_device_name(dev_list[i]), ib_devname))
@@ -33,6 +33,8 @@
 
 #include <dirent.h>
 #include <fcntl.h>
+#include <stdatomic.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <sys/sysmacros.h>
 
@@ -187,11 +189,50 @@ err:
 	return NLE_PARSE_ERR;
 }
 
+/*
+ * The uverbs lookup and device node check are done per device, spread over
+ * the probe threads.  A netlink socket must not be shared between threads,
+ * so the first worker to start takes the one used for the device dump and
+ * the others open their own.
+ */
+struct nl_probe {
+	unsigned int		num;
+	atomic_uint		next;
+	struct nl_sock *_Atomic	nl;
+	struct verbs_sysfs_dev	**devs;
+	bool			*drop;
+};
+
+static void *probe_devs_nl(void *arg)
+{
+	struct nl_probe *probe = arg;
+	struct verbs_sysfs_dev *dev;
+	struct nl_sock *nl, *own = NULL;
+	unsigned int i;
+
+	nl = atomic_exchange(&probe->nl, NULL);
+	if (!nl)
+		nl = own = rdmanl_socket_alloc();
+
+	while ((i = atomic_fetch_add(&probe->next, 1)) < probe->num) {
+		dev = probe->devs[i];
+		probe->drop[i] = ((!nl || find_uverbs_nl(nl, dev)) &&
+				  find_uverbs_sysfs(dev)) ||
+				 try_access_device(dev);
+	}
+
+	if (own)
+		nl_socket_free(own);
+	return NULL;
+}
+
 /* Fetch the list of IB devices and uverbs from netlink */
 int find_sysfs_devs_nl(struct list_head *tmp_sysfs_dev_list)
 {
 	struct verbs_sysfs_dev *dev, *dev_tmp;
+	struct nl_probe probe = {};
 	struct nl_sock *nl;
+	unsigned int i;
 
 	nl = rdmanl_socket_alloc();
 	if (!nl)
@@ -200,14 +241,34 @@ int find_sysfs_devs_nl(struct list_head *tmp_sysfs_dev_list)
 	if (rdmanl_get_devices(nl, find_sysfs_devs_nl_cb, tmp_sysfs_dev_list))
 		goto err;
 
-	list_for_each_safe (tmp_sysfs_dev_list, dev, dev_tmp, entry) {
-		if ((find_uverbs_nl(nl, dev) && find_uverbs_sysfs(dev)) ||
-		    try_access_device(dev)) {
-			list_del(&dev->entry);
-			free(dev);
+	list_for_each (tmp_sysfs_dev_list, dev, entry)
+		probe.num++;
+	if (!probe.num)
+		goto out;
+
+	probe.devs = calloc(probe.num, sizeof(*probe.devs));
+	probe.drop = calloc(probe.num, sizeof(*probe.drop));
+	if (!probe.devs || !probe.drop) {
+		free(probe.devs);
+		free(probe.drop);
+		goto err;
+	}
+	i = 0;
+	list_for_each (tmp_sysfs_dev_list, dev, entry)
+		probe.devs[i++] = dev;
+	atomic_init(&probe.nl, nl);
+	run_sysfs_probe(probe.num, probe_devs_nl, &probe);
+
+	for (i = 0; i != probe.num; i++) {
+		if (probe.drop[i]) {
+			list_del(&probe.devs[i]->entry);
+			free(probe.devs[i]);
 		}
 	}
+	free(probe.devs);
+	free(probe.drop);
 
+out:
 	nl_socket_free(nl);
 	return 0;
 
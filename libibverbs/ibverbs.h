@@ -60,13 +60,26 @@ int __lib_query_port(struct ibv_context *context, uint8_t port_num,
 		     struct ibv_port_attr *port_attr, size_t port_attr_len);
 int setup_sysfs_uverbs(int uv_dirfd, const char *uverbs,
 		       struct verbs_sysfs_dev *sysfs_dev);
+void ibv_mr_cache_flush_pd(struct ibv_pd *pd);
+void verbs_stats_set_level(void);
+void verbs_stats_init(struct verbs_context *vctx);
+void verbs_stats_uninit(struct verbs_context *vctx);
+
+bool ibv_sysfs_fake_tree(void);
+
+/* Set by load_driver() while the provider library runs its constructors */
+extern const char *verbs_loading_driver;
 
 #ifdef _STATIC_LIBRARY_BUILD_
 static inline void load_drivers(void)
 {
 }
+static inline void load_driver(const char *name)
+{
+}
 #else
 void load_drivers(void);
+void load_driver(const char *name);
 #endif
 
 struct verbs_ex_private {
@@ -75,6 +88,7 @@ struct verbs_ex_private {
 	bool use_ioctl_write;
 	struct verbs_context_ops ops;
 	bool imported;
+	struct verbs_stats *stats;
 };
 
 static inline struct verbs_ex_private *get_priv(struct ibv_context *ctx)
@@ -91,6 +105,8 @@ enum ibv_node_type decode_knode_type(unsigned int knode_type);
 
 int find_sysfs_devs_nl(struct list_head *tmp_sysfs_dev_list);
 
+void run_sysfs_probe(unsigned int num, void *(*worker)(void *), void *arg);
+
 int try_access_device(const struct verbs_sysfs_dev *sysfs_dev);
 
 #endif /* IB_VERBS_H */
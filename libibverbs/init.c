@@ -48,6 +48,8 @@
 #include <errno.h>
 #include <assert.h>
 #include <fnmatch.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <sys/sysmacros.h>
 
 #include <rdma/rdma_netlink.h>
@@ -80,8 +82,12 @@ void __verbs_log(struct verbs_context *ctx, uint32_t level,
 struct ibv_driver {
 	struct list_node	entry;
 	const struct verbs_device_ops *ops;
+	/* Name given to load_driver() for dynamically loaded providers */
+	char			*load_name;
 };
 
+const char *verbs_loading_driver;
+
 static LIST_HEAD(driver_list);
 
 int try_access_device(const struct verbs_sysfs_dev *sysfs_dev)
@@ -90,6 +96,10 @@ int try_access_device(const struct verbs_sysfs_dev *sysfs_dev)
 	char *devpath;
 	int ret;
 
+	/* A fake sysfs tree has no matching device nodes */
+	if (ibv_sysfs_fake_tree())
+		return 0;
+
 	if (asprintf(&devpath, RDMA_CDEV_DIR"/%s",
 		     sysfs_dev->sysfs_name) < 0)
 		return ENOMEM;
@@ -151,12 +161,13 @@ int setup_sysfs_uverbs(int uv_dirfd, const char *uverbs,
 }
 
 static int setup_sysfs_dev(int dirfd, const char *uverbs,
-			   struct list_head *tmp_sysfs_dev_list)
+			   struct verbs_sysfs_dev **out)
 {
 	struct verbs_sysfs_dev *sysfs_dev = NULL;
 	char value[32];
 	int uv_dirfd;
 
+	*out = NULL;
 	sysfs_dev = calloc(1, sizeof(*sysfs_dev));
 	if (!sysfs_dev)
 		return ENOMEM;
@@ -191,7 +202,7 @@ static int setup_sysfs_dev(int dirfd, const char *uverbs,
 		goto err_fd;
 
 	close(uv_dirfd);
-	list_add(tmp_sysfs_dev_list, &sysfs_dev->entry);
+	*out = sysfs_dev;
 	return 0;
 
 err_fd:
@@ -201,12 +212,67 @@ err_alloc:
 	return 0;
 }
 
+/*
+ * Each device costs several sysfs reads or netlink queries, hosts with many
+ * VFs probe them from a few threads.
+ */
+#define SYSFS_PROBE_DEVS_PER_THREAD	16
+#define SYSFS_PROBE_MAX_THREADS		8
+
+struct sysfs_probe {
+	int			dirfd;
+	unsigned int		num;
+	atomic_uint		next;
+	char			**names;
+	struct verbs_sysfs_dev	**devs;
+	int			*rets;
+};
+
+static void *probe_sysfs_devs(void *arg)
+{
+	struct sysfs_probe *probe = arg;
+	unsigned int i;
+
+	while ((i = atomic_fetch_add(&probe->next, 1)) < probe->num)
+		probe->rets[i] = setup_sysfs_dev(probe->dirfd, probe->names[i],
+						 &probe->devs[i]);
+	return NULL;
+}
+
+/*
+ * Run worker(arg) on enough threads for num devices.  The calling thread is
+ * one of them, the workers share out the devices themselves.
+ */
+void run_sysfs_probe(unsigned int num, void *(*worker)(void *), void *arg)
+{
+	pthread_t threads[SYSFS_PROBE_MAX_THREADS - 1];
+	unsigned int nthreads, started = 0, i;
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	nthreads = num / SYSFS_PROBE_DEVS_PER_THREAD;
+	if (nthreads > SYSFS_PROBE_MAX_THREADS)
+		nthreads = SYSFS_PROBE_MAX_THREADS;
+	if (ncpus > 0 && nthreads > ncpus)
+		nthreads = ncpus;
+
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&threads[started], NULL, worker, arg))
+			break;
+		started++;
+	}
+	worker(arg);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+}
+
 static int find_sysfs_devs(struct list_head *tmp_sysfs_dev_list)
 {
-	struct verbs_sysfs_dev *dev, *dev_tmp;
 	char class_path[IBV_SYSFS_PATH_MAX];
+	struct sysfs_probe probe = {};
+	unsigned int max_names = 0, i;
 	DIR *class_dir;
 	struct dirent *dent;
+	char **tmp;
 	int ret = 0;
 
 	if (!check_snprintf(class_path, sizeof(class_path),
@@ -221,19 +287,53 @@ static int find_sysfs_devs(struct list_head *tmp_sysfs_dev_list)
 		if (dent->d_name[0] == '.')
 			continue;
 
-		ret = setup_sysfs_dev(dirfd(class_dir), dent->d_name,
-				      tmp_sysfs_dev_list);
-		if (ret)
-			break;
+		if (probe.num == max_names) {
+			max_names = max_names ? max_names * 2 : 16;
+			tmp = realloc(probe.names, max_names * sizeof(*tmp));
+			if (!tmp) {
+				ret = ENOMEM;
+				goto out;
+			}
+			probe.names = tmp;
+		}
+		probe.names[probe.num] = strdup(dent->d_name);
+		if (!probe.names[probe.num]) {
+			ret = ENOMEM;
+			goto out;
+		}
+		probe.num++;
 	}
-	closedir(class_dir);
+	if (!probe.num)
+		goto out;
 
-	if (ret) {
-		list_for_each_safe (tmp_sysfs_dev_list, dev, dev_tmp, entry) {
-			list_del(&dev->entry);
-			free(dev);
-		}
+	probe.devs = calloc(probe.num, sizeof(*probe.devs));
+	probe.rets = calloc(probe.num, sizeof(*probe.rets));
+	if (!probe.devs || !probe.rets) {
+		ret = ENOMEM;
+		goto out;
 	}
+	probe.dirfd = dirfd(class_dir);
+	run_sysfs_probe(probe.num, probe_sysfs_devs, &probe);
+
+	for (i = 0; i != probe.num; i++)
+		if (probe.rets[i])
+			ret = probe.rets[i];
+	for (i = 0; i != probe.num; i++) {
+		if (!probe.devs[i])
+			continue;
+		if (ret)
+			free(probe.devs[i]);
+		else
+			list_add(tmp_sysfs_dev_list, &probe.devs[i]->entry);
+	}
+
+out:
+	closedir(class_dir);
+	for (i = 0; i != probe.num; i++)
+		free(probe.names[i]);
+	free(probe.names);
+	free(probe.devs);
+	free(probe.rets);
 	return ret;
 }
 
@@ -250,6 +350,9 @@ void verbs_register_driver(const struct verbs_device_ops *ops)
 	}
 
 	driver->ops = ops;
+	driver->load_name = NULL;
+	if (verbs_loading_driver)
+		driver->load_name = strdup(verbs_loading_driver);
 
 	list_add_tail(&driver_list, &driver->entry);
 }
@@ -548,16 +651,294 @@ static void try_all_drivers(struct list_head *sysfs_list,
 	}
 }
 
+/*
+ * RDMAV_DEVICE_CACHE names a file remembering the provider each device was
+ * matched to, so later processes only load the providers they need instead
+ * of every configured one. It is only a hint, anything that does not match
+ * falls back to loading all providers.
+ */
+struct driver_cache_ent {
+	char			*key;
+	char			*load_name;	/* NULL if nothing matched */
+};
+
+/* Sorted by key */
+struct driver_cache {
+	struct driver_cache_ent	*ents;
+	unsigned int		num;
+};
+
+static const char *driver_cache_path(void)
+{
+	/* Only follow the environment if we're not running setuid */
+	if (getuid() != geteuid())
+		return NULL;
+	return getenv("RDMAV_DEVICE_CACHE");
+}
+
+/* Cached matches are dropped whenever the provider configuration changes */
+static char *driver_cache_stamp(void)
+{
+	const char *env = NULL;
+	struct stat conf;
+	char *stamp;
+
+	if (stat(IBV_CONFIG_DIR, &conf))
+		memset(&conf, 0, sizeof(conf));
+
+	if (getuid() == geteuid()) {
+		env = getenv("RDMAV_DRIVERS");
+		if (!env)
+			env = getenv("IBV_DRIVERS");
+	}
+
+	if (asprintf(&stamp, "v1 %lld.%09ld %s", (long long)conf.st_mtim.tv_sec,
+		     conf.st_mtim.tv_nsec, env ? env : "-") < 0)
+		return NULL;
+	return stamp;
+}
+
+static bool driver_cache_key(struct verbs_sysfs_dev *sysfs_dev, char *buf,
+			     size_t len)
+{
+	return check_snprintf(buf, len, "%s %d %u %lld.%09ld",
+			      sysfs_dev->ibdev_name, sysfs_dev->ibdev_idx,
+			      sysfs_dev->driver_id,
+			      (long long)sysfs_dev->time_created.tv_sec,
+			      sysfs_dev->time_created.tv_nsec);
+}
+
+static void free_driver_cache(struct driver_cache *cache)
+{
+	unsigned int i;
+
+	for (i = 0; i != cache->num; i++) {
+		free(cache->ents[i].key);
+		free(cache->ents[i].load_name);
+	}
+	free(cache->ents);
+}
+
+static int driver_cache_cmp(const void *a, const void *b)
+{
+	const struct driver_cache_ent *ea = a, *eb = b;
+
+	return strcmp(ea->key, eb->key);
+}
+
+static int add_driver_cache_ent(struct driver_cache *cache, unsigned int *max,
+				const char *key, const char *load_name)
+{
+	struct driver_cache_ent *ent;
+
+	if (cache->num == *max) {
+		*max = *max ? *max * 2 : 64;
+		ent = realloc(cache->ents, *max * sizeof(*ent));
+		if (!ent)
+			return ENOMEM;
+		cache->ents = ent;
+	}
+
+	ent = &cache->ents[cache->num];
+	ent->key = strdup(key);
+	ent->load_name = NULL;
+	if (strcmp(load_name, "-"))
+		ent->load_name = strdup(load_name);
+	if (!ent->key || (strcmp(load_name, "-") && !ent->load_name)) {
+		free(ent->key);
+		free(ent->load_name);
+		return ENOMEM;
+	}
+	cache->num++;
+	return 0;
+}
+
+static void read_driver_cache(struct driver_cache *cache)
+{
+	const char *path = driver_cache_path();
+	char *line = NULL, *name;
+	unsigned int max = 0;
+	size_t buflen = 0;
+	char *stamp;
+	ssize_t len;
+	FILE *fp;
+
+	if (!path)
+		return;
+
+	fp = fopen(path, "r" STREAM_CLOEXEC);
+	if (!fp)
+		return;
+
+	stamp = driver_cache_stamp();
+	if (!stamp)
+		goto out;
+
+	len = getline(&line, &buflen, fp);
+	if (len <= 0 || line[len - 1] != '\n')
+		goto out;
+	line[len - 1] = 0;
+	if (strcmp(line, stamp))
+		goto out;
+
+	while ((len = getline(&line, &buflen, fp)) > 0) {
+		if (line[len - 1] == '\n')
+			line[len - 1] = 0;
+		name = strchr(line, '\t');
+		if (!name)
+			continue;
+		*name++ = 0;
+
+		if (add_driver_cache_ent(cache, &max, line, name))
+			break;
+	}
+	qsort(cache->ents, cache->num, sizeof(*cache->ents),
+	      driver_cache_cmp);
+out:
+	free(stamp);
+	free(line);
+	fclose(fp);
+}
+
+static struct driver_cache_ent *
+driver_cache_find(struct driver_cache *cache, struct verbs_sysfs_dev *sysfs_dev)
+{
+	char key[IBV_SYSFS_NAME_MAX + 64];
+	struct driver_cache_ent ent = { .key = key };
+
+	if (!cache->num || !driver_cache_key(sysfs_dev, key, sizeof(key)))
+		return NULL;
+
+	return bsearch(&ent, cache->ents, cache->num, sizeof(ent),
+		       driver_cache_cmp);
+}
+
+static const char *driver_load_name(const struct verbs_device_ops *ops)
+{
+	struct ibv_driver *driver;
+
+	list_for_each(&driver_list, driver, entry)
+		if (driver->ops == ops)
+			return driver->load_name;
+	return NULL;
+}
+
+static bool driver_loaded(const char *load_name)
+{
+	struct ibv_driver *driver;
+
+	list_for_each(&driver_list, driver, entry)
+		if (driver->load_name && !strcmp(driver->load_name, load_name))
+			return true;
+	return false;
+}
+
+/*
+ * Load only the providers the cache names for the devices in sysfs_list.
+ * Returns false if any device is unknown to the cache.
+ */
+static bool load_cached_drivers(struct driver_cache *cache,
+				struct list_head *sysfs_list)
+{
+	struct verbs_sysfs_dev *sysfs_dev;
+	struct driver_cache_ent *ent;
+
+	list_for_each(sysfs_list, sysfs_dev, entry)
+		if (!driver_cache_find(cache, sysfs_dev))
+			return false;
+
+	list_for_each(sysfs_list, sysfs_dev, entry) {
+		ent = driver_cache_find(cache, sysfs_dev);
+		if (ent->load_name && !driver_loaded(ent->load_name))
+			load_driver(ent->load_name);
+	}
+	return true;
+}
+
+/* True if every device left in sysfs_list is cached as having no provider */
+static bool driver_cache_unmatched(struct driver_cache *cache,
+				   struct list_head *sysfs_list)
+{
+	struct verbs_sysfs_dev *sysfs_dev;
+	struct driver_cache_ent *ent;
+
+	list_for_each(sysfs_list, sysfs_dev, entry) {
+		ent = driver_cache_find(cache, sysfs_dev);
+		if (!ent || ent->load_name)
+			return false;
+	}
+	return true;
+}
+
+static void write_driver_cache_ent(FILE *fp, struct verbs_sysfs_dev *sysfs_dev,
+				   const char *load_name)
+{
+	char key[IBV_SYSFS_NAME_MAX + 64];
+
+	if (driver_cache_key(sysfs_dev, key, sizeof(key)))
+		fprintf(fp, "%s\t%s\n", key, load_name ? load_name : "-");
+}
+
+static void write_driver_cache(struct list_head *device_list,
+			       struct list_head *sysfs_list)
+{
+	const char *path = driver_cache_path();
+	struct verbs_sysfs_dev *sysfs_dev;
+	struct verbs_device *vdev;
+	char *tmp_path, *stamp;
+	FILE *fp;
+	int fd;
+
+	if (!path)
+		return;
+	stamp = driver_cache_stamp();
+	if (!stamp)
+		return;
+
+	/* Write a new file and rename it so readers never see a partial one */
+	if (asprintf(&tmp_path, "%s.XXXXXX", path) < 0) {
+		free(stamp);
+		return;
+	}
+	fd = mkostemp(tmp_path, O_CLOEXEC);
+	if (fd < 0)
+		goto out;
+	fchmod(fd, 0644);
+	fp = fdopen(fd, "w");
+	if (!fp) {
+		close(fd);
+		goto out_unlink;
+	}
+
+	fprintf(fp, "%s\n", stamp);
+	list_for_each(device_list, vdev, entry)
+		write_driver_cache_ent(fp, vdev->sysfs,
+				       driver_load_name(vdev->ops));
+	list_for_each(sysfs_list, sysfs_dev, entry)
+		write_driver_cache_ent(fp, sysfs_dev, NULL);
+
+	if (!fclose(fp) && !rename(tmp_path, path))
+		goto out;
+out_unlink:
+	unlink(tmp_path);
+out:
+	free(tmp_path);
+	free(stamp);
+}
+
 int ibverbs_get_device_list(struct list_head *device_list)
 {
 	LIST_HEAD(sysfs_list);
 	struct verbs_sysfs_dev *sysfs_dev, *next_dev;
 	struct verbs_device *vdev, *tmp;
-	static int drivers_loaded;
+	static int drivers_loaded, cache_read;
 	unsigned int num_devices = 0;
-	int ret;
+	struct driver_cache cache = {};
+	int ret = -1;
 
-	ret = find_sysfs_devs_nl(&sysfs_list);
+	/* Netlink reports the real devices, not those of a fake tree */
+	if (!ibv_sysfs_fake_tree())
+		ret = find_sysfs_devs_nl(&sysfs_list);
 	if (ret) {
 		ret = find_sysfs_devs(&sysfs_list);
 		if (ret)
@@ -599,12 +980,26 @@ int ibverbs_get_device_list(struct list_head *device_list)
 	if (list_empty(&sysfs_list) || drivers_loaded)
 		goto out;
 
+	if (!cache_read) {
+		cache_read = 1;
+		read_driver_cache(&cache);
+		if (load_cached_drivers(&cache, &sysfs_list)) {
+			try_all_drivers(&sysfs_list, device_list,
+					&num_devices);
+			if (driver_cache_unmatched(&cache, &sysfs_list))
+				goto out;
+		}
+	}
+
 	load_drivers();
 	drivers_loaded = 1;
 
 	try_all_drivers(&sysfs_list, device_list, &num_devices);
+	write_driver_cache(device_list, &sysfs_list);
 
 out:
+	free_driver_cache(&cache);
+
 	/* Anything left in sysfs_list was not assoicated with a
 	 * driver.
 	 */
@@ -680,6 +1075,7 @@ int ibverbs_init(void)
 	check_memlock_limit();
 	verbs_set_log_level();
 	verbs_set_log_file();
+	verbs_stats_set_level();
 
 	return 0;
 }
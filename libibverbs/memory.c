@@ -37,6 +37,7 @@
 #include <sys/mman.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
@@ -58,80 +59,202 @@ struct ibv_mem_node {
 	int			refcnt;
 };
 
-static struct ibv_mem_node *mm_root;
-static pthread_mutex_t mm_mutex = PTHREAD_MUTEX_INITIALIZER;
+/*
+ * The address space is cut into regions of 1 << MM_REGION_SHIFT bytes
+ * (or one huge page, if larger), and each region is tracked by one of
+ * MM_NUM_TREES trees, each with its own lock. Registrations of unrelated
+ * buffers from different threads then rarely contend. A range spanning
+ * several regions is handled one region at a time.
+ */
+#define MM_REGION_SHIFT	24
+#define MM_NUM_TREES	64
+
+struct ibv_mem_tree {
+	pthread_mutex_t		mutex;
+	struct ibv_mem_node    *root;
+} __attribute__((aligned(64)));
+
+static struct ibv_mem_tree *mm_trees;
 static int page_size;
 static int huge_page_enabled;
 static int too_late;
 
-static unsigned long smaps_page_size(FILE *file)
+/*
+ * Page size of each VMA, parsed from /proc/self/smaps once and reused
+ * until a lookup misses or an madvise() suggests the mappings changed.
+ * Each reload bumps the generation.  The inode identifies the backing
+ * mapping, so a huge page hit can be checked against /proc/self/maps.
+ */
+struct ibv_vma {
+	uintptr_t		start, end;
+	unsigned long		page_size;
+	unsigned long		inode;
+};
+
+static struct {
+	pthread_rwlock_t	lock;
+	struct ibv_vma	       *vmas;
+	size_t			num;
+	unsigned int		gen;
+} vma_cache = {
+	.lock = PTHREAD_RWLOCK_INITIALIZER,
+};
+
+static int vma_cache_load(void)
 {
-	int n;
-	unsigned long size = page_size;
+	struct ibv_vma *vmas = NULL, *tmp;
+	size_t num = 0, max = 0;
+	FILE *file;
 	char buf[1024];
 
-	while (fgets(buf, sizeof(buf), file) != NULL) {
-		if (!strstr(buf, "KernelPageSize:"))
-			continue;
+	file = fopen("/proc/self/smaps", "r" STREAM_CLOEXEC);
+	if (!file)
+		return -1;
 
-		n = sscanf(buf, "%*s %lu", &size);
-		if (n < 1)
+	while (fgets(buf, sizeof(buf), file) != NULL) {
+		uintptr_t range_start, range_end;
+		unsigned long size, inode;
+
+		if (sscanf(buf, "%" SCNxPTR "-%" SCNxPTR " %*s %*s %*s %lu",
+			   &range_start, &range_end, &inode) == 3) {
+			if (num == max) {
+				max = max ? max * 2 : 64;
+				tmp = realloc(vmas, max * sizeof(*vmas));
+				if (!tmp)
+					goto err;
+				vmas = tmp;
+			}
+			vmas[num].start = range_start;
+			vmas[num].end = range_end;
+			vmas[num].page_size = page_size;
+			vmas[num].inode = inode;
+			num++;
 			continue;
+		}
 
 		/* page size is printed in Kb */
-		size = size * 1024;
-
-		break;
+		if (num && sscanf(buf, "KernelPageSize: %lu", &size) == 1)
+			vmas[num - 1].page_size = size * 1024;
 	}
+	fclose(file);
+
+	free(vma_cache.vmas);
+	vma_cache.vmas = vmas;
+	vma_cache.num = num;
+	vma_cache.gen++;
+	return 0;
 
-	return size;
+err:
+	fclose(file);
+	free(vmas);
+	return -1;
 }
 
-static unsigned long get_page_size(void *base)
+/* Returns NULL if addr is not covered by the cached VMAs */
+static struct ibv_vma *vma_cache_find(uintptr_t addr)
 {
-	unsigned long ret = page_size;
-	pid_t pid;
+	size_t lo = 0, hi = vma_cache.num;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		struct ibv_vma *vma = &vma_cache.vmas[mid];
+
+		if (addr < vma->start)
+			hi = mid;
+		else if (addr >= vma->end)
+			lo = mid + 1;
+		else
+			return vma;
+	}
+	return NULL;
+}
+
+/*
+ * Check that a cached VMA is still mapped with the same bounds and
+ * backing inode.  The page size belongs to the mapping, so it cannot
+ * have changed either.  Unlike smaps, maps is produced without walking
+ * page tables, and no lock is needed while reading it.
+ */
+static bool vma_still_mapped(const struct ibv_vma *vma)
+{
+	uintptr_t range_start, range_end;
+	unsigned long inode;
+	bool ret = false;
 	FILE *file;
 	char buf[1024];
 
-	pid = getpid();
-	snprintf(buf, sizeof(buf), "/proc/%d/smaps", pid);
-
-	file = fopen(buf, "r" STREAM_CLOEXEC);
+	file = fopen("/proc/self/maps", "r" STREAM_CLOEXEC);
 	if (!file)
-		goto out;
+		return false;
 
 	while (fgets(buf, sizeof(buf), file) != NULL) {
-		int n;
-		uintptr_t range_start, range_end;
-
-		n = sscanf(buf, "%" SCNxPTR "-%" SCNxPTR, &range_start, &range_end);
-
-		if (n < 2)
+		if (sscanf(buf, "%" SCNxPTR "-%" SCNxPTR " %*s %*s %*s %lu",
+			   &range_start, &range_end, &inode) != 3)
 			continue;
-
-		if ((uintptr_t) base >= range_start && (uintptr_t) base < range_end) {
-			ret = smaps_page_size(file);
-			break;
-		}
+		if (range_end <= vma->start)
+			continue;
+		ret = range_start == vma->start && range_end == vma->end &&
+		      inode == vma->inode;
+		break;
 	}
-
 	fclose(file);
-
-out:
 	return ret;
 }
 
+/* Reload the cache unless someone else already did since gen was read */
+static void vma_cache_invalidate(unsigned int gen)
+{
+	pthread_rwlock_wrlock(&vma_cache.lock);
+	if (vma_cache.gen == gen)
+		vma_cache_load();
+	pthread_rwlock_unlock(&vma_cache.lock);
+}
+
+/*
+ * Hits with the base page size are trusted.  If such a range was since
+ * remapped as hugetlb, madvise() rejects the base page alignment and
+ * ibv_madvise_range() reloads the cache.  A stale larger page size would
+ * instead silently advise the neighbouring mappings, so a huge page hit
+ * is only used once its VMA is found unchanged in /proc/self/maps.
+ */
+static unsigned long get_page_size(void *base, unsigned int *gen)
+{
+	struct ibv_vma *found, vma = {};
+
+	pthread_rwlock_rdlock(&vma_cache.lock);
+	found = vma_cache_find((uintptr_t) base);
+	if (found)
+		vma = *found;
+	*gen = vma_cache.gen;
+	pthread_rwlock_unlock(&vma_cache.lock);
+	if (vma.page_size == (unsigned long) page_size)
+		return vma.page_size;
+	if (vma.page_size && vma_still_mapped(&vma))
+		return vma.page_size;
+
+	vma_cache_invalidate(*gen);
+
+	pthread_rwlock_rdlock(&vma_cache.lock);
+	found = vma_cache_find((uintptr_t) base);
+	vma.page_size = found ? found->page_size : page_size;
+	*gen = vma_cache.gen;
+	pthread_rwlock_unlock(&vma_cache.lock);
+
+	return vma.page_size;
+}
+
 int ibv_fork_init(void)
 {
 	void *tmp, *tmp_aligned;
-	int ret;
+	struct ibv_mem_tree *trees;
+	unsigned int gen;
+	int ret, i;
 	unsigned long size;
 
 	if (getenv("RDMAV_HUGEPAGES_SAFE"))
 		huge_page_enabled = 1;
 
-	if (mm_root)
+	if (mm_trees)
 		return 0;
 
 	if (ibv_is_fork_initialized() == IBV_FORK_UNNEEDED)
@@ -148,7 +271,7 @@ int ibv_fork_init(void)
 		return ENOMEM;
 
 	if (huge_page_enabled) {
-		size = get_page_size(tmp);
+		size = get_page_size(tmp, &gen);
 		tmp_aligned = (void *) ((uintptr_t) tmp & ~(size - 1));
 	} else {
 		size = page_size;
@@ -163,17 +286,31 @@ int ibv_fork_init(void)
 	if (ret)
 		return ENOSYS;
 
-	mm_root = malloc(sizeof *mm_root);
-	if (!mm_root)
+	trees = calloc(MM_NUM_TREES, sizeof(*trees));
+	if (!trees)
 		return ENOMEM;
 
-	mm_root->parent = NULL;
-	mm_root->left   = NULL;
-	mm_root->right  = NULL;
-	mm_root->color  = IBV_BLACK;
-	mm_root->start  = 0;
-	mm_root->end    = UINTPTR_MAX;
-	mm_root->refcnt = 0;
+	for (i = 0; i < MM_NUM_TREES; i++) {
+		struct ibv_mem_node *root = malloc(sizeof(*root));
+
+		if (!root) {
+			while (i--)
+				free(trees[i].root);
+			free(trees);
+			return ENOMEM;
+		}
+		root->parent = NULL;
+		root->left   = NULL;
+		root->right  = NULL;
+		root->color  = IBV_BLACK;
+		root->start  = 0;
+		root->end    = UINTPTR_MAX;
+		root->refcnt = 0;
+
+		pthread_mutex_init(&trees[i].mutex, NULL);
+		trees[i].root = root;
+	}
+	mm_trees = trees;
 
 	return 0;
 }
@@ -183,7 +320,7 @@ enum ibv_fork_status ibv_is_fork_initialized(void)
 	if (get_copy_on_fork())
 		return IBV_FORK_UNNEEDED;
 
-	return mm_root ? IBV_FORK_ENABLED : IBV_FORK_DISABLED;
+	return mm_trees ? IBV_FORK_ENABLED : IBV_FORK_DISABLED;
 }
 
 static struct ibv_mem_node *__mm_prev(struct ibv_mem_node *node)
@@ -218,7 +355,8 @@ static struct ibv_mem_node *__mm_next(struct ibv_mem_node *node)
 	return node;
 }
 
-static void __mm_rotate_right(struct ibv_mem_node *node)
+static void __mm_rotate_right(struct ibv_mem_tree *tree,
+			      struct ibv_mem_node *node)
 {
 	struct ibv_mem_node *tmp;
 
@@ -234,7 +372,7 @@ static void __mm_rotate_right(struct ibv_mem_node *node)
 		else
 			node->parent->left = tmp;
 	} else
-		mm_root = tmp;
+		tree->root = tmp;
 
 	tmp->parent = node->parent;
 
@@ -242,7 +380,8 @@ static void __mm_rotate_right(struct ibv_mem_node *node)
 	node->parent = tmp;
 }
 
-static void __mm_rotate_left(struct ibv_mem_node *node)
+static void __mm_rotate_left(struct ibv_mem_tree *tree,
+			     struct ibv_mem_node *node)
 {
 	struct ibv_mem_node *tmp;
 
@@ -258,7 +397,7 @@ static void __mm_rotate_left(struct ibv_mem_node *node)
 		else
 			node->parent->left = tmp;
 	} else
-		mm_root = tmp;
+		tree->root = tmp;
 
 	tmp->parent = node->parent;
 
@@ -294,7 +433,8 @@ static int verify(struct ibv_mem_node *node)
 }
 #endif
 
-static void __mm_add_rebalance(struct ibv_mem_node *node)
+static void __mm_add_rebalance(struct ibv_mem_tree *tree,
+			       struct ibv_mem_node *node)
 {
 	struct ibv_mem_node *parent, *gp, *uncle;
 
@@ -313,7 +453,7 @@ static void __mm_add_rebalance(struct ibv_mem_node *node)
 				node = gp;
 			} else {
 				if (node == parent->right) {
-					__mm_rotate_left(parent);
+					__mm_rotate_left(tree, parent);
 					node   = parent;
 					parent = node->parent;
 				}
@@ -321,7 +461,7 @@ static void __mm_add_rebalance(struct ibv_mem_node *node)
 				parent->color = IBV_BLACK;
 				gp->color     = IBV_RED;
 
-				__mm_rotate_right(gp);
+				__mm_rotate_right(tree, gp);
 			}
 		} else {
 			uncle = gp->left;
@@ -334,7 +474,7 @@ static void __mm_add_rebalance(struct ibv_mem_node *node)
 				node = gp;
 			} else {
 				if (node == parent->left) {
-					__mm_rotate_right(parent);
+					__mm_rotate_right(tree, parent);
 					node   = parent;
 					parent = node->parent;
 				}
@@ -342,19 +482,19 @@ static void __mm_add_rebalance(struct ibv_mem_node *node)
 				parent->color = IBV_BLACK;
 				gp->color     = IBV_RED;
 
-				__mm_rotate_left(gp);
+				__mm_rotate_left(tree, gp);
 			}
 		}
 	}
 
-	mm_root->color = IBV_BLACK;
+	tree->root->color = IBV_BLACK;
 }
 
-static void __mm_add(struct ibv_mem_node *new)
+static void __mm_add(struct ibv_mem_tree *tree, struct ibv_mem_node *new)
 {
 	struct ibv_mem_node *node, *parent = NULL;
 
-	node = mm_root;
+	node = tree->root;
 	while (node) {
 		parent = node;
 		if (node->start < new->start)
@@ -373,10 +513,11 @@ static void __mm_add(struct ibv_mem_node *new)
 	new->right  = NULL;
 
 	new->color = IBV_RED;
-	__mm_add_rebalance(new);
+	__mm_add_rebalance(tree, new);
 }
 
-static void __mm_remove(struct ibv_mem_node *node)
+static void __mm_remove(struct ibv_mem_tree *tree,
+			struct ibv_mem_node *node)
 {
 	struct ibv_mem_node *child, *parent, *sib, *tmp;
 	int nodecol;
@@ -411,7 +552,7 @@ static void __mm_remove(struct ibv_mem_node *node)
 			else
 				node->parent->right = tmp;
 		} else
-			mm_root = tmp;
+			tree->root = tmp;
 	} else {
 		nodecol = node->color;
 
@@ -426,7 +567,7 @@ static void __mm_remove(struct ibv_mem_node *node)
 			else
 				parent->right = child;
 		} else
-			mm_root = child;
+			tree->root = child;
 	}
 
 	free(node);
@@ -434,14 +575,14 @@ static void __mm_remove(struct ibv_mem_node *node)
 	if (nodecol == IBV_RED)
 		return;
 
-	while ((!child || child->color == IBV_BLACK) && child != mm_root) {
+	while ((!child || child->color == IBV_BLACK) && child != tree->root) {
 		if (parent->left == child) {
 			sib = parent->right;
 
 			if (sib->color == IBV_RED) {
 				parent->color = IBV_RED;
 				sib->color    = IBV_BLACK;
-				__mm_rotate_left(parent);
+				__mm_rotate_left(tree, parent);
 				sib = parent->right;
 			}
 
@@ -455,7 +596,7 @@ static void __mm_remove(struct ibv_mem_node *node)
 					if (sib->left)
 						sib->left->color = IBV_BLACK;
 					sib->color = IBV_RED;
-					__mm_rotate_right(sib);
+					__mm_rotate_right(tree, sib);
 					sib = parent->right;
 				}
 
@@ -463,8 +604,8 @@ static void __mm_remove(struct ibv_mem_node *node)
 				parent->color = IBV_BLACK;
 				if (sib->right)
 					sib->right->color = IBV_BLACK;
-				__mm_rotate_left(parent);
-				child = mm_root;
+				__mm_rotate_left(tree, parent);
+				child = tree->root;
 				break;
 			}
 		} else {
@@ -473,7 +614,7 @@ static void __mm_remove(struct ibv_mem_node *node)
 			if (sib->color == IBV_RED) {
 				parent->color = IBV_RED;
 				sib->color    = IBV_BLACK;
-				__mm_rotate_right(parent);
+				__mm_rotate_right(tree, parent);
 				sib = parent->left;
 			}
 
@@ -487,7 +628,7 @@ static void __mm_remove(struct ibv_mem_node *node)
 					if (sib->right)
 						sib->right->color = IBV_BLACK;
 					sib->color = IBV_RED;
-					__mm_rotate_left(sib);
+					__mm_rotate_left(tree, sib);
 					sib = parent->left;
 				}
 
@@ -495,8 +636,8 @@ static void __mm_remove(struct ibv_mem_node *node)
 				parent->color = IBV_BLACK;
 				if (sib->left)
 					sib->left->color = IBV_BLACK;
-				__mm_rotate_right(parent);
-				child = mm_root;
+				__mm_rotate_right(tree, parent);
+				child = tree->root;
 				break;
 			}
 		}
@@ -506,9 +647,10 @@ static void __mm_remove(struct ibv_mem_node *node)
 		child->color = IBV_BLACK;
 }
 
-static struct ibv_mem_node *__mm_find_start(uintptr_t start, uintptr_t end)
+static struct ibv_mem_node *__mm_find_start(struct ibv_mem_tree *tree,
+					    uintptr_t start, uintptr_t end)
 {
-	struct ibv_mem_node *node = mm_root;
+	struct ibv_mem_node *node = tree->root;
 
 	while (node) {
 		if (node->start <= start && node->end >= start)
@@ -523,17 +665,19 @@ static struct ibv_mem_node *__mm_find_start(uintptr_t start, uintptr_t end)
 	return node;
 }
 
-static struct ibv_mem_node *merge_ranges(struct ibv_mem_node *node,
+static struct ibv_mem_node *merge_ranges(struct ibv_mem_tree *tree,
+					 struct ibv_mem_node *node,
 					 struct ibv_mem_node *prev)
 {
 	prev->end = node->end;
 	prev->refcnt = node->refcnt;
-	__mm_remove(node);
+	__mm_remove(tree, node);
 
 	return prev;
 }
 
-static struct ibv_mem_node *split_range(struct ibv_mem_node *node,
+static struct ibv_mem_node *split_range(struct ibv_mem_tree *tree,
+					struct ibv_mem_node *node,
 					uintptr_t cut_line)
 {
 	struct ibv_mem_node *new_node = NULL;
@@ -545,23 +689,24 @@ static struct ibv_mem_node *split_range(struct ibv_mem_node *node,
 	new_node->end    = node->end;
 	new_node->refcnt = node->refcnt;
 	node->end  = cut_line - 1;
-	__mm_add(new_node);
+	__mm_add(tree, new_node);
 
 	return new_node;
 }
 
-static struct ibv_mem_node *get_start_node(uintptr_t start, uintptr_t end,
+static struct ibv_mem_node *get_start_node(struct ibv_mem_tree *tree,
+					   uintptr_t start, uintptr_t end,
 					   int inc)
 {
 	struct ibv_mem_node *node, *tmp = NULL;
 
-	node = __mm_find_start(start, end);
+	node = __mm_find_start(tree, start, end);
 	if (node->start < start)
-		node = split_range(node, start);
+		node = split_range(tree, node, start);
 	else {
 		tmp = __mm_prev(node);
 		if (tmp && tmp->refcnt == node->refcnt + inc)
-			node = merge_ranges(node, tmp);
+			node = merge_ranges(tree, node, tmp);
 	}
 	return node;
 }
@@ -570,7 +715,8 @@ static struct ibv_mem_node *get_start_node(uintptr_t start, uintptr_t end,
  * This function is called if madvise() fails to undo merging/splitting
  * operations performed on the node.
  */
-static struct ibv_mem_node *undo_node(struct ibv_mem_node *node,
+static struct ibv_mem_node *undo_node(struct ibv_mem_tree *tree,
+				      struct ibv_mem_node *node,
 				      uintptr_t start, int inc)
 {
 	struct ibv_mem_node *tmp = NULL;
@@ -580,7 +726,7 @@ static struct ibv_mem_node *undo_node(struct ibv_mem_node *node,
 	 * node with the previous one, so we need to split them.
 	*/
 	if (start > node->start) {
-		tmp = split_range(node, start);
+		tmp = split_range(tree, node, start);
 		if (tmp) {
 			node->refcnt += inc;
 			node = tmp;
@@ -590,11 +736,11 @@ static struct ibv_mem_node *undo_node(struct ibv_mem_node *node,
 
 	tmp  =  __mm_prev(node);
 	if (tmp && tmp->refcnt == node->refcnt)
-		node = merge_ranges(node, tmp);
+		node = merge_ranges(tree, node, tmp);
 
 	tmp  =  __mm_next(node);
 	if (tmp && tmp->refcnt == node->refcnt)
-		node = merge_ranges(tmp, node);
+		node = merge_ranges(tree, tmp, node);
 
 	return node;
 }
@@ -621,32 +767,21 @@ static int do_madvise(void *addr, size_t length, int advice,
 	return 0;
 }
 
-static int ibv_madvise_range(void *base, size_t size, int advice)
+/* start ... end must lie within a single region of the tree */
+static int madvise_tree_range(struct ibv_mem_tree *tree, uintptr_t start,
+			      uintptr_t end, int advice,
+			      unsigned long range_page_size)
 {
-	uintptr_t start, end;
 	struct ibv_mem_node *node, *tmp;
 	int inc;
 	int rolling_back = 0;
 	int ret = 0;
-	unsigned long range_page_size;
-
-	if (!size || !base)
-		return 0;
 
-	if (huge_page_enabled)
-		range_page_size = get_page_size(base);
-	else
-		range_page_size = page_size;
-
-	start = (uintptr_t) base & ~(range_page_size - 1);
-	end   = ((uintptr_t) (base + size + range_page_size - 1) &
-		 ~(range_page_size - 1)) - 1;
-
-	pthread_mutex_lock(&mm_mutex);
+	pthread_mutex_lock(&tree->mutex);
 again:
 	inc = advice == MADV_DONTFORK ? 1 : -1;
 
-	node = get_start_node(start, end, inc);
+	node = get_start_node(tree, start, end, inc);
 	if (!node) {
 		ret = -1;
 		goto out;
@@ -654,7 +789,7 @@ again:
 
 	while (node && node->start <= end) {
 		if (node->end > end) {
-			if (!split_range(node, end + 1)) {
+			if (!split_range(tree, node, end + 1)) {
 				ret = -1;
 				goto out;
 			}
@@ -682,7 +817,7 @@ again:
 						 node->end - node->start + 1,
 						 advice, range_page_size);
 			if (ret) {
-				node = undo_node(node, start, inc);
+				node = undo_node(tree, node, start, inc);
 
 				if (rolling_back || !node)
 					goto out;
@@ -703,21 +838,95 @@ again:
 	if (node) {
 		tmp = __mm_prev(node);
 		if (tmp && node->refcnt == tmp->refcnt)
-			node = merge_ranges(node, tmp);
+			node = merge_ranges(tree, node, tmp);
 	}
 
 out:
 	if (rolling_back)
 		ret = -1;
 
-	pthread_mutex_unlock(&mm_mutex);
+	pthread_mutex_unlock(&tree->mutex);
+
+	return ret;
+}
+
+static int madvise_regions(uintptr_t start, uintptr_t end, int advice,
+			   unsigned long range_page_size)
+{
+	unsigned int shift = MM_REGION_SHIFT;
+	uintptr_t cur, last, failed;
+	int ret = 0;
+
+	while ((1UL << shift) < range_page_size)
+		shift++;
+
+	for (cur = start; ; cur = last + 1) {
+		last = cur | ((1UL << shift) - 1);
+		if (last > end)
+			last = end;
+
+		ret = madvise_tree_range(&mm_trees[(cur >> shift) % MM_NUM_TREES],
+					 cur, last, advice, range_page_size);
+		if (ret)
+			break;
+		if (last == end)
+			return 0;
+	}
+
+	/* Undo the regions before the one that failed */
+	advice = advice == MADV_DONTFORK ? MADV_DOFORK : MADV_DONTFORK;
+	failed = cur;
+	for (cur = start; cur != failed; cur = last + 1) {
+		last = cur | ((1UL << shift) - 1);
+		madvise_tree_range(&mm_trees[(cur >> shift) % MM_NUM_TREES],
+				   cur, last, advice, range_page_size);
+	}
 
 	return ret;
 }
 
+static int ibv_madvise_range(void *base, size_t size, int advice)
+{
+	uintptr_t start, end;
+	unsigned long range_page_size, new_page_size;
+	unsigned int gen = 0;
+	int retried = 0;
+	int ret;
+
+	if (!size || !base)
+		return 0;
+
+	if (huge_page_enabled)
+		range_page_size = get_page_size(base, &gen);
+	else
+		range_page_size = page_size;
+
+	for (;;) {
+		start = (uintptr_t) base & ~(range_page_size - 1);
+		end   = ((uintptr_t) (base + size + range_page_size - 1) &
+			 ~(range_page_size - 1)) - 1;
+
+		ret = madvise_regions(start, end, advice, range_page_size);
+		if (!ret || !huge_page_enabled || retried)
+			return ret;
+
+		/*
+		 * The cached page size may be stale if the range was
+		 * remapped, e.g. as hugetlb where madvise() rejects base
+		 * page alignment. Reload the cache and try once more.
+		 */
+		retried = 1;
+		vma_cache_invalidate(gen);
+		new_page_size = get_page_size(base, &gen);
+		if (new_page_size == range_page_size)
+			return ret;
+		range_page_size = new_page_size;
+	}
+}
+
 int ibv_dontfork_range(void *base, size_t size)
 {
-	if (mm_root)
+	if (mm_trees)
 		return ibv_madvise_range(base, size, MADV_DONTFORK);
 	else {
 		too_late = 1;
@@ -727,7 +936,7 @@ int ibv_dontfork_range(void *base, size_t size)
 
 int ibv_dofork_range(void *base, size_t size)
 {
-	if (mm_root)
+	if (mm_trees)
 		return ibv_madvise_range(base, size, MADV_DOFORK);
 	else {
 		too_late = 1;
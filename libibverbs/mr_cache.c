@@ -0,0 +1,335 @@
+// SPDX-License-Identifier: (GPL-2.0 OR Linux-OpenIB)
+/*
+ * Library level memory registration cache.
+ *
+ * Cached MRs are indexed by start address in a map of buckets, one bucket
+ * per distinct start. A lookup for [start, end) walks back from start over
+ * buckets no further than the longest cached MR, so it only visits
+ * entries that can contain the range. MRs that are no longer referenced
+ * stay registered on an LRU list until they are evicted, invalidated or
+ * their PD is freed.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <ccan/list.h>
+#include <util/cl_qmap.h>
+
+#include "ibverbs.h"
+
+/* Limits on MRs kept registered while nobody holds them */
+#define MR_CACHE_MAX_UNUSED		1024
+#define MR_CACHE_MAX_UNUSED_BYTES	(1ULL << 30)
+
+struct mr_cache_bucket {
+	cl_map_item_t		item;		/* keyed by start address */
+	struct list_head	entries;
+};
+
+struct mr_cache_entry {
+	struct mr_cache_bucket *bucket;		/* NULL once invalidated */
+	struct list_node	bucket_entry;
+	cl_map_item_t		mr_item;	/* keyed by the ibv_mr pointer */
+	struct list_node	lru_entry;	/* while refcnt == 0 */
+	struct ibv_mr	       *mr;
+	uintptr_t		start, end;
+	unsigned int		access;
+	unsigned int		refcnt;
+};
+
+static struct {
+	pthread_mutex_t		lock;
+	bool			initialized;
+	cl_qmap_t		by_start;
+	cl_qmap_t		by_mr;
+	struct list_head	unused;
+	size_t			num_unused;
+	size_t			unused_bytes;
+	uintptr_t		max_len;
+	unsigned int		inval_gen;
+} mr_cache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void mr_cache_init(void)
+{
+	if (mr_cache.initialized)
+		return;
+
+	cl_qmap_init(&mr_cache.by_start);
+	cl_qmap_init(&mr_cache.by_mr);
+	list_head_init(&mr_cache.unused);
+	mr_cache.initialized = true;
+}
+
+static struct mr_cache_entry *mr_cache_find(struct ibv_pd *pd,
+					    uintptr_t start, uintptr_t end,
+					    unsigned int access)
+{
+	uintptr_t lo = start > mr_cache.max_len ? start - mr_cache.max_len : 0;
+	const cl_map_item_t *map_end = cl_qmap_end(&mr_cache.by_start);
+	struct mr_cache_bucket *bucket;
+	struct mr_cache_entry *entry;
+	cl_map_item_t *item;
+
+	for (item = cl_qmap_prev(cl_qmap_get_next(&mr_cache.by_start, start));
+	     item != map_end && cl_qmap_key(item) >= lo;
+	     item = cl_qmap_prev(item)) {
+		bucket = container_of(item, struct mr_cache_bucket, item);
+		list_for_each(&bucket->entries, entry, bucket_entry)
+			if (entry->mr->pd == pd && entry->end >= end &&
+			    entry->access == access)
+				return entry;
+	}
+	return NULL;
+}
+
+static int mr_cache_insert(struct mr_cache_entry *entry)
+{
+	struct mr_cache_bucket *bucket;
+	cl_map_item_t *item;
+
+	item = cl_qmap_get(&mr_cache.by_start, entry->start);
+	if (item != cl_qmap_end(&mr_cache.by_start)) {
+		bucket = container_of(item, struct mr_cache_bucket, item);
+	} else {
+		bucket = calloc(1, sizeof(*bucket));
+		if (!bucket)
+			return ENOMEM;
+		list_head_init(&bucket->entries);
+		cl_qmap_insert(&mr_cache.by_start, entry->start, &bucket->item);
+	}
+	list_add_tail(&bucket->entries, &entry->bucket_entry);
+	entry->bucket = bucket;
+
+	if (entry->end - entry->start > mr_cache.max_len)
+		mr_cache.max_len = entry->end - entry->start;
+
+	return 0;
+}
+
+static void mr_cache_put_bucket(struct mr_cache_bucket *bucket)
+{
+	if (!list_empty(&bucket->entries))
+		return;
+
+	cl_qmap_remove_item(&mr_cache.by_start, &bucket->item);
+	free(bucket);
+	if (cl_is_qmap_empty(&mr_cache.by_start))
+		mr_cache.max_len = 0;
+}
+
+/* Stop handing the entry out to new lookups */
+static void mr_cache_detach(struct mr_cache_entry *entry)
+{
+	struct mr_cache_bucket *bucket = entry->bucket;
+
+	if (!bucket)
+		return;
+
+	list_del(&entry->bucket_entry);
+	entry->bucket = NULL;
+	mr_cache_put_bucket(bucket);
+}
+
+static void mr_cache_del_unused(struct mr_cache_entry *entry)
+{
+	list_del(&entry->lru_entry);
+	mr_cache.num_unused--;
+	mr_cache.unused_bytes -= entry->end - entry->start;
+}
+
+/* Unlink an unreferenced entry and queue it for deregistration */
+static void mr_cache_drop(struct mr_cache_entry *entry,
+			  struct list_head *free_list)
+{
+	mr_cache_detach(entry);
+	cl_qmap_remove_item(&mr_cache.by_mr, &entry->mr_item);
+	list_add_tail(free_list, &entry->lru_entry);
+}
+
+static void mr_cache_evict(struct list_head *free_list)
+{
+	struct mr_cache_entry *entry;
+
+	while (mr_cache.num_unused > MR_CACHE_MAX_UNUSED ||
+	       mr_cache.unused_bytes > MR_CACHE_MAX_UNUSED_BYTES) {
+		entry = list_top(&mr_cache.unused, struct mr_cache_entry,
+				 lru_entry);
+		mr_cache_del_unused(entry);
+		mr_cache_drop(entry, free_list);
+	}
+}
+
+/* Called without the lock held, deregistration goes to the kernel */
+static int mr_cache_free_list(struct list_head *free_list)
+{
+	struct mr_cache_entry *entry, *tmp;
+	int ret = 0, err;
+
+	list_for_each_safe(free_list, entry, tmp, lru_entry) {
+		err = ibv_dereg_mr(entry->mr);
+		if (err && !ret)
+			ret = err;
+		free(entry);
+	}
+	return ret;
+}
+
+struct ibv_mr *ibv_reg_mr_cached(struct ibv_pd *pd, void *addr,
+				 size_t length, unsigned int access)
+{
+	uintptr_t start = (uintptr_t)addr;
+	struct mr_cache_entry *entry;
+	struct ibv_mr *mr;
+	unsigned int gen;
+
+	if (!length || start + length < start) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	pthread_mutex_lock(&mr_cache.lock);
+	mr_cache_init();
+	entry = mr_cache_find(pd, start, start + length, access);
+	if (entry) {
+		if (!entry->refcnt++)
+			mr_cache_del_unused(entry);
+		mr = entry->mr;
+		pthread_mutex_unlock(&mr_cache.lock);
+		return mr;
+	}
+	gen = mr_cache.inval_gen;
+	pthread_mutex_unlock(&mr_cache.lock);
+
+	entry = calloc(1, sizeof(*entry));
+	if (!entry) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	mr = ibv_reg_mr_iova2(pd, addr, length, start, access);
+	if (!mr) {
+		free(entry);
+		return NULL;
+	}
+	entry->mr = mr;
+	entry->start = start;
+	entry->end = start + length;
+	entry->access = access;
+	entry->refcnt = 1;
+
+	pthread_mutex_lock(&mr_cache.lock);
+	/*
+	 * If anything was invalidated while the MR was being registered it
+	 * may already describe stale pages, so only hand it to this caller.
+	 */
+	if (gen == mr_cache.inval_gen)
+		mr_cache_insert(entry);
+	cl_qmap_insert(&mr_cache.by_mr, (uintptr_t)mr, &entry->mr_item);
+	pthread_mutex_unlock(&mr_cache.lock);
+
+	return mr;
+}
+
+int ibv_release_mr_cached(struct ibv_mr *mr)
+{
+	struct mr_cache_entry *entry;
+	LIST_HEAD(free_list);
+	cl_map_item_t *item;
+
+	pthread_mutex_lock(&mr_cache.lock);
+	mr_cache_init();
+	item = cl_qmap_get(&mr_cache.by_mr, (uintptr_t)mr);
+	if (item == cl_qmap_end(&mr_cache.by_mr)) {
+		pthread_mutex_unlock(&mr_cache.lock);
+		return EINVAL;
+	}
+	entry = container_of(item, struct mr_cache_entry, mr_item);
+
+	if (!--entry->refcnt) {
+		if (entry->bucket) {
+			list_add_tail(&mr_cache.unused, &entry->lru_entry);
+			mr_cache.num_unused++;
+			mr_cache.unused_bytes += entry->end - entry->start;
+			mr_cache_evict(&free_list);
+		} else {
+			mr_cache_drop(entry, &free_list);
+		}
+	}
+	pthread_mutex_unlock(&mr_cache.lock);
+
+	return mr_cache_free_list(&free_list);
+}
+
+void ibv_invalidate_mr_cache(void *addr, size_t length)
+{
+	uintptr_t start = (uintptr_t)addr, end = start + length;
+	const cl_map_item_t *map_end;
+	struct mr_cache_entry *entry, *tmp;
+	struct mr_cache_bucket *bucket;
+	cl_map_item_t *item, *next;
+	LIST_HEAD(free_list);
+	uintptr_t lo;
+
+	if (!length)
+		return;
+	if (end < start)
+		end = UINTPTR_MAX;
+
+	pthread_mutex_lock(&mr_cache.lock);
+	mr_cache_init();
+	mr_cache.inval_gen++;
+
+	map_end = cl_qmap_end(&mr_cache.by_start);
+	lo = start > mr_cache.max_len ? start - mr_cache.max_len : 0;
+	item = lo ? cl_qmap_get_next(&mr_cache.by_start, lo - 1) :
+		    cl_qmap_head(&mr_cache.by_start);
+
+	for (; item != map_end && cl_qmap_key(item) < end; item = next) {
+		next = cl_qmap_next(item);
+		bucket = container_of(item, struct mr_cache_bucket, item);
+		list_for_each_safe(&bucket->entries, entry, tmp, bucket_entry) {
+			if (entry->end <= start)
+				continue;
+
+			/* Entries still held are deregistered on last release */
+			list_del(&entry->bucket_entry);
+			entry->bucket = NULL;
+			if (!entry->refcnt) {
+				mr_cache_del_unused(entry);
+				mr_cache_drop(entry, &free_list);
+			}
+		}
+		mr_cache_put_bucket(bucket);
+	}
+	pthread_mutex_unlock(&mr_cache.lock);
+
+	mr_cache_free_list(&free_list);
+}
+
+void ibv_mr_cache_flush_pd(struct ibv_pd *pd)
+{
+	struct mr_cache_entry *entry, *tmp;
+	LIST_HEAD(free_list);
+
+	pthread_mutex_lock(&mr_cache.lock);
+	if (!mr_cache.initialized || !mr_cache.num_unused) {
+		pthread_mutex_unlock(&mr_cache.lock);
+		return;
+	}
+	list_for_each_safe(&mr_cache.unused, entry, tmp, lru_entry) {
+		if (entry->mr->pd != pd)
+			continue;
+		mr_cache_del_unused(entry);
+		mr_cache_drop(entry, &free_list);
+	}
+	pthread_mutex_unlock(&mr_cache.lock);
+
+	mr_cache_free_list(&free_list);
+}
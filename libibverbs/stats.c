@@ -0,0 +1,397 @@
+// SPDX-License-Identifier: (GPL-2.0 OR Linux-OpenIB)
+/*
+ * Per context verbs statistics.
+ *
+ * When RDMAV_STATS is set every new context has its data path and memory
+ * registration ops wrapped by functions that count calls, errors and work
+ * items. RDMAV_STATS=2 also times each call into a log2 latency histogram.
+ * Counters live in cache line aligned shards, each thread adds to its own
+ * shard and ibv_query_stats() sums them. Contexts opened without
+ * RDMAV_STATS keep the provider functions and pay nothing.
+ */
+#include <config.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <ccan/list.h>
+#include <ccan/minmax.h>
+#include <util/util.h>
+
+#include "ibverbs.h"
+
+#define VERBS_STATS_SHARDS	16
+
+struct verbs_stats_op {
+	_Atomic(uint64_t)	calls;
+	_Atomic(uint64_t)	errors;
+	_Atomic(uint64_t)	items;
+	_Atomic(uint64_t)	empty;
+	_Atomic(uint64_t)	total_ns;
+	_Atomic(uint64_t)	latency_hist[IBV_STATS_LATENCY_BUCKETS];
+};
+
+struct verbs_stats_shard {
+	struct verbs_stats_op	ops[IBV_STATS_OP_NUM];
+} __attribute__((aligned(64)));
+
+struct verbs_stats {
+	struct verbs_stats_shard shards[VERBS_STATS_SHARDS];
+	struct list_node	entry;
+	struct ibv_context	*context;
+	bool			latency;
+
+	/* The provider functions the wrappers call */
+	int (*post_send)(struct ibv_qp *qp, struct ibv_send_wr *wr,
+			 struct ibv_send_wr **bad_wr);
+	int (*post_recv)(struct ibv_qp *qp, struct ibv_recv_wr *wr,
+			 struct ibv_recv_wr **bad_wr);
+	int (*post_srq_recv)(struct ibv_srq *srq, struct ibv_recv_wr *wr,
+			     struct ibv_recv_wr **bad_wr);
+	int (*poll_cq)(struct ibv_cq *cq, int num_entries, struct ibv_wc *wc);
+	int (*req_notify_cq)(struct ibv_cq *cq, int solicited_only);
+	struct ibv_mr *(*reg_mr)(struct ibv_pd *pd, void *addr, size_t length,
+				 uint64_t hca_va, int access);
+	int (*dereg_mr)(struct verbs_mr *vmr);
+};
+
+static const char *const stats_op_names[IBV_STATS_OP_NUM] = {
+	[IBV_STATS_OP_POST_SEND] = "post_send",
+	[IBV_STATS_OP_POST_RECV] = "post_recv",
+	[IBV_STATS_OP_POST_SRQ_RECV] = "post_srq_recv",
+	[IBV_STATS_OP_POLL_CQ] = "poll_cq",
+	[IBV_STATS_OP_REQ_NOTIFY_CQ] = "req_notify_cq",
+	[IBV_STATS_OP_REG_MR] = "reg_mr",
+	[IBV_STATS_OP_DEREG_MR] = "dereg_mr",
+};
+
+static unsigned int stats_level;
+static pthread_mutex_t stats_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(stats_list);
+
+static uint64_t stats_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned int stats_thread_shard(void)
+{
+	static atomic_uint next_shard;
+	static __thread int shard = -1;
+
+	if (shard < 0)
+		shard = atomic_fetch_add_explicit(&next_shard, 1,
+						  memory_order_relaxed) %
+			VERBS_STATS_SHARDS;
+	return shard;
+}
+
+static inline void stats_add(_Atomic(uint64_t) *counter, uint64_t val)
+{
+	atomic_fetch_add_explicit(counter, val, memory_order_relaxed);
+}
+
+static inline struct verbs_stats *ctx_stats(struct ibv_context *context)
+{
+	return verbs_get_ctx(context)->priv->stats;
+}
+
+static inline uint64_t stats_start(struct verbs_stats *stats)
+{
+	return stats->latency ? stats_now_ns() : 0;
+}
+
+static void stats_record(struct verbs_stats *stats, enum ibv_stats_op op,
+			 uint64_t start, bool error, uint64_t items)
+{
+	struct verbs_stats_op *sop =
+		&stats->shards[stats_thread_shard()].ops[op];
+	unsigned int bucket;
+	uint64_t ns;
+
+	if (stats->latency) {
+		ns = stats_now_ns() - start;
+		bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+		if (bucket >= IBV_STATS_LATENCY_BUCKETS)
+			bucket = IBV_STATS_LATENCY_BUCKETS - 1;
+		stats_add(&sop->total_ns, ns);
+		stats_add(&sop->latency_hist[bucket], 1);
+	}
+
+	stats_add(&sop->calls, 1);
+	if (error)
+		stats_add(&sop->errors, 1);
+	else if (items)
+		stats_add(&sop->items, items);
+	else
+		stats_add(&sop->empty, 1);
+}
+
+static int stats_post_send(struct ibv_qp *qp, struct ibv_send_wr *wr,
+			   struct ibv_send_wr **bad_wr)
+{
+	struct verbs_stats *stats = ctx_stats(qp->context);
+	struct ibv_send_wr *cur;
+	uint64_t start, num = 0;
+	int ret;
+
+	for (cur = wr; cur; cur = cur->next)
+		num++;
+
+	start = stats_start(stats);
+	ret = stats->post_send(qp, wr, bad_wr);
+	stats_record(stats, IBV_STATS_OP_POST_SEND, start, ret, num);
+	return ret;
+}
+
+static int stats_post_recv(struct ibv_qp *qp, struct ibv_recv_wr *wr,
+			   struct ibv_recv_wr **bad_wr)
+{
+	struct verbs_stats *stats = ctx_stats(qp->context);
+	struct ibv_recv_wr *cur;
+	uint64_t start, num = 0;
+	int ret;
+
+	for (cur = wr; cur; cur = cur->next)
+		num++;
+
+	start = stats_start(stats);
+	ret = stats->post_recv(qp, wr, bad_wr);
+	stats_record(stats, IBV_STATS_OP_POST_RECV, start, ret, num);
+	return ret;
+}
+
+static int stats_post_srq_recv(struct ibv_srq *srq, struct ibv_recv_wr *wr,
+			       struct ibv_recv_wr **bad_wr)
+{
+	struct verbs_stats *stats = ctx_stats(srq->context);
+	struct ibv_recv_wr *cur;
+	uint64_t start, num = 0;
+	int ret;
+
+	for (cur = wr; cur; cur = cur->next)
+		num++;
+
+	start = stats_start(stats);
+	ret = stats->post_srq_recv(srq, wr, bad_wr);
+	stats_record(stats, IBV_STATS_OP_POST_SRQ_RECV, start, ret, num);
+	return ret;
+}
+
+static int stats_poll_cq(struct ibv_cq *cq, int num_entries, struct ibv_wc *wc)
+{
+	struct verbs_stats *stats = ctx_stats(cq->context);
+	uint64_t start = stats_start(stats);
+	int ret;
+
+	ret = stats->poll_cq(cq, num_entries, wc);
+	stats_record(stats, IBV_STATS_OP_POLL_CQ, start, ret < 0,
+		     ret > 0 ? ret : 0);
+	return ret;
+}
+
+static int stats_req_notify_cq(struct ibv_cq *cq, int solicited_only)
+{
+	struct verbs_stats *stats = ctx_stats(cq->context);
+	uint64_t start = stats_start(stats);
+	int ret;
+
+	ret = stats->req_notify_cq(cq, solicited_only);
+	stats_record(stats, IBV_STATS_OP_REQ_NOTIFY_CQ, start, ret, 1);
+	return ret;
+}
+
+static struct ibv_mr *stats_reg_mr(struct ibv_pd *pd, void *addr,
+				   size_t length, uint64_t hca_va, int access)
+{
+	struct verbs_stats *stats = ctx_stats(pd->context);
+	uint64_t start = stats_start(stats);
+	struct ibv_mr *mr;
+
+	mr = stats->reg_mr(pd, addr, length, hca_va, access);
+	stats_record(stats, IBV_STATS_OP_REG_MR, start, !mr, length);
+	return mr;
+}
+
+static int stats_dereg_mr(struct verbs_mr *vmr)
+{
+	/* The MR is gone once the provider returns */
+	struct verbs_stats *stats = ctx_stats(vmr->ibv_mr.context);
+	uint64_t start = stats_start(stats);
+	uint64_t length = vmr->ibv_mr.length;
+	int ret;
+
+	ret = stats->dereg_mr(vmr);
+	stats_record(stats, IBV_STATS_OP_DEREG_MR, start, ret, length);
+	return ret;
+}
+
+static void stats_sum(struct verbs_stats *stats, struct ibv_stats *out)
+{
+	struct verbs_stats_op *sop;
+	struct ibv_stats_op_data *op;
+	unsigned int i, j, k;
+
+	memset(out, 0, sizeof(*out));
+	if (stats->latency)
+		out->flags |= IBV_STATS_FLAGS_LATENCY;
+
+	for (i = 0; i != VERBS_STATS_SHARDS; i++) {
+		for (j = 0; j != IBV_STATS_OP_NUM; j++) {
+			sop = &stats->shards[i].ops[j];
+			op = &out->ops[j];
+
+			op->calls += atomic_load_explicit(&sop->calls,
+							  memory_order_relaxed);
+			op->errors += atomic_load_explicit(
+				&sop->errors, memory_order_relaxed);
+			op->items += atomic_load_explicit(&sop->items,
+							  memory_order_relaxed);
+			op->empty += atomic_load_explicit(&sop->empty,
+							  memory_order_relaxed);
+			op->total_ns += atomic_load_explicit(
+				&sop->total_ns, memory_order_relaxed);
+			for (k = 0; k != IBV_STATS_LATENCY_BUCKETS; k++)
+				op->latency_hist[k] += atomic_load_explicit(
+					&sop->latency_hist[k],
+					memory_order_relaxed);
+		}
+	}
+}
+
+static void stats_dump(struct verbs_stats *stats)
+{
+	struct ibv_stats_op_data *op;
+	struct ibv_stats sum;
+	unsigned int i, k;
+
+	stats_sum(stats, &sum);
+
+	fprintf(stderr, PFX "stats for %s, pid %d\n",
+		ibv_get_device_name(stats->context->device), getpid());
+	fprintf(stderr, "  %-14s %12s %8s %12s %12s %8s\n", "op", "calls",
+		"errors", "items", "empty", "avg ns");
+	for (i = 0; i != IBV_STATS_OP_NUM; i++) {
+		op = &sum.ops[i];
+		if (!op->calls)
+			continue;
+
+		fprintf(stderr, "  %-14s %12" PRIu64 " %8" PRIu64 " %12" PRIu64
+			" %12" PRIu64 " %8" PRIu64 "\n",
+			stats_op_names[i], op->calls, op->errors, op->items,
+			op->empty, stats->latency ? op->total_ns / op->calls : 0);
+		if (!stats->latency)
+			continue;
+
+		fprintf(stderr, "  %-14s", "");
+		for (k = 0; k != IBV_STATS_LATENCY_BUCKETS; k++)
+			if (op->latency_hist[k])
+				fprintf(stderr, " %" PRIu64 "ns:%" PRIu64,
+					(uint64_t)1 << k, op->latency_hist[k]);
+		fprintf(stderr, "\n");
+	}
+}
+
+void verbs_stats_set_level(void)
+{
+	const char *env = getenv("RDMAV_STATS");
+
+	if (env)
+		stats_level = strtoul(env, NULL, 0);
+}
+
+#define STATS_WRAP(ops, name)                                                  \
+	do {                                                                   \
+		if ((ops)->name) {                                             \
+			stats->name = (ops)->name;                             \
+			(ops)->name = stats_##name;                            \
+		}                                                              \
+	} while (0)
+
+void verbs_stats_init(struct verbs_context *vctx)
+{
+	struct verbs_ex_private *priv = vctx->priv;
+	struct ibv_context_ops *ctx_ops = &vctx->context.ops;
+	struct verbs_stats *stats;
+
+	if (!stats_level)
+		return;
+
+	if (posix_memalign((void **)&stats, 64, sizeof(*stats)))
+		return;
+	memset(stats, 0, sizeof(*stats));
+	stats->context = &vctx->context;
+	stats->latency = stats_level > 1;
+
+	/* The data path is called through the context ops by the inlines */
+	STATS_WRAP(ctx_ops, post_send);
+	STATS_WRAP(ctx_ops, post_recv);
+	STATS_WRAP(ctx_ops, post_srq_recv);
+	STATS_WRAP(ctx_ops, poll_cq);
+	STATS_WRAP(ctx_ops, req_notify_cq);
+	priv->ops.post_send = ctx_ops->post_send;
+	priv->ops.post_recv = ctx_ops->post_recv;
+	priv->ops.post_srq_recv = ctx_ops->post_srq_recv;
+	priv->ops.poll_cq = ctx_ops->poll_cq;
+	priv->ops.req_notify_cq = ctx_ops->req_notify_cq;
+
+	STATS_WRAP(&priv->ops, reg_mr);
+	STATS_WRAP(&priv->ops, dereg_mr);
+
+	priv->stats = stats;
+
+	pthread_mutex_lock(&stats_list_lock);
+	list_add_tail(&stats_list, &stats->entry);
+	pthread_mutex_unlock(&stats_list_lock);
+}
+
+void verbs_stats_uninit(struct verbs_context *vctx)
+{
+	struct verbs_stats *stats = vctx->priv->stats;
+
+	if (!stats)
+		return;
+
+	pthread_mutex_lock(&stats_list_lock);
+	list_del(&stats->entry);
+	pthread_mutex_unlock(&stats_list_lock);
+
+	stats_dump(stats);
+	free(stats);
+	vctx->priv->stats = NULL;
+}
+
+/* Report the contexts the application never closed */
+static void __attribute__((destructor)) verbs_stats_exit(void)
+{
+	struct verbs_stats *stats;
+
+	pthread_mutex_lock(&stats_list_lock);
+	list_for_each(&stats_list, stats, entry)
+		stats_dump(stats);
+	pthread_mutex_unlock(&stats_list_lock);
+}
+
+int _ibv_query_stats(struct ibv_context *context, struct ibv_stats *stats,
+		     size_t stats_size)
+{
+	struct verbs_stats *vstats = ctx_stats(context);
+	struct ibv_stats sum;
+
+	if (!vstats)
+		return EOPNOTSUPP;
+
+	stats_sum(vstats, &sum);
+	memcpy(stats, &sum, min_t(size_t, stats_size, sizeof(sum)));
+	return 0;
+}
@@ -75,6 +75,22 @@ const char *ibv_get_sysfs_path(void)
 	return sysfs_path;
 }
 
+/*
+ * Test only: RDMAV_TEST_FAKE_SYSFS declares that SYSFS_PATH holds a fake
+ * tree with no real devices behind it, so enumeration must not consult
+ * netlink or /dev/infiniband.  Ignored in setuid programs.
+ */
+bool ibv_sysfs_fake_tree(void)
+{
+	const char *path;
+
+	if (!secure_getenv("RDMAV_TEST_FAKE_SYSFS"))
+		return false;
+
+	path = ibv_get_sysfs_path();
+	return path && strcmp(path, "/sys") != 0;
+}
+
 int ibv_read_sysfs_file_at(int dirfd, const char *file, char *buf, size_t size)
 {
 	ssize_t len;
@@ -0,0 +1,225 @@
+// SPDX-License-Identifier: (GPL-2.0 OR Linux-OpenIB)
+/*
+ * Device enumeration startup benchmark.
+ *
+ * Builds a fake sysfs tree with N uverbs devices, points SYSFS_PATH at it,
+ * sets RDMAV_TEST_FAKE_SYSFS so only that tree is used, and times the
+ * first ibv_get_device_list() call of freshly forked processes, which is
+ * the cost every verbs application pays at startup.
+ *
+ * The fake devices are named <prefix>0..N-1 so they match a provider by
+ * name, "rxe" by default. Providers are found through the usual config
+ * files or RDMAV_DRIVERS, e.g. for the build tree:
+ *
+ *   RDMAV_DRIVERS=$PWD/lib/librxe:$PWD/lib/libmlx5 bin/enum_bench -n 512
+ *
+ * With -c the provider match cache is enabled, the first run fills it.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <getopt.h>
+#include <ftw.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <infiniband/verbs.h>
+
+static int ndevs = 256;
+static int iters = 20;
+static const char *prefix = "rxe";
+static const char *cache_file;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int write_file(const char *dir, const char *file, const char *fmt, ...)
+{
+	char path[4096];
+	va_list ap;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, file);
+	fp = fopen(path, "w");
+	if (!fp)
+		return -1;
+	va_start(ap, fmt);
+	vfprintf(fp, fmt, ap);
+	va_end(ap);
+	return fclose(fp);
+}
+
+static int make_dir(const char *fmt, ...)
+{
+	char path[4096];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(path, sizeof(path), fmt, ap);
+	va_end(ap);
+	return mkdir(path, 0755) && errno != EEXIST ? -1 : 0;
+}
+
+static int make_tree(const char *root)
+{
+	char path[4096];
+	int i;
+
+	if (make_dir("%s/class", root) ||
+	    make_dir("%s/class/infiniband", root) ||
+	    make_dir("%s/class/infiniband_verbs", root))
+		return -1;
+
+	snprintf(path, sizeof(path), "%s/class/infiniband_verbs", root);
+	if (write_file(path, "abi_version", "6\n"))
+		return -1;
+
+	for (i = 0; i < ndevs; i++) {
+		snprintf(path, sizeof(path), "%s/class/infiniband_verbs/uverbs%d",
+			 root, i);
+		if (make_dir("%s", path) ||
+		    write_file(path, "ibdev", "%s%d\n", prefix, i) ||
+		    write_file(path, "dev", "231:%d\n", i) ||
+		    write_file(path, "abi_version", "2\n"))
+			return -1;
+
+		snprintf(path, sizeof(path), "%s/class/infiniband/%s%d", root,
+			 prefix, i);
+		if (make_dir("%s", path) || make_dir("%s/device", path) ||
+		    write_file(path, "node_type", "1: CA\n") ||
+		    write_file(path, "device/modalias",
+			       "pci:v00001AF4d00001000sv00001AF4sd00000001bc02sc00i00\n"))
+			return -1;
+	}
+	return 0;
+}
+
+static int remove_ent(const char *path, const struct stat *st, int flag,
+		      struct FTW *ftw)
+{
+	return remove(path);
+}
+
+/* Time the first enumeration of a new process */
+static int run_once(uint64_t *elapsed, int *found)
+{
+	struct ibv_device **list;
+	int fds[2], status;
+	uint64_t res[2];
+	uint64_t start;
+	pid_t pid;
+
+	if (pipe(fds))
+		return -1;
+
+	pid = fork();
+	if (pid < 0)
+		return -1;
+	if (!pid) {
+		int num = 0;
+
+		close(fds[0]);
+		start = now_ns();
+		list = ibv_get_device_list(&num);
+		res[0] = now_ns() - start;
+		res[1] = num;
+		if (list)
+			ibv_free_device_list(list);
+		_exit(write(fds[1], res, sizeof(res)) != sizeof(res));
+	}
+
+	close(fds[1]);
+	if (read(fds[0], res, sizeof(res)) != sizeof(res))
+		res[1] = -1;
+	close(fds[0]);
+	waitpid(pid, &status, 0);
+	if (res[1] == (uint64_t)-1)
+		return -1;
+
+	*elapsed = res[0];
+	*found = res[1];
+	return 0;
+}
+
+static void usage(const char *argv0)
+{
+	printf("usage: %s [options]\n", argv0);
+	printf("\t-n devices     fake uverbs devices (default %d)\n", ndevs);
+	printf("\t-i count       processes to time (default %d)\n", iters);
+	printf("\t-p prefix      device name prefix (default %s)\n", prefix);
+	printf("\t-c file        use file as the provider match cache\n");
+}
+
+int main(int argc, char **argv)
+{
+	char root[] = "/tmp/enum_bench.XXXXXX";
+	uint64_t elapsed, total = 0, best = UINT64_MAX;
+	int i, op, found = 0, ret = 1;
+
+	while ((op = getopt(argc, argv, "n:i:p:c:")) != -1) {
+		switch (op) {
+		case 'n':
+			ndevs = atoi(optarg);
+			break;
+		case 'i':
+			iters = atoi(optarg);
+			break;
+		case 'p':
+			prefix = optarg;
+			break;
+		case 'c':
+			cache_file = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			exit(1);
+		}
+	}
+
+	if (ndevs < 1 || iters < 1) {
+		fprintf(stderr, "devices and count must be positive\n");
+		exit(1);
+	}
+
+	if (!mkdtemp(root)) {
+		perror("mkdtemp");
+		exit(1);
+	}
+	if (make_tree(root)) {
+		perror("create fake sysfs");
+		goto out;
+	}
+
+	setenv("SYSFS_PATH", root, 1);
+	setenv("RDMAV_TEST_FAKE_SYSFS", "1", 1);
+	if (cache_file)
+		setenv("RDMAV_DEVICE_CACHE", cache_file, 1);
+
+	for (i = 0; i < iters; i++) {
+		if (run_once(&elapsed, &found)) {
+			fprintf(stderr, "enumeration failed\n");
+			goto out;
+		}
+		total += elapsed;
+		if (elapsed < best)
+			best = elapsed;
+	}
+
+	printf("%d fake devices, %d found%s: %.1f us average, %.1f us best\n",
+	       ndevs, found, cache_file ? " (cached)" : "",
+	       total / 1e3 / iters, best / 1e3);
+	ret = 0;
+out:
+	nftw(root, remove_ent, 16, FTW_DEPTH | FTW_PHYS);
+	return ret;
+}
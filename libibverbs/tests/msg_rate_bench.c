@@ -0,0 +1,364 @@
+// SPDX-License-Identifier: (GPL-2.0 OR Linux-OpenIB)
+/*
+ * Small message rate benchmark.
+ *
+ * Connects two RC QPs on the same port to each other and posts batches of
+ * small RDMA writes from one to the other.  Only the last write of each
+ * batch is signaled.  Reports the number of writes completed per second.
+ * Run it on an rxe or siw device over loopback to measure the cost of the
+ * send path, including doorbells, without any hardware.
+ *
+ * By default each batch is posted with a single ibv_post_send() list.
+ * With -e, it is built with ibv_wr_start() ... ibv_wr_complete().
+ * With -t, the QPs and the CQ are created under a parent domain with a
+ * thread domain, so providers that support it can skip their locks.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+
+#include <infiniband/verbs.h>
+
+static const char *dev_name;
+static int ib_port = 1;
+static int gid_index;
+static int msg_size = 8;
+static int depth = 256;
+static int batch = 16;
+static long iters = 1000000;
+static int use_ex;
+static int use_td;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct ibv_qp *create_qp(struct ibv_context *ctx, struct ibv_pd *pd,
+				struct ibv_cq *cq)
+{
+	struct ibv_qp_init_attr_ex attr = {
+		.send_cq = cq,
+		.recv_cq = cq,
+		.cap = {
+			.max_send_wr = depth,
+			.max_recv_wr = 1,
+			.max_send_sge = 1,
+			.max_recv_sge = 1,
+		},
+		.qp_type = IBV_QPT_RC,
+		.comp_mask = IBV_QP_INIT_ATTR_PD,
+		.pd = pd,
+	};
+
+	if (use_ex) {
+		attr.comp_mask |= IBV_QP_INIT_ATTR_SEND_OPS_FLAGS;
+		attr.send_ops_flags = IBV_QP_EX_WITH_RDMA_WRITE;
+	}
+
+	return ibv_create_qp_ex(ctx, &attr);
+}
+
+static int connect_qp(struct ibv_qp *qp, uint32_t dest_qpn,
+		      union ibv_gid *gid, enum ibv_mtu mtu)
+{
+	struct ibv_qp_attr attr = {
+		.qp_state = IBV_QPS_INIT,
+		.port_num = ib_port,
+		.qp_access_flags = IBV_ACCESS_REMOTE_WRITE,
+	};
+
+	if (ibv_modify_qp(qp, &attr, IBV_QP_STATE | IBV_QP_PKEY_INDEX |
+			  IBV_QP_PORT | IBV_QP_ACCESS_FLAGS))
+		return -1;
+
+	memset(&attr, 0, sizeof attr);
+	attr.qp_state = IBV_QPS_RTR;
+	attr.path_mtu = mtu;
+	attr.dest_qp_num = dest_qpn;
+	attr.max_dest_rd_atomic = 1;
+	attr.min_rnr_timer = 12;
+	attr.ah_attr.is_global = 1;
+	attr.ah_attr.grh.dgid = *gid;
+	attr.ah_attr.grh.sgid_index = gid_index;
+	attr.ah_attr.grh.hop_limit = 1;
+	attr.ah_attr.port_num = ib_port;
+	if (ibv_modify_qp(qp, &attr, IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU |
+			  IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
+			  IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER))
+		return -1;
+
+	memset(&attr, 0, sizeof attr);
+	attr.qp_state = IBV_QPS_RTS;
+	attr.timeout = 14;
+	attr.retry_cnt = 7;
+	attr.rnr_retry = 7;
+	attr.max_rd_atomic = 1;
+	return ibv_modify_qp(qp, &attr, IBV_QP_STATE | IBV_QP_TIMEOUT |
+			     IBV_QP_RETRY_CNT | IBV_QP_RNR_RETRY |
+			     IBV_QP_SQ_PSN | IBV_QP_MAX_QP_RD_ATOMIC);
+}
+
+static int post_batch(struct ibv_qp *qp, struct ibv_mr *mr, uint64_t raddr)
+{
+	struct ibv_send_wr wr[batch], *bad;
+	struct ibv_sge sge = {
+		.addr = (uintptr_t) mr->addr,
+		.length = msg_size,
+		.lkey = mr->lkey,
+	};
+	struct ibv_qp_ex *qpx;
+	int i;
+
+	if (use_ex) {
+		qpx = ibv_qp_to_qp_ex(qp);
+		ibv_wr_start(qpx);
+		for (i = 0; i < batch; i++) {
+			qpx->wr_id = i;
+			qpx->wr_flags = (i == batch - 1) ? IBV_SEND_SIGNALED : 0;
+			ibv_wr_rdma_write(qpx, mr->rkey, raddr);
+			ibv_wr_set_sge(qpx, mr->lkey, sge.addr, sge.length);
+		}
+		return ibv_wr_complete(qpx);
+	}
+
+	memset(wr, 0, sizeof wr);
+	for (i = 0; i < batch; i++) {
+		wr[i].wr_id = i;
+		wr[i].next = (i == batch - 1) ? NULL : &wr[i + 1];
+		wr[i].sg_list = &sge;
+		wr[i].num_sge = 1;
+		wr[i].opcode = IBV_WR_RDMA_WRITE;
+		wr[i].send_flags = (i == batch - 1) ? IBV_SEND_SIGNALED : 0;
+		wr[i].wr.rdma.remote_addr = raddr;
+		wr[i].wr.rdma.rkey = mr->rkey;
+	}
+	return ibv_post_send(qp, wr, &bad);
+}
+
+static struct ibv_cq *create_cq(struct ibv_context *ctx, struct ibv_pd *pad)
+{
+	struct ibv_cq_init_attr_ex attr = {
+		.cqe = depth * 2,
+		.comp_mask = IBV_CQ_INIT_ATTR_MASK_PD,
+		.parent_domain = pad,
+	};
+	struct ibv_cq_ex *cq;
+
+	if (!pad)
+		return ibv_create_cq(ctx, depth * 2, NULL, NULL, 0);
+
+	cq = ibv_create_cq_ex(ctx, &attr);
+	return cq ? ibv_cq_ex_to_cq(cq) : NULL;
+}
+
+static int run(struct ibv_context *ctx)
+{
+	struct ibv_qp *sqp = NULL, *rqp = NULL;
+	struct ibv_port_attr port_attr;
+	struct ibv_pd *pd = NULL, *pad = NULL;
+	struct ibv_cq *cq = NULL;
+	struct ibv_mr *mr = NULL;
+	struct ibv_td *td = NULL;
+	long posted = 0, done = 0;
+	int outstanding = 0, ret = -1, n;
+	uint64_t start, elapsed;
+	union ibv_gid gid;
+	struct ibv_wc wc[16];
+	void *buf;
+
+	if (ibv_query_port(ctx, ib_port, &port_attr) ||
+	    ibv_query_gid(ctx, ib_port, gid_index, &gid)) {
+		perror("query port");
+		return -1;
+	}
+
+	buf = calloc(2, msg_size);
+	pd = ibv_alloc_pd(ctx);
+	if (!buf || !pd) {
+		perror("alloc");
+		goto out;
+	}
+
+	if (use_td) {
+		struct ibv_td_init_attr td_attr = {};
+		struct ibv_parent_domain_init_attr pad_attr = { .pd = pd };
+
+		td = ibv_alloc_td(ctx, &td_attr);
+		if (!td) {
+			perror("alloc td");
+			goto out;
+		}
+		pad_attr.td = td;
+		pad = ibv_alloc_parent_domain(ctx, &pad_attr);
+		if (!pad) {
+			perror("alloc parent domain");
+			goto out;
+		}
+	}
+
+	cq = create_cq(ctx, pad);
+	if (!cq) {
+		perror("create cq");
+		goto out;
+	}
+
+	mr = ibv_reg_mr(pd, buf, 2 * msg_size,
+			IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+	sqp = create_qp(ctx, pad ? pad : pd, cq);
+	rqp = create_qp(ctx, pad ? pad : pd, cq);
+	if (!mr || !sqp || !rqp) {
+		perror("create");
+		goto out;
+	}
+
+	if (connect_qp(sqp, rqp->qp_num, &gid, port_attr.active_mtu) ||
+	    connect_qp(rqp, sqp->qp_num, &gid, port_attr.active_mtu)) {
+		perror("connect");
+		goto out;
+	}
+
+	start = now_ns();
+	while (done < iters) {
+		while (posted < iters && outstanding + batch <= depth) {
+			if (post_batch(sqp, mr, (uintptr_t) buf + msg_size)) {
+				perror("post");
+				goto out;
+			}
+			posted += batch;
+			outstanding += batch;
+		}
+
+		n = ibv_poll_cq(cq, 16, wc);
+		if (n < 0) {
+			perror("poll");
+			goto out;
+		}
+		while (n--) {
+			if (wc[n].status != IBV_WC_SUCCESS) {
+				fprintf(stderr, "completion error %s\n",
+					ibv_wc_status_str(wc[n].status));
+				goto out;
+			}
+			outstanding -= batch;
+			done += batch;
+		}
+	}
+	elapsed = now_ns() - start;
+
+	printf("%s%s %ld writes of %d bytes, batch %d: %.0f msgs/sec, %.1f ns/msg\n",
+	       use_ex ? "ibv_wr_*" : "ibv_post_send",
+	       use_td ? " (thread domain)" : "", done, msg_size, batch,
+	       done * 1e9 / elapsed, (double) elapsed / done);
+	ret = 0;
+out:
+	if (rqp)
+		ibv_destroy_qp(rqp);
+	if (sqp)
+		ibv_destroy_qp(sqp);
+	if (mr)
+		ibv_dereg_mr(mr);
+	if (cq)
+		ibv_destroy_cq(cq);
+	if (pad)
+		ibv_dealloc_pd(pad);
+	if (td)
+		ibv_dealloc_td(td);
+	if (pd)
+		ibv_dealloc_pd(pd);
+	free(buf);
+	return ret;
+}
+
+static void usage(const char *argv0)
+{
+	printf("usage: %s [options]\n", argv0);
+	printf("\t-d device      RDMA device (default first found)\n");
+	printf("\t-i port        port number (default %d)\n", ib_port);
+	printf("\t-g index       source GID index (default %d)\n", gid_index);
+	printf("\t-s size        bytes per write (default %d)\n", msg_size);
+	printf("\t-n count       number of writes (default %ld)\n", iters);
+	printf("\t-b batch       writes per post (default %d)\n", batch);
+	printf("\t-q depth       send queue depth (default %d)\n", depth);
+	printf("\t-e             post with the ibv_wr_* API\n");
+	printf("\t-t             use a thread domain\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct ibv_device **list;
+	struct ibv_context *ctx;
+	int i, op, ret;
+
+	while ((op = getopt(argc, argv, "d:i:g:s:n:b:q:et")) != -1) {
+		switch (op) {
+		case 'd':
+			dev_name = optarg;
+			break;
+		case 'i':
+			ib_port = atoi(optarg);
+			break;
+		case 'g':
+			gid_index = atoi(optarg);
+			break;
+		case 's':
+			msg_size = atoi(optarg);
+			break;
+		case 'n':
+			iters = atol(optarg);
+			break;
+		case 'b':
+			batch = atoi(optarg);
+			break;
+		case 'q':
+			depth = atoi(optarg);
+			break;
+		case 'e':
+			use_ex = 1;
+			break;
+		case 't':
+			use_td = 1;
+			break;
+		default:
+			usage(argv[0]);
+			exit(1);
+		}
+	}
+
+	if (msg_size < 1 || batch < 1 || depth < batch) {
+		fprintf(stderr, "size and batch must be positive, depth >= batch\n");
+		exit(1);
+	}
+
+	list = ibv_get_device_list(NULL);
+	if (!list || !list[0]) {
+		fprintf(stderr, "no RDMA devices found\n");
+		exit(1);
+	}
+
+	for (i = 0; dev_name && list[i]; i++)
+		if (!strcmp(ibv_get_device_name(list[i]), dev_name))
+			break;
+	if (!list[i]) {
+		fprintf(stderr, "device %s not found\n", dev_name);
+		exit(1);
+	}
+
+	ctx = ibv_open_device(list[i]);
+	if (!ctx) {
+		perror("open device");
+		exit(1);
+	}
+
+	ret = run(ctx);
+
+	ibv_close_device(ctx);
+	ibv_free_device_list(list);
+	return ret ? 1 : 0;
+}
@@ -0,0 +1,216 @@
+// SPDX-License-Identifier: (GPL-2.0 OR Linux-OpenIB)
+/*
+ * Memory registration rate benchmark with fork protection enabled.
+ *
+ * Calls ibv_fork_init(), as IBV_FORK_SAFE=1 would, then starts N threads
+ * that each register and deregister their own buffers in a loop.  Reports
+ * the aggregate number of register/deregister pairs per second.
+ *
+ * With -r no device is opened and ibv_dontfork_range()/ibv_dofork_range()
+ * are called directly, which measures the fork protection bookkeeping
+ * alone.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <infiniband/verbs.h>
+#include <infiniband/driver.h>
+
+static const char *dev_name;
+static int nthreads = 4;
+static int nbufs = 16;
+static size_t buf_size = 65536;
+static long iters = 100000;
+static int range_only;
+
+struct thread_ctx {
+	pthread_t thread;
+	struct ibv_pd *pd;
+	void **bufs;
+	int ret;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *run_thread(void *arg)
+{
+	struct thread_ctx *t = arg;
+	struct ibv_mr *mr;
+	void *buf;
+	long i;
+
+	for (i = 0; i < iters; i++) {
+		buf = t->bufs[i % nbufs];
+
+		if (range_only) {
+			if (ibv_dontfork_range(buf, buf_size) ||
+			    ibv_dofork_range(buf, buf_size))
+				goto err;
+			continue;
+		}
+
+		mr = ibv_reg_mr(t->pd, buf, buf_size, IBV_ACCESS_LOCAL_WRITE);
+		if (!mr || ibv_dereg_mr(mr))
+			goto err;
+	}
+	return NULL;
+
+err:
+	perror(range_only ? "fork range" : "reg mr");
+	t->ret = -1;
+	return NULL;
+}
+
+static int run(struct ibv_pd *pd)
+{
+	struct thread_ctx *threads;
+	uint64_t start, elapsed;
+	int i, j, ret = 0;
+
+	threads = calloc(nthreads, sizeof(*threads));
+	if (!threads)
+		return -1;
+
+	for (i = 0; i < nthreads; i++) {
+		threads[i].pd = pd;
+		threads[i].bufs = calloc(nbufs, sizeof(void *));
+		if (!threads[i].bufs)
+			goto out;
+		for (j = 0; j < nbufs; j++) {
+			threads[i].bufs[j] = malloc(buf_size);
+			if (!threads[i].bufs[j])
+				goto out;
+			memset(threads[i].bufs[j], 0, buf_size);
+		}
+	}
+
+	start = now_ns();
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&threads[i].thread, NULL, run_thread,
+			       &threads[i]);
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i].thread, NULL);
+		ret |= threads[i].ret;
+	}
+	elapsed = now_ns() - start;
+
+	if (!ret)
+		printf("%s %d threads, %zu byte buffers: %.0f reg/dereg per sec\n",
+		       range_only ? "fork range" : "reg mr", nthreads,
+		       buf_size, nthreads * iters * 1e9 / elapsed);
+out:
+	for (i = 0; i < nthreads; i++) {
+		for (j = 0; threads[i].bufs && j < nbufs; j++)
+			free(threads[i].bufs[j]);
+		free(threads[i].bufs);
+	}
+	free(threads);
+	return ret;
+}
+
+static void usage(const char *argv0)
+{
+	printf("usage: %s [options]\n", argv0);
+	printf("\t-d device      RDMA device (default first found)\n");
+	printf("\t-t threads     number of threads (default %d)\n", nthreads);
+	printf("\t-b buffers     buffers per thread (default %d)\n", nbufs);
+	printf("\t-s size        bytes per buffer (default %zu)\n", buf_size);
+	printf("\t-n count       registrations per thread (default %ld)\n",
+	       iters);
+	printf("\t-r             fork range bookkeeping only, no device\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct ibv_device **list = NULL;
+	struct ibv_context *ctx = NULL;
+	struct ibv_pd *pd = NULL;
+	int i, op, ret;
+
+	while ((op = getopt(argc, argv, "d:t:b:s:n:r")) != -1) {
+		switch (op) {
+		case 'd':
+			dev_name = optarg;
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 'b':
+			nbufs = atoi(optarg);
+			break;
+		case 's':
+			buf_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			iters = atol(optarg);
+			break;
+		case 'r':
+			range_only = 1;
+			break;
+		default:
+			usage(argv[0]);
+			exit(1);
+		}
+	}
+
+	if (nthreads < 1 || nbufs < 1 || !buf_size) {
+		fprintf(stderr, "threads, buffers and size must be positive\n");
+		exit(1);
+	}
+
+	ret = ibv_fork_init();
+	if (ret) {
+		fprintf(stderr, "ibv_fork_init failed: %s\n", strerror(ret));
+		exit(1);
+	}
+	if (ibv_is_fork_initialized() != IBV_FORK_ENABLED)
+		printf("fork protection not needed by this kernel\n");
+
+	if (!range_only) {
+		list = ibv_get_device_list(NULL);
+		if (!list || !list[0]) {
+			fprintf(stderr, "no RDMA devices found\n");
+			exit(1);
+		}
+
+		for (i = 0; dev_name && list[i]; i++)
+			if (!strcmp(ibv_get_device_name(list[i]), dev_name))
+				break;
+		if (!list[i]) {
+			fprintf(stderr, "device %s not found\n", dev_name);
+			exit(1);
+		}
+
+		ctx = ibv_open_device(list[i]);
+		if (!ctx) {
+			perror("open device");
+			exit(1);
+		}
+		pd = ibv_alloc_pd(ctx);
+		if (!pd) {
+			perror("alloc pd");
+			exit(1);
+		}
+	}
+
+	ret = run(pd);
+
+	if (pd)
+		ibv_dealloc_pd(pd);
+	if (ctx)
+		ibv_close_device(ctx);
+	if (list)
+		ibv_free_device_list(list);
+	return ret ? 1 : 0;
+}
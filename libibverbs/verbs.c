@@ -304,6 +304,7 @@ LATEST_SYMVER_FUNC(ibv_dealloc_pd, 1_1, "IBVERBS_1.1",
 		   int,
 		   struct ibv_pd *pd)
 {
+	ibv_mr_cache_flush_pd(pd);
 	return get_ops(pd->context)->dealloc_pd(pd);
 }
 
@@ -2394,6 +2394,63 @@ int ibv_get_async_event(struct ibv_context *context,
  */
 void ibv_ack_async_event(struct ibv_async_event *event);
 
+enum ibv_async_event_set_type {
+	IBV_ASYNC_EVENT_SET_ASYNC,
+	IBV_ASYNC_EVENT_SET_COMP,
+};
+
+struct ibv_async_event_set_event {
+	enum ibv_async_event_set_type type;
+	struct ibv_context *context;
+	/* Valid for IBV_ASYNC_EVENT_SET_ASYNC, ack with ibv_ack_async_event() */
+	struct ibv_async_event async;
+	/* Valid for IBV_ASYNC_EVENT_SET_COMP, ack with ibv_ack_cq_events() */
+	struct {
+		struct ibv_comp_channel *channel;
+		struct ibv_cq *cq;
+		void *cq_context;
+	} comp;
+};
+
+struct ibv_async_event_set;
+
+/**
+ * ibv_create_async_event_set - Create a set to wait for the async events
+ * and completion events of many contexts at once
+ */
+struct ibv_async_event_set *ibv_create_async_event_set(void);
+
+/**
+ * ibv_destroy_async_event_set - Destroy an event set, the contexts and
+ * channels in it are not affected
+ */
+int ibv_destroy_async_event_set(struct ibv_async_event_set *set);
+
+int ibv_async_event_set_add_context(struct ibv_async_event_set *set,
+				    struct ibv_context *context);
+int ibv_async_event_set_remove_context(struct ibv_async_event_set *set,
+				       struct ibv_context *context);
+int ibv_async_event_set_add_comp_channel(struct ibv_async_event_set *set,
+					 struct ibv_comp_channel *channel);
+int ibv_async_event_set_remove_comp_channel(struct ibv_async_event_set *set,
+					    struct ibv_comp_channel *channel);
+
+/**
+ * ibv_async_event_set_get_fd - Return a file descriptor that becomes
+ * readable when ibv_async_event_set_poll() has events to return
+ */
+int ibv_async_event_set_get_fd(struct ibv_async_event_set *set);
+
+/**
+ * ibv_async_event_set_poll - Wait up to timeout ms for events
+ * @events: Array filled with up to num_events events
+ *
+ * Returns the number of events returned, 0 on timeout or -1 and errno.
+ */
+int ibv_async_event_set_poll(struct ibv_async_event_set *set,
+			     struct ibv_async_event_set_event *events,
+			     int num_events, int timeout);
+
 /**
  * ibv_query_device - Get device properties
  */
@@ -2465,6 +2522,53 @@ static inline ssize_t ibv_query_gid_table(struct ibv_context *context,
 				    sizeof(*entries));
 }
 
+enum ibv_stats_op {
+	IBV_STATS_OP_POST_SEND,
+	IBV_STATS_OP_POST_RECV,
+	IBV_STATS_OP_POST_SRQ_RECV,
+	IBV_STATS_OP_POLL_CQ,
+	IBV_STATS_OP_REQ_NOTIFY_CQ,
+	IBV_STATS_OP_REG_MR,
+	IBV_STATS_OP_DEREG_MR,
+	IBV_STATS_OP_NUM,
+};
+
+#define IBV_STATS_LATENCY_BUCKETS 32
+
+struct ibv_stats_op_data {
+	uint64_t calls;
+	uint64_t errors;
+	/* Work requests posted, completions polled or bytes registered */
+	uint64_t items;
+	/* Successful calls that handled no items, e.g. empty CQ polls */
+	uint64_t empty;
+	uint64_t total_ns;
+	/* Bucket i counts calls that took [2^i, 2^(i+1)) ns */
+	uint64_t latency_hist[IBV_STATS_LATENCY_BUCKETS];
+};
+
+enum ibv_stats_flags {
+	IBV_STATS_FLAGS_LATENCY = 1 << 0,
+};
+
+struct ibv_stats {
+	uint32_t flags;
+	uint32_t reserved;
+	struct ibv_stats_op_data ops[IBV_STATS_OP_NUM];
+};
+
+int _ibv_query_stats(struct ibv_context *context, struct ibv_stats *stats,
+		     size_t stats_size);
+
+/**
+ * ibv_query_stats - Read the verbs call statistics of a context
+ */
+static inline int ibv_query_stats(struct ibv_context *context,
+				  struct ibv_stats *stats)
+{
+	return _ibv_query_stats(context, stats, sizeof(*stats));
+}
+
 /**
  * ibv_query_pkey - Get a P_Key table entry
  */
@@ -2632,6 +2736,23 @@ __ibv_reg_mr_iova(struct ibv_pd *pd, void *addr, size_t length, uint64_t iova,
 struct ibv_mr *ibv_reg_dmabuf_mr(struct ibv_pd *pd, uint64_t offset, size_t length,
 				 uint64_t iova, int fd, int access);
 
+/**
+ * ibv_reg_mr_cached - Register a memory region through the library MR cache
+ */
+struct ibv_mr *ibv_reg_mr_cached(struct ibv_pd *pd, void *addr, size_t length,
+				 unsigned int access);
+
+/**
+ * ibv_release_mr_cached - Drop a reference taken by ibv_reg_mr_cached
+ */
+int ibv_release_mr_cached(struct ibv_mr *mr);
+
+/**
+ * ibv_invalidate_mr_cache - Drop cached MRs overlapping a range that is
+ * about to be unmapped
+ */
+void ibv_invalidate_mr_cache(void *addr, size_t length);
+
 enum ibv_rereg_mr_err_code {
 	/* Old MR is valid, invalid input */
 	IBV_REREG_MR_ERR_INPUT = -1,
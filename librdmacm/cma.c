@@ -689,8 +689,11 @@ static void ucma_insert_id(struct cma_id_private *id_priv)
 
 static void ucma_remove_id(struct cma_id_private *id_priv)
 {
-	if (id_priv->handle <= IDX_MAX_INDEX)
+	if (id_priv->handle <= IDX_MAX_INDEX) {
+		fastlock_acquire(&idm_lock);
 		idm_clear(&ucma_idm, id_priv->handle);
+		fastlock_release(&idm_lock);
+	}
 }
 
 static struct cma_id_private *ucma_lookup_id(int handle)
@@ -37,6 +37,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
 #include <netdb.h>
 #include <fcntl.h>
@@ -95,6 +96,9 @@ static int keepalive;
 static char *dst_addr;
 static char *src_addr;
 static struct timeval start, end;
+static struct rusage start_usage, end_usage;
+static int lat_stats;
+static uint32_t *lat_samples;
 static void *buf;
 static struct rdma_addrinfo rai_hints;
 static struct addrinfo ai_hints;
@@ -123,6 +127,58 @@ static void show_perf(void)
 		(usec / iterations) / (transfer_count * 2));
 }
 
+static uint64_t tv_usec(const struct timeval *tv)
+{
+	return tv->tv_sec * 1000000ULL + tv->tv_usec;
+}
+
+static int cmp_sample(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+static uint32_t percentile(int cnt, double pct)
+{
+	int i = (int) (cnt * pct / 100.);
+
+	return lat_samples[i < cnt ? i : cnt - 1];
+}
+
+/*
+ * Report round trip latency percentiles next to the CPU time used, so the
+ * cost of busy polling can be weighed against the latency it buys.
+ */
+static void show_lat_stats(void)
+{
+	struct rdma_poll_stats stats;
+	socklen_t len = sizeof stats;
+	uint64_t wall, cpu;
+
+	if (!iterations)
+		return;
+
+	wall = tv_usec(&end) - tv_usec(&start);
+	cpu = tv_usec(&end_usage.ru_utime) - tv_usec(&start_usage.ru_utime) +
+	      tv_usec(&end_usage.ru_stime) - tv_usec(&start_usage.ru_stime);
+	qsort(lat_samples, iterations, sizeof(*lat_samples), cmp_sample);
+
+	printf("%-10s rtt usec: p50 %u p90 %u p99 %u p99.9 %u max %u  cpu %.1f%%\n",
+	       "", percentile(iterations, 50), percentile(iterations, 90),
+	       percentile(iterations, 99), percentile(iterations, 99.9),
+	       lat_samples[iterations - 1], wall ? cpu * 100. / wall : 0.);
+
+	if (use_rs && !rgetsockopt(rs, SOL_RDMA, RDMA_POLL_STATS, &stats, &len))
+		printf("%-10s poll: spin %llu yield %llu sleep %llu, %llu usec polling, "
+		       "avg wait %u usec, budget %u usec\n", "",
+		       (unsigned long long) stats.spin_wakeups,
+		       (unsigned long long) stats.yield_wakeups,
+		       (unsigned long long) stats.sleep_wakeups,
+		       (unsigned long long) stats.poll_usecs,
+		       stats.wait_usecs, stats.poll_budget);
+}
+
 static void init_latency_test(int size)
 {
 	char sstr[5];
@@ -225,14 +281,28 @@ static int sync_test(void)
 
 static int run_test(void)
 {
+	struct timeval iter_start, iter_end;
 	int ret, i, t;
 
+	if (lat_stats) {
+		free(lat_samples);
+		lat_samples = calloc(iterations, sizeof(*lat_samples));
+		if (!lat_samples) {
+			perror("calloc");
+			return -1;
+		}
+	}
+
 	ret = sync_test();
 	if (ret)
 		goto out;
 
+	getrusage(RUSAGE_SELF, &start_usage);
 	gettimeofday(&start, NULL);
 	for (i = 0; i < iterations; i++) {
+		if (lat_stats)
+			gettimeofday(&iter_start, NULL);
+
 		for (t = 0; t < transfer_count; t++) {
 			ret = dst_addr ? send_xfer(transfer_size) :
 					 recv_xfer(transfer_size);
@@ -246,9 +316,17 @@ static int run_test(void)
 			if (ret)
 				goto out;
 		}
+
+		if (lat_stats) {
+			gettimeofday(&iter_end, NULL);
+			lat_samples[i] = tv_usec(&iter_end) - tv_usec(&iter_start);
+		}
 	}
 	gettimeofday(&end, NULL);
+	getrusage(RUSAGE_SELF, &end_usage);
 	show_perf();
+	if (lat_stats)
+		show_lat_stats();
 	ret = 0;
 
 out:
@@ -560,6 +638,7 @@ static int run(void)
 		rs_shutdown(rs, SHUT_RDWR);
 	rs_close(rs);
 free:
+	free(lat_samples);
 	free(buf);
 	return ret;
 }
@@ -590,6 +669,9 @@ static int set_test_opt(const char *arg)
 		case 'v':
 			verify = 1;
 			break;
+		case 'l':
+			lat_stats = 1;
+			break;
 		default:
 			return -1;
 		}
@@ -606,6 +688,8 @@ static int set_test_opt(const char *arg)
 			use_rgai = 1;
 		} else if (!strncasecmp("verify", arg, 6)) {
 			verify = 1;
+		} else if (!strncasecmp("latency", arg, 7)) {
+			lat_stats = 1;
 		} else if (!strncasecmp("fork", arg, 4)) {
 			use_fork = 1;
 			use_rs = 0;
@@ -695,6 +779,7 @@ int main(int argc, char **argv)
 			printf("\t    n|nonblocking - use nonblocking calls\n");
 			printf("\t    r|resolve - use rdma cm to resolve address\n");
 			printf("\t    v|verify - verify data\n");
+			printf("\t    l|latency - report latency percentiles and cpu use\n");
 			exit(1);
 		}
 	}
@@ -34,8 +34,13 @@
 #include <config.h>
 
 #include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <sys/types.h>
+#include <sys/syscall.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <linux/membarrier.h>
 
 #include "indexer.h"
 
@@ -48,18 +53,28 @@
  * The lower bits specify the offset into the allocated memory where
  * the pointer is stored.
  *
- * This allows us to adjust the number of pointers stored by the index
- * list without taking a lock during data lookups.
+ * The array of allocations is resized as the indexer grows, so lookups
+ * must be serialized with inserts by the caller.
  */
 
 static int idx_grow(struct indexer *idx)
 {
-	union idx_entry *entry;
-	int i, start_index;
+	union idx_entry *entry, **array;
+	int i, start_index, max_size;
 
-	if (idx->size >= IDX_ARRAY_SIZE)
+	if (idx->size > idx_array_index(IDX_MAX_INDEX))
 		goto nomem;
 
+	if (idx->size == idx->max_size) {
+		max_size = idx->max_size ? idx->max_size * 2 : 16;
+		array = realloc(idx->array, max_size * sizeof(*array));
+		if (!array)
+			goto nomem;
+
+		idx->array = array;
+		idx->max_size = max_size;
+	}
+
 	idx->array[idx->size] = calloc(IDX_ENTRY_SIZE, sizeof(union idx_entry));
 	if (!idx->array[idx->size])
 		goto nomem;
@@ -119,46 +134,374 @@ void idx_replace(struct indexer *idx, int index, void *item)
 	entry[idx_entry_index(index)].item = item;
 }
 
+/*
+ * Index map readers
+ *
+ * Each thread that calls idm_lookup() owns a reader record.  While inside
+ * idm_lookup() the record holds the global epoch that was current when the
+ * thread entered, and 0 otherwise.  Records are only ever written by their
+ * owner, so concurrent lookups do not share any written cache lines.
+ * Records are never freed; a record is released for reuse when its thread
+ * exits.
+ *
+ * An array unlinked from a map is tagged with a new epoch.  It may be freed
+ * once no reader record holds an older epoch, since any reader that
+ * entered afterwards cannot have found the array.
+ *
+ * A reader's epoch store must be visible before its loads of the map, and
+ * the reclaimer's unlink before its scan of the records.  Rather than a
+ * full fence on every lookup, the reclaimer issues a process wide memory
+ * barrier with membarrier(2), which orders the readers as well.  Readers
+ * only need a fence if the kernel does not support it.
+ */
+struct idm_reader {
+	_Atomic(unsigned long)	epoch;
+	atomic_bool		in_use;
+	struct idm_reader	*next;
+};
+
+static _Atomic(struct idm_reader *) idm_readers;
+static _Atomic(unsigned long) idm_epoch = 1;
+/* Readers that could not allocate a record block all reclamation */
+static atomic_int idm_anon_readers;
+static __thread struct idm_reader *idm_self;
+static pthread_once_t idm_once = PTHREAD_ONCE_INIT;
+static pthread_key_t idm_key;
+static bool idm_key_valid;
+static bool idm_membarrier;
 
-static int idm_grow(struct index_map *idm, int index)
+static void idm_reader_release(void *arg)
 {
-	idm->array[idx_array_index(index)] = calloc(IDX_ENTRY_SIZE, sizeof(void *));
-	if (!idm->array[idx_array_index(index)])
-		goto nomem;
+	struct idm_reader *reader = arg;
 
-	return index;
+	idm_self = NULL;
+	atomic_store(&reader->epoch, 0);
+	atomic_store_explicit(&reader->in_use, false, memory_order_release);
+}
 
-nomem:
-	errno = ENOMEM;
-	return -1;
+static void idm_key_init(void)
+{
+	idm_key_valid = !pthread_key_create(&idm_key, idm_reader_release);
+	idm_membarrier = !syscall(__NR_membarrier,
+				  MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0);
+}
+
+static struct idm_reader *idm_reader_get(void)
+{
+	struct idm_reader *reader;
+
+	if (idm_self)
+		return idm_self;
+
+	pthread_once(&idm_once, idm_key_init);
+	if (!idm_key_valid)
+		return NULL;
+
+	for (reader = atomic_load(&idm_readers); reader; reader = reader->next) {
+		if (!atomic_load_explicit(&reader->in_use, memory_order_relaxed) &&
+		    !atomic_exchange(&reader->in_use, true))
+			goto found;
+	}
+
+	reader = calloc(1, sizeof(*reader));
+	if (!reader)
+		return NULL;
+
+	atomic_init(&reader->in_use, true);
+	reader->next = atomic_load(&idm_readers);
+	while (!atomic_compare_exchange_weak(&idm_readers, &reader->next, reader))
+		;
+found:
+	if (pthread_setspecific(idm_key, reader)) {
+		idm_reader_release(reader);
+		return NULL;
+	}
+	idm_self = reader;
+	return reader;
+}
+
+/*
+ * Returns the epoch previously held by the reader, which is non-zero if
+ * idm_lookup() is re-entered from a signal handler.
+ */
+static unsigned long idm_read_lock(struct idm_reader *reader)
+{
+	unsigned long prev;
+
+	if (!reader) {
+		atomic_fetch_add(&idm_anon_readers, 1);
+		return 0;
+	}
+
+	prev = atomic_load_explicit(&reader->epoch, memory_order_relaxed);
+	if (!prev) {
+		atomic_store_explicit(&reader->epoch,
+				      atomic_load_explicit(&idm_epoch,
+							   memory_order_acquire),
+				      memory_order_release);
+		/* Order the store above with the loads of the map */
+		if (idm_membarrier)
+			atomic_signal_fence(memory_order_seq_cst);
+		else
+			atomic_thread_fence(memory_order_seq_cst);
+	}
+	return prev;
+}
+
+static void idm_read_unlock(struct idm_reader *reader, unsigned long prev)
+{
+	if (!reader)
+		atomic_fetch_sub_explicit(&idm_anon_readers, 1,
+					  memory_order_release);
+	else if (!prev)
+		atomic_store_explicit(&reader->epoch, 0, memory_order_release);
+}
+
+/* Returns the oldest epoch that a reader may still be using */
+static unsigned long idm_min_epoch(void)
+{
+	struct idm_reader *reader;
+	unsigned long epoch, min_epoch = ~0UL;
+
+	/* idm_membarrier must not change between here and the readers */
+	pthread_once(&idm_once, idm_key_init);
+	if (!idm_membarrier ||
+	    syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0))
+		atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load(&idm_anon_readers))
+		return 0;
+
+	for (reader = atomic_load(&idm_readers); reader; reader = reader->next) {
+		epoch = atomic_load_explicit(&reader->epoch,
+					     memory_order_acquire);
+		if (epoch && epoch < min_epoch)
+			min_epoch = epoch;
+	}
+	return min_epoch;
+}
+
+static void idm_reclaim(struct index_map *idm)
+{
+	struct idm_retired **prev, *retired;
+	unsigned long min_epoch;
+
+	if (!idm->retire_list)
+		return;
+
+	min_epoch = idm_min_epoch();
+	prev = &idm->retire_list;
+	while ((retired = *prev)) {
+		if (retired->epoch <= min_epoch) {
+			*prev = retired->next;
+			free(retired);
+		} else {
+			prev = &retired->next;
+		}
+	}
+}
+
+static void idm_retire(struct index_map *idm, struct idm_retired *retired)
+{
+	retired->epoch = atomic_fetch_add(&idm_epoch, 1) + 1;
+	retired->next = idm->retire_list;
+	idm->retire_list = retired;
+}
+
+/*
+ * The arrays holding the lowest indexes are kept once allocated.  Those
+ * hold the most commonly used fds, which would otherwise cause an array
+ * to be allocated and freed each time a lone socket is opened and closed.
+ */
+static bool idm_pinned(int index)
+{
+	return idx_array_index(index) == 0;
 }
 
 int idm_set(struct index_map *idm, int index, void *item)
 {
-	void **entry;
+	struct idm_dir *dir;
+	struct idm_leaf *leaf;
 
-	if (index > IDX_MAX_INDEX) {
+	if (index < 0 || index > IDX_MAX_INDEX) {
 		errno = ENOMEM;
 		return -1;
 	}
 
-	if (!idm->array[idx_array_index(index)]) {
-		if (idm_grow(idm, index) < 0)
-			return -1;
+	if (!item) {
+		idm_clear(idm, index);
+		return index;
+	}
+
+	dir = atomic_load_explicit(&idm->dir[idx_root_index(index)],
+				   memory_order_relaxed);
+	if (!dir) {
+		dir = calloc(1, sizeof(*dir));
+		if (!dir)
+			goto nomem;
+
+		atomic_store_explicit(&idm->dir[idx_root_index(index)], dir,
+				      memory_order_release);
+	}
+
+	leaf = atomic_load_explicit(&dir->leaf[idx_dir_index(index)],
+				    memory_order_relaxed);
+	if (!leaf) {
+		leaf = calloc(1, sizeof(*leaf));
+		if (!leaf)
+			goto nomem;
+
+		atomic_store_explicit(&dir->leaf[idx_dir_index(index)], leaf,
+				      memory_order_release);
+		dir->count++;
 	}
 
-	entry = idm->array[idx_array_index(index)];
-	entry[idx_entry_index(index)] = item;
+	if (!atomic_load_explicit(&leaf->item[idx_entry_index(index)],
+				  memory_order_relaxed))
+		leaf->count++;
+	atomic_store_explicit(&leaf->item[idx_entry_index(index)], item,
+			      memory_order_release);
 	return index;
+
+nomem:
+	/* A newly allocated, empty directory is left for later use */
+	errno = ENOMEM;
+	return -1;
 }
 
 void *idm_clear(struct index_map *idm, int index)
 {
-	void **entry;
+	struct idm_dir *dir;
+	struct idm_leaf *leaf;
 	void *item;
 
-	entry = idm->array[idx_array_index(index)];
-	item = entry[idx_entry_index(index)];
-	entry[idx_entry_index(index)] = NULL;
+	if (index < 0 || index > IDX_MAX_INDEX)
+		return NULL;
+
+	dir = atomic_load_explicit(&idm->dir[idx_root_index(index)],
+				   memory_order_relaxed);
+	if (!dir)
+		return NULL;
+
+	leaf = atomic_load_explicit(&dir->leaf[idx_dir_index(index)],
+				    memory_order_relaxed);
+	if (!leaf)
+		return NULL;
+
+	item = atomic_load_explicit(&leaf->item[idx_entry_index(index)],
+				    memory_order_relaxed);
+	if (!item)
+		return NULL;
+
+	atomic_store_explicit(&leaf->item[idx_entry_index(index)], NULL,
+			      memory_order_release);
+	if (--leaf->count || idm_pinned(index))
+		goto out;
+
+	atomic_store_explicit(&dir->leaf[idx_dir_index(index)], NULL,
+			      memory_order_release);
+	idm_retire(idm, &leaf->retired);
+	if (--dir->count)
+		goto out;
+
+	atomic_store_explicit(&idm->dir[idx_root_index(index)], NULL,
+			      memory_order_release);
+	idm_retire(idm, &dir->retired);
+out:
+	idm_reclaim(idm);
 	return item;
 }
+
+void *idm_lookup(struct index_map *idm, int index)
+{
+	struct idm_reader *reader;
+	struct idm_dir *dir;
+	struct idm_leaf *leaf;
+	unsigned long prev;
+	void *item = NULL;
+
+	if (index < 0 || index > IDX_MAX_INDEX)
+		return NULL;
+
+	reader = idm_reader_get();
+	prev = idm_read_lock(reader);
+	dir = atomic_load_explicit(&idm->dir[idx_root_index(index)],
+				   memory_order_acquire);
+	if (!dir)
+		goto out;
+
+	leaf = atomic_load_explicit(&dir->leaf[idx_dir_index(index)],
+				    memory_order_acquire);
+	if (!leaf)
+		goto out;
+
+	item = atomic_load_explicit(&leaf->item[idx_entry_index(index)],
+				    memory_order_acquire);
+out:
+	idm_read_unlock(reader, prev);
+	return item;
+}
+
+/*
+ * Returns the first item stored at or above *index, and updates *index to
+ * its position.  Must be serialized with updates to the map.
+ */
+void *idm_next(struct index_map *idm, int *index)
+{
+	struct idm_dir *dir;
+	struct idm_leaf *leaf;
+	void *item;
+	long i;
+
+	for (i = *index < 0 ? 0 : *index; i <= IDX_MAX_INDEX; ) {
+		dir = atomic_load_explicit(&idm->dir[idx_root_index(i)],
+					   memory_order_relaxed);
+		if (!dir) {
+			i = (idx_root_index(i) + 1) << (IDX_DIR_BITS + IDX_ENTRY_BITS);
+			continue;
+		}
+
+		leaf = atomic_load_explicit(&dir->leaf[idx_dir_index(i)],
+					    memory_order_relaxed);
+		if (!leaf) {
+			i = (idx_array_index(i) + 1) << IDX_ENTRY_BITS;
+			continue;
+		}
+
+		item = atomic_load_explicit(&leaf->item[idx_entry_index(i)],
+					    memory_order_relaxed);
+		if (item) {
+			*index = i;
+			return item;
+		}
+		i++;
+	}
+	return NULL;
+}
+
+/*
+ * Release all memory held by the map.  The caller must ensure that the map
+ * is no longer in use by any thread.
+ */
+void idm_cleanup(struct index_map *idm)
+{
+	struct idm_retired *retired;
+	struct idm_dir *dir;
+	int i, j;
+
+	for (i = 0; i < IDX_ROOT_SIZE; i++) {
+		dir = atomic_load_explicit(&idm->dir[i], memory_order_relaxed);
+		if (!dir)
+			continue;
+
+		for (j = 0; j < IDX_DIR_SIZE; j++)
+			free(atomic_load_explicit(&dir->leaf[j],
+						  memory_order_relaxed));
+		free(dir);
+		atomic_store_explicit(&idm->dir[i], NULL, memory_order_relaxed);
+	}
+
+	while ((retired = idm->retire_list)) {
+		idm->retire_list = retired->next;
+		free(retired);
+	}
+}
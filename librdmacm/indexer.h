@@ -36,12 +36,31 @@
 
 #include <config.h>
 #include <stddef.h>
+#include <stdatomic.h>
 #include <sys/types.h>
 
+/*
+ * Indexes cover the full range of non-negative ints, so that any fd
+ * allowed by RLIMIT_NOFILE may be used as an index.
+ */
+#define IDX_INDEX_BITS 31
+#define IDX_ENTRY_BITS 10
+#define IDX_DIR_BITS   10
+#define IDX_ROOT_BITS  (IDX_INDEX_BITS - IDX_DIR_BITS - IDX_ENTRY_BITS)
+#define IDX_ENTRY_SIZE (1 << IDX_ENTRY_BITS)
+#define IDX_DIR_SIZE   (1 << IDX_DIR_BITS)
+#define IDX_ROOT_SIZE  (1 << IDX_ROOT_BITS)
+#define IDX_MAX_INDEX  ((int) ((1U << IDX_INDEX_BITS) - 1))
+
+#define idx_array_index(index) ((index) >> IDX_ENTRY_BITS)
+#define idx_entry_index(index) ((index) & (IDX_ENTRY_SIZE - 1))
+#define idx_root_index(index)  ((index) >> (IDX_DIR_BITS + IDX_ENTRY_BITS))
+#define idx_dir_index(index)   (idx_array_index(index) & (IDX_DIR_SIZE - 1))
+
 /*
  * Indexer - to find a structure given an index.  Synchronization
  * must be provided by the caller.  Caller must initialize the
- * indexer by setting free_list and size to 0.
+ * indexer by setting it to 0.
  */
 
 union idx_entry {
@@ -49,22 +68,14 @@ union idx_entry {
 	int   next;
 };
 
-#define IDX_INDEX_BITS 16
-#define IDX_ENTRY_BITS 10
-#define IDX_ENTRY_SIZE (1 << IDX_ENTRY_BITS)
-#define IDX_ARRAY_SIZE (1 << (IDX_INDEX_BITS - IDX_ENTRY_BITS))
-#define IDX_MAX_INDEX  ((1 << IDX_INDEX_BITS) - 1)
-
 struct indexer
 {
-	union idx_entry *array[IDX_ARRAY_SIZE];
+	union idx_entry **array;
 	int		 free_list;
 	int		 size;
+	int		 max_size;
 };
 
-#define idx_array_index(index) (index >> IDX_ENTRY_BITS)
-#define idx_entry_index(index) (index & (IDX_ENTRY_SIZE - 1))
-
 int idx_insert(struct indexer *idx, void *item);
 void *idx_remove(struct indexer *idx, int index);
 void idx_replace(struct indexer *idx, int index, void *item);
@@ -75,30 +86,50 @@ static inline void *idx_at(struct indexer *idx, int index)
 }
 
 /*
- * Index map - associates a structure with an index.  Synchronization
- * must be provided by the caller.  Caller must initialize the
- * index map by setting it to 0.
+ * Index map - associates a structure with an index.  Calls that modify
+ * the map must be serialized by the caller.  idm_lookup() and idm_at()
+ * take no locks and may run concurrently with updates.  Caller must
+ * initialize the index map by setting it to 0.
+ *
+ * The map is a three level radix tree.  Leaf and directory arrays are
+ * allocated on demand and released once they become empty.  Because
+ * readers may still be walking a released array, it is placed on a
+ * retire list and freed only after every thread that could have seen
+ * it has left idm_lookup().
  */
 
+struct idm_retired {
+	struct idm_retired	*next;
+	unsigned long		epoch;
+};
+
+struct idm_leaf {
+	struct idm_retired	retired;
+	int			count;
+	_Atomic(void *)		item[IDX_ENTRY_SIZE];
+};
+
+struct idm_dir {
+	struct idm_retired	retired;
+	int			count;
+	_Atomic(struct idm_leaf *) leaf[IDX_DIR_SIZE];
+};
+
 struct index_map
 {
-	void **array[IDX_ARRAY_SIZE];
+	_Atomic(struct idm_dir *) dir[IDX_ROOT_SIZE];
+	struct idm_retired	*retire_list;
 };
 
 int idm_set(struct index_map *idm, int index, void *item);
 void *idm_clear(struct index_map *idm, int index);
+void *idm_lookup(struct index_map *idm, int index);
+void *idm_next(struct index_map *idm, int *index);
+void idm_cleanup(struct index_map *idm);
 
 static inline void *idm_at(struct index_map *idm, int index)
 {
-	void **entry;
-	entry = idm->array[idx_array_index(index)];
-	return entry[idx_entry_index(index)];
-}
-
-static inline void *idm_lookup(struct index_map *idm, int index)
-{
-	return ((index <= IDX_MAX_INDEX) && idm->array[idx_array_index(index)]) ?
-		idm_at(idm, index) : NULL;
+	return idm_lookup(idm, index);
 }
 
 typedef struct _dlist_entry {
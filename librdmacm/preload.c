@@ -38,6 +38,7 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/sendfile.h>
+#include <sys/epoll.h>
 #include <stdarg.h>
 #include <dlfcn.h>
 #include <netdb.h>
@@ -47,6 +48,7 @@
 #include <netinet/tcp.h>
 #include <unistd.h>
 #include <semaphore.h>
+#include <signal.h>
 #include <ctype.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -69,12 +71,16 @@ struct socket_calls {
 	ssize_t (*recvfrom)(int socket, void *buf, size_t len, int flags,
 			    struct sockaddr *src_addr, socklen_t *addrlen);
 	ssize_t (*recvmsg)(int socket, struct msghdr *msg, int flags);
+	int (*recvmmsg)(int socket, struct mmsghdr *msgvec, unsigned int vlen,
+			int flags, struct timespec *timeout);
 	ssize_t (*read)(int socket, void *buf, size_t count);
 	ssize_t (*readv)(int socket, const struct iovec *iov, int iovcnt);
 	ssize_t (*send)(int socket, const void *buf, size_t len, int flags);
 	ssize_t (*sendto)(int socket, const void *buf, size_t len, int flags,
 			  const struct sockaddr *dest_addr, socklen_t addrlen);
 	ssize_t (*sendmsg)(int socket, const struct msghdr *msg, int flags);
+	int (*sendmmsg)(int socket, struct mmsghdr *msgvec, unsigned int vlen,
+			int flags);
 	ssize_t (*write)(int socket, const void *buf, size_t count);
 	ssize_t (*writev)(int socket, const struct iovec *iov, int iovcnt);
 	int (*poll)(struct pollfd *fds, nfds_t nfds, int timeout);
@@ -90,6 +96,16 @@ struct socket_calls {
 	int (*dup2)(int oldfd, int newfd);
 	ssize_t (*sendfile)(int out_fd, int in_fd, off_t *offset, size_t count);
 	int (*fxstat)(int ver, int fd, struct stat *buf);
+	int (*epoll_create)(int size);
+	int (*epoll_create1)(int flags);
+	int (*epoll_ctl)(int epfd, int op, int fd, struct epoll_event *event);
+	int (*epoll_wait)(int epfd, struct epoll_event *events,
+			  int maxevents, int timeout);
+	int (*epoll_pwait)(int epfd, struct epoll_event *events,
+			   int maxevents, int timeout, const sigset_t *sigmask);
+	int (*munmap)(void *addr, size_t length);
+	void *(*mremap)(void *old_address, size_t old_size, size_t new_size,
+			int flags, ... /* void *new_address */);
 };
 
 static struct socket_calls real;
@@ -98,14 +114,19 @@ static struct socket_calls rs;
 static struct index_map idm;
 static pthread_mutex_t mut = PTHREAD_MUTEX_INITIALIZER;
 
+/* Set while calling into librdmacm, which may itself create sockets */
+static __thread int recursive;
+
 static int sq_size;
 static int rq_size;
 static int sq_inline;
+static int zcopy_threshold;
 static int fork_support;
 
 enum fd_type {
 	fd_normal,
-	fd_rsocket
+	fd_rsocket,
+	fd_repoll
 };
 
 enum fd_fork_state {
@@ -340,7 +361,9 @@ static enum fd_type fd_close(int index, int *fd)
 
 	fdi = idm_lookup(&idm, index);
 	if (fdi) {
+		pthread_mutex_lock(&mut);
 		idm_clear(&idm, index);
+		pthread_mutex_unlock(&mut);
 		*fd = fdi->fd;
 		type = fdi->type;
 		real.close(index);
@@ -368,6 +391,10 @@ static void getenv_options(void)
 	if (var)
 		sq_inline = atoi(var);
 
+	var = getenv("RS_ZCOPY_THRESHOLD");
+	if (var)
+		zcopy_threshold = atoi(var);
+
 	var = getenv("RDMAV_FORK_SAFE");
 	if (var)
 		fork_support = atoi(var);
@@ -393,11 +420,13 @@ static void init_preload(void)
 	real.recv = dlsym(RTLD_NEXT, "recv");
 	real.recvfrom = dlsym(RTLD_NEXT, "recvfrom");
 	real.recvmsg = dlsym(RTLD_NEXT, "recvmsg");
+	real.recvmmsg = dlsym(RTLD_NEXT, "recvmmsg");
 	real.read = dlsym(RTLD_NEXT, "read");
 	real.readv = dlsym(RTLD_NEXT, "readv");
 	real.send = dlsym(RTLD_NEXT, "send");
 	real.sendto = dlsym(RTLD_NEXT, "sendto");
 	real.sendmsg = dlsym(RTLD_NEXT, "sendmsg");
+	real.sendmmsg = dlsym(RTLD_NEXT, "sendmmsg");
 	real.write = dlsym(RTLD_NEXT, "write");
 	real.writev = dlsym(RTLD_NEXT, "writev");
 	real.poll = dlsym(RTLD_NEXT, "poll");
@@ -411,6 +440,13 @@ static void init_preload(void)
 	real.dup2 = dlsym(RTLD_NEXT, "dup2");
 	real.sendfile = dlsym(RTLD_NEXT, "sendfile");
 	real.fxstat = dlsym(RTLD_NEXT, "__fxstat");
+	real.epoll_create = dlsym(RTLD_NEXT, "epoll_create");
+	real.epoll_create1 = dlsym(RTLD_NEXT, "epoll_create1");
+	real.epoll_ctl = dlsym(RTLD_NEXT, "epoll_ctl");
+	real.epoll_wait = dlsym(RTLD_NEXT, "epoll_wait");
+	real.epoll_pwait = dlsym(RTLD_NEXT, "epoll_pwait");
+	real.munmap = dlsym(RTLD_NEXT, "munmap");
+	real.mremap = dlsym(RTLD_NEXT, "mremap");
 
 	rs.socket = dlsym(RTLD_DEFAULT, "rsocket");
 	rs.bind = dlsym(RTLD_DEFAULT, "rbind");
@@ -420,11 +456,13 @@ static void init_preload(void)
 	rs.recv = dlsym(RTLD_DEFAULT, "rrecv");
 	rs.recvfrom = dlsym(RTLD_DEFAULT, "rrecvfrom");
 	rs.recvmsg = dlsym(RTLD_DEFAULT, "rrecvmsg");
+	rs.recvmmsg = dlsym(RTLD_DEFAULT, "rrecvmmsg");
 	rs.read = dlsym(RTLD_DEFAULT, "rread");
 	rs.readv = dlsym(RTLD_DEFAULT, "rreadv");
 	rs.send = dlsym(RTLD_DEFAULT, "rsend");
 	rs.sendto = dlsym(RTLD_DEFAULT, "rsendto");
 	rs.sendmsg = dlsym(RTLD_DEFAULT, "rsendmsg");
+	rs.sendmmsg = dlsym(RTLD_DEFAULT, "rsendmmsg");
 	rs.write = dlsym(RTLD_DEFAULT, "rwrite");
 	rs.writev = dlsym(RTLD_DEFAULT, "rwritev");
 	rs.poll = dlsym(RTLD_DEFAULT, "rpoll");
@@ -527,11 +565,14 @@ static void set_rsocket_options(int rsocket)
 
 	if (sq_inline)
 		rsetsockopt(rsocket, SOL_RDMA, RDMA_INLINE, &sq_inline, sizeof sq_inline);
+
+	if (zcopy_threshold)
+		rsetsockopt(rsocket, SOL_RDMA, RDMA_ZCOPY_THRESHOLD,
+			    &zcopy_threshold, sizeof zcopy_threshold);
 }
 
 int socket(int domain, int type, int protocol)
 {
-	static __thread int recursive;
 	int index, ret;
 
 	init_preload();
@@ -818,6 +859,15 @@ ssize_t recvmsg(int socket, struct msghdr *msg, int flags)
 		rrecvmsg(fd, msg, flags) : real.recvmsg(fd, msg, flags);
 }
 
+int recvmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen,
+	     int flags, struct timespec *timeout)
+{
+	int fd;
+	return (fd_fork_get(socket, &fd) == fd_rsocket) ?
+		rrecvmmsg(fd, msgvec, vlen, flags, timeout) :
+		real.recvmmsg(fd, msgvec, vlen, flags, timeout);
+}
+
 ssize_t read(int socket, void *buf, size_t count)
 {
 	int fd;
@@ -857,6 +907,14 @@ ssize_t sendmsg(int socket, const struct msghdr *msg, int flags)
 		rsendmsg(fd, msg, flags) : real.sendmsg(fd, msg, flags);
 }
 
+int sendmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+	int fd;
+	return (fd_fork_get(socket, &fd) == fd_rsocket) ?
+		rsendmmsg(fd, msgvec, vlen, flags) :
+		real.sendmmsg(fd, msgvec, vlen, flags);
+}
+
 ssize_t write(int socket, const void *buf, size_t count)
 {
 	int fd;
@@ -1027,9 +1085,11 @@ int close(int socket)
 	if (atomic_fetch_sub(&fdi->refcnt, 1) != 1)
 		return 0;
 
+	pthread_mutex_lock(&mut);
 	idm_clear(&idm, socket);
+	pthread_mutex_unlock(&mut);
 	real.close(socket);
-	ret = (fdi->type == fd_rsocket) ? rclose(fdi->fd) : real.close(fdi->fd);
+	ret = (fdi->type == fd_normal) ? real.close(fdi->fd) : rclose(fdi->fd);
 	free(fdi);
 	return ret;
 }
@@ -1195,3 +1255,121 @@ int __fxstat(int ver, int socket, struct stat *buf)
 	}
 	return ret;
 }
+
+/*
+ * epoll sets are backed by repoll, so that they may contain rsockets.
+ */
+static int epoll_open(int size, int flags)
+{
+	int index, ret, fd;
+
+	init_preload();
+	if (recursive)
+		goto real;
+
+	index = fd_open();
+	if (index < 0)
+		return index;
+
+	recursive = 1;
+	ret = size ? repoll_create(size) : repoll_create1(flags);
+	recursive = 0;
+	if (ret < 0) {
+		fd_close(index, &fd);
+		return ret;
+	}
+
+	fd_store(index, ret, fd_repoll, fd_ready);
+	return index;
+real:
+	return size ? real.epoll_create(size) : real.epoll_create1(flags);
+}
+
+int epoll_create(int size)
+{
+	if (size <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return epoll_open(size, 0);
+}
+
+int epoll_create1(int flags)
+{
+	return epoll_open(0, flags);
+}
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+	int efd, sfd;
+
+	init_preload();
+	if (fd_get(epfd, &efd) != fd_repoll)
+		return real.epoll_ctl(efd, op, fd, event);
+
+	fd_get(fd, &sfd);
+	return repoll_ctl(efd, op, sfd, event);
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+	int fd;
+
+	init_preload();
+	return (fd_get(epfd, &fd) == fd_repoll) ?
+		repoll_wait(fd, events, maxevents, timeout) :
+		real.epoll_wait(fd, events, maxevents, timeout);
+}
+
+/*
+ * The signal mask is swapped around repoll_wait(), so unlike the kernel's
+ * epoll_pwait() a signal may be delivered between the swap and the wait.
+ */
+int epoll_pwait(int epfd, struct epoll_event *events, int maxevents,
+		int timeout, const sigset_t *sigmask)
+{
+	sigset_t oldmask;
+	int fd, ret;
+
+	init_preload();
+	if (fd_get(epfd, &fd) != fd_repoll)
+		return real.epoll_pwait(fd, events, maxevents, timeout, sigmask);
+
+	if (sigmask)
+		pthread_sigmask(SIG_SETMASK, sigmask, &oldmask);
+	ret = repoll_wait(fd, events, maxevents, timeout);
+	if (sigmask)
+		pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+	return ret;
+}
+
+/*
+ * Zero-copy sends keep their buffers registered in the verbs MR cache,
+ * drop those registrations before the memory goes away.
+ */
+int munmap(void *addr, size_t length)
+{
+	init_preload();
+	if (zcopy_threshold)
+		ibv_invalidate_mr_cache(addr, length);
+	return real.munmap(addr, length);
+}
+
+void *mremap(void *old_address, size_t old_size, size_t new_size,
+	     int flags, ...)
+{
+	void *new_address = NULL;
+	va_list args;
+
+	if (flags & MREMAP_FIXED) {
+		va_start(args, flags);
+		new_address = va_arg(args, void *);
+		va_end(args);
+	}
+
+	init_preload();
+	if (zcopy_threshold)
+		ibv_invalidate_mr_cache(old_address, old_size);
+	return real.mremap(old_address, old_size, new_size, flags, new_address);
+}
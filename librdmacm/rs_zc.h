@@ -0,0 +1,131 @@
+/* SPDX-License-Identifier: (GPL-2.0 OR Linux-OpenIB) */
+/*
+ * Ring of rbuf regions lent to the application by rrecv_zc(), kept apart
+ * from rsocket.c so that the bookkeeping can be tested without a device.
+ */
+#if !defined(RS_ZC_H)
+#define RS_ZC_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * Regions of rbuf lent to the application by rrecv_zc(), in stream order.
+ * Received data that is copied out while regions are lent is queued as an
+ * already released region, so that rbuf space is only credited back to
+ * the remote side in order.
+ */
+struct rs_zc_region {
+	uint8_t *base;		/* rbuf the region was lent from */
+	uint32_t offset;
+	uint32_t len;
+	int released;
+};
+
+struct rs_zc_ring {
+	struct rs_zc_region *regions;
+	uint32_t size;
+	uint32_t head;
+	uint32_t cnt;		/* lent and released regions queued */
+	uint32_t lent;		/* not yet released */
+};
+
+static inline int rs_zc_init(struct rs_zc_ring *ring, uint32_t size)
+{
+	ring->regions = calloc(size, sizeof(*ring->regions));
+	if (!ring->regions)
+		return -1;
+	ring->size = size;
+	ring->head = ring->cnt = ring->lent = 0;
+	return 0;
+}
+
+static inline struct rs_zc_region *rs_zc_at(struct rs_zc_ring *ring,
+					    uint32_t i)
+{
+	return &ring->regions[(ring->head + i) % ring->size];
+}
+
+static inline struct rs_zc_region *rs_zc_push(struct rs_zc_ring *ring)
+{
+	return rs_zc_at(ring, ring->cnt++);
+}
+
+/*
+ * Released regions in the middle of the ring are not merged, so with
+ * out of order releases the ring can fill before max_lent regions are
+ * out.  A new region needs one slot, plus one for data copied out
+ * behind it.
+ */
+static inline int rs_zc_full(struct rs_zc_ring *ring, uint32_t max_lent)
+{
+	return ring->lent >= max_lent || ring->cnt + 2 > ring->size;
+}
+
+static inline void rs_zc_lend(struct rs_zc_ring *ring, uint8_t *base,
+			      uint32_t offset, uint32_t len)
+{
+	struct rs_zc_region *region;
+
+	region = rs_zc_push(ring);
+	region->base = base;
+	region->offset = offset;
+	region->len = len;
+	region->released = 0;
+	ring->lent++;
+}
+
+/*
+ * Queue len bytes that were copied out.  Returns the number of bytes
+ * that may be credited now, which is zero while regions are lent.
+ */
+static inline uint32_t rs_zc_free(struct rs_zc_ring *ring, uint32_t len)
+{
+	struct rs_zc_region *region;
+
+	if (!ring->cnt)
+		return len;
+
+	region = rs_zc_at(ring, ring->cnt - 1);
+	if (!region->released) {
+		region = rs_zc_push(ring);
+		region->released = 1;
+		region->len = 0;
+	}
+	region->len += len;
+	return 0;
+}
+
+/* Returns the region buf was lent from, or NULL if it is not lent */
+static inline struct rs_zc_region *
+rs_zc_release(struct rs_zc_ring *ring, void *buf, uint32_t len)
+{
+	struct rs_zc_region *region;
+	uint32_t i;
+
+	for (i = 0; i < ring->cnt; i++) {
+		region = rs_zc_at(ring, i);
+		if (!region->released && region->len == len &&
+		    &region->base[region->offset] == buf) {
+			region->released = 1;
+			ring->lent--;
+			return region;
+		}
+	}
+	return NULL;
+}
+
+/* Pop released regions off the head, returning the bytes they held */
+static inline uint32_t rs_zc_reclaim(struct rs_zc_ring *ring)
+{
+	uint32_t len = 0;
+
+	while (ring->cnt && ring->regions[ring->head].released) {
+		len += ring->regions[ring->head].len;
+		ring->head = (ring->head + 1) % ring->size;
+		ring->cnt--;
+	}
+	return len;
+}
+
+#endif /* RS_ZC_H */
@@ -47,7 +47,7 @@
 #include <netinet/tcp.h>
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
-#include <search.h>
+#include <sched.h>
 #include <time.h>
 #include <byteswap.h>
 #include <util/compiler.h>
@@ -59,6 +59,7 @@
 #include <rdma/rsocket.h>
 #include "cma.h"
 #include "indexer.h"
+#include "rs_zc.h"
 
 #define RS_OLAP_START_SIZE 2048
 #define RS_MAX_TRANSFER 65536
@@ -68,9 +69,14 @@
 #define RS_QP_CTRL_SIZE 4	/* must be power of 2 */
 #define RS_CONN_RETRIES 6
 #define RS_SGL_SIZE 2
+#define RS_SVC_MAX_WORKERS 64
+#define RS_SVC_WHEEL_SIZE 64	/* must be power of 2 */
+#define RS_POLL_YIELD_FACTOR 8
+#define RS_POLL_MAX_WAIT (1 << 20)
+#define DS_MAX_BATCH 16
+#define DS_DEST_SLOTS 4
 static struct index_map idm;
 static pthread_mutex_t mut = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t svc_mut = PTHREAD_MUTEX_INITIALIZER;
 
 struct rsocket;
 
@@ -83,6 +89,16 @@ enum {
 	RS_SVC_MOD_KEEPALIVE,
 	RS_SVC_ADD_CM,
 	RS_SVC_REM_CM,
+	RS_SVC_ADD_CORK,
+	RS_SVC_REM_CORK,
+};
+
+enum {
+	RS_SVC_UDP,
+	RS_SVC_TCP,
+	RS_SVC_LISTEN,
+	RS_SVC_CONNECT,
+	RS_SVC_TYPES
 };
 
 struct rs_svc_msg {
@@ -91,8 +107,16 @@ struct rs_svc_msg {
 	struct rsocket *rs;
 };
 
+/*
+ * Each service is a pool of worker threads.  An rsocket is always handled
+ * by the same worker, selected by its index.  A worker thread is started
+ * when the first rsocket is assigned to it and exits when its last rsocket
+ * is removed.
+ */
 struct rs_svc {
 	pthread_t id;
+	pthread_mutex_t lock;
+	int type;
 	int sock[2];
 	int cnt;
 	int size;
@@ -100,29 +124,32 @@ struct rs_svc {
 	void *(*run)(void *svc);
 	struct rsocket **rss;
 	void *contexts;
+	dlist_entry *wheel;	/* keepalive timer wheel, tcp service only */
+	uint64_t wheel_time;
+	dlist_entry cork_list;	/* corked rsockets, tcp service only */
+	int cork_fd;
+	atomic_bool cork_idle;	/* see tcp_svc_flush_corks() */
 };
 
-static struct pollfd *udp_svc_fds;
+#define RS_SVC_POOL(svc_type, svc_context_size, svc_run)		\
+	{ [0 ... RS_SVC_MAX_WORKERS - 1] = {				\
+		.lock = PTHREAD_MUTEX_INITIALIZER,			\
+		.type = svc_type,					\
+		.context_size = svc_context_size,			\
+		.run = svc_run						\
+	} }
+
 static void *udp_svc_run(void *arg);
-static struct rs_svc udp_svc = {
-	.context_size = sizeof(*udp_svc_fds),
-	.run = udp_svc_run
-};
-static uint64_t *tcp_svc_timeouts;
+static struct rs_svc udp_svc[RS_SVC_MAX_WORKERS] =
+	RS_SVC_POOL(RS_SVC_UDP, sizeof(struct pollfd), udp_svc_run);
 static void *tcp_svc_run(void *arg);
-static struct rs_svc tcp_svc = {
-	.context_size = sizeof(*tcp_svc_timeouts),
-	.run = tcp_svc_run
-};
+static struct rs_svc tcp_svc[RS_SVC_MAX_WORKERS] =
+	RS_SVC_POOL(RS_SVC_TCP, 0, tcp_svc_run);
 static void *cm_svc_run(void *arg);
-static struct rs_svc listen_svc = {
-	.context_size = sizeof(struct pollfd),
-	.run = cm_svc_run
-};
-static struct rs_svc connect_svc = {
-	.context_size = sizeof(struct pollfd),
-	.run = cm_svc_run
-};
+static struct rs_svc listen_svc[RS_SVC_MAX_WORKERS] =
+	RS_SVC_POOL(RS_SVC_LISTEN, sizeof(struct pollfd), cm_svc_run);
+static struct rs_svc connect_svc[RS_SVC_MAX_WORKERS] =
+	RS_SVC_POOL(RS_SVC_CONNECT, sizeof(struct pollfd), cm_svc_run);
 
 static uint32_t pollcnt;
 static bool suspendpoll;
@@ -134,7 +161,13 @@ static uint16_t def_sqsize = 384;
 static uint16_t def_rqsize = 384;
 static uint32_t def_mem = (1 << 17);
 static uint32_t def_wmem = (1 << 17);
+static uint32_t def_mem_min = (1 << 14);
+static uint32_t def_wmem_min = (1 << 14);
 static uint32_t polling_time = 10;
+static uint32_t cork_time = 50;
+static uint32_t svc_workers = 1;
+static uint32_t dest_cache_size = (1 << 17);
+static uint32_t def_zcopy_threshold = 0;
 static int wake_up_interval = 5000;
 
 /*
@@ -209,6 +242,22 @@ struct rs_iomap {
 	struct rs_sge sge;
 };
 
+/*
+ * Busy poll controller.  Tracks a moving average of how long a caller had
+ * to wait for a completion and sizes the busy poll budget from it: waits
+ * shorter than polling_time are spun on, somewhat longer waits are polled
+ * while yielding the CPU, and sockets that mostly wait longer than that
+ * arm the CQ right away.  Updates are not serialized, so concurrent
+ * waiters may lose an update to the statistics.
+ */
+struct rs_poll_ctl {
+	uint32_t	  wait;		/* average wait, in us */
+	uint64_t	  spin_wakeups;
+	uint64_t	  yield_wakeups;
+	uint64_t	  sleep_wakeups;
+	uint64_t	  poll_usecs;
+};
+
 struct rs_iomap_mr {
 	uint64_t offset;
 	struct ibv_mr *mr;
@@ -272,6 +321,14 @@ enum rs_state {
 #define RS_OPT_UDP_SVC    (1 << 2)
 #define RS_OPT_KEEPALIVE  (1 << 3)
 #define RS_OPT_CM_SVC	  (1 << 4)
+/* Small sends are coalesced, set by TCP_CORK or clearing TCP_NODELAY */
+#define RS_OPT_CORK	  (1 << 5)
+/* Buffer sizes adapt to the connection, cleared by SO_RCVBUF/SO_SNDBUF */
+#define RS_OPT_RBUF_TUNE  (1 << 6)
+#define RS_OPT_SBUF_TUNE  (1 << 7)
+
+/* Rounds with little buffer use before a buffer is halved */
+#define RS_TUNE_SHRINK_ROUNDS 8
 
 union socket_addr {
 	struct sockaddr		sa;
@@ -295,11 +352,32 @@ struct ds_header {
 #define DS_IPV4_HDR_LEN  8
 #define DS_IPV6_HDR_LEN 24
 
+/*
+ * A destination is referenced by conn_dest, by the UDP service while it
+ * resolves the address, and by each send still in flight.  Unreferenced
+ * destinations stay cached until evicted LRU.  The destination embedded
+ * in each ds_qp is never evicted.
+ */
 struct ds_dest {
 	union socket_addr addr;	/* must be first */
 	struct ds_qp	  *qp;
 	struct ibv_ah	  *ah;
 	uint32_t	   qpn;
+	uint32_t	   hash;
+	_Atomic(int)	   refcnt;
+	dlist_entry	   lru_entry;
+};
+
+#define DS_DEST_TOMB ((struct ds_dest *) 1)
+
+/*
+ * The destination map is an open addressed hash table.  Each bucket
+ * holds a few destinations along with their hash values, so that most
+ * lookups touch a single cache line before comparing addresses.
+ */
+struct ds_dest_bucket {
+	uint32_t	   hash[DS_DEST_SLOTS];
+	struct ds_dest	   *dest[DS_DEST_SLOTS];
 };
 
 struct ds_qp {
@@ -319,6 +397,7 @@ struct ds_qp {
 struct rsocket {
 	int		  type;
 	int		  index;
+	int		  svc_index[RS_SVC_TYPES];
 	fastlock_t	  slock;
 	fastlock_t	  rlock;
 	fastlock_t	  cq_lock;
@@ -331,6 +410,8 @@ struct rsocket {
 			struct rdma_cm_id *cm_id;
 			uint64_t	  tcp_opts;
 			unsigned int	  keepalive_time;
+			uint64_t	  keepalive_deadline;
+			dlist_entry	  keepalive_entry;
 			int		  accept_queue[2];
 
 			unsigned int	  ctrl_seqno;
@@ -358,15 +439,54 @@ struct rsocket {
 			struct ibv_mr	  *rmr;
 			uint8_t		  *rbuf;
 
+			/* receive buffer autotuning, see rs_tune_rbuf() */
+			uint8_t		  *rbuf_next;
+			struct ibv_mr	  *rmr_next;
+			uint32_t	  rbuf_next_size;
+			int		  rbuf_switched;	/* credits come from rbuf_next */
+			int		  rbuf_remote_avail;	/* granted, not yet written */
+			int		  rbuf_remote_min;
+			int		  rbuf_starved;
+			int		  rbuf_idle;
+
 			int		  sbuf_bytes_avail;
 			struct ibv_mr	  *smr;
 			struct ibv_sge	  ssgl[2];
+			/* send buffer autotuning, see rs_tune_sbuf() */
+			uint32_t	  sbuf_next_size;
+			uint32_t	  sbuf_sent;	/* this round */
+			uint32_t	  sbuf_peak;
+			int		  sbuf_idle;
+
+			uint32_t	  zcopy_threshold;
+
+			uint32_t	  cork_len;	/* bytes staged at ssgl[0] */
+			_Atomic(uint64_t) cork_deadline;	/* 0 if none staged */
+			dlist_entry	  cork_entry;
+			/*
+			 * Set while on the tcp service's cork list, which
+			 * pushes corked data once cork_time has passed.
+			 * Written by the service thread only, so kept out
+			 * of opts, which other threads update.
+			 */
+			atomic_bool	  cork_svc;
+
+			struct rs_zc_ring zc;	/* 2 * rq_size regions */
+			/* replaced rbuf, kept until its lent regions return */
+			uint8_t		  *rbuf_old;
+			struct ibv_mr	  *rmr_old;
+			uint32_t	  zc_old_lent;
 		};
 		/* datagram */
 		struct {
 			struct ds_qp	  *qp_list;
-			void		  *dest_map;
+			struct ds_dest_bucket *dest_table;
+			uint32_t	  dest_mask;	/* buckets - 1 */
+			uint32_t	  dest_cnt;
+			uint32_t	  dest_used;	/* includes tombstones */
+			dlist_entry	  dest_lru;
 			struct ds_dest    *conn_dest;
+			struct ds_dest	  **smsg_dest;	/* per send slot */
 
 			int		  udp_sock;
 			int		  epfd;
@@ -406,6 +526,10 @@ struct rsocket {
 	dlist_entry	  iomap_queue;
 	int		  iomap_pending;
 	int		  unack_cqe;
+
+	uint32_t	  comp_gen;	/* bumped for every completion */
+	dlist_entry	  repoll_list;
+	struct rs_poll_ctl poll_ctl;
 };
 
 #define DS_UDP_TAG 0x55555555
@@ -469,6 +593,77 @@ static uint64_t rs_time_us(void)
 	return now.tv_sec * 1000000 + now.tv_nsec / 1000;
 }
 
+static void rs_poll_ctl_init(struct rs_poll_ctl *ctl)
+{
+	memset(ctl, 0, sizeof(*ctl));
+	ctl->wait = polling_time;
+}
+
+/* Number of us to poll before blocking */
+static uint32_t rs_poll_budget(struct rs_poll_ctl *ctl)
+{
+	uint32_t max_budget = polling_time * RS_POLL_YIELD_FACTOR;
+	uint32_t budget;
+
+	if (ctl->wait > max_budget)
+		return 0;
+
+	budget = max(ctl->wait * 2, polling_time);
+	return min(budget, max_budget);
+}
+
+/*
+ * Called once per poll iteration that found nothing.  Returns false
+ * once the budget is spent and the caller should block.
+ */
+static bool rs_poll_continue(struct rs_poll_ctl *ctl, uint64_t *start_time,
+			     uint32_t *budget)
+{
+	uint32_t poll_time;
+
+	if (!*start_time) {
+		*start_time = rs_time_us();
+		*budget = rs_poll_budget(ctl);
+		return *budget != 0;
+	}
+
+	poll_time = (uint32_t) (rs_time_us() - *start_time);
+	if (poll_time > *budget) {
+		ctl->poll_usecs += poll_time;
+		return false;
+	}
+
+	if (poll_time > polling_time)
+		sched_yield();
+	return true;
+}
+
+/*
+ * Record how long the caller waited.  Polling is a non-zero start_time
+ * if the wait completed before the poll budget was spent.
+ */
+static void rs_poll_done(struct rs_poll_ctl *ctl, uint64_t start_time,
+			 bool polling)
+{
+	uint32_t wait;
+
+	if (!start_time)
+		return;
+
+	wait = (uint32_t) min(rs_time_us() - start_time,
+			      (uint64_t) RS_POLL_MAX_WAIT);
+	if (!polling) {
+		ctl->sleep_wakeups++;
+	} else {
+		ctl->poll_usecs += wait;
+		if (wait > polling_time)
+			ctl->yield_wakeups++;
+		else
+			ctl->spin_wakeups++;
+	}
+	ctl->wait = ctl->wait - (ctl->wait >> 3) + (wait >> 3);
+}
+
 static void ds_insert_qp(struct rsocket *rs, struct ds_qp *qp)
 {
 	if (!rs->qp_list)
@@ -488,12 +683,18 @@ static void ds_remove_qp(struct rsocket *rs, struct ds_qp *qp)
 	}
 }
 
-static int rs_notify_svc(struct rs_svc *svc, struct rsocket *rs, int cmd)
+static struct rs_svc *rs_svc_of(struct rs_svc *pool, struct rsocket *rs)
 {
+	return &pool[(unsigned int) rs->index % svc_workers];
+}
+
+static int rs_notify_svc(struct rs_svc *pool, struct rsocket *rs, int cmd)
+{
+	struct rs_svc *svc = rs_svc_of(pool, rs);
 	struct rs_svc_msg msg;
 	int ret;
 
-	pthread_mutex_lock(&svc_mut);
+	pthread_mutex_lock(&svc->lock);
 	if (!svc->cnt) {
 		ret = socketpair(AF_UNIX, SOCK_STREAM, 0, svc->sock);
 		if (ret)
@@ -520,7 +721,7 @@ closepair:
 	close(svc->sock[0]);
 	close(svc->sock[1]);
 unlock:
-	pthread_mutex_unlock(&svc_mut);
+	pthread_mutex_unlock(&svc->lock);
 	return ret;
 }
 
@@ -537,6 +738,172 @@ static int ds_compare_addr(const void *dst1, const void *dst2)
 	return memcmp(dst1, dst2, len);
 }
 
+/* Hashes the same bytes that ds_compare_addr() compares */
+static uint32_t ds_hash_addr(const void *addr)
+{
+	const struct sockaddr *sa = addr;
+	uint32_t w, hash = 0;
+	size_t i, len;
+
+	len = (sa->sa_family == AF_INET6) ?
+	      sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+	for (i = 0; i + sizeof(w) <= len; i += sizeof(w)) {
+		memcpy(&w, addr + i, sizeof(w));
+		hash = (hash ^ w) * 0x9e3779b1;
+		hash = (hash << 13) | (hash >> 19);
+	}
+
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6b;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35;
+	return hash ^ (hash >> 16);
+}
+
+static int ds_is_qp_dest(struct ds_dest *dest)
+{
+	return dest == &dest->qp->dest;
+}
+
+/* Caller must hold map_lock */
+static struct ds_dest **ds_find_dest(struct rsocket *rs, const void *addr,
+				     uint32_t hash)
+{
+	struct ds_dest_bucket *bucket;
+	uint32_t i, b;
+	int s;
+
+	if (!rs->dest_table)
+		return NULL;
+
+	for (i = 0, b = hash & rs->dest_mask; i <= rs->dest_mask;
+	     i++, b = (b + 1) & rs->dest_mask) {
+		bucket = &rs->dest_table[b];
+		for (s = 0; s < DS_DEST_SLOTS; s++) {
+			if (!bucket->dest[s])
+				return NULL;
+
+			if (bucket->hash[s] == hash &&
+			    bucket->dest[s] != DS_DEST_TOMB &&
+			    !ds_compare_addr(addr, &bucket->dest[s]->addr))
+				return &bucket->dest[s];
+		}
+	}
+	return NULL;
+}
+
+/* Returns 1 if an empty slot was used, 0 if a tombstone was replaced */
+static int ds_insert_slot(struct ds_dest_bucket *table, uint32_t mask,
+			  struct ds_dest *dest)
+{
+	uint32_t b;
+	int s, empty;
+
+	for (b = dest->hash & mask; ; b = (b + 1) & mask) {
+		for (s = 0; s < DS_DEST_SLOTS; s++) {
+			if (!table[b].dest[s] || table[b].dest[s] == DS_DEST_TOMB) {
+				empty = !table[b].dest[s];
+				table[b].hash[s] = dest->hash;
+				table[b].dest[s] = dest;
+				return empty;
+			}
+		}
+	}
+}
+
+/* Rehash to a table at most half full, dropping all tombstones */
+static int ds_resize_dests(struct rsocket *rs)
+{
+	struct ds_dest_bucket *table;
+	struct ds_dest *dest;
+	uint32_t i, size = 1;
+	int s;
+
+	while (size * DS_DEST_SLOTS < (rs->dest_cnt + 1) * 2)
+		size <<= 1;
+
+	table = calloc(size, sizeof(*table));
+	if (!table)
+		return ERR(ENOMEM);
+
+	for (i = 0; rs->dest_table && i <= rs->dest_mask; i++) {
+		for (s = 0; s < DS_DEST_SLOTS; s++) {
+			dest = rs->dest_table[i].dest[s];
+			if (dest && dest != DS_DEST_TOMB)
+				ds_insert_slot(table, size - 1, dest);
+		}
+	}
+
+	free(rs->dest_table);
+	rs->dest_table = table;
+	rs->dest_mask = size - 1;
+	rs->dest_used = rs->dest_cnt;
+	return 0;
+}
+
+/* Caller must hold map_lock */
+static int ds_insert_dest(struct rsocket *rs, struct ds_dest *dest)
+{
+	int ret;
+
+	dest->hash = ds_hash_addr(&dest->addr);
+	if (!rs->dest_table || (rs->dest_used + 1) * 4 >
+			       (rs->dest_mask + 1) * DS_DEST_SLOTS * 3) {
+		ret = ds_resize_dests(rs);
+		if (ret)
+			return ret;
+	}
+
+	rs->dest_used += ds_insert_slot(rs->dest_table, rs->dest_mask, dest);
+	rs->dest_cnt++;
+	return 0;
+}
+
+/* Caller must hold map_lock */
+static void ds_remove_dest(struct rsocket *rs, struct ds_dest *dest)
+{
+	struct ds_dest **slot;
+
+	slot = ds_find_dest(rs, &dest->addr, dest->hash);
+	if (slot && *slot == dest) {
+		*slot = DS_DEST_TOMB;
+		rs->dest_cnt--;
+	}
+}
+
+static void ds_free_dest(struct ds_dest *dest)
+{
+	if (dest->ah)
+		ibv_destroy_ah(dest->ah);
+	free(dest);
+}
+
+/*
+ * Free the least recently used destination that is not referenced.
+ * Caller must hold map_lock.
+ */
+static void ds_evict_dest(struct rsocket *rs)
+{
+	struct ds_dest *dest;
+	dlist_entry *entry;
+
+	for (entry = rs->dest_lru.prev; entry != &rs->dest_lru;
+	     entry = entry->prev) {
+		dest = container_of(entry, struct ds_dest, lru_entry);
+		if (!atomic_load(&dest->refcnt)) {
+			ds_remove_dest(rs, dest);
+			dlist_remove(&dest->lru_entry);
+			ds_free_dest(dest);
+			return;
+		}
+	}
+}
+
+static void ds_put_dest(struct ds_dest *dest)
+{
+	atomic_fetch_sub(&dest->refcnt, 1);
+}
+
 static int rs_value_to_scale(int value, int bits)
 {
 	return value <= (1 << (bits - 1)) ?
@@ -614,6 +981,20 @@ static void rs_configure(void)
 			def_wmem = RS_SNDLOWAT << 1;
 	}
 
+	if ((f = fopen(RS_CONF_DIR "/mem_min", "r"))) {
+		failable_fscanf(f, "%u", &def_mem_min);
+		fclose(f);
+		if (def_mem_min < RS_SNDLOWAT)
+			def_mem_min = RS_SNDLOWAT << 1;
+	}
+
+	if ((f = fopen(RS_CONF_DIR "/wmem_min", "r"))) {
+		failable_fscanf(f, "%u", &def_wmem_min);
+		fclose(f);
+		if (def_wmem_min < RS_SNDLOWAT)
+			def_wmem_min = RS_SNDLOWAT << 1;
+	}
+
 	if ((f = fopen(RS_CONF_DIR "/iomap_size", "r"))) {
 		failable_fscanf(f, "%hu", &def_iomap_size);
 		fclose(f);
@@ -622,6 +1003,31 @@ static void rs_configure(void)
 		def_iomap_size = (uint8_t) rs_value_to_scale(
 			(uint16_t) rs_scale_to_value(def_iomap_size, 8), 8);
 	}
+
+	if ((f = fopen(RS_CONF_DIR "/zcopy_threshold", "r"))) {
+		failable_fscanf(f, "%u", &def_zcopy_threshold);
+		fclose(f);
+	}
+
+	if ((f = fopen(RS_CONF_DIR "/cork_time", "r"))) {
+		failable_fscanf(f, "%u", &cork_time);
+		fclose(f);
+	}
+
+	if ((f = fopen(RS_CONF_DIR "/dest_cache_size", "r"))) {
+		failable_fscanf(f, "%u", &dest_cache_size);
+		fclose(f);
+	}
+
+	if ((f = fopen(RS_CONF_DIR "/svc_workers", "r"))) {
+		failable_fscanf(f, "%u", &svc_workers);
+		fclose(f);
+
+		if (svc_workers < 1)
+			svc_workers = 1;
+		else if (svc_workers > RS_SVC_MAX_WORKERS)
+			svc_workers = RS_SVC_MAX_WORKERS;
+	}
 	init = 1;
 out:
 	pthread_mutex_unlock(&mut);
@@ -667,6 +1073,11 @@ static struct rsocket *rs_alloc(struct rsocket *inherited_rs, int type)
 		if (type == SOCK_STREAM) {
 			rs->ctrl_max_seqno = inherited_rs->ctrl_max_seqno;
 			rs->target_iomap_size = inherited_rs->target_iomap_size;
+			rs->zcopy_threshold = inherited_rs->zcopy_threshold;
+			rs->tcp_opts = inherited_rs->tcp_opts &
+				       ((1 << TCP_NODELAY) | (1 << TCP_CORK));
+			rs->opts = inherited_rs->opts &
+				   (RS_OPT_CORK | RS_OPT_RBUF_TUNE | RS_OPT_SBUF_TUNE);
 		}
 	} else {
 		rs->sbuf_size = def_wmem;
@@ -677,6 +1088,16 @@ static struct rsocket *rs_alloc(struct rsocket *inherited_rs, int type)
 		if (type == SOCK_STREAM) {
 			rs->ctrl_max_seqno = RS_QP_CTRL_SIZE;
 			rs->target_iomap_size = def_iomap_size;
+			rs->zcopy_threshold = def_zcopy_threshold;
+			rs->tcp_opts = 1 << TCP_NODELAY;
+			if (def_mem_min < def_mem) {
+				rs->rbuf_size = def_mem_min;
+				rs->opts |= RS_OPT_RBUF_TUNE;
+			}
+			if (def_wmem_min < def_wmem) {
+				rs->sbuf_size = def_wmem_min;
+				rs->opts |= RS_OPT_SBUF_TUNE;
+			}
 		}
 	}
 	fastlock_init(&rs->slock);
@@ -686,6 +1107,8 @@ static struct rsocket *rs_alloc(struct rsocket *inherited_rs, int type)
 	fastlock_init(&rs->map_lock);
 	dlist_init(&rs->iomap_list);
 	dlist_init(&rs->iomap_queue);
+	dlist_init(&rs->repoll_list);
+	rs_poll_ctl_init(&rs->poll_ctl);
 	return rs;
 }
 
@@ -807,6 +1230,8 @@ static int rs_init_bufs(struct rsocket *rs)
 
 	rs->rbuf_free_offset = rs->rbuf_size >> 1;
 	rs->rbuf_bytes_avail = rs->rbuf_size >> 1;
+	rs->rbuf_remote_avail = rs->rbuf_size >> 1;
+	rs->rbuf_remote_min = rs->rbuf_size;
 	rs->sqe_avail = rs->sq_size - rs->ctrl_max_seqno;
 	rs->rseq_comp = rs->rq_size >> 1;
 	return 0;
@@ -891,11 +1316,10 @@ static inline int rs_post_recv(struct rsocket *rs)
 	return rdma_seterrno(ibv_post_recv(rs->cm_id->qp, &wr, &bad));
 }
 
-static inline int ds_post_recv(struct rsocket *rs, struct ds_qp *qp, uint32_t offset)
+static inline void ds_init_recv_wr(struct rsocket *rs, struct ds_qp *qp,
+				   uint32_t offset, struct ibv_recv_wr *wr,
+				   struct ibv_sge *sge)
 {
-	struct ibv_recv_wr wr, *bad;
-	struct ibv_sge sge[2];
-
 	sge[0].addr = (uintptr_t) qp->rbuf + rs->rbuf_size;
 	sge[0].length = sizeof(struct ibv_grh);
 	sge[0].lkey = qp->rmr->lkey;
@@ -903,11 +1327,18 @@ static inline int ds_post_recv(struct rsocket *rs, struct ds_qp *qp, uint32_t of
 	sge[1].length = RS_SNDLOWAT;
 	sge[1].lkey = qp->rmr->lkey;
 
-	wr.wr_id = rs_recv_wr_id(offset);
-	wr.next = NULL;
-	wr.sg_list = sge;
-	wr.num_sge = 2;
+	wr->wr_id = rs_recv_wr_id(offset);
+	wr->next = NULL;
+	wr->sg_list = sge;
+	wr->num_sge = 2;
+}
+
+static inline int ds_post_recv(struct rsocket *rs, struct ds_qp *qp, uint32_t offset)
+{
+	struct ibv_recv_wr wr, *bad;
+	struct ibv_sge sge[2];
 
+	ds_init_recv_wr(rs, qp, offset, &wr, sge);
 	return rdma_seterrno(ibv_post_recv(qp->cm_id->qp, &wr, &bad));
 }
 
@@ -920,6 +1351,12 @@ static int rs_create_ep(struct rsocket *rs)
 	if (rs->cm_id->verbs->device->transport_type == IBV_TRANSPORT_IWARP) {
 		rs->opts |= RS_OPT_MSG_SEND;
 
+		/* Receive messages are placed after the data area of rbuf */
+		if (rs->opts & RS_OPT_RBUF_TUNE) {
+			rs->opts &= ~RS_OPT_RBUF_TUNE;
+			rs->rbuf_size = def_mem;
+		}
+
 		if (rs->sq_inline < RS_MSG_SIZE)
 			rs->sq_inline = RS_MSG_SIZE;
 	}
@@ -1001,7 +1438,9 @@ static void ds_free_qp(struct ds_qp *qp)
 
 	if (qp->cm_id) {
 		if (qp->cm_id->qp) {
-			tdelete(&qp->dest.addr, &qp->rs->dest_map, ds_compare_addr);
+			ds_remove_dest(qp->rs, &qp->dest);
+			if (qp->dest.ah)
+				ibv_destroy_ah(qp->dest.ah);
 			epoll_ctl(qp->rs->epfd, EPOLL_CTL_DEL,
 				  qp->cm_id->recv_cq_channel->fd, NULL);
 			rdma_destroy_qp(qp->cm_id);
@@ -1014,6 +1453,7 @@ static void ds_free_qp(struct ds_qp *qp)
 
 static void ds_free(struct rsocket *rs)
 {
+	struct ds_dest *dest;
 	struct ds_qp *qp;
 
 	if (rs->udp_sock >= 0)
@@ -1036,7 +1476,13 @@ static void ds_free(struct rsocket *rs)
 	if (rs->sbuf)
 		free(rs->sbuf);
 
-	tdestroy(rs->dest_map, free);
+	free(rs->smsg_dest);
+	while (!dlist_empty(&rs->dest_lru)) {
+		dest = container_of(rs->dest_lru.next, struct ds_dest, lru_entry);
+		dlist_remove(&dest->lru_entry);
+		ds_free_dest(dest);
+	}
+	free(rs->dest_table);
 	fastlock_destroy(&rs->map_lock);
 	fastlock_destroy(&rs->cq_wait_lock);
 	fastlock_destroy(&rs->cq_lock);
@@ -1067,6 +1513,16 @@ static void rs_free(struct rsocket *rs)
 		free(rs->rbuf);
 	}
 
+	if (rs->rbuf_next) {
+		rdma_dereg_mr(rs->rmr_next);
+		free(rs->rbuf_next);
+	}
+
+	if (rs->rbuf_old) {
+		rdma_dereg_mr(rs->rmr_old);
+		free(rs->rbuf_old);
+	}
+
 	if (rs->target_buffer_list) {
 		if (rs->target_mr)
 			rdma_dereg_mr(rs->target_mr);
@@ -1078,6 +1534,7 @@ static void rs_free(struct rsocket *rs)
 
 	if (rs->cm_id) {
 		rs_free_iomappings(rs);
+		free(rs->zc.regions);
 		if (rs->cm_id->qp) {
 			ibv_ack_cq_events(rs->cm_id->recv_cq, rs->unack_cqe);
 			rdma_destroy_qp(rs->cm_id);
@@ -1130,7 +1587,7 @@ static void rs_save_conn_data(struct rsocket *rs, struct rs_conn_data *conn)
 	rs->remote_sge = 1;
 	if ((rs_host_is_net() && !(conn->flags & RS_CONN_FLAG_NET)) ||
 	    (!rs_host_is_net() && (conn->flags & RS_CONN_FLAG_NET)))
-		rs->opts = RS_OPT_SWAP_SGL;
+		rs->opts |= RS_OPT_SWAP_SGL;
 
 	if (conn->flags & RS_CONN_FLAG_IOMAP) {
 		rs->remote_iomap.addr = rs->remote_sgl.addr +
@@ -1148,6 +1605,7 @@ static void rs_save_conn_data(struct rsocket *rs, struct rs_conn_data *conn)
 
 static int ds_init(struct rsocket *rs, int domain)
 {
+	dlist_init(&rs->dest_lru);
 	rs->udp_sock = socket(domain, SOCK_DGRAM, 0);
 	if (rs->udp_sock < 0)
 		return rs->udp_sock;
@@ -1174,6 +1632,10 @@ static int ds_init_ep(struct rsocket *rs)
 	if (!rs->dmsg)
 		return ERR(ENOMEM);
 
+	rs->smsg_dest = calloc(rs->sq_size, sizeof(*rs->smsg_dest));
+	if (!rs->smsg_dest)
+		return ERR(ENOMEM);
+
 	rs->sqe_avail = rs->sq_size;
 	rs->rqe_avail = rs->rq_size;
 
@@ -1185,7 +1647,7 @@ static int ds_init_ep(struct rsocket *rs)
 	}
 	msg->next = NULL;
 
-	ret = rs_notify_svc(&udp_svc, rs, RS_SVC_ADD_DGRAM);
+	ret = rs_notify_svc(udp_svc, rs, RS_SVC_ADD_DGRAM);
 	if (ret)
 		return ret;
 
@@ -1288,7 +1750,7 @@ int rlisten(int socket, int backlog)
 	if (ret)
 		return ret;
 
-	ret = rs_notify_svc(&listen_svc, rs, RS_SVC_ADD_CM);
+	ret = rs_notify_svc(listen_svc, rs, RS_SVC_ADD_CM);
 	if (ret)
 		return ret;
 
@@ -1369,7 +1831,7 @@ int raccept(int socket, struct sockaddr *addr, socklen_t *addrlen)
 		rgetpeername(new_rs->index, addr, addrlen);
 	/* The app can still drive the CM state on failure */
 	int save_errno = errno;
-	rs_notify_svc(&connect_svc, new_rs, RS_SVC_ADD_CM);
+	rs_notify_svc(connect_svc, new_rs, RS_SVC_ADD_CM);
 	errno = save_errno;
 	return new_rs->index;
 }
@@ -1580,8 +2042,8 @@ static int ds_add_qp_dest(struct ds_qp *qp, union socket_addr *addr,
 	if (!qp->dest.ah)
 		return ERR(ENOMEM);
 
-	tsearch(&qp->dest.addr, &qp->rs->dest_map, ds_compare_addr);
-	return 0;
+	atomic_store(&qp->dest.refcnt, 1);
+	return ds_insert_dest(qp->rs, &qp->dest);
 }
 
 static int ds_create_qp(struct rsocket *rs, union socket_addr *src_addr,
@@ -1672,19 +2134,32 @@ static int ds_get_qp(struct rsocket *rs, union socket_addr *src_addr,
 	return ds_create_qp(rs, src_addr, addrlen, qp);
 }
 
+/*
+ * Find or create the destination for an address.  The caller is given a
+ * reference on the destination, which replaces the reference held through
+ * the previous value of *dest, if any.
+ */
 static int ds_get_dest(struct rsocket *rs, const struct sockaddr *addr,
 		       socklen_t addrlen, struct ds_dest **dest)
 {
 	union socket_addr src_addr;
 	socklen_t src_len;
 	struct ds_qp *qp;
-	struct ds_dest **tdest, *new_dest;
+	struct ds_dest **slot, *new_dest;
+	uint32_t hash;
 	int ret = 0;
 
+	hash = ds_hash_addr(addr);
 	fastlock_acquire(&rs->map_lock);
-	tdest = tfind(addr, &rs->dest_map, ds_compare_addr);
-	if (tdest)
+	slot = ds_find_dest(rs, addr, hash);
+	if (slot) {
+		new_dest = *slot;
+		if (!ds_is_qp_dest(new_dest)) {
+			dlist_remove(&new_dest->lru_entry);
+			dlist_insert_head(&new_dest->lru_entry, &rs->dest_lru);
+		}
 		goto found;
+	}
 
 	ret = ds_get_src_addr(rs, addr, addrlen, &src_addr, &src_len);
 	if (ret)
@@ -1694,21 +2169,35 @@ static int ds_get_dest(struct rsocket *rs, const struct sockaddr *addr,
 	if (ret)
 		goto out;
 
-	tdest = tfind(addr, &rs->dest_map, ds_compare_addr);
-	if (!tdest) {
-		new_dest = calloc(1, sizeof(*new_dest));
-		if (!new_dest) {
-			ret = ERR(ENOMEM);
-			goto out;
-		}
+	slot = ds_find_dest(rs, addr, hash);
+	if (slot) {
+		new_dest = *slot;
+		goto found;
+	}
+
+	if (rs->dest_cnt >= dest_cache_size)
+		ds_evict_dest(rs);
 
-		memcpy(&new_dest->addr, addr, addrlen);
-		new_dest->qp = qp;
-		tdest = tsearch(&new_dest->addr, &rs->dest_map, ds_compare_addr);
+	new_dest = calloc(1, sizeof(*new_dest));
+	if (!new_dest) {
+		ret = ERR(ENOMEM);
+		goto out;
+	}
+
+	memcpy(&new_dest->addr, addr, addrlen);
+	new_dest->qp = qp;
+	ret = ds_insert_dest(rs, new_dest);
+	if (ret) {
+		free(new_dest);
+		goto out;
 	}
+	dlist_insert_head(&new_dest->lru_entry, &rs->dest_lru);
 
 found:
-	*dest = *tdest;
+	atomic_fetch_add(&new_dest->refcnt, 1);
+	if (*dest)
+		ds_put_dest(*dest);
+	*dest = new_dest;
 out:
 	fastlock_release(&rs->map_lock);
 	return ret;
@@ -1728,7 +2217,7 @@ int rconnect(int socket, const struct sockaddr *addr, socklen_t addrlen)
 		if (ret == -1 && errno == EINPROGRESS) {
 			save_errno = errno;
 			/* The app can still drive the CM state on failure */
-			rs_notify_svc(&connect_svc, rs, RS_SVC_ADD_CM);
+			rs_notify_svc(connect_svc, rs, RS_SVC_ADD_CM);
 			errno = save_errno;
 		}
 	} else {
@@ -1838,24 +2327,68 @@ static int rs_post_write_msg(struct rsocket *rs,
 	}
 }
 
+static void ds_init_send_wr(struct rsocket *rs, struct ds_dest *dest,
+			    struct ibv_send_wr *wr, struct ibv_sge *sge,
+			    uint32_t wr_data)
+{
+	wr->wr_id = rs_send_wr_id(wr_data);
+	wr->next = NULL;
+	wr->sg_list = sge;
+	wr->num_sge = 1;
+	wr->opcode = IBV_WR_SEND;
+	wr->send_flags = (sge->length <= rs->sq_inline) ? IBV_SEND_INLINE : 0;
+	wr->wr.ud.ah = dest->ah;
+	wr->wr.ud.remote_qpn = dest->qpn;
+	wr->wr.ud.remote_qkey = RDMA_UDP_QKEY;
+}
+
 static int ds_post_send(struct rsocket *rs, struct ibv_sge *sge,
 			uint32_t wr_data)
 {
 	struct ibv_send_wr wr, *bad;
 
-	wr.wr_id = rs_send_wr_id(wr_data);
-	wr.next = NULL;
-	wr.sg_list = sge;
-	wr.num_sge = 1;
-	wr.opcode = IBV_WR_SEND;
-	wr.send_flags = (sge->length <= rs->sq_inline) ? IBV_SEND_INLINE : 0;
-	wr.wr.ud.ah = rs->conn_dest->ah;
-	wr.wr.ud.remote_qpn = rs->conn_dest->qpn;
-	wr.wr.ud.remote_qkey = RDMA_UDP_QKEY;
-
+	ds_init_send_wr(rs, rs->conn_dest, &wr, sge, wr_data);
 	return rdma_seterrno(ibv_post_send(rs->conn_dest->qp->cm_id->qp, &wr, &bad));
 }
 
+/*
+ * Send buffer autotuning.  sbuf bounds the data awaiting completion, so a
+ * round that fills it was limited by sbuf and it is doubled, up to
+ * wmem_default.  After RS_TUNE_SHRINK_ROUNDS rounds that never used half
+ * of it, sbuf is halved, down to wmem_min.  A round ends once a buffer's
+ * worth of data has been sent.  The new size is applied by
+ * rs_switch_sbuf() when no sends are outstanding.
+ */
+static void rs_tune_sbuf(struct rsocket *rs, uint32_t length)
+{
+	uint32_t size = rs->sbuf_size;
+
+	if (rs->sbuf_size - rs->sbuf_bytes_avail > rs->sbuf_peak)
+		rs->sbuf_peak = rs->sbuf_size - rs->sbuf_bytes_avail;
+	rs->sbuf_sent += length;
+	if (rs->sbuf_sent < rs->sbuf_size)
+		return;
+
+	if (rs->sbuf_peak + RS_SNDLOWAT > rs->sbuf_size) {
+		rs->sbuf_idle = 0;
+		size <<= 1;
+		if (size > def_wmem)
+			size = def_wmem;
+	} else if (rs->sbuf_peak <= (rs->sbuf_size >> 1)) {
+		if (++rs->sbuf_idle >= RS_TUNE_SHRINK_ROUNDS) {
+			rs->sbuf_idle = 0;
+			size >>= 1;
+			if (size < def_wmem_min)
+				size = def_wmem_min;
+		}
+	} else {
+		rs->sbuf_idle = 0;
+	}
+	rs->sbuf_sent = 0;
+	rs->sbuf_peak = 0;
+	rs->sbuf_next_size = (size != rs->sbuf_size) ? size : 0;
+}
+
 /*
  * Update target SGE before sending data.  Otherwise the remote side may
  * update the entry before we do.
@@ -1872,6 +2405,8 @@ static int rs_write_data(struct rsocket *rs,
 	if (rs->opts & RS_OPT_MSG_SEND)
 		rs->sqe_avail--;
 	rs->sbuf_bytes_avail -= length;
+	if (rs->opts & RS_OPT_SBUF_TUNE)
+		rs_tune_sbuf(rs, length);
 
 	addr = rs->target_sgl[rs->target_sge].addr;
 	rkey = rs->target_sgl[rs->target_sge].key;
@@ -1923,26 +2458,195 @@ static uint32_t rs_sbuf_left(struct rsocket *rs)
 			   rs->ssgl[0].addr);
 }
 
+/*
+ * Receive buffer autotuning.  Credits are granted a half of rbuf at a
+ * time and the remote side may only write into granted space, so rbuf
+ * bounds the data in flight.  When the application has read everything
+ * and the remote side has no credits left, the connection was limited by
+ * rbuf and it is doubled, up to mem_default.  When the remote side never
+ * used more than half of its credits for RS_TUNE_SHRINK_ROUNDS rounds,
+ * rbuf is halved, down to mem_min.
+ *
+ * A new buffer is only used once all data in the current one has been
+ * consumed: credits stop at the end of rbuf until then, so at most two
+ * grants are ever outstanding, as the remote SGL requires.  The next
+ * grant comes from the start of the new buffer and the reader follows it
+ * when it wraps.  Grants carry their own address, key and length, so the
+ * remote side needs no notice.
+ *
+ * This runs under cq_lock and only records the new size.  The buffer is
+ * allocated and registered by the reader, see rs_alloc_rbuf_next().
+ */
+static void rs_tune_rbuf(struct rsocket *rs)
+{
+	uint32_t size = rs->rbuf_size;
+
+	if (rs->rbuf_starved) {
+		rs->rbuf_idle = 0;
+		size <<= 1;
+		if (size > def_mem)
+			size = def_mem & ~1;
+	} else if (rs->rbuf_remote_min >= (int) (rs->rbuf_size >> 1)) {
+		if (++rs->rbuf_idle >= RS_TUNE_SHRINK_ROUNDS) {
+			rs->rbuf_idle = 0;
+			size >>= 1;
+			if (size < def_mem_min)
+				size = def_mem_min;
+		}
+	} else {
+		rs->rbuf_idle = 0;
+	}
+	rs->rbuf_starved = 0;
+	rs->rbuf_remote_min = rs->rbuf_size;
+	if (size != rs->rbuf_size)
+		rs->rbuf_next_size = size;
+}
+
+/*
+ * Allocate and register the buffer sized by rs_tune_rbuf(), outside of
+ * cq_lock.  Caller must hold rlock.
+ */
+static void rs_alloc_rbuf_next(struct rsocket *rs)
+{
+	struct ibv_mr *mr = NULL;
+	uint8_t *rbuf;
+	uint32_t size;
+
+	if (!rs->rbuf_next_size || rs->rbuf_next)
+		return;
+
+	fastlock_acquire(&rs->cq_lock);
+	size = rs->rbuf_next ? 0 : rs->rbuf_next_size;
+	fastlock_release(&rs->cq_lock);
+	if (!size)
+		return;
+
+	rbuf = forksafe_alloc(size);
+	if (rbuf)
+		mr = rdma_reg_write(rs->cm_id, rbuf, size);
+
+	fastlock_acquire(&rs->cq_lock);
+	if (mr && !rs->rbuf_next && rs->rbuf_next_size == size) {
+		rs->rbuf_next = rbuf;
+		rs->rmr_next = mr;
+		rbuf = NULL;
+		mr = NULL;
+	} else if (!rs->rbuf_next) {
+		/* Give up until the next tuning round */
+		rs->rbuf_next_size = 0;
+	}
+	fastlock_release(&rs->cq_lock);
+
+	if (mr)
+		rdma_dereg_mr(mr);
+	free(rbuf);
+}
+
+static void rs_cancel_rbuf_next(struct rsocket *rs)
+{
+	fastlock_acquire(&rs->cq_lock);
+	if (!rs->rbuf_switched) {
+		if (rs->rbuf_next) {
+			rdma_dereg_mr(rs->rmr_next);
+			free(rs->rbuf_next);
+			rs->rbuf_next = NULL;
+			rs->rmr_next = NULL;
+		}
+		rs->rbuf_next_size = 0;
+	}
+	fastlock_release(&rs->cq_lock);
+}
+
+/*
+ * The reader has reached the end of rbuf.  Once credits come from the
+ * next buffer, all data in the current one has been consumed, and the
+ * next buffer replaces it.  Regions lent by rrecv_zc() may still point
+ * into the current buffer, in which case it is freed by rrecv_release()
+ * once they have all been returned.  Tuning stops when the first region
+ * is lent, so only one buffer is ever held this way.  Caller must hold
+ * rlock.
+ */
+static void rs_rbuf_wrap(struct rsocket *rs)
+{
+	rs->rbuf_offset = 0;
+	if (!rs->rbuf_switched)
+		return;
+
+	fastlock_acquire(&rs->cq_lock);
+	if (rs->zc.lent) {
+		rs->rbuf_old = rs->rbuf;
+		rs->rmr_old = rs->rmr;
+		rs->zc_old_lent = rs->zc.lent;
+	} else {
+		rdma_dereg_mr(rs->rmr);
+		free(rs->rbuf);
+	}
+	rs->rbuf = rs->rbuf_next;
+	rs->rmr = rs->rmr_next;
+	rs->rbuf_size = rs->rbuf_next_size;
+	rs->rbuf_next = NULL;
+	rs->rmr_next = NULL;
+	rs->rbuf_next_size = 0;
+	rs->rbuf_switched = 0;
+	rs->rbuf_starved = 0;
+	rs->rbuf_remote_min = rs->rbuf_size;
+	fastlock_release(&rs->cq_lock);
+}
+
+/* The application found no data to read, see rs_tune_rbuf() */
+static void rs_rbuf_empty(struct rsocket *rs)
+{
+	if ((rs->opts & RS_OPT_RBUF_TUNE) && !rs->rbuf_remote_avail)
+		rs->rbuf_starved = 1;
+}
+
+/* Whether the next half of rbuf can be granted to the remote side */
+static int rs_rbuf_ready(struct rsocket *rs)
+{
+	if (rs->rbuf_next && !rs->rbuf_switched)
+		return rs->rbuf_bytes_avail == rs->rbuf_size;
+
+	return rs->rbuf_bytes_avail >= ((rs->rbuf_switched ?
+					  rs->rbuf_next_size : rs->rbuf_size) >> 1);
+}
+
 static void rs_send_credits(struct rsocket *rs)
 {
 	struct ibv_sge ibsge;
 	struct rs_sge sge, *sge_buf;
+	struct ibv_mr *mr;
+	uint8_t *rbuf;
+	uint32_t size;
 	int flags;
 
 	rs->ctrl_seqno++;
 	rs->rseq_comp = rs->rseq_no + (rs->rq_size >> 1);
-	if (rs->rbuf_bytes_avail >= (rs->rbuf_size >> 1)) {
+	if (rs_rbuf_ready(rs)) {
 		if (rs->opts & RS_OPT_MSG_SEND)
 			rs->ctrl_seqno++;
 
-		if (!(rs->opts & RS_OPT_SWAP_SGL)) {
-			sge.addr = (uintptr_t) &rs->rbuf[rs->rbuf_free_offset];
-			sge.key = rs->rmr->rkey;
-			sge.length = rs->rbuf_size >> 1;
+		if (rs->rbuf_next && !rs->rbuf_switched) {
+			rs->rbuf_switched = 1;
+			rs->rbuf_bytes_avail = rs->rbuf_next_size;
+		}
+		if (rs->rbuf_switched) {
+			rbuf = rs->rbuf_next;
+			mr = rs->rmr_next;
+			size = rs->rbuf_next_size;
+		} else {
+			rbuf = rs->rbuf;
+			mr = rs->rmr;
+			size = rs->rbuf_size;
+		}
+
+		if (!(rs->opts & RS_OPT_SWAP_SGL)) {
+			sge.addr = (uintptr_t) &rbuf[rs->rbuf_free_offset];
+			sge.key = mr->rkey;
+			sge.length = size >> 1;
 		} else {
-			sge.addr = bswap_64((uintptr_t) &rs->rbuf[rs->rbuf_free_offset]);
-			sge.key = bswap_32(rs->rmr->rkey);
-			sge.length = bswap_32(rs->rbuf_size >> 1);
+			sge.addr = bswap_64((uintptr_t) &rbuf[rs->rbuf_free_offset]);
+			sge.key = bswap_32(mr->rkey);
+			sge.length = bswap_32(size >> 1);
 		}
 
 		if (rs->sq_inline < sizeof sge) {
@@ -1963,10 +2667,14 @@ static void rs_send_credits(struct rsocket *rs)
 			rs->remote_sgl.addr + rs->remote_sge * sizeof(struct rs_sge),
 			rs->remote_sgl.key);
 
-		rs->rbuf_bytes_avail -= rs->rbuf_size >> 1;
-		rs->rbuf_free_offset += rs->rbuf_size >> 1;
-		if (rs->rbuf_free_offset >= rs->rbuf_size)
+		rs->rbuf_bytes_avail -= size >> 1;
+		rs->rbuf_remote_avail += size >> 1;
+		rs->rbuf_free_offset += size >> 1;
+		if (rs->rbuf_free_offset >= size) {
 			rs->rbuf_free_offset = 0;
+			if ((rs->opts & RS_OPT_RBUF_TUNE) && !rs->rbuf_next_size)
+				rs_tune_rbuf(rs);
+		}
 		if (++rs->remote_sge == rs->remote_sgl.length)
 			rs->remote_sge = 0;
 	} else {
@@ -1988,11 +2696,11 @@ static inline int rs_2ctrl_avail(struct rsocket *rs)
 static int rs_give_credits(struct rsocket *rs)
 {
 	if (!(rs->opts & RS_OPT_MSG_SEND)) {
-		return ((rs->rbuf_bytes_avail >= (rs->rbuf_size >> 1)) ||
+		return (rs_rbuf_ready(rs) ||
 			((short) ((short) rs->rseq_no - (short) rs->rseq_comp) >= 0)) &&
 		       rs_ctrl_avail(rs) && (rs->state & rs_connected);
 	} else {
-		return ((rs->rbuf_bytes_avail >= (rs->rbuf_size >> 1)) ||
+		return (rs_rbuf_ready(rs) ||
 			((short) ((short) rs->rseq_no - (short) rs->rseq_comp) >= 0)) &&
 		       rs_2ctrl_avail(rs) && (rs->state & rs_connected);
 	}
@@ -2011,6 +2719,7 @@ static int rs_poll_cq(struct rsocket *rs)
 	int ret, rcnt = 0;
 
 	while ((ret = ibv_poll_cq(rs->cm_id->recv_cq, 1, &wc)) > 0) {
+		rs->comp_gen++;
 		if (rs_wr_is_recv(wc.wr_id)) {
 			if (wc.status != IBV_WC_SUCCESS)
 				continue;
@@ -2049,6 +2758,9 @@ static int rs_poll_cq(struct rsocket *rs)
 			default:
 				rs->rmsg[rs->rmsg_tail].op = rs_msg_op(msg);
 				rs->rmsg[rs->rmsg_tail].data = rs_msg_data(msg);
+				rs->rbuf_remote_avail -= rs_msg_data(msg);
+				if (rs->rbuf_remote_avail < rs->rbuf_remote_min)
+					rs->rbuf_remote_min = rs->rbuf_remote_avail;
 				if (++rs->rmsg_tail == rs->rq_size + 1)
 					rs->rmsg_tail = 0;
 				break;
@@ -2166,24 +2878,50 @@ static int rs_process_cq(struct rsocket *rs, int nonblock, int (*test)(struct rs
 static int rs_get_comp(struct rsocket *rs, int nonblock, int (*test)(struct rsocket *rs))
 {
 	uint64_t start_time = 0;
-	uint32_t poll_time;
+	uint32_t budget;
 	int ret;
 
 	do {
 		ret = rs_process_cq(rs, 1, test);
-		if (!ret || nonblock || errno != EWOULDBLOCK)
+		if (!ret || nonblock || errno != EWOULDBLOCK) {
+			if (!ret)
+				rs_poll_done(&rs->poll_ctl, start_time, true);
 			return ret;
-
-		if (!start_time)
-			start_time = rs_time_us();
-
-		poll_time = (uint32_t) (rs_time_us() - start_time);
-	} while (poll_time <= polling_time);
+		}
+	} while (rs_poll_continue(&rs->poll_ctl, &start_time, &budget));
 
 	ret = rs_process_cq(rs, 0, test);
+	if (!ret)
+		rs_poll_done(&rs->poll_ctl, start_time, false);
 	return ret;
 }
 
+/*
+ * Take a send slot for a message to dest.  The destination stays
+ * referenced until the send completes.  Caller must hold slock.
+ */
+static struct ds_smsg *ds_alloc_smsg(struct rsocket *rs, struct ds_dest *dest)
+{
+	struct ds_smsg *smsg;
+
+	smsg = rs->smsg_free;
+	rs->smsg_free = smsg->next;
+	rs->sqe_avail--;
+
+	atomic_fetch_add(&dest->refcnt, 1);
+	rs->smsg_dest[((uint8_t *) smsg - rs->sbuf) / RS_SNDLOWAT] = dest;
+	return smsg;
+}
+
+static void ds_free_smsg(struct rsocket *rs, struct ds_smsg *smsg)
+{
+	ds_put_dest(rs->smsg_dest[((uint8_t *) smsg - rs->sbuf) / RS_SNDLOWAT]);
+
+	smsg->next = rs->smsg_free;
+	rs->smsg_free = smsg;
+	rs->sqe_avail++;
+}
+
 static int ds_valid_recv(struct ds_qp *qp, struct ibv_wc *wc)
 {
 	struct ds_header *hdr;
@@ -2199,15 +2937,16 @@ static int ds_valid_recv(struct ds_qp *qp, struct ibv_wc *wc)
  * received messages that we do not have room to store.  To limit drops,
  * we only poll if we have room to store the receive or we need a send
  * buffer.  To ensure fairness, we poll the CQs round robin, remembering
- * where we left off.
+ * where we left off.  Completions are reaped in batches, but never more
+ * than we have room to store, so batching does not add to the drops.
  */
 static void ds_poll_cqs(struct rsocket *rs)
 {
 	struct ds_qp *qp;
 	struct ds_smsg *smsg;
 	struct ds_rmsg *rmsg;
-	struct ibv_wc wc;
-	int ret, cnt;
+	struct ibv_wc wc[DS_MAX_BATCH];
+	int i, ret, cnt;
 
 	if (!(qp = rs->qp_list))
 		return;
@@ -2215,30 +2954,33 @@ static void ds_poll_cqs(struct rsocket *rs)
 	do {
 		cnt = 0;
 		do {
-			ret = ibv_poll_cq(qp->cm_id->recv_cq, 1, &wc);
+			ret = ibv_poll_cq(qp->cm_id->recv_cq, rs->rqe_avail ?
+					  min(rs->rqe_avail, DS_MAX_BATCH) : 1, wc);
 			if (ret <= 0) {
 				qp = ds_next_qp(qp);
 				continue;
 			}
 
-			if (rs_wr_is_recv(wc.wr_id)) {
-				if (rs->rqe_avail && wc.status == IBV_WC_SUCCESS &&
-				    ds_valid_recv(qp, &wc)) {
+			for (i = 0; i < ret; i++) {
+				rs->comp_gen++;
+				if (!rs_wr_is_recv(wc[i].wr_id)) {
+					smsg = (struct ds_smsg *) (rs->sbuf +
+						rs_wr_data(wc[i].wr_id));
+					ds_free_smsg(rs, smsg);
+				} else if (rs->rqe_avail &&
+					   wc[i].status == IBV_WC_SUCCESS &&
+					   ds_valid_recv(qp, &wc[i])) {
 					rs->rqe_avail--;
 					rmsg = &rs->dmsg[rs->rmsg_tail];
 					rmsg->qp = qp;
-					rmsg->offset = rs_wr_data(wc.wr_id);
-					rmsg->length = wc.byte_len - sizeof(struct ibv_grh);
+					rmsg->offset = rs_wr_data(wc[i].wr_id);
+					rmsg->length = wc[i].byte_len -
+						       sizeof(struct ibv_grh);
 					if (++rs->rmsg_tail == rs->rq_size + 1)
 						rs->rmsg_tail = 0;
 				} else {
-					ds_post_recv(rs, qp, rs_wr_data(wc.wr_id));
+					ds_post_recv(rs, qp, rs_wr_data(wc[i].wr_id));
 				}
-			} else {
-				smsg = (struct ds_smsg *) (rs->sbuf + rs_wr_data(wc.wr_id));
-				smsg->next = rs->smsg_free;
-				rs->smsg_free = smsg;
-				rs->sqe_avail++;
 			}
 
 			qp = ds_next_qp(qp);
@@ -2325,21 +3067,21 @@ static int ds_process_cqs(struct rsocket *rs, int nonblock, int (*test)(struct r
 static int ds_get_comp(struct rsocket *rs, int nonblock, int (*test)(struct rsocket *rs))
 {
 	uint64_t start_time = 0;
-	uint32_t poll_time;
+	uint32_t budget;
 	int ret;
 
 	do {
 		ret = ds_process_cqs(rs, 1, test);
-		if (!ret || nonblock || errno != EWOULDBLOCK)
+		if (!ret || nonblock || errno != EWOULDBLOCK) {
+			if (!ret)
+				rs_poll_done(&rs->poll_ctl, start_time, true);
 			return ret;
-
-		if (!start_time)
-			start_time = rs_time_us();
-
-		poll_time = (uint32_t) (rs_time_us() - start_time);
-	} while (poll_time <= polling_time);
+		}
+	} while (rs_poll_continue(&rs->poll_ctl, &start_time, &budget));
 
 	ret = ds_process_cqs(rs, 0, test);
+	if (!ret)
+		rs_poll_done(&rs->poll_ctl, start_time, false);
 	return ret;
 }
 
@@ -2410,6 +3152,13 @@ static int rs_conn_have_rdata(struct rsocket *rs)
 	return rs_have_rdata(rs) || !(rs->state & rs_readable);
 }
 
+/* Control messages, such as credit updates, are not waited for */
+static int rs_conn_data_sends_done(struct rsocket *rs)
+{
+	return (rs->sqe_avail + RS_QP_CTRL_SIZE == rs->sq_size) ||
+	       !(rs->state & rs_connected);
+}
+
 static int rs_conn_all_sends_done(struct rsocket *rs)
 {
 	return ((((int) rs->ctrl_max_seqno) - ((int) rs->ctrl_seqno)) +
@@ -2481,11 +3230,14 @@ static ssize_t ds_recvfrom(struct rsocket *rs, void *buf, size_t len, int flags,
 static ssize_t rs_peek(struct rsocket *rs, void *buf, size_t len)
 {
 	size_t left = len;
-	uint32_t end_size, rsize;
+	uint32_t end_size, rsize, rbuf_size;
 	int rmsg_head, rbuf_offset;
+	uint8_t *rbuf;
 
 	rmsg_head = rs->rmsg_head;
 	rbuf_offset = rs->rbuf_offset;
+	rbuf = rs->rbuf;
+	rbuf_size = rs->rbuf_size;
 
 	for (; left && (rmsg_head != rs->rmsg_tail); left -= rsize) {
 		if (left < rs->rmsg[rmsg_head].data) {
@@ -2496,15 +3248,19 @@ static ssize_t rs_peek(struct rsocket *rs, void *buf, size_t len)
 				rmsg_head = 0;
 		}
 
-		end_size = rs->rbuf_size - rbuf_offset;
+		end_size = rbuf_size - rbuf_offset;
 		if (rsize > end_size) {
-			memcpy(buf, &rs->rbuf[rbuf_offset], end_size);
+			memcpy(buf, &rbuf[rbuf_offset], end_size);
 			rbuf_offset = 0;
+			if (rs->rbuf_switched) {
+				rbuf = rs->rbuf_next;
+				rbuf_size = rs->rbuf_next_size;
+			}
 			buf += end_size;
 			rsize -= end_size;
 			left -= end_size;
 		}
-		memcpy(buf, &rs->rbuf[rbuf_offset], rsize);
+		memcpy(buf, &rbuf[rbuf_offset], rsize);
 		rbuf_offset += rsize;
 		buf += rsize;
 	}
@@ -2512,6 +3268,143 @@ static ssize_t rs_peek(struct rsocket *rs, void *buf, size_t len)
 	return len - left;
 }
 
+/*
+ * Send coalescing.  When corked, small sends are copied into sbuf at
+ * ssgl[0] without being posted.  The staged bytes are written as a single
+ * message once they reach the cork size, once cork_time microseconds have
+ * passed since the first byte was staged, when the socket is uncorked, or
+ * before any other data is placed into sbuf.  The cork_time deadline is
+ * kept by the tcp service thread, which pushes the data if no rsocket call
+ * has done so by then.  Staged data is also pushed when the application
+ * waits on the rsocket, so a reply is not delayed by the timer.
+ */
+static uint32_t rs_cork_size(struct rsocket *rs)
+{
+	return min(rs->sbuf_size >> 2, (uint32_t) RS_MAX_TRANSFER);
+}
+
+static int rs_cork_flush(struct rsocket *rs, int nonblock)
+{
+	int ret;
+
+	if (!rs->cork_len)
+		return 0;
+
+	if (!rs_can_send(rs)) {
+		ret = rs_get_comp(rs, nonblock, rs_conn_can_send);
+		if (ret)
+			return ret;
+		if (!(rs->state & rs_writable))
+			return ERR(ECONNRESET);
+	}
+
+	rs->ssgl[0].length = rs->cork_len;
+	ret = rs_write_data(rs, rs->ssgl, 1, rs->cork_len,
+			    rs->cork_len <= rs->sq_inline ? IBV_SEND_INLINE : 0);
+	if (rs->cork_len < rs_sbuf_left(rs))
+		rs->ssgl[0].addr += rs->cork_len;
+	else
+		rs->ssgl[0].addr = (uintptr_t) rs->sbuf;
+	rs->cork_len = 0;
+	atomic_store(&rs->cork_deadline, 0);
+	return ret;
+}
+
+/*
+ * Arm the cork_time deadline for newly staged data.  The tcp service
+ * thread only needs waking if it has no deadline pending, and since every
+ * deadline is the same cork_time after its data was staged, a pending one
+ * always expires first.
+ */
+static void rs_cork_start(struct rsocket *rs)
+{
+	struct rs_svc *svc;
+	uint64_t c = 1;
+	ssize_t ret;
+
+	atomic_store(&rs->cork_deadline, rs_time_us() + cork_time);
+	if (!atomic_load(&rs->cork_svc))
+		return;
+
+	svc = rs_svc_of(tcp_svc, rs);
+	if (atomic_exchange(&svc->cork_idle, false)) {
+		ret = write(svc->cork_fd, &c, sizeof(c));
+		(void) ret;
+	}
+}
+
+static int rs_cork_fits(struct rsocket *rs, size_t len)
+{
+	return rs->cork_len + len <= rs_sbuf_left(rs) &&
+	       rs->cork_len + len <= rs->sbuf_bytes_avail &&
+	       rs->cork_len + len <= rs->target_sgl[rs->target_sge].length;
+}
+
+/*
+ * Returns 0 if the data was staged, 1 if it must be sent normally, or an
+ * error if staged data could not be flushed to make room.
+ */
+static int rs_cork_send(struct rsocket *rs, const void *buf, size_t len,
+			int flags)
+{
+	int ret;
+
+	if (!rs_cork_fits(rs, len)) {
+		ret = rs_cork_flush(rs, rs_nonblocking(rs, flags));
+		if (ret)
+			return ret;
+		if (!rs_cork_fits(rs, len))
+			return 1;
+	}
+
+	if (!(rs->state & rs_writable))
+		return ERR(ECONNRESET);
+
+	memcpy((void *) (uintptr_t) rs->ssgl[0].addr + rs->cork_len, buf, len);
+	if (!rs->cork_len)
+		rs_cork_start(rs);
+	rs->cork_len += len;
+
+	/* Without TCP_CORK, behave like Nagle: only hold data behind a send */
+	if (rs->cork_len >= rs_cork_size(rs) ||
+	    rs_time_us() >= atomic_load(&rs->cork_deadline) ||
+	    (!(rs->tcp_opts & (1 << TCP_CORK)) && rs_conn_all_sends_done(rs)))
+		rs_cork_flush(rs, 1);
+	return 0;
+}
+
+/* Push staged data without holding the caller up */
+static void rs_cork_push(struct rsocket *rs)
+{
+	fastlock_acquire(&rs->slock);
+	rs_cork_flush(rs, 1);
+	fastlock_release(&rs->slock);
+}
+
+static void rs_set_cork(struct rsocket *rs, int push)
+{
+	fastlock_acquire(&rs->slock);
+	if ((rs->tcp_opts & (1 << TCP_CORK)) ||
+	    !(rs->tcp_opts & (1 << TCP_NODELAY)))
+		rs->opts |= RS_OPT_CORK;
+	else
+		rs->opts &= ~RS_OPT_CORK;
+
+	if (push || !(rs->opts & RS_OPT_CORK))
+		rs_cork_flush(rs, rs_nonblocking(rs, 0));
+	fastlock_release(&rs->slock);
+}
+
+/*
+ * Return rbuf space that the application has consumed.  While regions
+ * are lent out, the space is held until the regions ahead of it have
+ * been released.  Caller must hold rlock.
+ */
+static void rs_rbuf_free(struct rsocket *rs, uint32_t len)
+{
+	rs->rbuf_bytes_avail += rs_zc_free(&rs->zc, len);
+}
+
 /*
  * Continue to receive any queued data even if the remote side has disconnected.
  */
@@ -2540,9 +3433,13 @@ ssize_t rrecv(int socket, void *buf, size_t len, int flags)
 			return ret;
 		}
 	}
+	if (rs->cork_len)
+		rs_cork_push(rs);
+
 	fastlock_acquire(&rs->rlock);
 	do {
 		if (!rs_have_rdata(rs)) {
+			rs_rbuf_empty(rs);
 			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
 					  rs_conn_have_rdata);
 			if (ret)
@@ -2568,24 +3465,141 @@ ssize_t rrecv(int socket, void *buf, size_t len, int flags)
 			end_size = rs->rbuf_size - rs->rbuf_offset;
 			if (rsize > end_size) {
 				memcpy(buf, &rs->rbuf[rs->rbuf_offset], end_size);
-				rs->rbuf_offset = 0;
+				rs_rbuf_wrap(rs);
 				buf += end_size;
 				rsize -= end_size;
 				left -= end_size;
-				rs->rbuf_bytes_avail += end_size;
+				rs_rbuf_free(rs, end_size);
 			}
 			memcpy(buf, &rs->rbuf[rs->rbuf_offset], rsize);
 			rs->rbuf_offset += rsize;
 			buf += rsize;
-			rs->rbuf_bytes_avail += rsize;
+			rs_rbuf_free(rs, rsize);
 		}
 
 	} while (left && (flags & MSG_WAITALL) && (rs->state & rs_readable));
 
+	if (rs->opts & RS_OPT_RBUF_TUNE)
+		rs_alloc_rbuf_next(rs);
 	fastlock_release(&rs->rlock);
 	return (ret && left == len) ? ret : len - left;
 }
 
+/*
+ * Zero-copy receive.  Rather than copying, lend the application the next
+ * contiguous block of received data where it sits in rbuf.  The space is
+ * not credited back to the remote side until the block is released.
+ */
+ssize_t rrecv_zc(int socket, void **buf, size_t len, int flags)
+{
+	struct rsocket *rs;
+	uint32_t rsize;
+	int ret = 0;
+
+	rs = idm_at(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	if (rs->type != SOCK_STREAM)
+		return ERR(EOPNOTSUPP);
+	if (flags & (MSG_PEEK | MSG_WAITALL))
+		return ERR(EINVAL);
+
+	if (rs->state & rs_opening) {
+		ret = rs_do_connect(rs);
+		if (ret) {
+			if (errno == EINPROGRESS)
+				errno = EAGAIN;
+			return ret;
+		}
+	}
+	if (rs->cork_len)
+		rs_cork_push(rs);
+
+	fastlock_acquire(&rs->rlock);
+	if (!rs->zc.regions) {
+		if (rs_zc_init(&rs->zc, rs->rq_size * 2)) {
+			ret = ERR(ENOMEM);
+			goto out;
+		}
+		/* Lent regions could hold back a buffer switch indefinitely */
+		rs->opts &= ~RS_OPT_RBUF_TUNE;
+		rs_cancel_rbuf_next(rs);
+	}
+
+	if (rs_zc_full(&rs->zc, rs->rq_size)) {
+		ret = ERR(ENOBUFS);
+		goto out;
+	}
+
+	if (!rs_have_rdata(rs)) {
+		ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
+				  rs_conn_have_rdata);
+		if (ret || !rs_have_rdata(rs))
+			goto out;
+	}
+
+	if (rs->rbuf_offset == rs->rbuf_size)
+		rs_rbuf_wrap(rs);
+
+	rsize = min(rs->rmsg[rs->rmsg_head].data,
+		    rs->rbuf_size - rs->rbuf_offset);
+	if (len < rsize)
+		rsize = len;
+
+	if (rsize < rs->rmsg[rs->rmsg_head].data) {
+		rs->rmsg[rs->rmsg_head].data -= rsize;
+	} else {
+		rs->rseq_no++;
+		if (++rs->rmsg_head == rs->rq_size + 1)
+			rs->rmsg_head = 0;
+	}
+
+	rs_zc_lend(&rs->zc, rs->rbuf, rs->rbuf_offset, rsize);
+	*buf = &rs->rbuf[rs->rbuf_offset];
+	rs->rbuf_offset += rsize;
+	ret = rsize;
+out:
+	fastlock_release(&rs->rlock);
+	return ret;
+}
+
+/*
+ * Return a block lent by rrecv_zc().  Blocks may be released in any
+ * order, but rbuf space is credited back in stream order.
+ */
+int rrecv_release(int socket, void *buf, size_t len)
+{
+	struct rs_zc_region *region;
+	struct rsocket *rs;
+	int ret;
+
+	rs = idm_at(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+
+	fastlock_acquire(&rs->rlock);
+	region = rs_zc_release(&rs->zc, buf, len);
+	ret = region ? 0 : ERR(EINVAL);
+
+	/* The last region lent from a replaced rbuf frees it */
+	if (region && region->base == rs->rbuf_old && !--rs->zc_old_lent) {
+		rdma_dereg_mr(rs->rmr_old);
+		free(rs->rbuf_old);
+		rs->rbuf_old = NULL;
+		rs->rmr_old = NULL;
+	}
+
+	rs->rbuf_bytes_avail += rs_zc_reclaim(&rs->zc);
+	fastlock_release(&rs->rlock);
+
+	if (!ret && (rs->state & rs_connected)) {
+		fastlock_acquire(&rs->cq_lock);
+		rs_update_credits(rs);
+		fastlock_release(&rs->cq_lock);
+	}
+	return ret;
+}
+
 ssize_t rrecvfrom(int socket, void *buf, size_t len, int flags,
 		  struct sockaddr *src_addr, socklen_t *addrlen)
 {
@@ -2626,6 +3640,153 @@ ssize_t rrecvmsg(int socket, struct msghdr *msg, int flags)
 	return rrecvv(socket, msg->msg_iov, (int) msg->msg_iovlen, msg->msg_flags);
 }
 
+static int ds_post_recv_list(struct ds_qp *qp, struct ibv_recv_wr *wr, int cnt)
+{
+	struct ibv_recv_wr *bad;
+
+	wr[cnt - 1].next = NULL;
+	return rdma_seterrno(ibv_post_recv(qp->cm_id->qp, wr, &bad));
+}
+
+static size_t ds_copy_to_iov(const struct iovec *iov, size_t iovcnt,
+			     const void *src, size_t len)
+{
+	size_t size, copied = 0;
+
+	for (; len && iovcnt; iov++, iovcnt--) {
+		size = min(iov->iov_len, len);
+		memcpy(iov->iov_base, src + copied, size);
+		copied += size;
+		len -= size;
+	}
+	return copied;
+}
+
+static int ds_timed_out(struct timespec *timeout, uint64_t start_time)
+{
+	return timeout && rs_time_us() - start_time >=
+			  (uint64_t) timeout->tv_sec * 1000000 +
+			  timeout->tv_nsec / 1000;
+}
+
+/*
+ * Receive a batch of datagrams under a single acquisition of rlock.
+ * Receive buffers are returned to the QPs as a chained list of work
+ * requests, posted before we wait for more data and once at the end.
+ * If reposting fails after datagrams were returned, the batch is cut
+ * short and the error is left pending on the socket (SO_ERROR).
+ */
+static int ds_recvmmsg(struct rsocket *rs, struct mmsghdr *msgvec,
+		       unsigned int vlen, int flags, struct timespec *timeout)
+{
+	struct ibv_recv_wr wr[DS_MAX_BATCH];
+	struct ibv_sge sge[DS_MAX_BATCH][2];
+	struct ds_qp *qp = NULL;
+	struct ds_rmsg *rmsg;
+	struct ds_header *hdr;
+	struct msghdr *msg;
+	uint64_t start_time = 0;
+	unsigned int i;
+	size_t len;
+	int nonblock, cnt = 0, ret = 0;
+
+	if (!(rs->state & rs_readable))
+		return ERR(EINVAL);
+
+	if (timeout)
+		start_time = rs_time_us();
+
+	for (i = 0; i < vlen; i++) {
+		if (!rs_have_rdata(rs)) {
+			if (cnt) {
+				ret = ds_post_recv_list(qp, wr, cnt);
+				if (ret)
+					break;
+				cnt = 0;
+			}
+
+			nonblock = rs_nonblocking(rs, flags) ||
+				   (i && (flags & MSG_WAITFORONE));
+			ret = ds_get_comp(rs, nonblock, rs_have_rdata);
+			if (ret)
+				break;
+		}
+
+		rmsg = &rs->dmsg[rs->rmsg_head];
+		hdr = (struct ds_header *) (rmsg->qp->rbuf + rmsg->offset);
+		len = rmsg->length - hdr->length;
+
+		msg = &msgvec[i].msg_hdr;
+		msgvec[i].msg_len = ds_copy_to_iov(msg->msg_iov, msg->msg_iovlen,
+						   (void *) hdr + hdr->length, len);
+		msg->msg_flags = (msgvec[i].msg_len < len) ? MSG_TRUNC : 0;
+		msg->msg_controllen = 0;
+		if (msg->msg_name)
+			ds_set_src(msg->msg_name, &msg->msg_namelen, hdr);
+
+		if (flags & MSG_PEEK) {
+			i++;
+			break;
+		}
+
+		if (cnt && (rmsg->qp != qp || cnt == DS_MAX_BATCH)) {
+			ret = ds_post_recv_list(qp, wr, cnt);
+			if (ret)
+				break;
+			cnt = 0;
+		}
+		qp = rmsg->qp;
+		ds_init_recv_wr(rs, qp, rmsg->offset, &wr[cnt], sge[cnt]);
+		if (cnt)
+			wr[cnt - 1].next = &wr[cnt];
+		cnt++;
+
+		if (++rs->rmsg_head == rs->rq_size + 1)
+			rs->rmsg_head = 0;
+		rs->rqe_avail++;
+
+		if (ds_timed_out(timeout, start_time)) {
+			i++;
+			break;
+		}
+	}
+
+	if (cnt && !ret)
+		ret = ds_post_recv_list(qp, wr, cnt);
+	if (ret && cnt && i)
+		rs->err = errno;
+	return i ? i : ret;
+}
+
+int rrecvmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen,
+	      int flags, struct timespec *timeout)
+{
+	struct rsocket *rs;
+	unsigned int i;
+	ssize_t ret = 0;
+
+	rs = idm_at(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	if (rs->type == SOCK_DGRAM) {
+		fastlock_acquire(&rs->rlock);
+		ret = ds_recvmmsg(rs, msgvec, vlen, flags, timeout);
+		fastlock_release(&rs->rlock);
+		return ret;
+	}
+
+	for (i = 0; i < vlen; i++) {
+		ret = rrecvv(socket, msgvec[i].msg_hdr.msg_iov,
+			     (int) msgvec[i].msg_hdr.msg_iovlen, flags);
+		if (ret <= 0)
+			break;
+		msgvec[i].msg_len = ret;
+		if (flags & MSG_WAITFORONE)
+			flags |= MSG_DONTWAIT;
+	}
+	return i ? i : ret;
+}
+
 ssize_t rread(int socket, void *buf, size_t count)
 {
 	return rrecv(socket, buf, count, 0);
@@ -2643,6 +3804,10 @@ static int rs_send_iomaps(struct rsocket *rs, int flags)
 	struct rs_iomap iom;
 	int ret = 0;
 
+	ret = rs_cork_flush(rs, rs_nonblocking(rs, flags));
+	if (ret)
+		return ret;
+
 	fastlock_acquire(&rs->map_lock);
 	while (!dlist_empty(&rs->iomap_queue)) {
 		if (!rs_can_send(rs)) {
@@ -2770,10 +3935,7 @@ static ssize_t dsend(struct rsocket *rs, const void *buf, size_t len, int flags)
 			return ret;
 	}
 
-	msg = rs->smsg_free;
-	rs->smsg_free = msg->next;
-	rs->sqe_avail--;
-
+	msg = ds_alloc_smsg(rs, rs->conn_dest);
 	memcpy((void *) msg, &rs->conn_dest->qp->hdr, rs->conn_dest->qp->hdr.length);
 	memcpy((void *) msg + rs->conn_dest->qp->hdr.length, buf, len);
 	sge.addr = (uintptr_t) msg;
@@ -2786,16 +3948,86 @@ static ssize_t dsend(struct rsocket *rs, const void *buf, size_t len, int flags)
 }
 
 /*
- * We overlap sending the data, by posting a small work request immediately,
- * then increasing the size of the send on each iteration.
+ * Replace sbuf with one of the size chosen by rs_tune_sbuf().  Posted
+ * sends reference sbuf, so this waits for them to complete when growing,
+ * and otherwise waits for an idle moment.  Caller must hold slock with no
+ * data corked.
  */
-ssize_t rsend(int socket, const void *buf, size_t len, int flags)
+static int rs_switch_sbuf(struct rsocket *rs, int nonblock)
 {
-	struct rsocket *rs;
-	struct ibv_sge sge;
-	size_t left = len;
-	uint32_t xfer_size, olen = RS_OLAP_START_SIZE;
-	int ret = 0;
+	uint32_t size, total_size;
+	struct ibv_mr *mr;
+	uint8_t *sbuf;
+	int ret;
+
+	size = rs->sbuf_next_size;
+	if (!rs_conn_all_sends_done(rs)) {
+		if (nonblock || size < rs->sbuf_size)
+			return 0;
+
+		ret = rs_get_comp(rs, 0, rs_conn_all_sends_done);
+		if (ret)
+			return ret;
+	}
+	if (!(rs->state & rs_connected))
+		return 0;
+
+	total_size = size;
+	if (rs->sq_inline < RS_MAX_CTRL_MSG)
+		total_size += RS_MAX_CTRL_MSG * RS_QP_CTRL_SIZE;
+	sbuf = forksafe_alloc(total_size);
+	if (!sbuf)
+		goto out;
+
+	mr = rdma_reg_msgs(rs->cm_id, sbuf, total_size);
+	if (!mr) {
+		free(sbuf);
+		goto out;
+	}
+
+	/* Control messages may have been posted from sbuf meanwhile */
+	fastlock_acquire(&rs->cq_lock);
+	if (!rs_conn_all_sends_done(rs)) {
+		fastlock_release(&rs->cq_lock);
+		rdma_dereg_mr(mr);
+		free(sbuf);
+		return 0;
+	}
+
+	rdma_dereg_mr(rs->smr);
+	free(rs->sbuf);
+	rs->sbuf = sbuf;
+	rs->smr = mr;
+	rs->sbuf_size = size;
+	rs->sbuf_bytes_avail = size;
+	rs->ssgl[0].addr = rs->ssgl[1].addr = (uintptr_t) sbuf;
+	rs->ssgl[0].lkey = rs->ssgl[1].lkey = mr->lkey;
+	fastlock_release(&rs->cq_lock);
+out:
+	rs->sbuf_next_size = 0;
+	return 0;
+}
+
+/*
+ * We overlap sending the data, by posting a small work request immediately,
+ * then increasing the size of the send on each iteration.
+ *
+ * Large blocking sends may bypass the sbuf copy if zero-copy is enabled.
+ * The data is written directly from the user's buffer, registered through
+ * the verbs MR cache, so repeated sends from the same buffer are not
+ * registered again.  The application owns the buffer again once we
+ * return, so the data writes must complete first.  Send completions are
+ * in order, so only the data writes posted so far are waited for, not
+ * control messages sent on behalf of the receive side.
+ */
+ssize_t rsend(int socket, const void *buf, size_t len, int flags)
+{
+	struct rsocket *rs;
+	struct ibv_sge sge;
+	struct ibv_mr *zmr = NULL;
+	size_t left = len;
+	uint32_t xfer_size, olen = RS_OLAP_START_SIZE;
+	int ret = 0;
 
 	rs = idm_at(&idm, socket);
 	if (!rs)
@@ -2816,12 +4048,39 @@ ssize_t rsend(int socket, const void *buf, size_t len, int flags)
 		}
 	}
 
+	/*
+	 * Hand corked rsockets to the tcp service for their flush deadline.
+	 * Without it, staged data still goes out on the next call or wait.
+	 */
+	if ((rs->opts & RS_OPT_CORK) && !atomic_load(&rs->cork_svc))
+		rs_notify_svc(tcp_svc, rs, RS_SVC_ADD_CORK);
+
 	fastlock_acquire(&rs->slock);
 	if (rs->iomap_pending) {
 		ret = rs_send_iomaps(rs, flags);
 		if (ret)
 			goto out;
 	}
+	if ((rs->opts & RS_OPT_CORK) && len < rs_cork_size(rs)) {
+		ret = rs_cork_send(rs, buf, len, flags);
+		if (!ret)
+			left = 0;
+		if (ret <= 0)
+			goto out;
+	}
+	ret = rs_cork_flush(rs, rs_nonblocking(rs, flags));
+	if (ret)
+		goto out;
+	if (rs->sbuf_next_size) {
+		ret = rs_switch_sbuf(rs, rs_nonblocking(rs, flags));
+		if (ret)
+			goto out;
+	}
+
+	if (rs->zcopy_threshold && len >= rs->zcopy_threshold &&
+	    !rs_nonblocking(rs, flags))
+		zmr = ibv_reg_mr_cached(rs->cm_id->pd, (void *) buf, len, 0);
+
 	for (; left; left -= xfer_size, buf += xfer_size) {
 		if (!rs_can_send(rs)) {
 			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
@@ -2852,6 +4111,11 @@ ssize_t rsend(int socket, const void *buf, size_t len, int flags)
 			sge.length = xfer_size;
 			sge.lkey = 0;
 			ret = rs_write_data(rs, &sge, 1, xfer_size, IBV_SEND_INLINE);
+		} else if (zmr) {
+			sge.addr = (uintptr_t) buf;
+			sge.length = xfer_size;
+			sge.lkey = zmr->lkey;
+			ret = rs_write_data(rs, &sge, 1, xfer_size, 0);
 		} else if (xfer_size <= rs_sbuf_left(rs)) {
 			memcpy((void *) (uintptr_t) rs->ssgl[0].addr, buf, xfer_size);
 			rs->ssgl[0].length = xfer_size;
@@ -2872,6 +4136,15 @@ ssize_t rsend(int socket, const void *buf, size_t len, int flags)
 		if (ret)
 			break;
 	}
+
+	if (zmr) {
+		if (left != len) {
+			ret = rs_get_comp(rs, 0, rs_conn_data_sends_done);
+			if (ret)
+				left = len;
+		}
+		ibv_release_mr_cached(zmr);
+	}
 out:
 	fastlock_release(&rs->slock);
 
@@ -2965,6 +4238,15 @@ static ssize_t rsendv(int socket, const struct iovec *iov, int iovcnt, int flags
 		if (ret)
 			goto out;
 	}
+	ret = rs_cork_flush(rs, rs_nonblocking(rs, flags));
+	if (ret)
+		goto out;
+	if (rs->sbuf_next_size) {
+		ret = rs_switch_sbuf(rs, rs_nonblocking(rs, flags));
+		if (ret)
+			goto out;
+	}
+
 	for (; left; left -= xfer_size) {
 		if (!rs_can_send(rs)) {
 			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
@@ -3027,6 +4309,169 @@ ssize_t rsendmsg(int socket, const struct msghdr *msg, int flags)
 	return rsendv(socket, msg->msg_iov, (int) msg->msg_iovlen, flags);
 }
 
+/*
+ * Post a chain of datagram sends to a single QP with one doorbell.  The
+ * sends have already been charged against sqe_avail.  If the post fails,
+ * the messages that were not posted are returned to the free list.
+ * Returns the number of sends posted.
+ */
+static int ds_post_send_list(struct rsocket *rs, struct ds_qp *qp,
+			     struct ibv_send_wr *wr, int cnt)
+{
+	struct ibv_send_wr *bad;
+	struct ds_smsg *smsg;
+	int ret;
+
+	wr[cnt - 1].next = NULL;
+	ret = ibv_post_send(qp->cm_id->qp, wr, &bad);
+	if (!ret)
+		return cnt;
+
+	for (; bad; bad = bad->next, cnt--) {
+		smsg = (struct ds_smsg *) (rs->sbuf + rs_wr_data(bad->wr_id));
+		ds_free_smsg(rs, smsg);
+	}
+	errno = ret;
+	return cnt;
+}
+
+/*
+ * Send a batch of datagrams under a single acquisition of slock.  Messages
+ * to destinations reached through the same QP are chained and posted
+ * together.  Consecutive messages to the same address reuse the previous
+ * destination lookup.
+ */
+static int ds_sendmmsg(struct rsocket *rs, struct mmsghdr *msgvec,
+		       unsigned int vlen, int flags)
+{
+	struct ibv_send_wr wr[DS_MAX_BATCH];
+	struct ibv_sge sge[DS_MAX_BATCH];
+	const struct iovec *iov;
+	struct ds_qp *qp = NULL;
+	struct ds_dest *dest;
+	struct ds_smsg *smsg;
+	struct msghdr *msg;
+	unsigned int i, sent = 0;
+	size_t len, offset;
+	int n, cnt = 0, ret = 0;
+
+	for (i = 0; i < vlen; i++) {
+		msg = &msgvec[i].msg_hdr;
+		if (msg->msg_control && msg->msg_controllen) {
+			ret = ERR(ENOTSUP);
+			break;
+		}
+
+		if (msg->msg_name) {
+			if (!rs->conn_dest ||
+			    ds_compare_addr(msg->msg_name, &rs->conn_dest->addr)) {
+				ret = ds_get_dest(rs, msg->msg_name,
+						  msg->msg_namelen, &rs->conn_dest);
+				if (ret)
+					break;
+			}
+		} else if (!rs->conn_dest) {
+			ret = ERR(EDESTADDRREQ);
+			break;
+		}
+		dest = rs->conn_dest;
+
+		for (len = 0, n = 0; n < msg->msg_iovlen; n++)
+			len += msg->msg_iov[n].iov_len;
+
+		if (cnt && (!dest->ah || dest->qp != qp || cnt == DS_MAX_BATCH ||
+			    !ds_can_send(rs))) {
+			n = ds_post_send_list(rs, qp, wr, cnt);
+			sent += n;
+			if (n != cnt) {
+				ret = -1;
+				cnt = 0;
+				break;
+			}
+			cnt = 0;
+		}
+
+		if (!dest->ah) {
+			ret = ds_sendv_udp(rs, msg->msg_iov, msg->msg_iovlen,
+					   flags, RS_OP_DATA);
+			if (ret < 0)
+				break;
+			msgvec[i].msg_len = ret;
+			sent++;
+			continue;
+		}
+
+		if (len > RS_SNDLOWAT - dest->qp->hdr.length) {
+			ret = ERR(EMSGSIZE);
+			break;
+		}
+
+		if (!ds_can_send(rs)) {
+			ret = ds_get_comp(rs, rs_nonblocking(rs, flags),
+					  ds_can_send);
+			if (ret)
+				break;
+		}
+
+		smsg = ds_alloc_smsg(rs, dest);
+		memcpy((void *) smsg, &dest->qp->hdr, dest->qp->hdr.length);
+		iov = msg->msg_iov;
+		offset = 0;
+		rs_copy_iov((void *) smsg + dest->qp->hdr.length, &iov,
+			    &offset, len);
+
+		sge[cnt].addr = (uintptr_t) smsg;
+		sge[cnt].length = dest->qp->hdr.length + len;
+		sge[cnt].lkey = dest->qp->smr->lkey;
+		ds_init_send_wr(rs, dest, &wr[cnt], &sge[cnt],
+				(uint8_t *) smsg - rs->sbuf);
+		if (cnt)
+			wr[cnt - 1].next = &wr[cnt];
+		cnt++;
+		qp = dest->qp;
+		msgvec[i].msg_len = len;
+	}
+
+	if (cnt) {
+		n = ds_post_send_list(rs, qp, wr, cnt);
+		sent += n;
+		if (n != cnt)
+			ret = -1;
+	}
+	return sent ? sent : ret;
+}
+
+int rsendmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+	struct rsocket *rs;
+	unsigned int i;
+	ssize_t ret = 0;
+
+	rs = idm_at(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	if (rs->type == SOCK_DGRAM) {
+		if (rs->state == rs_init) {
+			ret = ds_init_ep(rs);
+			if (ret)
+				return ret;
+		}
+
+		fastlock_acquire(&rs->slock);
+		ret = ds_sendmmsg(rs, msgvec, vlen, flags);
+		fastlock_release(&rs->slock);
+		return ret;
+	}
+
+	for (i = 0; i < vlen; i++) {
+		ret = rsendmsg(socket, &msgvec[i].msg_hdr, flags);
+		if (ret < 0)
+			break;
+		msgvec[i].msg_len = ret;
+	}
+	return i ? i : ret;
+}
+
 ssize_t rwrite(int socket, const void *buf, size_t count)
 {
 	return rsend(socket, buf, count, 0);
@@ -3281,6 +4726,8 @@ static int rs_poll_arm(struct pollfd *rfds, struct pollfd *fds, nfds_t nfds)
 	for (i = 0; i < nfds; i++) {
 		rs = idm_lookup(&idm, fds[i].fd);
 		if (rs) {
+			if (rs->type == SOCK_STREAM && rs->cork_len)
+				rs_cork_push(rs);
 			fds[i].revents = rs_poll_rs(rs, fds[i].events, 0, rs_is_cq_armed);
 			if (fds[i].revents)
 				return 1;
@@ -3337,21 +4784,20 @@ static int rs_poll_events(struct pollfd *rfds, struct pollfd *fds, nfds_t nfds)
  */
 int rpoll(struct pollfd *fds, nfds_t nfds, int timeout)
 {
+	static __thread struct rs_poll_ctl rpoll_ctl;
 	struct pollfd *rfds;
 	uint64_t start_time = 0;
-	uint32_t poll_time;
+	uint32_t budget;
 	int pollsleep, ret;
 
 	do {
 		ret = rs_poll_check(fds, nfds);
-		if (ret || !timeout)
+		if (ret || !timeout) {
+			if (ret > 0)
+				rs_poll_done(&rpoll_ctl, start_time, true);
 			return ret;
-
-		if (!start_time)
-			start_time = rs_time_us();
-
-		poll_time = (uint32_t) (rs_time_us() - start_time);
-	} while (poll_time <= polling_time);
+		}
+	} while (rs_poll_continue(&rpoll_ctl, &start_time, &budget));
 
 	rfds = rs_fds_alloc(nfds);
 	if (!rfds)
@@ -3374,105 +4820,699 @@ int rpoll(struct pollfd *fds, nfds_t nfds, int timeout)
 			pollsleep = wake_up_interval;
 		}
 
-		ret = poll(rfds, nfds + 1, pollsleep);
-		if (ret < 0) {
-			rs_poll_exit();
-			break;
-		}
+		ret = poll(rfds, nfds + 1, pollsleep);
+		if (ret < 0) {
+			rs_poll_exit();
+			break;
+		}
+
+		ret = rs_poll_events(rfds, fds, nfds);
+		rs_poll_stop();
+	} while (!ret);
+
+	if (ret > 0)
+		rs_poll_done(&rpoll_ctl, start_time, false);
+	return ret;
+}
+
+static struct pollfd *
+rs_select_to_poll(int *nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds)
+{
+	struct pollfd *fds;
+	int fd, i = 0;
+
+	fds = calloc(*nfds, sizeof(*fds));
+	if (!fds)
+		return NULL;
+
+	for (fd = 0; fd < *nfds; fd++) {
+		if (readfds && FD_ISSET(fd, readfds)) {
+			fds[i].fd = fd;
+			fds[i].events = POLLIN;
+		}
+
+		if (writefds && FD_ISSET(fd, writefds)) {
+			fds[i].fd = fd;
+			fds[i].events |= POLLOUT;
+		}
+
+		if (exceptfds && FD_ISSET(fd, exceptfds))
+			fds[i].fd = fd;
+
+		if (fds[i].fd)
+			i++;
+	}
+
+	*nfds = i;
+	return fds;
+}
+
+static int
+rs_poll_to_select(int nfds, struct pollfd *fds, fd_set *readfds,
+		  fd_set *writefds, fd_set *exceptfds)
+{
+	int i, cnt = 0;
+
+	for (i = 0; i < nfds; i++) {
+		if (readfds && (fds[i].revents & (POLLIN | POLLHUP))) {
+			FD_SET(fds[i].fd, readfds);
+			cnt++;
+		}
+
+		if (writefds && (fds[i].revents & POLLOUT)) {
+			FD_SET(fds[i].fd, writefds);
+			cnt++;
+		}
+
+		if (exceptfds && (fds[i].revents & ~(POLLIN | POLLOUT))) {
+			FD_SET(fds[i].fd, exceptfds);
+			cnt++;
+		}
+	}
+	return cnt;
+}
+
+static int rs_convert_timeout(struct timeval *timeout)
+{
+	return !timeout ? -1 :
+		timeout->tv_sec * 1000 + timeout->tv_usec / 1000;
+}
+
+int rselect(int nfds, fd_set *readfds, fd_set *writefds,
+	    fd_set *exceptfds, struct timeval *timeout)
+{
+	struct pollfd *fds;
+	int ret;
+
+	fds = rs_select_to_poll(&nfds, readfds, writefds, exceptfds);
+	if (!fds)
+		return ERR(ENOMEM);
+
+	ret = rpoll(fds, nfds, rs_convert_timeout(timeout));
+
+	if (readfds)
+		FD_ZERO(readfds);
+	if (writefds)
+		FD_ZERO(writefds);
+	if (exceptfds)
+		FD_ZERO(exceptfds);
+
+	if (ret > 0)
+		ret = rs_poll_to_select(nfds, fds, readfds, writefds, exceptfds);
+
+	free(fds);
+	return ret;
+}
+
+/*
+ * repoll provides an epoll style interface over rsockets.  Unlike rpoll,
+ * the set of monitored fds persists across calls, so we avoid walking every
+ * fd on each wait.  Each rsocket is registered once with a kernel epoll fd
+ * through the fd that signals its activity (CQ channel, CM channel, or
+ * accept queue).  When that fd fires, the rsocket is placed on a ready list
+ * and only rsockets on the ready list are checked for events.
+ *
+ * Normal fds are handed directly to the kernel epoll fd.
+ */
+struct repoll_set;
+
+struct repoll_item {
+	dlist_entry	  ready_entry;
+	dlist_entry	  rs_entry;
+	struct repoll_set *set;
+	struct rsocket	  *rs;		/* NULL for normal fds */
+	struct epoll_event event;
+	int		  fd;
+	int		  wait_fd;
+	uint32_t	  comp_gen;
+	bool		  ready;
+	bool		  pending;
+	bool		  disabled;
+};
+
+/*
+ * A set is referenced by its entry in repoll_idm and by each thread in
+ * repoll_wait().  Closing the set frees its items and drops the first
+ * reference; the set itself and its epoll fd go away with the last one.
+ */
+struct repoll_set {
+	int		  epfd;
+	int		  refcnt;	/* protected by repoll_mut */
+	bool		  closed;
+	pthread_mutex_t	  lock;
+	dlist_entry	  ready_list;
+	struct index_map  items;
+	struct rs_poll_ctl poll_ctl;
+};
+
+static struct index_map repoll_idm;
+static pthread_mutex_t repoll_mut = PTHREAD_MUTEX_INITIALIZER;
+
+#define REPOLL_SIGNAL_FD (-1)
+#define REPOLL_MAX_EVENTS 64
+
+static int repoll_init(int epfd)
+{
+	struct repoll_set *set;
+	struct epoll_event event;
+	int ret;
+
+	rs_configure();
+	ret = rs_pollinit();
+	if (ret)
+		goto err1;
+
+	set = calloc(1, sizeof(*set));
+	if (!set) {
+		ret = ERR(ENOMEM);
+		goto err1;
+	}
+
+	set->epfd = epfd;
+	set->refcnt = 1;
+	pthread_mutex_init(&set->lock, NULL);
+	dlist_init(&set->ready_list);
+	rs_poll_ctl_init(&set->poll_ctl);
+
+	/* See rs_poll_stop: other pollers signal us when rsocket state changes */
+	event.events = EPOLLIN;
+	event.data.fd = REPOLL_SIGNAL_FD;
+	ret = epoll_ctl(epfd, EPOLL_CTL_ADD, pollsignal, &event);
+	if (ret)
+		goto err2;
+
+	pthread_mutex_lock(&repoll_mut);
+	ret = idm_set(&repoll_idm, epfd, set);
+	pthread_mutex_unlock(&repoll_mut);
+	if (ret < 0)
+		goto err2;
+
+	return epfd;
+
+err2:
+	pthread_mutex_destroy(&set->lock);
+	free(set);
+err1:
+	close(epfd);
+	return ret;
+}
+
+int repoll_create1(int flags)
+{
+	int epfd;
+
+	epfd = epoll_create1(flags);
+	if (epfd < 0)
+		return epfd;
+
+	return repoll_init(epfd);
+}
+
+int repoll_create(int size)
+{
+	if (size <= 0)
+		return ERR(EINVAL);
+
+	return repoll_create1(0);
+}
+
+static int rs_poll_fd(struct rsocket *rs)
+{
+	if (rs->type == SOCK_DGRAM)
+		return rs->epfd;
+	if (rs->state == rs_listening)
+		return rs->accept_queue[0];
+	if (rs->state >= rs_connected && rs->cm_id->recv_cq_channel)
+		return rs->cm_id->recv_cq_channel->fd;
+	return rs->cm_id->channel->fd;
+}
+
+/*
+ * The fd that signals rsocket activity changes as the rsocket moves
+ * through connection states.  Track it in the kernel epoll set.
+ */
+static void repoll_update_wait_fd(struct repoll_item *item)
+{
+	struct epoll_event event;
+	int fd;
+
+	fd = rs_poll_fd(item->rs);
+	if (fd == item->wait_fd)
+		return;
+
+	if (item->wait_fd >= 0)
+		epoll_ctl(item->set->epfd, EPOLL_CTL_DEL, item->wait_fd, NULL);
+
+	/* The accept queue is not drained by us, so honor edge triggering */
+	event.events = EPOLLIN;
+	if (item->rs->type == SOCK_STREAM && fd == item->rs->accept_queue[0])
+		event.events |= item->event.events & EPOLLET;
+	event.data.fd = item->fd;
+	item->wait_fd = epoll_ctl(item->set->epfd, EPOLL_CTL_ADD, fd, &event) ?
+			-1 : fd;
+}
+
+static void repoll_queue(struct repoll_item *item)
+{
+	if (item->ready || item->disabled)
+		return;
+
+	dlist_insert_tail(&item->ready_entry, &item->set->ready_list);
+	item->ready = true;
+}
+
+static void repoll_set_ready(struct repoll_item *item)
+{
+	item->pending = true;
+	repoll_queue(item);
+}
+
+static void repoll_clear_ready(struct repoll_item *item)
+{
+	if (!item->ready)
+		return;
+
+	dlist_remove(&item->ready_entry);
+	item->ready = false;
+}
+
+static void repoll_free_item(struct repoll_item *item)
+{
+	repoll_clear_ready(item);
+	idm_clear(&item->set->items, item->fd);
+	if (item->rs) {
+		if (item->wait_fd >= 0)
+			epoll_ctl(item->set->epfd, EPOLL_CTL_DEL,
+				  item->wait_fd, NULL);
+		dlist_remove(&item->rs_entry);
+	} else {
+		epoll_ctl(item->set->epfd, EPOLL_CTL_DEL, item->fd, NULL);
+	}
+	free(item);
+}
+
+static int repoll_add(struct repoll_set *set, int fd, struct epoll_event *event)
+{
+	struct repoll_item *item;
+	struct epoll_event kevent;
+	int ret;
+
+	if (idm_lookup(&set->items, fd))
+		return ERR(EEXIST);
+
+	item = calloc(1, sizeof(*item));
+	if (!item)
+		return ERR(ENOMEM);
+
+	item->set = set;
+	item->fd = fd;
+	item->wait_fd = -1;
+	item->event = *event;
+	item->rs = idm_lookup(&idm, fd);
+	if (!item->rs) {
+		kevent.events = event->events;
+		kevent.data.fd = fd;
+		ret = epoll_ctl(set->epfd, EPOLL_CTL_ADD, fd, &kevent);
+		if (ret)
+			goto err;
+	}
+
+	ret = idm_set(&set->items, fd, item);
+	if (ret < 0) {
+		if (!item->rs)
+			epoll_ctl(set->epfd, EPOLL_CTL_DEL, fd, NULL);
+		goto err;
+	}
+
+	if (item->rs) {
+		dlist_insert_tail(&item->rs_entry, &item->rs->repoll_list);
+		repoll_update_wait_fd(item);
+		repoll_set_ready(item);
+	}
+	return 0;
+
+err:
+	free(item);
+	return ret;
+}
+
+static int repoll_mod(struct repoll_set *set, int fd, struct epoll_event *event)
+{
+	struct repoll_item *item;
+	struct epoll_event kevent;
+
+	item = idm_lookup(&set->items, fd);
+	if (!item)
+		return ERR(ENOENT);
+
+	item->event = *event;
+	item->disabled = false;
+	if (!item->rs) {
+		kevent.events = event->events;
+		kevent.data.fd = fd;
+		return epoll_ctl(set->epfd, EPOLL_CTL_MOD, fd, &kevent);
+	}
+
+	if (item->wait_fd >= 0) {
+		epoll_ctl(set->epfd, EPOLL_CTL_DEL, item->wait_fd, NULL);
+		item->wait_fd = -1;
+	}
+	repoll_update_wait_fd(item);
+	repoll_set_ready(item);
+	return 0;
+}
+
+int repoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+	struct repoll_set *set;
+	struct repoll_item *item;
+	int ret;
+
+	if (op != EPOLL_CTL_DEL && !event)
+		return ERR(EFAULT);
+
+	pthread_mutex_lock(&repoll_mut);
+	set = idm_lookup(&repoll_idm, epfd);
+	if (!set) {
+		ret = ERR(EBADF);
+		goto out;
+	}
+
+	pthread_mutex_lock(&set->lock);
+	switch (op) {
+	case EPOLL_CTL_ADD:
+		ret = repoll_add(set, fd, event);
+		break;
+	case EPOLL_CTL_MOD:
+		ret = repoll_mod(set, fd, event);
+		break;
+	case EPOLL_CTL_DEL:
+		item = idm_lookup(&set->items, fd);
+		if (item) {
+			repoll_free_item(item);
+			ret = 0;
+		} else {
+			ret = ERR(ENOENT);
+		}
+		break;
+	default:
+		ret = ERR(EINVAL);
+		break;
+	}
+	pthread_mutex_unlock(&set->lock);
+out:
+	pthread_mutex_unlock(&repoll_mut);
+	return ret;
+}
+
+/* Called when an rsocket is closed */
+static void repoll_remove_rs(struct rsocket *rs)
+{
+	struct repoll_item *item;
+	struct repoll_set *set;
+
+	pthread_mutex_lock(&repoll_mut);
+	while (!dlist_empty(&rs->repoll_list)) {
+		item = container_of(rs->repoll_list.next,
+				    struct repoll_item, rs_entry);
+		set = item->set;
+		pthread_mutex_lock(&set->lock);
+		repoll_free_item(item);
+		pthread_mutex_unlock(&set->lock);
+	}
+	pthread_mutex_unlock(&repoll_mut);
+}
+
+static struct repoll_set *repoll_get(int epfd)
+{
+	struct repoll_set *set;
+
+	pthread_mutex_lock(&repoll_mut);
+	set = idm_lookup(&repoll_idm, epfd);
+	if (set)
+		set->refcnt++;
+	pthread_mutex_unlock(&repoll_mut);
+	return set;
+}
+
+static int repoll_put(struct repoll_set *set)
+{
+	int epfd, refcnt;
+
+	pthread_mutex_lock(&repoll_mut);
+	refcnt = --set->refcnt;
+	pthread_mutex_unlock(&repoll_mut);
+	if (refcnt)
+		return 0;
+
+	epfd = set->epfd;
+	idm_cleanup(&set->items);
+	pthread_mutex_destroy(&set->lock);
+	free(set);
+	return close(epfd);
+}
+
+static int repoll_close(int epfd)
+{
+	struct repoll_set *set;
+	struct repoll_item *item;
+	int i;
+
+	pthread_mutex_lock(&repoll_mut);
+	set = idm_lookup(&repoll_idm, epfd);
+	if (!set) {
+		pthread_mutex_unlock(&repoll_mut);
+		return ERR(EBADF);
+	}
+	idm_clear(&repoll_idm, epfd);
+
+	pthread_mutex_lock(&set->lock);
+	for (i = 0; (item = idm_next(&set->items, &i)); i++)
+		repoll_free_item(item);
+	set->closed = true;
+	pthread_mutex_unlock(&set->lock);
+	pthread_mutex_unlock(&repoll_mut);
+
+	/* Threads blocked in repoll_wait() on the set see it closed and leave */
+	rs_poll_signal();
+	return repoll_put(set);
+}
+
+/*
+ * Process any activity on the rsocket and determine whether the item
+ * should be reported.  Edge triggered items are reported only if something
+ * happened on the rsocket since they were last reported.
+ */
+static uint32_t repoll_check_item(struct repoll_item *item, int arm)
+{
+	struct rsocket *rs = item->rs;
+	uint32_t revents;
+
+	if (arm && rs->type == SOCK_STREAM && rs->cork_len)
+		rs_cork_push(rs);
+
+	revents = rs_poll_rs(rs, item->event.events & (POLLIN | POLLOUT),
+			     !arm, arm ? rs_is_cq_armed : rs_poll_all);
+	repoll_update_wait_fd(item);
 
-		ret = rs_poll_events(rfds, fds, nfds);
-		rs_poll_stop();
-	} while (!ret);
+	if ((item->event.events & EPOLLET) && !item->pending &&
+	    item->comp_gen == rs->comp_gen)
+		return 0;
 
-	return ret;
+	return revents;
 }
 
-static struct pollfd *
-rs_select_to_poll(int *nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds)
+/*
+ * Walk the ready list once, reporting items with events.  Level triggered
+ * items which reported an event stay on the ready list and are rotated to
+ * the back for fairness.  When arming, items without events are removed
+ * from the ready list, to be put back when their wait fd signals.
+ */
+static int repoll_check_ready(struct repoll_set *set, struct epoll_event *events,
+			      int maxevents, int cnt, int arm)
 {
-	struct pollfd *fds;
-	int fd, i = 0;
+	struct repoll_item *item;
+	dlist_entry *entry, *last;
+	uint32_t revents;
 
-	fds = calloc(*nfds, sizeof(*fds));
-	if (!fds)
-		return NULL;
+	if (dlist_empty(&set->ready_list))
+		return cnt;
 
-	for (fd = 0; fd < *nfds; fd++) {
-		if (readfds && FD_ISSET(fd, readfds)) {
-			fds[i].fd = fd;
-			fds[i].events = POLLIN;
+	last = set->ready_list.prev;
+	do {
+		entry = set->ready_list.next;
+		item = container_of(entry, struct repoll_item, ready_entry);
+		repoll_clear_ready(item);
+
+		revents = repoll_check_item(item, arm);
+		item->pending = false;
+		if (revents) {
+			events[cnt].events = revents;
+			events[cnt++].data = item->event.data;
+			item->comp_gen = item->rs->comp_gen;
+			if (item->event.events & EPOLLONESHOT)
+				item->disabled = true;
+			else if (!arm || !(item->event.events & EPOLLET))
+				repoll_queue(item);
+		} else if (!arm) {
+			repoll_queue(item);
 		}
+	} while (entry != last && cnt < maxevents);
 
-		if (writefds && FD_ISSET(fd, writefds)) {
-			fds[i].fd = fd;
-			fds[i].events |= POLLOUT;
-		}
+	return cnt;
+}
 
-		if (exceptfds && FD_ISSET(fd, exceptfds))
-			fds[i].fd = fd;
+static int repoll_check(struct repoll_set *set, struct epoll_event *events,
+			int maxevents, int arm)
+{
+	int cnt;
 
-		if (fds[i].fd)
-			i++;
-	}
+	pthread_mutex_lock(&set->lock);
+	if (set->closed)
+		cnt = ERR(EBADF);
+	else
+		cnt = repoll_check_ready(set, events, maxevents, 0, arm);
+	pthread_mutex_unlock(&set->lock);
+	return cnt;
+}
 
-	*nfds = i;
-	return fds;
+static void repoll_rescan(struct repoll_set *set, bool cm_only)
+{
+	struct repoll_item *item;
+	int i;
+
+	for (i = 0; (item = idm_next(&set->items, &i)); i++) {
+		if (!item->rs)
+			continue;
+
+		if (!cm_only || (item->rs->type == SOCK_STREAM &&
+		    item->wait_fd == item->rs->cm_id->channel->fd))
+			repoll_set_ready(item);
+	}
 }
 
-static int
-rs_poll_to_select(int nfds, struct pollfd *fds, fd_set *readfds,
-		  fd_set *writefds, fd_set *exceptfds)
+/*
+ * Translate kernel events into user events.  Normal fds are reported
+ * directly.  For rsockets, we retrieve the CQ event, which rearms the wait
+ * fd, and mark the rsocket as ready for checking.
+ */
+static int repoll_events(struct repoll_set *set, struct epoll_event *kevents,
+			 int nevents, struct epoll_event *events, int maxevents,
+			 bool rescan)
 {
+	struct repoll_item *item;
+	struct rsocket *rs;
 	int i, cnt = 0;
 
-	for (i = 0; i < nfds; i++) {
-		if (readfds && (fds[i].revents & (POLLIN | POLLHUP))) {
-			FD_SET(fds[i].fd, readfds);
-			cnt++;
+	pthread_mutex_lock(&set->lock);
+	if (set->closed) {
+		pthread_mutex_unlock(&set->lock);
+		return ERR(EBADF);
+	}
+
+	if (rescan)
+		repoll_rescan(set, false);
+
+	for (i = 0; i < nevents; i++) {
+		if (kevents[i].data.fd == REPOLL_SIGNAL_FD) {
+			repoll_rescan(set, true);
+			continue;
 		}
 
-		if (writefds && (fds[i].revents & POLLOUT)) {
-			FD_SET(fds[i].fd, writefds);
-			cnt++;
+		item = idm_lookup(&set->items, kevents[i].data.fd);
+		if (!item || item->disabled)
+			continue;
+
+		if (!item->rs) {
+			events[cnt].events = kevents[i].events;
+			events[cnt++].data = item->event.data;
+			if (item->event.events & EPOLLONESHOT)
+				item->disabled = true;
+			continue;
 		}
 
-		if (exceptfds && (fds[i].revents & ~(POLLIN | POLLOUT))) {
-			FD_SET(fds[i].fd, exceptfds);
-			cnt++;
+		rs = item->rs;
+		if (rs->type != SOCK_STREAM ||
+		    item->wait_fd != rs->accept_queue[0]) {
+			fastlock_acquire(&rs->cq_wait_lock);
+			if (rs->type == SOCK_STREAM)
+				rs_get_cq_event(rs);
+			else
+				ds_get_cq_event(rs);
+			fastlock_release(&rs->cq_wait_lock);
 		}
+		repoll_set_ready(item);
 	}
+
+	cnt = repoll_check_ready(set, events, maxevents, cnt, 0);
+	pthread_mutex_unlock(&set->lock);
 	return cnt;
 }
 
-static int rs_convert_timeout(struct timeval *timeout)
+int repoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
 {
-	return !timeout ? -1 :
-		timeout->tv_sec * 1000 + timeout->tv_usec / 1000;
-}
+	struct epoll_event kevents[REPOLL_MAX_EVENTS];
+	struct repoll_set *set;
+	uint64_t start_time = 0;
+	uint32_t budget;
+	int pollsleep, ret;
 
-int rselect(int nfds, fd_set *readfds, fd_set *writefds,
-	    fd_set *exceptfds, struct timeval *timeout)
-{
-	struct pollfd *fds;
-	int ret;
+	if (maxevents <= 0)
+		return ERR(EINVAL);
 
-	fds = rs_select_to_poll(&nfds, readfds, writefds, exceptfds);
-	if (!fds)
-		return ERR(ENOMEM);
+	set = repoll_get(epfd);
+	if (!set)
+		return ERR(EBADF);
 
-	ret = rpoll(fds, nfds, rs_convert_timeout(timeout));
+	do {
+		ret = repoll_check(set, events, maxevents, 0);
+		if (ret || !timeout) {
+			if (ret > 0)
+				rs_poll_done(&set->poll_ctl, start_time, true);
+			goto out;
+		}
+	} while (rs_poll_continue(&set->poll_ctl, &start_time, &budget));
 
-	if (readfds)
-		FD_ZERO(readfds);
-	if (writefds)
-		FD_ZERO(writefds);
-	if (exceptfds)
-		FD_ZERO(exceptfds);
+	do {
+		ret = repoll_check(set, events, maxevents, 1);
+		if (ret)
+			break;
 
-	if (ret > 0)
-		ret = rs_poll_to_select(nfds, fds, readfds, writefds, exceptfds);
+		if (timeout >= 0) {
+			pollsleep = timeout -
+				    (int) ((rs_time_us() - start_time) / 1000);
+			if (pollsleep <= 0) {
+				ret = 0;
+				goto out;
+			}
+			pollsleep = min(pollsleep, wake_up_interval);
+		} else {
+			pollsleep = wake_up_interval;
+		}
 
-	free(fds);
+		if (rs_poll_enter())
+			continue;
+
+		ret = epoll_wait(epfd, kevents, min(maxevents, REPOLL_MAX_EVENTS),
+				 pollsleep);
+		if (ret < 0) {
+			rs_poll_exit();
+			break;
+		}
+
+		/*
+		 * Guard against missed wake ups the same way rpoll does: if
+		 * we sleep for a full wake_up_interval, recheck every rsocket.
+		 */
+		ret = repoll_events(set, kevents, ret, events, maxevents,
+				    !ret && pollsleep == wake_up_interval);
+		rs_poll_stop();
+	} while (!ret);
+
+	if (ret > 0)
+		rs_poll_done(&set->poll_ctl, start_time, false);
+out:
+	repoll_put(set);
 	return ret;
 }
 
@@ -3490,11 +5530,18 @@ int rshutdown(int socket, int how)
 	if (!rs)
 		return ERR(EBADF);
 	if (rs->opts & RS_OPT_KEEPALIVE)
-		rs_notify_svc(&tcp_svc, rs, RS_SVC_REM_KEEPALIVE);
+		rs_notify_svc(tcp_svc, rs, RS_SVC_REM_KEEPALIVE);
 
 	if (rs->fd_flags & O_NONBLOCK)
 		rs_set_nonblocking(rs, 0);
 
+	if (rs->type == SOCK_STREAM && rs->cork_len &&
+	    (rs->state & rs_writable) && how != SHUT_RD) {
+		fastlock_acquire(&rs->slock);
+		rs_cork_flush(rs, 0);
+		fastlock_release(&rs->slock);
+	}
+
 	if (rs->state & rs_connected) {
 		if (how == SHUT_RDWR) {
 			ctrl = RS_CTRL_DISCONNECT;
@@ -3540,7 +5587,7 @@ out:
 static void ds_shutdown(struct rsocket *rs)
 {
 	if (rs->opts & RS_OPT_UDP_SVC)
-		rs_notify_svc(&udp_svc, rs, RS_SVC_REM_DGRAM);
+		rs_notify_svc(udp_svc, rs, RS_SVC_REM_DGRAM);
 
 	if (rs->fd_flags & O_NONBLOCK)
 		rs_set_nonblocking(rs, 0);
@@ -3558,16 +5605,23 @@ int rclose(int socket)
 
 	rs = idm_lookup(&idm, socket);
 	if (!rs)
-		return EBADF;
+		return idm_lookup(&repoll_idm, socket) ?
+		       repoll_close(socket) : ERR(EBADF);
+
+	if (!dlist_empty(&rs->repoll_list))
+		repoll_remove_rs(rs);
+
 	if (rs->type == SOCK_STREAM) {
 		if (rs->state & rs_connected)
 			rshutdown(socket, SHUT_RDWR);
 		if (rs->opts & RS_OPT_KEEPALIVE)
-			rs_notify_svc(&tcp_svc, rs, RS_SVC_REM_KEEPALIVE);
+			rs_notify_svc(tcp_svc, rs, RS_SVC_REM_KEEPALIVE);
+		if (atomic_load(&rs->cork_svc))
+			rs_notify_svc(tcp_svc, rs, RS_SVC_REM_CORK);
 		if (rs->opts & RS_OPT_CM_SVC && rs->state == rs_listening)
-			rs_notify_svc(&listen_svc, rs, RS_SVC_REM_CM);
+			rs_notify_svc(listen_svc, rs, RS_SVC_REM_CM);
 		if (rs->opts & RS_OPT_CM_SVC)
-			rs_notify_svc(&connect_svc, rs, RS_SVC_REM_CM);
+			rs_notify_svc(connect_svc, rs, RS_SVC_REM_CM);
 	} else {
 		ds_shutdown(rs);
 	}
@@ -3639,9 +5693,9 @@ static int rs_set_keepalive(struct rsocket *rs, int on)
 				rs->keepalive_time = 7200;
 			}
 		}
-		ret = rs_notify_svc(&tcp_svc, rs, RS_SVC_ADD_KEEPALIVE);
+		ret = rs_notify_svc(tcp_svc, rs, RS_SVC_ADD_KEEPALIVE);
 	} else {
-		ret = rs_notify_svc(&tcp_svc, rs, RS_SVC_REM_KEEPALIVE);
+		ret = rs_notify_svc(tcp_svc, rs, RS_SVC_REM_KEEPALIVE);
 	}
 
 	return ret;
@@ -3684,11 +5738,15 @@ int rsetsockopt(int socket, int level, int optname,
 			if ((rs->type == SOCK_STREAM && !rs->rbuf) ||
 			    (rs->type == SOCK_DGRAM && !rs->qp_list))
 				rs->rbuf_size = (*(uint32_t *) optval) << 1;
+			if (!rs->rbuf)
+				rs->opts &= ~RS_OPT_RBUF_TUNE;
 			ret = 0;
 			break;
 		case SO_SNDBUF:
-			if (!rs->sbuf)
+			if (!rs->sbuf) {
 				rs->sbuf_size = (*(uint32_t *) optval) << 1;
+				rs->opts &= ~RS_OPT_SBUF_TUNE;
+			}
 			if (rs->sbuf_size < RS_SNDLOWAT)
 				rs->sbuf_size = RS_SNDLOWAT << 1;
 			ret = 0;
@@ -3724,9 +5782,10 @@ int rsetsockopt(int socket, int level, int optname,
 			}
 			rs->keepalive_time = *(int *) optval;
 			ret = (rs->opts & RS_OPT_KEEPALIVE) ?
-			      rs_notify_svc(&tcp_svc, rs, RS_SVC_MOD_KEEPALIVE) : 0;
+			      rs_notify_svc(tcp_svc, rs, RS_SVC_MOD_KEEPALIVE) : 0;
 			break;
 		case TCP_NODELAY:
+		case TCP_CORK:
 			opt_on = *(int *) optval;
 			ret = 0;
 			break;
@@ -3779,6 +5838,14 @@ int rsetsockopt(int socket, int level, int optname,
 				(uint8_t) rs_value_to_scale(*(int *) optval, 8), 8);
 			ret = 0;
 			break;
+		case RDMA_ZCOPY_THRESHOLD:
+			if (rs->type != SOCK_STREAM) {
+				ret = ERR(EINVAL);
+				break;
+			}
+			rs->zcopy_threshold = *(uint32_t *) optval;
+			ret = 0;
+			break;
 		case RDMA_ROUTE:
 			if ((rs->optval = malloc(optlen))) {
 				memcpy(rs->optval, optval, optlen);
@@ -3803,6 +5870,10 @@ int rsetsockopt(int socket, int level, int optname,
 			*opts &= ~(1 << optname);
 	}
 
+	if (!ret && level == IPPROTO_TCP &&
+	    (optname == TCP_NODELAY || optname == TCP_CORK))
+		rs_set_cork(rs, optname == TCP_NODELAY && opt_on);
+
 	return ret;
 }
 
@@ -3835,6 +5906,7 @@ int rgetsockopt(int socket, int level, int optname,
 	void *opt;
 	struct ibv_sa_path_rec *path_rec;
 	struct ibv_path_data path_data;
+	struct rdma_poll_stats *stats;
 	socklen_t len;
 	int ret = 0;
 	int num_paths;
@@ -3887,6 +5959,7 @@ int rgetsockopt(int socket, int level, int optname,
 			*optlen = sizeof(int);
 			break;
 		case TCP_NODELAY:
+		case TCP_CORK:
 			*((int *) optval) = !!(rs->tcp_opts & (1 << optname));
 			*optlen = sizeof(int);
 			break;
@@ -3930,6 +6003,25 @@ int rgetsockopt(int socket, int level, int optname,
 			*((int *) optval) = rs->target_iomap_size;
 			*optlen = sizeof(int);
 			break;
+		case RDMA_ZCOPY_THRESHOLD:
+			*((int *) optval) = (rs->type == SOCK_STREAM) ?
+					    rs->zcopy_threshold : 0;
+			*optlen = sizeof(int);
+			break;
+		case RDMA_POLL_STATS:
+			if (*optlen < sizeof(struct rdma_poll_stats)) {
+				ret = EINVAL;
+				break;
+			}
+			stats = optval;
+			stats->spin_wakeups = rs->poll_ctl.spin_wakeups;
+			stats->yield_wakeups = rs->poll_ctl.yield_wakeups;
+			stats->sleep_wakeups = rs->poll_ctl.sleep_wakeups;
+			stats->poll_usecs = rs->poll_ctl.poll_usecs;
+			stats->wait_usecs = rs->poll_ctl.wait;
+			stats->poll_budget = rs_poll_budget(&rs->poll_ctl);
+			*optlen = sizeof(struct rdma_poll_stats);
+			break;
 		case RDMA_ROUTE:
 			if (rs->optval) {
 				if (*optlen < rs->optlen) {
@@ -4144,6 +6236,10 @@ size_t riowrite(int socket, const void *buf, size_t count, off_t offset, int fla
 		if (ret)
 			goto out;
 	}
+	ret = rs_cork_flush(rs, rs_nonblocking(rs, flags));
+	if (ret)
+		goto out;
+
 	for (; left; left -= xfer_size, buf += xfer_size, offset += xfer_size) {
 		if (!iom || offset > iom->offset + iom->sge.length) {
 			iom = rs_find_iomap(rs, offset);
@@ -4235,31 +6331,30 @@ static int rs_svc_grow_sets(struct rs_svc *svc, int grow_size)
 }
 
 /*
- * Index 0 is reserved for the service's communication socket.
+ * Index 0 is reserved for the service's communication socket.  Each
+ * rsocket records its position in the set, so it can be removed without
+ * searching.
  */
 static int rs_svc_add_rs(struct rs_svc *svc, struct rsocket *rs)
 {
 	int ret;
 
 	if (svc->cnt >= svc->size - 1) {
-		ret = rs_svc_grow_sets(svc, 4);
+		ret = rs_svc_grow_sets(svc, svc->size < 64 ? 4 : svc->size / 2);
 		if (ret)
 			return ret;
 	}
 
 	svc->rss[++svc->cnt] = rs;
+	rs->svc_index[svc->type] = svc->cnt;
 	return 0;
 }
 
 static int rs_svc_index(struct rs_svc *svc, struct rsocket *rs)
 {
-	int i;
+	int i = rs->svc_index[svc->type];
 
-	for (i = 1; i <= svc->cnt; i++) {
-		if (svc->rss[i] == rs)
-			return i;
-	}
-	return -1;
+	return (i > 0 && i <= svc->cnt && svc->rss[i] == rs) ? i : -1;
 }
 
 static int rs_svc_rm_rs(struct rs_svc *svc, struct rsocket *rs)
@@ -4268,10 +6363,12 @@ static int rs_svc_rm_rs(struct rs_svc *svc, struct rsocket *rs)
 
 	if ((i = rs_svc_index(svc, rs)) >= 0) {
 		svc->rss[i] = svc->rss[svc->cnt];
+		svc->rss[i]->svc_index[svc->type] = i;
 		memcpy(svc->contexts + i * svc->context_size,
 		       svc->contexts + svc->cnt * svc->context_size,
 		       svc->context_size);
 		svc->cnt--;
+		rs->svc_index[svc->type] = 0;
 		return 0;
 	}
 	return EBADF;
@@ -4280,6 +6377,7 @@ static int rs_svc_rm_rs(struct rs_svc *svc, struct rsocket *rs)
 static void udp_svc_process_sock(struct rs_svc *svc)
 {
 	struct rs_svc_msg msg;
+	struct pollfd *fds;
 
 	read_all(svc->sock[1], &msg, sizeof msg);
 	switch (msg.cmd) {
@@ -4287,10 +6385,10 @@ static void udp_svc_process_sock(struct rs_svc *svc)
 		msg.status = rs_svc_add_rs(svc, msg.rs);
 		if (!msg.status) {
 			msg.rs->opts |= RS_OPT_UDP_SVC;
-			udp_svc_fds = svc->contexts;
-			udp_svc_fds[svc->cnt].fd = msg.rs->udp_sock;
-			udp_svc_fds[svc->cnt].events = POLLIN;
-			udp_svc_fds[svc->cnt].revents = 0;
+			fds = svc->contexts;
+			fds[svc->cnt].fd = msg.rs->udp_sock;
+			fds[svc->cnt].events = POLLIN;
+			fds[svc->cnt].revents = 0;
 		}
 		break;
 	case RS_SVC_REM_DGRAM:
@@ -4409,10 +6507,7 @@ static void udp_svc_forward(struct rsocket *rs, void *buf, size_t len,
 			return;
 	}
 
-	msg = rs->smsg_free;
-	rs->smsg_free = msg->next;
-	rs->sqe_avail--;
-
+	msg = ds_alloc_smsg(rs, rs->conn_dest);
 	ds_format_hdr(&hdr, src);
 	memcpy((void *) msg, &hdr, hdr.length);
 	memcpy((void *) msg + hdr.length, buf, len);
@@ -4426,8 +6521,8 @@ static void udp_svc_forward(struct rsocket *rs, void *buf, size_t len,
 
 static void udp_svc_process_rs(struct rsocket *rs)
 {
-	static uint8_t buf[RS_SNDLOWAT];
-	struct ds_dest *dest, *cur_dest;
+	uint8_t buf[RS_SNDLOWAT];
+	struct ds_dest *dest = NULL, *cur_dest;
 	struct ds_udp_header *udp_hdr;
 	union socket_addr addr;
 	socklen_t addrlen = sizeof addr;
@@ -4473,12 +6568,14 @@ static void udp_svc_process_rs(struct rsocket *rs)
 		rs->conn_dest = cur_dest;
 		fastlock_release(&rs->slock);
 	}
+	ds_put_dest(dest);
 }
 
 static void *udp_svc_run(void *arg)
 {
 	struct rs_svc *svc = arg;
 	struct rs_svc_msg msg;
+	struct pollfd *fds;
 	int i, ret;
 
 	ret = rs_svc_grow_sets(svc, 4);
@@ -4488,19 +6585,21 @@ static void *udp_svc_run(void *arg)
 		return (void *) (uintptr_t) ret;
 	}
 
-	udp_svc_fds = svc->contexts;
-	udp_svc_fds[0].fd = svc->sock[1];
-	udp_svc_fds[0].events = POLLIN;
+	fds = svc->contexts;
+	fds[0].fd = svc->sock[1];
+	fds[0].events = POLLIN;
 	do {
 		for (i = 0; i <= svc->cnt; i++)
-			udp_svc_fds[i].revents = 0;
+			fds[i].revents = 0;
 
-		poll(udp_svc_fds, svc->cnt + 1, -1);
-		if (udp_svc_fds[0].revents)
+		poll(fds, svc->cnt + 1, -1);
+		if (fds[0].revents) {
 			udp_svc_process_sock(svc);
+			fds = svc->contexts;
+		}
 
 		for (i = 1; i <= svc->cnt; i++) {
-			if (udp_svc_fds[i].revents)
+			if (fds[i].revents)
 				udp_svc_process_rs(svc->rss[i]);
 		}
 	} while (svc->cnt >= 1);
@@ -4513,31 +6612,85 @@ static uint64_t rs_get_time(void)
 	return rs_time_us() / 1000000;
 }
 
+/*
+ * Keepalive deadlines are kept in a hashed timer wheel with one second
+ * slots.  Deadlines further out than the size of the wheel remain in their
+ * slot and are skipped until the wheel comes back around to them.
+ */
+static void tcp_svc_schedule(struct rs_svc *svc, struct rsocket *rs,
+			     uint64_t now)
+{
+	rs->keepalive_deadline = now + max(rs->keepalive_time, 1U);
+	dlist_insert_tail(&rs->keepalive_entry,
+			  &svc->wheel[rs->keepalive_deadline &
+				      (RS_SVC_WHEEL_SIZE - 1)]);
+}
+
+/*
+ * An rsocket is in the tcp service set while it uses keepalives or is
+ * corked, or both.
+ */
+static int tcp_svc_add_rs(struct rs_svc *svc, struct rsocket *rs)
+{
+	return rs_svc_index(svc, rs) >= 0 ? 0 : rs_svc_add_rs(svc, rs);
+}
+
+static int tcp_svc_rm_rs(struct rs_svc *svc, struct rsocket *rs)
+{
+	return ((rs->opts & RS_OPT_KEEPALIVE) || atomic_load(&rs->cork_svc)) ?
+	       0 : rs_svc_rm_rs(svc, rs);
+}
+
 static void tcp_svc_process_sock(struct rs_svc *svc)
 {
 	struct rs_svc_msg msg;
-	int i;
 
 	read_all(svc->sock[1], &msg, sizeof msg);
 	switch (msg.cmd) {
 	case RS_SVC_ADD_KEEPALIVE:
-		msg.status = rs_svc_add_rs(svc, msg.rs);
+		if (msg.rs->opts & RS_OPT_KEEPALIVE) {
+			msg.status = 0;
+			break;
+		}
+		msg.status = tcp_svc_add_rs(svc, msg.rs);
 		if (!msg.status) {
 			msg.rs->opts |= RS_OPT_KEEPALIVE;
-			tcp_svc_timeouts = svc->contexts;
-			tcp_svc_timeouts[svc->cnt] = rs_get_time() +
-						     msg.rs->keepalive_time;
+			tcp_svc_schedule(svc, msg.rs, rs_get_time());
 		}
 		break;
 	case RS_SVC_REM_KEEPALIVE:
-		msg.status = rs_svc_rm_rs(svc, msg.rs);
-		if (!msg.status)
-			msg.rs->opts &= ~RS_OPT_KEEPALIVE;
+		if (!(msg.rs->opts & RS_OPT_KEEPALIVE)) {
+			msg.status = EBADF;
+			break;
+		}
+		msg.rs->opts &= ~RS_OPT_KEEPALIVE;
+		dlist_remove(&msg.rs->keepalive_entry);
+		msg.status = tcp_svc_rm_rs(svc, msg.rs);
+		break;
+	case RS_SVC_ADD_CORK:
+		if (atomic_load(&msg.rs->cork_svc)) {
+			msg.status = 0;
+			break;
+		}
+		msg.status = tcp_svc_add_rs(svc, msg.rs);
+		if (!msg.status) {
+			atomic_store(&msg.rs->cork_svc, true);
+			dlist_insert_tail(&msg.rs->cork_entry, &svc->cork_list);
+		}
+		break;
+	case RS_SVC_REM_CORK:
+		if (!atomic_load(&msg.rs->cork_svc)) {
+			msg.status = EBADF;
+			break;
+		}
+		atomic_store(&msg.rs->cork_svc, false);
+		dlist_remove(&msg.rs->cork_entry);
+		msg.status = tcp_svc_rm_rs(svc, msg.rs);
 		break;
 	case RS_SVC_MOD_KEEPALIVE:
-		i = rs_svc_index(svc, msg.rs);
-		if (i >= 0) {
-			tcp_svc_timeouts[i] = rs_get_time() + msg.rs->keepalive_time;
+		if (rs_svc_index(svc, msg.rs) >= 0) {
+			dlist_remove(&msg.rs->keepalive_entry);
+			tcp_svc_schedule(svc, msg.rs, rs_get_time());
 			msg.status = 0;
 		} else {
 			msg.status = EBADF;
@@ -4567,44 +6720,152 @@ static void tcp_svc_send_keepalive(struct rsocket *rs)
 	fastlock_release(&rs->cq_lock);
 }	
 
+/*
+ * Send keepalives for all expired deadlines.  Returns the number of
+ * seconds until the next occupied wheel slot, or -1 if the wheel is empty.
+ */
+static int tcp_svc_expire(struct rs_svc *svc)
+{
+	dlist_entry *slot, *entry, *next;
+	struct rsocket *rs;
+	uint64_t now;
+	int i;
+
+	now = rs_get_time();
+	if (svc->wheel_time + RS_SVC_WHEEL_SIZE < now)
+		svc->wheel_time = now - RS_SVC_WHEEL_SIZE;
+
+	for (; svc->wheel_time <= now; svc->wheel_time++) {
+		slot = &svc->wheel[svc->wheel_time & (RS_SVC_WHEEL_SIZE - 1)];
+		for (entry = slot->next; entry != slot; entry = next) {
+			next = entry->next;
+			rs = container_of(entry, struct rsocket, keepalive_entry);
+			if (rs->keepalive_deadline > now)
+				continue;
+
+			tcp_svc_send_keepalive(rs);
+			dlist_remove(entry);
+			tcp_svc_schedule(svc, rs, now);
+		}
+	}
+
+	if (svc->cnt < 1)
+		return -1;
+
+	for (i = 0; i < RS_SVC_WHEEL_SIZE - 1; i++) {
+		slot = &svc->wheel[(svc->wheel_time + i) & (RS_SVC_WHEEL_SIZE - 1)];
+		if (!dlist_empty(slot))
+			break;
+	}
+	return i + 1;
+}
+
+/*
+ * Push corked data whose cork_time has passed.  Returns the number of
+ * microseconds until the next deadline, or -1 if no data is staged.
+ *
+ * cork_idle is set while scanning, so an rsocket that stages data after
+ * its deadline was read wakes us through cork_fd (see rs_cork_start).
+ */
+static int64_t tcp_svc_flush_corks(struct rs_svc *svc)
+{
+	uint64_t now, deadline, next = 0;
+	dlist_entry *entry;
+	struct rsocket *rs;
+
+	atomic_store(&svc->cork_idle, true);
+	now = rs_time_us();
+	for (entry = svc->cork_list.next; entry != &svc->cork_list;
+	     entry = entry->next) {
+		rs = container_of(entry, struct rsocket, cork_entry);
+		deadline = atomic_load(&rs->cork_deadline);
+		if (deadline && deadline <= now) {
+			fastlock_acquire(&rs->slock);
+			if (!(rs->state & rs_writable))
+				atomic_store(&rs->cork_deadline, 0);
+			else if (rs_cork_flush(rs, 1))
+				/* Out of credits, retry after another cork_time */
+				atomic_store(&rs->cork_deadline, now + cork_time);
+			fastlock_release(&rs->slock);
+			deadline = atomic_load(&rs->cork_deadline);
+		}
+
+		if (deadline && (!next || deadline < next))
+			next = deadline;
+	}
+
+	if (!next)
+		return -1;
+
+	atomic_store(&svc->cork_idle, false);
+	return next > now ? next - now : 0;
+}
+
 static void *tcp_svc_run(void *arg)
 {
 	struct rs_svc *svc = arg;
 	struct rs_svc_msg msg;
-	struct pollfd fds;
-	uint64_t now, next_timeout;
-	int i, ret, timeout;
+	struct pollfd fds[2];
+	struct timespec ts;
+	int64_t timeout, cork_timeout;
+	uint64_t c;
+	int i, ret;
 
 	ret = rs_svc_grow_sets(svc, 16);
+	if (!ret) {
+		svc->wheel = calloc(RS_SVC_WHEEL_SIZE, sizeof(*svc->wheel));
+		if (!svc->wheel)
+			ret = ENOMEM;
+	}
+	if (!ret) {
+		svc->cork_fd = eventfd(0, EFD_NONBLOCK);
+		if (svc->cork_fd < 0) {
+			ret = errno;
+			free(svc->wheel);
+			svc->wheel = NULL;
+		}
+	}
 	if (ret) {
 		msg.status = ret;
 		write_all(svc->sock[1], &msg, sizeof msg);
 		return (void *) (uintptr_t) ret;
 	}
 
-	tcp_svc_timeouts = svc->contexts;
-	fds.fd = svc->sock[1];
-	fds.events = POLLIN;
+	for (i = 0; i < RS_SVC_WHEEL_SIZE; i++)
+		dlist_init(&svc->wheel[i]);
+	svc->wheel_time = rs_get_time();
+	dlist_init(&svc->cork_list);
+	atomic_store(&svc->cork_idle, false);
+
+	fds[0].fd = svc->sock[1];
+	fds[0].events = POLLIN;
+	fds[1].fd = svc->cork_fd;
+	fds[1].events = POLLIN;
 	timeout = -1;
 	do {
-		poll(&fds, 1, timeout * 1000);
-		if (fds.revents)
+		if (timeout >= 0) {
+			ts.tv_sec = timeout / 1000000;
+			ts.tv_nsec = (timeout % 1000000) * 1000;
+		}
+		ppoll(fds, 2, timeout < 0 ? NULL : &ts, NULL);
+		if (fds[1].revents) {
+			ret = read(svc->cork_fd, &c, sizeof(c));
+			(void) ret;
+		}
+		if (fds[0].revents)
 			tcp_svc_process_sock(svc);
 
-		now = rs_get_time();
-		next_timeout = ~0;
-		for (i = 1; i <= svc->cnt; i++) {
-			if (tcp_svc_timeouts[i] <= now) {
-				tcp_svc_send_keepalive(svc->rss[i]);
-				tcp_svc_timeouts[i] =
-					now + svc->rss[i]->keepalive_time;
-			}
-			if (tcp_svc_timeouts[i] < next_timeout)
-				next_timeout = tcp_svc_timeouts[i];
-		}
-		timeout = (int) (next_timeout - now);
+		timeout = tcp_svc_expire(svc);
+		if (timeout >= 0)
+			timeout *= 1000000;
+		cork_timeout = tcp_svc_flush_corks(svc);
+		if (cork_timeout >= 0 && (timeout < 0 || cork_timeout < timeout))
+			timeout = cork_timeout;
 	} while (svc->cnt >= 1);
 
+	close(svc->cork_fd);
+	free(svc->wheel);
+	svc->wheel = NULL;
 	return NULL;
 }
 
@@ -4688,7 +6949,7 @@ static void *cm_svc_run(void *arg)
 			if (!fds[i].revents)
 				continue;
 
-			if (svc == &listen_svc)
+			if (svc->type == RS_SVC_LISTEN)
 				rs_accept(svc->rss[i]);
 			else
 				rs_handle_cm_event(svc->rss[i]);
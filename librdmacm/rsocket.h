@@ -40,6 +40,7 @@
 #include <poll.h>
 #include <sys/select.h>
 #include <sys/mman.h>
+#include <sys/epoll.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -61,6 +62,12 @@ ssize_t rsend(int socket, const void *buf, size_t len, int flags);
 ssize_t rsendto(int socket, const void *buf, size_t len, int flags,
 		const struct sockaddr *dest_addr, socklen_t addrlen);
 ssize_t rsendmsg(int socket, const struct msghdr *msg, int flags);
+struct mmsghdr;
+struct timespec;
+int rrecvmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen,
+	      int flags, struct timespec *timeout);
+int rsendmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen,
+	      int flags);
 ssize_t rread(int socket, void *buf, size_t count);
 ssize_t rreadv(int socket, const struct iovec *iov, int iovcnt);
 ssize_t rwrite(int socket, const void *buf, size_t count);
@@ -70,6 +77,12 @@ int rpoll(struct pollfd *fds, nfds_t nfds, int timeout);
 int rselect(int nfds, fd_set *readfds, fd_set *writefds,
 	    fd_set *exceptfds, struct timeval *timeout);
 
+int repoll_create(int size);
+int repoll_create1(int flags);
+int repoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+int repoll_wait(int epfd, struct epoll_event *events, int maxevents,
+		int timeout);
+
 int rgetpeername(int socket, struct sockaddr *addr, socklen_t *addrlen);
 int rgetsockname(int socket, struct sockaddr *addr, socklen_t *addrlen);
 
@@ -79,7 +92,19 @@ enum {
 	RDMA_RQSIZE,
 	RDMA_INLINE,
 	RDMA_IOMAPSIZE,
-	RDMA_ROUTE
+	RDMA_ROUTE,
+	RDMA_ZCOPY_THRESHOLD,
+	RDMA_POLL_STATS
+};
+
+/* Returned by rgetsockopt RDMA_POLL_STATS */
+struct rdma_poll_stats {
+	uint64_t spin_wakeups;	/* waits completed while busy polling */
+	uint64_t yield_wakeups;	/* waits completed while polling with yields */
+	uint64_t sleep_wakeups;	/* waits that blocked on the CQ */
+	uint64_t poll_usecs;	/* total time spent polling */
+	uint32_t wait_usecs;	/* average wait for a completion */
+	uint32_t poll_budget;	/* time polled before blocking, in us */
 };
 
 int rsetsockopt(int socket, int level, int optname,
@@ -91,6 +116,8 @@ int rfcntl(int socket, int cmd, ... /* arg */ );
 off_t riomap(int socket, void *buf, size_t len, int prot, int flags, off_t offset);
 int riounmap(int socket, void *buf, size_t len);
 size_t riowrite(int socket, const void *buf, size_t count, off_t offset, int flags);
+ssize_t rrecv_zc(int socket, void **buf, size_t len, int flags);
+int rrecv_release(int socket, void *buf, size_t len);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,247 @@
+// SPDX-License-Identifier: (GPL-2.0 OR Linux-OpenIB)
+/*
+ * Index map tests and lookup microbenchmark.
+ *
+ * The tests check that indexes well above 64K can be stored, iterated
+ * and cleared.  The benchmark then runs reader threads performing random
+ * idm_lookup() calls while a writer keeps inserting and removing entries,
+ * forcing leaf arrays to be allocated and retired, and reports the cost
+ * of a lookup.  With -l each lookup is wrapped in a shared mutex, which
+ * approximates a design where readers serialize with writers.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "../indexer.h"
+
+static atomic_int failed_tests;
+
+#define EXPECT_EQ(expected, actual) \
+	({ \
+		typeof(expected) _expected = (expected); \
+		typeof(actual) _actual = (actual); \
+		if (_expected != _actual) { \
+			printf("  FAIL at line %d: %s not %s\n", __LINE__, \
+				#expected, #actual); \
+			printf("\tExpected: %ld\n", (long) _expected); \
+			printf("\t  Actual: %ld\n", (long) _actual); \
+			failed_tests++; \
+		} \
+	})
+
+#define ITEM(index) ((void *) ((uintptr_t) (index) + 1))
+
+static struct index_map idm;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_bool stop;
+static int nentries = 1 << 18;
+static int nthreads = 4;
+static int seconds = 2;
+static bool use_lock;
+
+static void test_idm_basic(void)
+{
+	int index;
+
+	EXPECT_EQ(NULL, idm_lookup(&idm, -1));
+	EXPECT_EQ(NULL, idm_lookup(&idm, 70000));
+	EXPECT_EQ(NULL, idm_clear(&idm, 70000));
+
+	for (index = 0; index < nentries; index += 7)
+		EXPECT_EQ(index, idm_set(&idm, index, ITEM(index)));
+	EXPECT_EQ(IDX_MAX_INDEX, idm_set(&idm, IDX_MAX_INDEX,
+					 ITEM(IDX_MAX_INDEX)));
+
+	for (index = 0; index < nentries; index++)
+		EXPECT_EQ(index % 7 ? NULL : ITEM(index),
+			  idm_lookup(&idm, index));
+	EXPECT_EQ(ITEM(IDX_MAX_INDEX), idm_lookup(&idm, IDX_MAX_INDEX));
+}
+
+static void test_idm_next(void)
+{
+	int index, expected = 0;
+	void *item;
+
+	for (index = 0; (item = idm_next(&idm, &index)); index++) {
+		if (index == IDX_MAX_INDEX)
+			break;
+		EXPECT_EQ(expected, index);
+		EXPECT_EQ(ITEM(index), item);
+		expected += 7;
+	}
+	EXPECT_EQ(ITEM(IDX_MAX_INDEX), item);
+	EXPECT_EQ(IDX_MAX_INDEX, index);
+}
+
+static void test_idm_clear(void)
+{
+	int index;
+
+	EXPECT_EQ(ITEM(IDX_MAX_INDEX), idm_clear(&idm, IDX_MAX_INDEX));
+	EXPECT_EQ(NULL, idm_lookup(&idm, IDX_MAX_INDEX));
+
+	for (index = 0; index < nentries; index += 14)
+		EXPECT_EQ(ITEM(index), idm_clear(&idm, index));
+
+	for (index = 0; index < nentries; index++)
+		EXPECT_EQ(index % 14 == 7 ? ITEM(index) : NULL,
+			  idm_lookup(&idm, index));
+
+	/* Emptied arrays are released; the map must remain usable */
+	EXPECT_EQ(70001, idm_set(&idm, 70001, ITEM(70001)));
+	EXPECT_EQ(ITEM(70001), idm_lookup(&idm, 70001));
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Readers only look up the even indexes; the writer owns the odd ones */
+static void *reader(void *arg)
+{
+	uint64_t *lookups = arg;
+	unsigned int seed = *lookups;
+	uint64_t cnt = 0;
+	int index;
+	void *item;
+
+	while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+		index = (rand_r(&seed) % nentries) & ~1;
+		if (use_lock)
+			pthread_mutex_lock(&lock);
+		item = idm_lookup(&idm, index);
+		if (use_lock)
+			pthread_mutex_unlock(&lock);
+		if (item != ITEM(index))
+			failed_tests++;
+		cnt++;
+	}
+	*lookups = cnt;
+	return NULL;
+}
+
+static void *writer(void *arg)
+{
+	uint64_t *updates = arg;
+	uint64_t cnt = 0;
+	int index, base;
+
+	/* Fill and empty whole leaf arrays above the range used by readers */
+	for (base = nentries; !atomic_load_explicit(&stop, memory_order_relaxed);
+	     base = base + IDX_ENTRY_SIZE < IDX_MAX_INDEX / 2 ?
+		    base + IDX_ENTRY_SIZE : nentries) {
+		for (index = base + 1; index < base + IDX_ENTRY_SIZE; index += 2) {
+			pthread_mutex_lock(&lock);
+			idm_set(&idm, index, ITEM(index));
+			pthread_mutex_unlock(&lock);
+		}
+		for (index = base + 1; index < base + IDX_ENTRY_SIZE; index += 2) {
+			pthread_mutex_lock(&lock);
+			idm_clear(&idm, index);
+			pthread_mutex_unlock(&lock);
+		}
+		cnt += IDX_ENTRY_SIZE;
+	}
+	*updates = cnt;
+	return NULL;
+}
+
+static void run_bench(void)
+{
+	pthread_t *threads;
+	uint64_t *counts, total = 0, start, elapsed;
+	int i, index;
+
+	for (index = 0; index < nentries; index += 2)
+		idm_set(&idm, index, ITEM(index));
+
+	threads = calloc(nthreads + 1, sizeof(*threads));
+	counts = calloc(nthreads + 1, sizeof(*counts) * 8);
+	if (!threads || !counts) {
+		printf("unable to allocate memory\n");
+		exit(1);
+	}
+
+	start = now_ns();
+	for (i = 0; i < nthreads; i++) {
+		counts[i * 8] = i + 1;
+		pthread_create(&threads[i], NULL, reader, &counts[i * 8]);
+	}
+	pthread_create(&threads[nthreads], NULL, writer, &counts[nthreads * 8]);
+
+	sleep(seconds);
+	atomic_store(&stop, true);
+	for (i = 0; i <= nthreads; i++)
+		pthread_join(threads[i], NULL);
+	elapsed = now_ns() - start;
+
+	for (i = 0; i < nthreads; i++)
+		total += counts[i * 8];
+
+	printf("%d readers, %d entries%s: %.2f Mlookups/s, %.1f ns/lookup per thread, %.2f Mupdates/s\n",
+	       nthreads, nentries, use_lock ? ", locked" : "",
+	       total * 1000.0 / elapsed,
+	       total ? (double) elapsed * nthreads / total : 0.0,
+	       counts[nthreads * 8] * 1000.0 / elapsed);
+	free(counts);
+	free(threads);
+}
+
+int main(int argc, char **argv)
+{
+	int op;
+
+	while ((op = getopt(argc, argv, "ln:s:t:")) != -1) {
+		switch (op) {
+		case 'l':
+			use_lock = true;
+			break;
+		case 'n':
+			nentries = atoi(optarg);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		default:
+			printf("usage: %s\n", argv[0]);
+			printf("\t[-l] serialize lookups with a mutex\n");
+			printf("\t[-n entries] (default %d)\n", 1 << 18);
+			printf("\t[-s seconds] benchmark duration, 0 to only run tests\n");
+			printf("\t[-t reader_threads] (default 4)\n");
+			exit(1);
+		}
+	}
+	if (nentries < 2 || nthreads < 1) {
+		printf("invalid arguments\n");
+		exit(1);
+	}
+
+	test_idm_basic();
+	test_idm_next();
+	test_idm_clear();
+	idm_cleanup(&idm);
+
+	if (seconds > 0 && !failed_tests)
+		run_bench();
+
+	idm_cleanup(&idm);
+	if (failed_tests) {
+		printf("%d tests failed\n", failed_tests);
+		return 1;
+	}
+	return 0;
+}
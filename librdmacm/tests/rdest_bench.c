@@ -0,0 +1,163 @@
+// SPDX-License-Identifier: (GPL-2.0 OR Linux-OpenIB)
+/*
+ * Datagram rsocket destination lookup benchmark.
+ *
+ * Sends small datagrams round robin to a large number of distinct
+ * destinations and reports the cost of each rsendto().  Destinations use
+ * consecutive ports, moving on to the next address once the port range is
+ * used up.  The first pass creates the destinations; later passes find
+ * them in the destination cache.  Run it against an address routed through
+ * an RDMA device, for example 127.0.0.1 with an rxe device over loopback.
+ *
+ * Nothing needs to listen on the destination ports.  Destinations that
+ * never answer are reached through the UDP socket backing the rsocket, so
+ * the reported time includes one sendmsg() call per datagram.  Run with
+ * -n 1 to measure that baseline.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <rdma/rsocket.h>
+
+static const char *dst_addr;
+static int port = 10000;
+static int nports = 50000;
+static int ndests = 100000;
+static int passes = 5;
+static int msg_size = 64;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void set_dest(struct sockaddr_storage *dest,
+		     const struct sockaddr_storage *base, int i)
+{
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) dest;
+	struct sockaddr_in *sin = (struct sockaddr_in *) dest;
+	uint32_t a;
+
+	memcpy(dest, base, sizeof(*dest));
+	if (dest->ss_family == AF_INET) {
+		sin->sin_addr.s_addr = htonl(ntohl(sin->sin_addr.s_addr) +
+					     i / nports);
+		sin->sin_port = htons(port + i % nports);
+	} else {
+		memcpy(&a, &sin6->sin6_addr.s6_addr[12], sizeof(a));
+		a = htonl(ntohl(a) + i / nports);
+		memcpy(&sin6->sin6_addr.s6_addr[12], &a, sizeof(a));
+		sin6->sin6_port = htons(port + i % nports);
+	}
+}
+
+static int run(void)
+{
+	struct sockaddr_storage base, addr;
+	struct addrinfo *res;
+	uint64_t start, elapsed;
+	socklen_t addrlen;
+	char *buf;
+	int rs, i, pass, ret;
+
+	ret = getaddrinfo(dst_addr, NULL, NULL, &res);
+	if (ret) {
+		printf("getaddrinfo: %s\n", gai_strerror(ret));
+		return ret;
+	}
+	memset(&base, 0, sizeof(base));
+	memcpy(&base, res->ai_addr, res->ai_addrlen);
+	addrlen = res->ai_addrlen;
+	freeaddrinfo(res);
+
+	buf = calloc(1, msg_size);
+	if (!buf)
+		return -1;
+
+	rs = rsocket(base.ss_family, SOCK_DGRAM, 0);
+	if (rs < 0) {
+		perror("rsocket");
+		ret = rs;
+		goto free;
+	}
+
+	for (pass = 0; pass < passes; pass++) {
+		start = now_ns();
+		for (i = 0; i < ndests; i++) {
+			set_dest(&addr, &base, i);
+			ret = rsendto(rs, buf, msg_size, 0,
+				      (struct sockaddr *) &addr, addrlen);
+			if (ret != msg_size) {
+				perror("rsendto");
+				ret = -1;
+				goto close;
+			}
+		}
+		elapsed = now_ns() - start;
+
+		printf("pass %d%s: %d destinations, %.1f ns/send, %.2f Msends/s\n",
+		       pass, pass ? "" : " (create)", ndests,
+		       (double) elapsed / ndests, ndests * 1000.0 / elapsed);
+	}
+	ret = 0;
+close:
+	rclose(rs);
+free:
+	free(buf);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int op;
+
+	while ((op = getopt(argc, argv, "s:p:P:n:i:S:")) != -1) {
+		switch (op) {
+		case 's':
+			dst_addr = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'P':
+			nports = atoi(optarg);
+			break;
+		case 'n':
+			ndests = atoi(optarg);
+			break;
+		case 'i':
+			passes = atoi(optarg);
+			break;
+		case 'S':
+			msg_size = atoi(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	if (!dst_addr || ndests < 1 || nports < 1 || port < 1 ||
+	    port + nports > 65536 || msg_size < 1)
+		goto usage;
+
+	return run() ? 1 : 0;
+
+usage:
+	printf("usage: %s -s address\n", argv[0]);
+	printf("\t[-p base_port] (default 10000)\n");
+	printf("\t[-P ports_per_address] (default 50000)\n");
+	printf("\t[-n destinations] (default 100000)\n");
+	printf("\t[-i passes] (default 5)\n");
+	printf("\t[-S message_size] (default 64)\n");
+	return 1;
+}
@@ -0,0 +1,184 @@
+// SPDX-License-Identifier: (GPL-2.0 OR Linux-OpenIB)
+/*
+ * Tests for the ring of regions lent out by rrecv_zc().
+ *
+ * The ring is driven the way rsocket.c drives it: regions are lent from
+ * a stream offset, data copied out by rrecv is queued behind them and
+ * regions are released in random order.  After every step the bytes
+ * credited back must equal the stream offset of the oldest region still
+ * lent, and every lent region must still be found where it was lent.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <getopt.h>
+#include "../rs_zc.h"
+
+static int failed_tests;
+
+#define EXPECT_EQ(expected, actual) \
+	({ \
+		typeof(expected) _expected = (expected); \
+		typeof(actual) _actual = (actual); \
+		if (_expected != _actual) { \
+			printf("  FAIL at line %d: %s not %s\n", __LINE__, \
+				#expected, #actual); \
+			printf("\tExpected: %ld\n", (long) _expected); \
+			printf("\t  Actual: %ld\n", (long) _actual); \
+			failed_tests++; \
+		} \
+	})
+
+/* Stream offsets stand in for rbuf addresses; rbuf never wraps here */
+static uint8_t *rbuf = (uint8_t *) 0x1000;
+
+struct lent {
+	uint32_t offset;
+	uint32_t len;
+};
+
+/*
+ * rq_size = 2: lend A, lend B, copy, release B, lend C, copy.  With only
+ * the lent count checked, the last copy wrapped onto A's slot.
+ */
+static void test_zc_out_of_order(void)
+{
+	struct rs_zc_ring ring;
+	uint32_t rq_size = 2;
+
+	if (rs_zc_init(&ring, rq_size * 2))
+		exit(1);
+
+	EXPECT_EQ(0, rs_zc_full(&ring, rq_size));
+	rs_zc_lend(&ring, rbuf, 0, 10);			/* A */
+	EXPECT_EQ(0, rs_zc_full(&ring, rq_size));
+	rs_zc_lend(&ring, rbuf, 10, 10);		/* B */
+	EXPECT_EQ(0u, rs_zc_free(&ring, 5));
+	EXPECT_EQ(3u, ring.cnt);
+
+	EXPECT_EQ(1, rs_zc_release(&ring, rbuf + 10, 10) != NULL);
+	EXPECT_EQ(0u, rs_zc_reclaim(&ring));
+	EXPECT_EQ(1u, ring.lent);
+
+	/* C would leave no slot for the copy behind it */
+	EXPECT_EQ(1, rs_zc_full(&ring, rq_size));
+	EXPECT_EQ(0u, rs_zc_free(&ring, 5));
+	EXPECT_EQ(3u, ring.cnt);
+
+	EXPECT_EQ(0u, rs_zc_at(&ring, 0)->offset);
+	EXPECT_EQ(10u, rs_zc_at(&ring, 0)->len);
+	EXPECT_EQ(0, rs_zc_at(&ring, 0)->released);
+
+	EXPECT_EQ(1, rs_zc_release(&ring, rbuf, 10) != NULL);
+	EXPECT_EQ(30u, rs_zc_reclaim(&ring));
+	EXPECT_EQ(0u, ring.cnt);
+	EXPECT_EQ(0, rs_zc_full(&ring, rq_size));
+	EXPECT_EQ(7u, rs_zc_free(&ring, 7));
+	EXPECT_EQ(1, rs_zc_release(&ring, rbuf, 10) == NULL);
+	free(ring.regions);
+}
+
+static void test_zc_random(uint32_t rq_size, int iters, unsigned int seed)
+{
+	struct rs_zc_ring ring;
+	struct lent *lent;
+	uint32_t nlent = 0, stream = 0, credited = 0, oldest, i, j, len;
+	int full_cnt = 0;
+
+	srand(seed);
+	if (rs_zc_init(&ring, rq_size * 2))
+		exit(1);
+	lent = calloc(rq_size, sizeof(*lent));
+	if (!lent)
+		exit(1);
+
+	while (iters--) {
+		len = 1 + rand() % 64;
+		switch (rand() % 3) {
+		case 0:
+			if (rs_zc_full(&ring, rq_size)) {
+				full_cnt++;
+				break;
+			}
+			EXPECT_EQ(1, nlent < rq_size);
+			rs_zc_lend(&ring, rbuf, stream, len);
+			lent[nlent].offset = stream;
+			lent[nlent++].len = len;
+			stream += len;
+			break;
+		case 1:
+			credited += rs_zc_free(&ring, len);
+			stream += len;
+			break;
+		default:
+			if (!nlent)
+				break;
+			i = rand() % nlent;
+			EXPECT_EQ(1, rs_zc_release(&ring,
+						   rbuf + lent[i].offset,
+						   lent[i].len) != NULL);
+			lent[i] = lent[--nlent];
+			credited += rs_zc_reclaim(&ring);
+			break;
+		}
+
+		EXPECT_EQ(nlent, ring.lent);
+		EXPECT_EQ(1, ring.cnt <= ring.size);
+		oldest = stream;
+		for (i = 0; i < nlent; i++) {
+			if (lent[i].offset < oldest)
+				oldest = lent[i].offset;
+			for (j = 0; j < ring.cnt; j++) {
+				if (!rs_zc_at(&ring, j)->released &&
+				    rs_zc_at(&ring, j)->offset == lent[i].offset)
+					break;
+			}
+			EXPECT_EQ(1, j < ring.cnt);
+		}
+		EXPECT_EQ(oldest, credited);
+		if (failed_tests)
+			break;
+	}
+
+	while (nlent) {
+		rs_zc_release(&ring, rbuf + lent[nlent - 1].offset,
+			      lent[nlent - 1].len);
+		nlent--;
+	}
+	credited += rs_zc_reclaim(&ring);
+	EXPECT_EQ(stream, credited);
+	EXPECT_EQ(0u, ring.cnt);
+	printf("rq_size %u: %u bytes streamed, ring full %d times\n",
+	       rq_size, stream, full_cnt);
+	free(lent);
+	free(ring.regions);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int seed = 1;
+	int op;
+
+	while ((op = getopt(argc, argv, "s:")) != -1) {
+		switch (op) {
+		case 's':
+			seed = atoi(optarg);
+			break;
+		default:
+			printf("usage: %s [-s seed]\n", argv[0]);
+			exit(1);
+		}
+	}
+
+	test_zc_out_of_order();
+	test_zc_random(2, 100000, seed);
+	test_zc_random(4, 100000, seed);
+	test_zc_random(128, 100000, seed);
+
+	if (failed_tests) {
+		printf("%d tests failed\n", failed_tests);
+		return 1;
+	}
+	printf("all tests passed\n");
+	return 0;
+}
@@ -34,23 +34,65 @@
  */
 
 #include <stdlib.h>
+#include <strings.h>
 #include <util/bitmap.h>
 #include "mlx5dv_dr.h"
 
 struct dr_icm_pool;
 struct dr_icm_buddy_mem;
 
-static int dr_find_first_bit(const unsigned long *set_addr,
-			     const unsigned long *addr,
-			     unsigned int size)
+/*
+ * Free blocks are searched through three levels of bitmaps per order:
+ * bit w of set_bit[order] is set when word w of bits[order] is not empty,
+ * and bit t of set_top[order] when word t of set_bit[order] is not. Each
+ * level is at most a few words long, so finding and updating a free block
+ * touches a single word per level.
+ */
+static void dr_buddy_mark_free(struct dr_icm_buddy_mem *buddy,
+			       uint32_t seg, int order)
+{
+	uint32_t w = seg / BITS_PER_LONG;
+
+	bitmap_set_bit(buddy->bits[order], seg);
+	bitmap_set_bit(buddy->set_bit[order], w);
+	bitmap_set_bit(buddy->set_top[order], w / BITS_PER_LONG);
+	++buddy->num_free[order];
+}
+
+static void dr_buddy_mark_used(struct dr_icm_buddy_mem *buddy,
+			       uint32_t seg, int order)
+{
+	uint32_t w = seg / BITS_PER_LONG;
+
+	bitmap_clear_bit(buddy->bits[order], seg);
+	if (!buddy->bits[order][w]) {
+		bitmap_clear_bit(buddy->set_bit[order], w);
+		if (!buddy->set_bit[order][w / BITS_PER_LONG])
+			bitmap_clear_bit(buddy->set_top[order],
+					 w / BITS_PER_LONG);
+	}
+	--buddy->num_free[order];
+}
+
+/* Index of the first set bit in word w of bmp, which must not be empty */
+static inline uint32_t dr_buddy_first_in_word(const unsigned long *bmp,
+					      uint32_t w)
+{
+	return w * BITS_PER_LONG + ffsl(bmp[w]) - 1;
+}
+
+/* Caller must make sure the order has a free block */
+static uint32_t dr_buddy_find_first(struct dr_icm_buddy_mem *buddy, int order)
 {
-	unsigned int set_size = (size - 1) / BITS_PER_LONG + 1;
-	unsigned long set_idx;
+	const unsigned long *top = buddy->set_top[order];
+	uint32_t t = 0;
+
+	while (!top[t])
+		t++;
 
-	/* find the first free in the first level */
-	set_idx =  bitmap_find_first_bit(set_addr, 0, set_size);
-	/* find the next level */
-	return bitmap_find_first_bit(addr, set_idx * BITS_PER_LONG, size);
+	t = dr_buddy_first_in_word(top, t);
+	t = dr_buddy_first_in_word(buddy->set_bit[order], t);
+	return dr_buddy_first_in_word(buddy->bits[order], t);
 }
 
 int dr_buddy_init(struct dr_icm_buddy_mem *buddy, uint32_t max_order)
@@ -77,6 +119,10 @@ int dr_buddy_init(struct dr_icm_buddy_mem *buddy, uint32_t max_order)
 	if (!buddy->set_bit)
 		goto err_out_free_num_free;
 
+	buddy->set_top = calloc(buddy->max_order + 1, sizeof(long *));
+	if (!buddy->set_top)
+		goto err_out_free_set_bit;
+
 	/* Allocating max_order bitmaps, one for each order.
 	 * only the bitmap for the maximum size will be available for use and
 	 * the first bit there will be set.
@@ -84,34 +130,26 @@ int dr_buddy_init(struct dr_icm_buddy_mem *buddy, uint32_t max_order)
 	for (i = 0; i <= buddy->max_order; ++i) {
 		s = 1 << (buddy->max_order - i);
 		buddy->bits[i] = bitmap_alloc0(s);
-		if (!buddy->bits[i])
+		buddy->set_bit[i] = bitmap_alloc0(BITS_TO_LONGS(s));
+		buddy->set_top[i] = bitmap_alloc0(BITS_TO_LONGS(BITS_TO_LONGS(s)));
+		if (!buddy->bits[i] || !buddy->set_bit[i] || !buddy->set_top[i])
 			goto err_out_free_each_bit_per_order;
 	}
 
-	for (i = 0; i <= buddy->max_order; ++i) {
-		s = BITS_TO_LONGS(1 << (buddy->max_order - i));
-		buddy->set_bit[i] = bitmap_alloc0(s);
-		if (!buddy->set_bit[i])
-			goto err_out_free_set;
-	}
-
-	bitmap_set_bit(buddy->bits[buddy->max_order], 0);
-	bitmap_set_bit(buddy->set_bit[buddy->max_order], 0);
-
-	buddy->num_free[buddy->max_order] = 1;
+	dr_buddy_mark_free(buddy, 0, buddy->max_order);
 
 	return 0;
 
-err_out_free_set:
-	for (i = 0; i <= buddy->max_order; ++i)
-		free(buddy->set_bit[i]);
-
 err_out_free_each_bit_per_order:
-	free(buddy->set_bit);
-
-	for (i = 0; i <= buddy->max_order; ++i)
+	for (i = 0; i <= buddy->max_order; ++i) {
 		free(buddy->bits[i]);
+		free(buddy->set_bit[i]);
+		free(buddy->set_top[i]);
+	}
 
+	free(buddy->set_top);
+err_out_free_set_bit:
+	free(buddy->set_bit);
 err_out_free_num_free:
 	free(buddy->num_free);
 
@@ -130,74 +168,37 @@ void dr_buddy_cleanup(struct dr_icm_buddy_mem *buddy)
 	for (i = 0; i <= buddy->max_order; ++i) {
 		free(buddy->bits[i]);
 		free(buddy->set_bit[i]);
+		free(buddy->set_top[i]);
 	}
 
+	free(buddy->set_top);
 	free(buddy->set_bit);
 	free(buddy->num_free);
 	free(buddy->bits);
 }
 
 /*
- * Find the borders (high and low) of specific seg (segment location)
- * of the lower level of the bitmap in order to mark the upper layer
- * of bitmap.
- */
-static void dr_buddy_get_seg_borders(uint32_t seg,
-				     uint32_t *low,
-				     uint32_t *high)
-{
-	*low = (seg / BITS_PER_LONG) * BITS_PER_LONG;
-	*high = ((seg / BITS_PER_LONG) + 1) * BITS_PER_LONG;
-}
-
-/*
- * We have two layers of searching in the bitmaps, so when needed update the
- * second layer of search.
- */
-static void dr_buddy_update_upper_bitmap(struct dr_icm_buddy_mem *buddy,
-					 uint32_t seg, int order)
-{
-	uint32_t h, l, m;
-
-	/* clear upper layer of search if needed */
-	dr_buddy_get_seg_borders(seg, &l, &h);
-	m = bitmap_find_first_bit(buddy->bits[order], l, h);
-	if (m == h) /* nothing in the long that includes seg */
-		bitmap_clear_bit(buddy->set_bit[order], seg / BITS_PER_LONG);
-}
-
-/*
- * This function finds the first area of the managed memory by the buddy.
- * It uses the data structures of the buddy-system in order to find the first
- * area of free place, starting from the current order till the maximum order
- * in the system.
+ * This function takes the first free block of the smallest order, starting
+ * from the requested order till the maximum order in the system, that has
+ * one. Blocks bigger than needed are split and their unused halves are
+ * marked free in the lower orders.
  * The function returns the location (seg) in the whole buddy memory area, this
  * indicates the place of the memory to use, it is the index of the mem segment.
  */
 int dr_buddy_alloc_mem(struct dr_icm_buddy_mem *buddy, int order)
 {
-	int seg;
-	int o, m;
+	uint32_t seg;
+	int o;
 
 	for (o = order; o <= buddy->max_order; ++o)
-		if (buddy->num_free[o]) {
-			m = 1 << (buddy->max_order - o);
-			seg = dr_find_first_bit(buddy->set_bit[o], buddy->bits[o], m);
-			if (m <= seg) {
-				/* not found free mem, but there are free mem */
-				assert(false);
-				return -1;
-			}
+		if (buddy->num_free[o])
 			goto found;
-		}
 
 	return -1;
 
 found:
-	bitmap_clear_bit(buddy->bits[o], seg);
-	/* clear upper layer of search if needed */
-	dr_buddy_update_upper_bitmap(buddy, seg, o);
-	--buddy->num_free[o];
+	seg = dr_buddy_find_first(buddy, o);
+	dr_buddy_mark_used(buddy, seg, o);
 	/* if we find free memory in some order that it is bigger than the
 	 * required order, we need to devied each order between the required to
 	 * the found one to 2, and mark accordingly.
@@ -205,10 +206,7 @@ found:
 	while (o > order) {
 		--o;
 		seg <<= 1;
-		bitmap_set_bit(buddy->bits[o], seg ^ 1);
-		bitmap_set_bit(buddy->set_bit[o], (seg ^ 1) / BITS_PER_LONG);
-
-		++buddy->num_free[o];
+		dr_buddy_mark_free(buddy, seg ^ 1, o);
 	}
 
 	seg <<= order;
@@ -222,16 +220,12 @@ dr_buddy_free_mem(struct dr_icm_buddy_mem *buddy, uint32_t seg, int order)
 	seg >>= order;
 
 	/* whenever a segment is free, the mem is added to the buddy that gave it */
-	while (bitmap_test_bit(buddy->bits[order], seg ^ 1)) {
-		bitmap_clear_bit(buddy->bits[order], seg ^ 1);
-		dr_buddy_update_upper_bitmap(buddy, seg ^ 1, order);
-		--buddy->num_free[order];
+	while (order < buddy->max_order &&
+	       bitmap_test_bit(buddy->bits[order], seg ^ 1)) {
+		dr_buddy_mark_used(buddy, seg ^ 1, order);
 		seg >>= 1;
 		++order;
 	}
-	bitmap_set_bit(buddy->bits[order], seg);
-	bitmap_set_bit(buddy->set_bit[order], seg / BITS_PER_LONG);
 
-	++buddy->num_free[order];
+	dr_buddy_mark_free(buddy, seg, order);
 }
-
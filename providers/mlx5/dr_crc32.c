@@ -54,11 +54,25 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <endian.h>
 #include "mlx5dv_dr.h"
 
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(__aarch64__) && __BYTE_ORDER == __LITTLE_ENDIAN
+#include <sys/auxv.h>
+#endif
+
 #define DR_STE_CRC_POLY		0xEDB88320L
 
+typedef uint32_t (*dr_crc32_update_fn)(uint32_t crc, const uint8_t *data,
+					size_t length);
+
 static uint32_t dr_ste_crc_tab32[8][256];
+static uint32_t dr_crc32_slice8_update(uint32_t crc, const uint8_t *data,
+				       size_t length);
+static dr_crc32_update_fn dr_crc32_update = dr_crc32_slice8_update;
 
 static void dr_crc32_calc_lookup_entry(uint32_t (*tbl)[256], uint8_t i,
 				       uint8_t j)
@@ -66,6 +80,141 @@ static void dr_crc32_calc_lookup_entry(uint32_t (*tbl)[256], uint8_t i,
 	tbl[i][j] = (tbl[i-1][j] >> 8) ^ tbl[0][tbl[i-1][j] & 0xff];
 }
 
+/* Compute CRC32 (Slicing-by-8 algorithm) */
+static uint32_t dr_crc32_slice8_update(uint32_t crc, const uint8_t *data,
+				       size_t length)
+{
+	const uint32_t *current = (const uint32_t *)data;
+	const uint8_t *current_char;
+	uint32_t one, two;
+
+	/* Process eight bytes at once (Slicing-by-8) */
+	while (length >= 8) {
+		one = *current++ ^ crc;
+		two = *current++;
+
+		crc = dr_ste_crc_tab32[0][(two >> 24) & 0xff]
+			^ dr_ste_crc_tab32[1][(two >> 16) & 0xff]
+			^ dr_ste_crc_tab32[2][(two >> 8) & 0xff]
+			^ dr_ste_crc_tab32[3][two & 0xff]
+			^ dr_ste_crc_tab32[4][(one >> 24) & 0xff]
+			^ dr_ste_crc_tab32[5][(one >> 16) & 0xff]
+			^ dr_ste_crc_tab32[6][(one >> 8) & 0xff]
+			^ dr_ste_crc_tab32[7][one & 0xff];
+
+		length -= 8;
+	}
+
+	current_char = (const uint8_t *)current;
+	/* Remaining 1 to 7 bytes (standard algorithm) */
+	while (length-- != 0)
+		crc = (crc >> 8) ^ dr_ste_crc_tab32[0][(crc & 0xff)
+			^ *current_char++];
+
+	return crc;
+}
+
+#if defined(__x86_64__)
+/*
+ * Fold 16 bytes at a time with carry-less multiplication and finish with a
+ * Barrett reduction, as described in Intel's "Fast CRC Computation for
+ * Generic Polynomials Using PCLMULQDQ Instruction". STE tags are only 16 or
+ * 32 bytes long, so a single folding lane is enough.
+ */
+static uint32_t __attribute__((target("pclmul")))
+dr_crc32_pclmul_update(uint32_t crc, const uint8_t *data, size_t length)
+{
+	const __m128i mask32 = _mm_set_epi32(0, 0, 0, ~0);
+	__m128i x, y, k;
+
+	if (length < 16)
+		return dr_crc32_slice8_update(crc, data, length);
+
+	/* x^(128+32) and x^(128-32) mod P, bit reflected */
+	k = _mm_set_epi64x(0x0ccaa009e, 0x1751997d0);
+	x = _mm_loadu_si128((const __m128i *)data);
+	x = _mm_xor_si128(x, _mm_cvtsi32_si128(crc));
+	data += 16;
+	length -= 16;
+
+	while (length >= 16) {
+		y = _mm_clmulepi64_si128(x, k, 0x11);
+		x = _mm_clmulepi64_si128(x, k, 0x00);
+		x = _mm_xor_si128(x, y);
+		x = _mm_xor_si128(x, _mm_loadu_si128((const __m128i *)data));
+		data += 16;
+		length -= 16;
+	}
+
+	/* 128 to 64 bits, appending the 32 zero bits of the message */
+	y = _mm_clmulepi64_si128(x, k, 0x10);
+	x = _mm_xor_si128(_mm_srli_si128(x, 8), y);
+
+	/* 64 to 32 bits */
+	k = _mm_set_epi64x(0, 0x163cd6124);
+	y = _mm_srli_si128(x, 4);
+	x = _mm_clmulepi64_si128(_mm_and_si128(x, mask32), k, 0x00);
+	x = _mm_xor_si128(x, y);
+
+	/* Barrett reduction, mu and P bit reflected */
+	k = _mm_set_epi64x(0x1f7011641, 0x1db710641);
+	y = x;
+	x = _mm_clmulepi64_si128(_mm_and_si128(x, mask32), k, 0x10);
+	x = _mm_clmulepi64_si128(_mm_and_si128(x, mask32), k, 0x00);
+	x = _mm_xor_si128(x, y);
+	crc = _mm_cvtsi128_si32(_mm_srli_si128(x, 4));
+
+	return dr_crc32_slice8_update(crc, data, length);
+}
+
+static dr_crc32_update_fn dr_crc32_select(void)
+{
+	unsigned int ax, bx, cx, dx;
+
+	if (__get_cpuid(1, &ax, &bx, &cx, &dx) && (cx & bit_PCLMUL))
+		return dr_crc32_pclmul_update;
+
+	return dr_crc32_slice8_update;
+}
+#elif defined(__aarch64__) && __BYTE_ORDER == __LITTLE_ENDIAN
+/*
+ * The ARMv8 CRC32 instructions implement this exact polynomial, which for
+ * 16 and 32 byte tags is cheaper than setting up a PMULL folding loop.
+ */
+static uint32_t dr_crc32_arm64_update(uint32_t crc, const uint8_t *data,
+				      size_t length)
+{
+	uint64_t val;
+
+	while (length >= 8) {
+		memcpy(&val, data, sizeof(val));
+		asm(".arch_extension crc\n\tcrc32x %w0, %w0, %x1"
+		    : "+r"(crc) : "r"(val));
+		data += 8;
+		length -= 8;
+	}
+
+	while (length--)
+		asm(".arch_extension crc\n\tcrc32b %w0, %w0, %w1"
+		    : "+r"(crc) : "r"(*data++));
+
+	return crc;
+}
+
+static dr_crc32_update_fn dr_crc32_select(void)
+{
+	if (getauxval(AT_HWCAP) & HWCAP_CRC32)
+		return dr_crc32_arm64_update;
+
+	return dr_crc32_slice8_update;
+}
+#else
+static dr_crc32_update_fn dr_crc32_select(void)
+{
+	return dr_crc32_slice8_update;
+}
+#endif
+
 void dr_crc32_init_table(void)
 {
 	uint32_t crc, i, j;
@@ -91,41 +240,30 @@ void dr_crc32_init_table(void)
 		dr_crc32_calc_lookup_entry(dr_ste_crc_tab32, 6, i);
 		dr_crc32_calc_lookup_entry(dr_ste_crc_tab32, 7, i);
 	}
+
+	dr_crc32_update = dr_crc32_select();
 }
 
-/* Compute CRC32 (Slicing-by-8 algorithm) */
-uint32_t dr_crc32_slice8_calc(const void *input_data, size_t length)
+static uint32_t dr_crc32_swab(uint32_t crc)
 {
-	const uint32_t *current = (const uint32_t *)input_data;
-	const uint8_t *current_char;
-	uint32_t crc = 0, one, two;
+	return ((crc>>24) & 0xff) | ((crc<<8) & 0xff0000) |
+		((crc>>8) & 0xff00) | ((crc<<24) & 0xff000000);
+}
 
+/* Table driven CRC32, always available as the reference implementation */
+uint32_t dr_crc32_slice8_calc(const void *input_data, size_t length)
+{
 	if (!input_data)
 		return 0;
 
-	/* Process eight bytes at once (Slicing-by-8) */
-	while (length >= 8) {
-		one = *current++ ^ crc;
-		two = *current++;
-
-		crc = dr_ste_crc_tab32[0][(two >> 24) & 0xff]
-			^ dr_ste_crc_tab32[1][(two >> 16) & 0xff]
-			^ dr_ste_crc_tab32[2][(two >> 8) & 0xff]
-			^ dr_ste_crc_tab32[3][two & 0xff]
-			^ dr_ste_crc_tab32[4][(one >> 24) & 0xff]
-			^ dr_ste_crc_tab32[5][(one >> 16) & 0xff]
-			^ dr_ste_crc_tab32[6][(one >> 8) & 0xff]
-			^ dr_ste_crc_tab32[7][one & 0xff];
-
-		length -= 8;
-	}
+	return dr_crc32_swab(dr_crc32_slice8_update(0, input_data, length));
+}
 
-	current_char = (const uint8_t *)current;
-	/* Remaining 1 to 7 bytes (standard algorithm) */
-	while (length-- != 0)
-		crc = (crc >> 8) ^ dr_ste_crc_tab32[0][(crc & 0xff)
-			^ *current_char++];
+/* CRC32 using the fastest implementation supported by the CPU */
+uint32_t dr_crc32_calc(const void *input_data, size_t length)
+{
+	if (!input_data)
+		return 0;
 
-	return ((crc>>24) & 0xff) | ((crc<<8) & 0xff0000) |
-		((crc>>8) & 0xff00) | ((crc<<24) & 0xff000000);
+	return dr_crc32_swab(dr_crc32_update(0, input_data, length));
 }
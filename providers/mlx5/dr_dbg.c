@@ -43,6 +43,7 @@ enum dr_dump_rec_type {
 	DR_DUMP_REC_TYPE_DOMAIN_INFO_VPORT = 3003,
 	DR_DUMP_REC_TYPE_DOMAIN_INFO_CAPS = 3004,
 	DR_DUMP_REC_TYPE_DOMAIN_SEND_RING = 3005,
+	DR_DUMP_REC_TYPE_DOMAIN_REHASH_STATS = 3006,
 
 	DR_DUMP_REC_TYPE_TABLE = 3100,
 	DR_DUMP_REC_TYPE_TABLE_RX = 3101,
@@ -636,6 +637,30 @@ static int dr_dump_send_ring(FILE *f, struct dr_send_ring *ring,
 	return 0;
 }
 
+static int dr_dump_rehash_stats(FILE *f, struct dr_domain_rx_tx *nic_dmn,
+				const uint64_t domain_id)
+{
+	struct dr_rehash_stats *stats = &nic_dmn->rehash_stats;
+	int ret;
+
+	ret = fprintf(f, "%d,0x%" PRIx64 ",%d,%" PRIu64 ",%" PRIu64 ",%" PRIu64
+		      ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+		      DR_DUMP_REC_TYPE_DOMAIN_REHASH_STATS,
+		      domain_id,
+		      nic_dmn->type,
+		      atomic_load(&stats->num_sync),
+		      atomic_load(&stats->sync_total_ns),
+		      atomic_load(&stats->sync_max_ns),
+		      atomic_load(&stats->num_incr),
+		      atomic_load(&stats->num_steps),
+		      atomic_load(&stats->step_total_ns),
+		      atomic_load(&stats->step_max_ns));
+	if (ret < 0)
+		return ret;
+
+	return 0;
+}
+
 static int dr_dump_domain_info_flex_parser(FILE *f, const char *flex_parser_name,
 					   const uint8_t flex_parser_value,
 					   const uint64_t domain_id)
@@ -788,6 +813,14 @@ static int dr_dump_domain(FILE *f, struct mlx5dv_dr_domain *dmn)
 			if (ret < 0)
 				return ret;
 		}
+
+		ret = dr_dump_rehash_stats(f, &dmn->info.rx, domain_id);
+		if (ret < 0)
+			return ret;
+
+		ret = dr_dump_rehash_stats(f, &dmn->info.tx, domain_id);
+		if (ret < 0)
+			return ret;
 	}
 
 	return 0;
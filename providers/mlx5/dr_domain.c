@@ -172,12 +172,13 @@ clean_pd:
 
 static void dr_free_resources(struct mlx5dv_dr_domain *dmn)
 {
-	dr_send_ring_free(dmn);
+	/* The pools stop their sync threads, which use the send rings */
 	dr_domain_destroy_sw_encap_resources(dmn);
 	dr_ptrn_mngr_destroy(dmn->modify_header_ptrn_mngr);
 	dr_arg_mngr_destroy(dmn->modify_header_arg_mngr);
 	dr_icm_pool_destroy(dmn->action_icm_pool);
 	dr_icm_pool_destroy(dmn->ste_icm_pool);
+	dr_send_ring_free(dmn);
 	mlx5dv_devx_free_uar(dmn->uar);
 	ibv_dealloc_pd(dmn->pd);
 }
@@ -643,6 +644,51 @@ void mlx5dv_dr_domain_allow_duplicate_rules(struct mlx5dv_dr_domain *dmn,
 	dr_domain_unlock(dmn);
 }
 
+static void dr_domain_add_rehash_stats(struct dr_domain_rx_tx *nic_dmn,
+				       struct mlx5dv_dr_domain_rehash_stats *stats)
+{
+	struct dr_rehash_stats *nic_stats = &nic_dmn->rehash_stats;
+
+	stats->num_sync_rehash += atomic_load(&nic_stats->num_sync);
+	stats->sync_rehash_total_ns += atomic_load(&nic_stats->sync_total_ns);
+	stats->sync_rehash_max_ns = max_t(uint64_t, stats->sync_rehash_max_ns,
+					  atomic_load(&nic_stats->sync_max_ns));
+	stats->num_incr_rehash += atomic_load(&nic_stats->num_incr);
+	stats->num_rehash_steps += atomic_load(&nic_stats->num_steps);
+	stats->rehash_step_total_ns += atomic_load(&nic_stats->step_total_ns);
+	stats->rehash_step_max_ns = max_t(uint64_t, stats->rehash_step_max_ns,
+					  atomic_load(&nic_stats->step_max_ns));
+}
+
+int mlx5dv_dr_domain_query_rehash_stats(struct mlx5dv_dr_domain *dmn,
+					struct mlx5dv_dr_domain_rehash_stats *stats)
+{
+	if (!dmn->info.supp_sw_steering) {
+		errno = EOPNOTSUPP;
+		return errno;
+	}
+
+	memset(stats, 0, sizeof(*stats));
+
+	switch (dmn->type) {
+	case MLX5DV_DR_DOMAIN_TYPE_NIC_RX:
+		dr_domain_add_rehash_stats(&dmn->info.rx, stats);
+		break;
+	case MLX5DV_DR_DOMAIN_TYPE_NIC_TX:
+		dr_domain_add_rehash_stats(&dmn->info.tx, stats);
+		break;
+	case MLX5DV_DR_DOMAIN_TYPE_FDB:
+		dr_domain_add_rehash_stats(&dmn->info.rx, stats);
+		dr_domain_add_rehash_stats(&dmn->info.tx, stats);
+		break;
+	default:
+		errno = EINVAL;
+		return errno;
+	}
+
+	return 0;
+}
+
 int mlx5dv_dr_domain_destroy(struct mlx5dv_dr_domain *dmn)
 {
 	if (atomic_load(&dmn->refcount) > 1)
@@ -30,10 +30,34 @@
  */
 
 #include <stdlib.h>
+#include <unistd.h>
+#include <stdatomic.h>
 #include "mlx5dv_dr.h"
 
 #define DR_ICM_MODIFY_HDR_ALIGN_BASE	64
 
+/* Small chunks are cached per thread slot of the pool (see dr_icm_mag) */
+#define DR_ICM_POOL_MAGS		16
+#define DR_ICM_MAG_MAX_CHUNK_SZ		DR_CHUNK_SIZE_8
+#define DR_ICM_MAG_SIZE			16
+#define DR_ICM_MAG_REFILL		(DR_ICM_MAG_SIZE / 2)
+
+/*
+ * A magazine of small chunks used by the threads mapped to its slot.
+ * Allocations are served from the cached chunks, which are taken from the
+ * buddies a batch at a time, and frees are collected and handed over to
+ * the hot lists a batch at a time, so the pool lock is not taken on every
+ * call. Cached chunks were never used and are on the used_list of their
+ * buddy like any allocated chunk.
+ */
+struct dr_icm_mag {
+	pthread_spinlock_t	lock;
+	int			num_cached[DR_ICM_MAG_MAX_CHUNK_SZ + 1];
+	struct dr_icm_chunk	*cached[DR_ICM_MAG_MAX_CHUNK_SZ + 1][DR_ICM_MAG_SIZE];
+	int			num_freed;
+	struct dr_icm_chunk	*freed[DR_ICM_MAG_SIZE];
+};
+
 struct dr_icm_pool {
 	enum dr_icm_type	icm_type;
 	struct mlx5dv_dr_domain	*dmn;
@@ -44,8 +68,19 @@ struct dr_icm_pool {
 	uint64_t		hot_memory_size;
 	bool			syncing;
 	size_t			th;
+	struct dr_icm_mag	mags[DR_ICM_POOL_MAGS];
+	/* Hot memory is synced by a background thread, created on first use */
+	pthread_mutex_t		sync_mutex;
+	pthread_cond_t		sync_cond;
+	pthread_t		sync_thread;
+	pid_t			sync_pid;
+	bool			sync_requested;
+	bool			sync_stop;
 };
 
+static atomic_int dr_icm_mag_next;
+static __thread int dr_icm_mag_idx = -1;
+
 struct dr_icm_mr {
 	struct ibv_mr		*mr;
 	struct ibv_dm		*dm;
@@ -356,6 +391,15 @@ dr_icm_chunk_create(struct dr_icm_pool *pool,
 	return chunk;
 }
 
+static void dr_icm_chunk_put_mem(struct dr_icm_chunk *chunk)
+{
+	struct dr_icm_buddy_mem *buddy = chunk->buddy_mem;
+
+	dr_buddy_free_mem(buddy, chunk->seg, ilog32(chunk->num_of_entries - 1));
+	buddy->used_memory -= chunk->byte_size;
+	dr_icm_chunk_destroy(chunk);
+}
+
 static bool dr_icm_pool_is_sync_required(struct dr_icm_pool *pool)
 {
 	if (pool->hot_memory_size >= pool->th)
@@ -394,12 +438,8 @@ static int dr_icm_pool_sync_pool_buddies(struct dr_icm_pool *pool)
 
 	pthread_spin_lock(&pool->lock);
 	list_for_each_safe(&sync_list, chunk, tmp_chunk, chunk_list) {
-		buddy = chunk->buddy_mem;
-		dr_buddy_free_mem(buddy, chunk->seg,
-				  ilog32(chunk->num_of_entries - 1));
-		buddy->used_memory -= chunk->byte_size;
 		pool->hot_memory_size -= chunk->byte_size;
-		dr_icm_chunk_destroy(chunk);
+		dr_icm_chunk_put_mem(chunk);
 	}
 
 	if (need_reclaim) {
@@ -412,10 +452,68 @@ static int dr_icm_pool_sync_pool_buddies(struct dr_icm_pool *pool)
 	return err;
 }
 
-int dr_icm_pool_sync_pool(struct dr_icm_pool *pool)
+/* Move freed chunks to the hot lists, called with the pool lock held */
+static void dr_icm_pool_add_hot_chunks(struct dr_icm_pool *pool,
+				       struct dr_icm_chunk **chunks, int num)
+{
+	struct dr_icm_chunk *chunk;
+	int i;
+
+	for (i = 0; i < num; i++) {
+		chunk = chunks[i];
+		list_del_init(&chunk->chunk_list);
+		list_add_tail(&chunk->buddy_mem->hot_list, &chunk->chunk_list);
+		pool->hot_memory_size += chunk->byte_size;
+	}
+}
+
+/* Hand the chunks freed to the magazines over to the pool. Chunks cached for
+ * allocation are given back to the buddies as well when drop_cache is set.
+ */
+static void dr_icm_pool_flush_mags(struct dr_icm_pool *pool, bool drop_cache)
+{
+	struct dr_icm_chunk *cached[(DR_ICM_MAG_MAX_CHUNK_SZ + 1) * DR_ICM_MAG_SIZE];
+	struct dr_icm_chunk *freed[DR_ICM_MAG_SIZE];
+	struct dr_icm_mag *mag;
+	int num_cached, num_freed;
+	int i, j;
+
+	for (i = 0; i < DR_ICM_POOL_MAGS; i++) {
+		mag = &pool->mags[i];
+		num_cached = 0;
+
+		pthread_spin_lock(&mag->lock);
+		num_freed = mag->num_freed;
+		memcpy(freed, mag->freed, num_freed * sizeof(*freed));
+		mag->num_freed = 0;
+		if (drop_cache) {
+			for (j = 0; j <= DR_ICM_MAG_MAX_CHUNK_SZ; j++) {
+				memcpy(&cached[num_cached], mag->cached[j],
+				       mag->num_cached[j] * sizeof(*cached));
+				num_cached += mag->num_cached[j];
+				mag->num_cached[j] = 0;
+			}
+		}
+		pthread_spin_unlock(&mag->lock);
+
+		if (!num_freed && !num_cached)
+			continue;
+
+		pthread_spin_lock(&pool->lock);
+		dr_icm_pool_add_hot_chunks(pool, freed, num_freed);
+		/* Never used, no need to sync them before reuse */
+		for (j = 0; j < num_cached; j++)
+			dr_icm_chunk_put_mem(cached[j]);
+		pthread_spin_unlock(&pool->lock);
+	}
+}
+
+static int dr_icm_pool_sync(struct dr_icm_pool *pool, bool drop_cache)
 {
 	int ret = 0;
 
+	dr_icm_pool_flush_mags(pool, drop_cache);
+
 	pthread_spin_lock(&pool->lock);
 	if (!pool->syncing)
 		ret = dr_icm_pool_sync_pool_buddies(pool);
@@ -424,8 +522,79 @@ int dr_icm_pool_sync_pool(struct dr_icm_pool *pool)
 	return ret;
 }
 
+int dr_icm_pool_sync_pool(struct dr_icm_pool *pool)
+{
+	return dr_icm_pool_sync(pool, pool->dmn->flags &
+				      DR_DOMAIN_FLAG_MEMORY_RECLAIM);
+}
+
+static void *dr_icm_pool_sync_thread(void *arg)
+{
+	struct dr_icm_pool *pool = arg;
+
+	pthread_mutex_lock(&pool->sync_mutex);
+	while (!pool->sync_stop) {
+		if (!pool->sync_requested) {
+			pthread_cond_wait(&pool->sync_cond, &pool->sync_mutex);
+			continue;
+		}
+
+		pool->sync_requested = false;
+		pthread_mutex_unlock(&pool->sync_mutex);
+		dr_icm_pool_sync(pool, false);
+		pthread_mutex_lock(&pool->sync_mutex);
+	}
+	pthread_mutex_unlock(&pool->sync_mutex);
+
+	return NULL;
+}
+
+/* Ask the background thread to sync the hot memory, the thread is created
+ * on the first request. Sync inline if the thread can't be used, e.g. in
+ * the child after fork().
+ */
+static void dr_icm_pool_kick_sync(struct dr_icm_pool *pool)
+{
+	pid_t pid = getpid();
+	bool inline_sync = false;
+
+	pthread_mutex_lock(&pool->sync_mutex);
+	if (!pool->sync_pid) {
+		if (pthread_create(&pool->sync_thread, NULL,
+				   dr_icm_pool_sync_thread, pool))
+			inline_sync = true;
+		else
+			pool->sync_pid = pid;
+	} else if (pool->sync_pid != pid) {
+		inline_sync = true;
+	}
+
+	if (!inline_sync) {
+		pool->sync_requested = true;
+		pthread_cond_signal(&pool->sync_cond);
+	}
+	pthread_mutex_unlock(&pool->sync_mutex);
+
+	if (inline_sync)
+		dr_icm_pool_sync(pool, false);
+}
+
+static void dr_icm_pool_stop_sync_thread(struct dr_icm_pool *pool)
+{
+	if (pool->sync_pid != getpid())
+		return;
+
+	pthread_mutex_lock(&pool->sync_mutex);
+	pool->sync_stop = true;
+	pthread_cond_signal(&pool->sync_cond);
+	pthread_mutex_unlock(&pool->sync_mutex);
+
+	pthread_join(pool->sync_thread, NULL);
+}
+
 static int dr_icm_handle_buddies_get_mem(struct dr_icm_pool *pool,
 					 enum dr_icm_chunk_size chunk_size,
+					 bool may_grow,
 					 struct dr_icm_buddy_mem **buddy,
 					 int *seg)
 {
@@ -452,6 +621,11 @@ static int dr_icm_handle_buddies_get_mem(struct dr_icm_pool *pool,
 				goto out;
 			}
 		}
+		if (!may_grow) {
+			errno = ENOMEM;
+			err = ENOMEM;
+			goto out;
+		}
 		/* no more available allocators in that pool, create new */
 		err = dr_icm_buddy_create(pool);
 		if (err)
@@ -466,58 +640,153 @@ out:
 	return err;
 }
 
-/* Allocate an ICM chunk, each chunk holds a piece of ICM memory and
- * also memory used for HW STE management for optimisations.
- */
-struct dr_icm_chunk *dr_icm_alloc_chunk(struct dr_icm_pool *pool,
-					enum dr_icm_chunk_size chunk_size)
+/* Called with the pool lock held */
+static struct dr_icm_chunk *
+dr_icm_pool_alloc_chunk(struct dr_icm_pool *pool,
+			enum dr_icm_chunk_size chunk_size,
+			bool may_grow)
 {
 	struct dr_icm_buddy_mem *buddy;
-	struct dr_icm_chunk *chunk = NULL;
+	struct dr_icm_chunk *chunk;
 	int ret;
 	int seg;
 
-	pthread_spin_lock(&pool->lock);
-
 	if (chunk_size > pool->max_log_chunk_sz) {
 		errno = EINVAL;
-		goto out;
+		return NULL;
 	}
 
 	/* find mem, get back the relevant buddy pool and seg in that mem */
-	ret = dr_icm_handle_buddies_get_mem(pool, chunk_size, &buddy, &seg);
+	ret = dr_icm_handle_buddies_get_mem(pool, chunk_size, may_grow,
+					    &buddy, &seg);
 	if (ret)
-		goto out;
+		return NULL;
 
 	chunk = dr_icm_chunk_create(pool, chunk_size, buddy, seg);
 	if (!chunk)
-		goto out_err;
+		dr_buddy_free_mem(buddy, seg, chunk_size);
 
-	goto out;
+	return chunk;
+}
 
-out_err:
-	dr_buddy_free_mem(buddy, seg, chunk_size);
-out:
+/* Called with the pool lock held, returns true if hot memory should be synced
+ * in the background.
+ */
+static bool dr_icm_pool_free_chunks(struct dr_icm_pool *pool,
+				    struct dr_icm_chunk **chunks, int num)
+{
+	dr_icm_pool_add_hot_chunks(pool, chunks, num);
+
+	/* Check if we have chunks that are waiting for sync-ste */
+	if (!dr_icm_pool_is_sync_required(pool) || pool->syncing)
+		return false;
+
+	/* The background sync doesn't keep up, sync in place to slow down */
+	if (pool->hot_memory_size >= 2 * pool->th) {
+		dr_icm_pool_sync_pool_buddies(pool);
+		return false;
+	}
+
+	return true;
+}
+
+static struct dr_icm_mag *dr_icm_pool_get_mag(struct dr_icm_pool *pool)
+{
+	if (dr_icm_mag_idx < 0)
+		dr_icm_mag_idx = atomic_fetch_add(&dr_icm_mag_next, 1) %
+				 DR_ICM_POOL_MAGS;
+
+	return &pool->mags[dr_icm_mag_idx];
+}
+
+static struct dr_icm_chunk *
+dr_icm_mag_alloc_chunk(struct dr_icm_pool *pool,
+		       enum dr_icm_chunk_size chunk_size)
+{
+	struct dr_icm_mag *mag = dr_icm_pool_get_mag(pool);
+	struct dr_icm_chunk *chunk = NULL;
+	int *num = &mag->num_cached[chunk_size];
+
+	pthread_spin_lock(&mag->lock);
+	if (!*num) {
+		/* Only the first chunk of the batch may add a buddy */
+		pthread_spin_lock(&pool->lock);
+		while (*num < DR_ICM_MAG_REFILL) {
+			chunk = dr_icm_pool_alloc_chunk(pool, chunk_size, !*num);
+			if (!chunk)
+				break;
+			mag->cached[chunk_size][(*num)++] = chunk;
+		}
+		pthread_spin_unlock(&pool->lock);
+	}
+
+	if (*num)
+		chunk = mag->cached[chunk_size][--(*num)];
+	pthread_spin_unlock(&mag->lock);
+
+	return chunk;
+}
+
+static void dr_icm_mag_free_chunk(struct dr_icm_pool *pool,
+				  struct dr_icm_chunk *chunk)
+{
+	struct dr_icm_mag *mag = dr_icm_pool_get_mag(pool);
+	struct dr_icm_chunk *freed[DR_ICM_MAG_SIZE];
+	bool kick;
+
+	pthread_spin_lock(&mag->lock);
+	mag->freed[mag->num_freed++] = chunk;
+	if (mag->num_freed < DR_ICM_MAG_SIZE) {
+		pthread_spin_unlock(&mag->lock);
+		return;
+	}
+	memcpy(freed, mag->freed, sizeof(freed));
+	mag->num_freed = 0;
+	pthread_spin_unlock(&mag->lock);
+
+	pthread_spin_lock(&pool->lock);
+	kick = dr_icm_pool_free_chunks(pool, freed, DR_ICM_MAG_SIZE);
+	pthread_spin_unlock(&pool->lock);
+
+	if (kick)
+		dr_icm_pool_kick_sync(pool);
+}
+
+/* Allocate an ICM chunk, each chunk holds a piece of ICM memory and
+ * also memory used for HW STE management for optimisations.
+ */
+struct dr_icm_chunk *dr_icm_alloc_chunk(struct dr_icm_pool *pool,
+					enum dr_icm_chunk_size chunk_size)
+{
+	struct dr_icm_chunk *chunk;
+
+	if (chunk_size <= DR_ICM_MAG_MAX_CHUNK_SZ)
+		return dr_icm_mag_alloc_chunk(pool, chunk_size);
+
+	pthread_spin_lock(&pool->lock);
+	chunk = dr_icm_pool_alloc_chunk(pool, chunk_size, true);
 	pthread_spin_unlock(&pool->lock);
+
 	return chunk;
 }
 
 void dr_icm_free_chunk(struct dr_icm_chunk *chunk)
 {
-	struct dr_icm_buddy_mem *buddy = chunk->buddy_mem;
-	struct dr_icm_pool *pool = buddy->pool;
+	struct dr_icm_pool *pool = chunk->buddy_mem->pool;
+	bool kick;
 
 	/* move the memory to the waiting list AKA "hot" */
-	pthread_spin_lock(&pool->lock);
-	list_del_init(&chunk->chunk_list);
-	list_add_tail(&buddy->hot_list, &chunk->chunk_list);
-	buddy->pool->hot_memory_size += chunk->byte_size;
-
-	/* Check if we have chunks that are waiting for sync-ste */
-	if (dr_icm_pool_is_sync_required(pool) && !pool->syncing)
-		dr_icm_pool_sync_pool_buddies(buddy->pool);
+	if (ilog32(chunk->num_of_entries - 1) <= DR_ICM_MAG_MAX_CHUNK_SZ) {
+		dr_icm_mag_free_chunk(pool, chunk);
+		return;
+	}
 
+	pthread_spin_lock(&pool->lock);
+	kick = dr_icm_pool_free_chunks(pool, &chunk, 1);
 	pthread_spin_unlock(&pool->lock);
+
+	if (kick)
+		dr_icm_pool_kick_sync(pool);
 }
 
 void dr_icm_pool_set_pool_max_log_chunk_sz(struct dr_icm_pool *pool,
@@ -553,7 +822,7 @@ struct dr_icm_pool *dr_icm_pool_create(struct mlx5dv_dr_domain *dmn,
 				       enum dr_icm_type icm_type)
 {
 	struct dr_icm_pool *pool;
-	int ret;
+	int ret, i;
 
 	pool = calloc(1, sizeof(struct dr_icm_pool));
 	if (!pool) {
@@ -598,8 +867,35 @@ struct dr_icm_pool *dr_icm_pool_create(struct mlx5dv_dr_domain *dmn,
 		goto free_pool;
 	}
 
+	for (i = 0; i < DR_ICM_POOL_MAGS; i++) {
+		ret = pthread_spin_init(&pool->mags[i].lock,
+					PTHREAD_PROCESS_PRIVATE);
+		if (ret) {
+			errno = ret;
+			goto free_mags;
+		}
+	}
+
+	ret = pthread_mutex_init(&pool->sync_mutex, NULL);
+	if (ret) {
+		errno = ret;
+		goto free_mags;
+	}
+
+	ret = pthread_cond_init(&pool->sync_cond, NULL);
+	if (ret) {
+		errno = ret;
+		goto free_mutex;
+	}
+
 	return pool;
 
+free_mutex:
+	pthread_mutex_destroy(&pool->sync_mutex);
+free_mags:
+	while (i--)
+		pthread_spin_destroy(&pool->mags[i].lock);
+	pthread_spin_destroy(&pool->lock);
 free_pool:
 	free(pool);
 	return NULL;
@@ -608,10 +904,18 @@ free_pool:
 void dr_icm_pool_destroy(struct dr_icm_pool *pool)
 {
 	struct dr_icm_buddy_mem *buddy, *tmp_buddy;
+	int i;
+
+	dr_icm_pool_stop_sync_thread(pool);
 
+	/* Chunks left in the magazines are destroyed with their buddies */
 	list_for_each_safe(&pool->buddy_mem_list, buddy, tmp_buddy, list_node)
 		dr_icm_buddy_destroy(buddy);
 
+	pthread_cond_destroy(&pool->sync_cond);
+	pthread_mutex_destroy(&pool->sync_mutex);
+	for (i = 0; i < DR_ICM_POOL_MAGS; i++)
+		pthread_spin_destroy(&pool->mags[i].lock);
 	pthread_spin_destroy(&pool->lock);
 
 	free(pool);
@@ -30,7 +30,9 @@
  * SOFTWARE.
  */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
+#include <pthread.h>
 #include "mlx5dv_dr.h"
 
 #define DR_MASK_IPV4_ETHERTYPE        0x0800
@@ -1148,6 +1150,7 @@ static int dr_matcher_add_to_tbl(struct mlx5dv_dr_matcher *matcher)
 
 static void dr_matcher_uninit_nic(struct dr_matcher_rx_tx *nic_matcher)
 {
+	pthread_rwlock_destroy(&nic_matcher->s_htbl_lock);
 	dr_matcher_clear_ste_builders(nic_matcher);
 	dr_htbl_put(nic_matcher->s_htbl);
 	dr_htbl_put(nic_matcher->e_anchor);
@@ -1189,6 +1192,23 @@ static void dr_matcher_uninit(struct mlx5dv_dr_matcher *matcher)
 	}
 }
 
+static int dr_matcher_s_htbl_lock_init(struct dr_matcher_rx_tx *nic_matcher)
+{
+	pthread_rwlockattr_t attr;
+	int ret;
+
+	ret = pthread_rwlockattr_init(&attr);
+	if (ret)
+		return ret;
+
+	/* Growing s_htbl must not wait for the inserts to pause */
+	pthread_rwlockattr_setkind_np(&attr,
+				      PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	ret = pthread_rwlock_init(&nic_matcher->s_htbl_lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+	return ret;
+}
+
 static int dr_matcher_init_nic(struct mlx5dv_dr_matcher *matcher,
 			       struct dr_matcher_rx_tx *nic_matcher)
 {
@@ -1215,12 +1235,20 @@ static int dr_matcher_init_nic(struct mlx5dv_dr_matcher *matcher,
 	if (!nic_matcher->s_htbl)
 		goto free_e_htbl;
 
+	ret = dr_matcher_s_htbl_lock_init(nic_matcher);
+	if (ret) {
+		errno = ret;
+		goto free_s_htbl;
+	}
+
 	/* make sure the tables exist while empty */
 	dr_htbl_get(nic_matcher->s_htbl);
 	dr_htbl_get(nic_matcher->e_anchor);
 
 	return 0;
 
+free_s_htbl:
+	dr_ste_htbl_free(nic_matcher->s_htbl);
 free_e_htbl:
 	dr_ste_htbl_free(nic_matcher->e_anchor);
 clear_ste_builders:
@@ -1275,11 +1303,6 @@ static int dr_matcher_init_root(struct mlx5dv_dr_matcher *matcher,
 	return 0;
 }
 
-static bool dr_matcher_is_fixed_size(struct mlx5dv_dr_matcher *matcher)
-{
-	return (matcher->rx.fixed_size || matcher->tx.fixed_size);
-}
-
 static int dr_matcher_copy_param(struct mlx5dv_dr_matcher *matcher,
 				 struct mlx5dv_flow_match_parameters *mask)
 {
@@ -1362,13 +1385,17 @@ static int dr_matcher_init(struct mlx5dv_dr_matcher *matcher,
 		return errno;
 	}
 
-	/* Drain QP to resolve possible race between new multi QP rules
-	 * and matcher hash table initial creation.
+	if (ret)
+		return ret;
+
+	/* Rules of all matchers are written with multiple QPs, drain them to
+	 * resolve possible race between new rules and matcher hash table
+	 * initial creation.
 	 */
-	if (dr_matcher_is_fixed_size(matcher))
-		dr_send_ring_force_drain(dmn);
+	dmn->info.use_mqs = true;
+	dr_send_ring_force_drain(dmn);
 
-	return ret;
+	return 0;
 }
 
 static int
@@ -1385,6 +1412,7 @@ dr_matcher_set_nic_matcher_layout(struct mlx5dv_dr_matcher *matcher,
 		return ENOTSUP;
 	}
 
+	pthread_rwlock_wrlock(&nic_matcher->s_htbl_lock);
 	dr_domain_lock(dmn);
 
 	if (matcher_layout->flags & MLX5DV_DR_MATCHER_LAYOUT_NUM_RULE) {
@@ -1410,6 +1438,7 @@ dr_matcher_set_nic_matcher_layout(struct mlx5dv_dr_matcher *matcher,
 	dr_send_ring_force_drain(dmn);
 out:
 	dr_domain_unlock(dmn);
+	pthread_rwlock_unlock(&nic_matcher->s_htbl_lock);
 	return ret;
 }
 
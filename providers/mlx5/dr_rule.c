@@ -31,6 +31,7 @@
  */
 
 #include <stdlib.h>
+#include <time.h>
 #include <ccan/minmax.h>
 #include "mlx5dv_dr.h"
 
@@ -71,7 +72,8 @@ static int dr_rule_append_to_miss_list(struct dr_ste_ctx *ste_ctx,
 static struct dr_ste
 *dr_rule_create_collision_htbl(struct mlx5dv_dr_matcher *matcher,
 			       struct dr_matcher_rx_tx *nic_matcher,
-			       uint8_t *hw_ste)
+			       uint8_t *hw_ste,
+			       uint64_t miss_icm_addr)
 {
 	struct mlx5dv_dr_domain *dmn = matcher->tbl->dmn;
 	struct dr_ste_ctx *ste_ctx = dmn->ste_ctx;
@@ -91,8 +93,7 @@ static struct dr_ste
 
 	/* One and only entry, never grows */
 	ste = new_htbl->ste_arr;
-	dr_ste_set_miss_addr(ste_ctx, hw_ste,
-			     dr_icm_pool_get_chunk_icm_addr(nic_matcher->e_anchor->chunk));
+	dr_ste_set_miss_addr(ste_ctx, hw_ste, miss_icm_addr);
 	dr_htbl_get(new_htbl);
 
 	return ste;
@@ -106,7 +107,9 @@ static struct dr_ste *dr_rule_create_collision_entry(struct mlx5dv_dr_matcher *m
 {
 	struct dr_ste *ste;
 
-	ste = dr_rule_create_collision_htbl(matcher, nic_matcher, hw_ste);
+	ste = dr_rule_create_collision_htbl(matcher, nic_matcher, hw_ste,
+					    dr_ste_htbl_miss_icm_addr(orig_ste->htbl,
+								      nic_matcher));
 	if (!ste) {
 		dr_dbg(matcher->tbl->dmn, "Failed creating collision entry\n");
 		return NULL;
@@ -215,7 +218,9 @@ dr_rule_rehash_handle_collision(struct mlx5dv_dr_matcher *matcher,
 	struct dr_ste *new_ste;
 	int ret;
 
-	new_ste = dr_rule_create_collision_htbl(matcher, nic_matcher, hw_ste);
+	new_ste = dr_rule_create_collision_htbl(matcher, nic_matcher, hw_ste,
+						dr_ste_htbl_miss_icm_addr(col_ste->htbl,
+									  nic_matcher));
 	if (!new_ste)
 		return NULL;
 
@@ -246,6 +251,7 @@ static void dr_rule_rehash_copy_ste_ctrl(struct mlx5dv_dr_matcher *matcher,
 					 struct dr_ste *cur_ste,
 					 struct dr_ste *new_ste)
 {
+	new_ste->hash = cur_ste->hash;
 	new_ste->next_htbl = cur_ste->next_htbl;
 	new_ste->ste_chain_location = cur_ste->ste_chain_location;
 
@@ -266,12 +272,13 @@ static struct dr_ste *dr_rule_rehash_copy_ste(struct mlx5dv_dr_matcher *matcher,
 					      struct dr_matcher_rx_tx *nic_matcher,
 					      struct dr_ste *cur_ste,
 					      struct dr_ste_htbl *new_htbl,
-					      struct list_head *update_list)
+					      struct list_head *update_list,
+					      bool write_ste)
 {
 	struct dr_ste_ctx *ste_ctx = matcher->tbl->dmn->ste_ctx;
 	uint8_t hw_ste[DR_STE_SIZE] = {};
 	struct dr_ste_send_info *ste_info;
-	bool use_update_list = false;
+	bool use_update_list = write_ste;
 	struct dr_ste_build *sb;
 	struct dr_ste *new_ste;
 	uint8_t sb_idx;
@@ -285,9 +292,10 @@ static struct dr_ste *dr_rule_rehash_copy_ste(struct mlx5dv_dr_matcher *matcher,
 	memcpy(hw_ste, cur_ste->hw_ste, cur_ste->size);
 	dr_ste_set_bit_mask(hw_ste, sb);
 	dr_ste_set_miss_addr(ste_ctx, hw_ste,
-			     dr_icm_pool_get_chunk_icm_addr(nic_matcher->e_anchor->chunk));
+			     dr_ste_htbl_miss_icm_addr(new_htbl, nic_matcher));
 
-	new_idx = dr_ste_calc_hash_index(hw_ste, new_htbl);
+	/* The new table hashes the same tag bytes, only its size differs */
+	new_idx = dr_ste_hash_to_index(cur_ste->hash, new_htbl);
 	new_ste = &new_htbl->ste_arr[new_idx];
 
 	if (dr_ste_is_not_used(new_ste)) {
@@ -343,7 +351,8 @@ static int dr_rule_rehash_copy_miss_list(struct mlx5dv_dr_matcher *matcher,
 						  nic_matcher,
 						  cur_ste,
 						  new_htbl,
-						  update_list);
+						  update_list,
+						  false);
 		if (!new_ste)
 			goto err_insert;
 
@@ -399,6 +408,49 @@ clean_copy:
 	return err;
 }
 
+/* Point the STE in front of cur_htbl at new_htbl */
+static void dr_rule_rehash_connect(struct mlx5dv_dr_domain *dmn,
+				   struct dr_matcher_rx_tx *nic_matcher,
+				   struct dr_ste_htbl *cur_htbl,
+				   struct dr_ste_htbl *new_htbl,
+				   uint8_t ste_location,
+				   struct dr_ste_send_info *ste_info,
+				   struct list_head *update_list)
+{
+	struct dr_ste *ste_to_update;
+
+	if (ste_location == 1) {
+		/* The previous table is an anchor, anchors size is always one STE */
+		struct dr_ste_htbl *prev_htbl = cur_htbl->pointing_ste->htbl;
+
+		/* On matcher s_anchor we keep an extra refcount */
+		dr_htbl_get(new_htbl);
+		dr_htbl_put(cur_htbl);
+
+		nic_matcher->s_htbl = new_htbl;
+
+		/*
+		 * It is safe to operate dr_ste_set_hit_addr on the hw_ste here
+		 * (48B len) which works only on first 32B
+		 */
+		dr_ste_set_hit_addr(dmn->ste_ctx,
+				    prev_htbl->ste_arr[0].hw_ste,
+				    dr_icm_pool_get_chunk_icm_addr(new_htbl->chunk),
+				    new_htbl->chunk->num_of_entries);
+
+		ste_to_update = &prev_htbl->ste_arr[0];
+	} else {
+		dr_ste_set_hit_addr_by_next_htbl(dmn->ste_ctx,
+						 cur_htbl->pointing_ste->hw_ste,
+						 new_htbl);
+		ste_to_update = cur_htbl->pointing_ste;
+	}
+
+	dr_send_fill_and_append_ste_send_info(ste_to_update, DR_STE_SIZE_CTRL,
+					      0, ste_to_update->hw_ste, ste_info,
+					      update_list, false);
+}
+
 static struct dr_ste_htbl *dr_rule_rehash_htbl_common(struct mlx5dv_dr_matcher *matcher,
 						      struct dr_matcher_rx_tx *nic_matcher,
 						      struct dr_ste_htbl *cur_htbl,
@@ -414,7 +466,6 @@ static struct dr_ste_htbl *dr_rule_rehash_htbl_common(struct mlx5dv_dr_matcher *
 	struct dr_htbl_connect_info info;
 	LIST_HEAD(rehash_table_send_list);
 	struct dr_ste_htbl *new_htbl;
-	struct dr_ste *ste_to_update;
 	uint8_t *mask = NULL;
 	int err;
 
@@ -464,45 +515,510 @@ static struct dr_ste_htbl *dr_rule_rehash_htbl_common(struct mlx5dv_dr_matcher *
 		goto free_new_htbl;
 	}
 
-	/* Connect previous hash table to current */
-	if (ste_location == 1) {
-		/* The previous table is an anchor, anchors size is always one STE */
-		struct dr_ste_htbl *prev_htbl = cur_htbl->pointing_ste->htbl;
+	dr_rule_rehash_connect(dmn, nic_matcher, cur_htbl, new_htbl,
+			       ste_location, ste_info, update_list);
 
-		/* On matcher s_anchor we keep an extra refcount */
-		dr_htbl_get(new_htbl);
-		dr_htbl_put(cur_htbl);
+	return new_htbl;
 
-		nic_matcher->s_htbl = new_htbl;
+free_new_htbl:
+	dr_ste_htbl_free(new_htbl);
+free_ste_info:
+	free(ste_info);
+	return NULL;
+}
 
-		/*
-		 * It is safe to operate dr_ste_set_hit_addr on the hw_ste here
-		 * (48B len) which works only on first 32B
-		 */
-		dr_ste_set_hit_addr(dmn->ste_ctx,
-				    prev_htbl->ste_arr[0].hw_ste,
-				    dr_icm_pool_get_chunk_icm_addr(new_htbl->chunk),
-				    new_htbl->chunk->num_of_entries);
+/*
+ * Tables from this size on grow in steps done by the following inserts,
+ * instead of within one insert. Each step formats or cleans up to
+ * DR_REHASH_STEP_ENTRIES entries of the new table, or moves up to
+ * DR_REHASH_STEP_STES STEs of the old table.
+ */
+#define DR_REHASH_INCR_MIN_SIZE	DR_CHUNK_SIZE_1K
+#define DR_REHASH_STEP_ENTRIES	1024
+#define DR_REHASH_STEP_STES	64
 
-		ste_to_update = &prev_htbl->ste_arr[0];
-	} else {
-		dr_ste_set_hit_addr_by_next_htbl(dmn->ste_ctx,
-						 cur_htbl->pointing_ste->hw_ste,
-						 new_htbl);
-		ste_to_update = cur_htbl->pointing_ste;
+/*
+ * Keys that share an s_htbl bucket share the low bits of their hash. Taking
+ * the lock from at most this many of them keeps it the same while s_htbl is
+ * replaced in steps, when both the old and the new bucket are in use.
+ */
+#define DR_RULE_LOCK_SPAN	(1 << DR_REHASH_INCR_MIN_SIZE)
+
+static uint8_t dr_rule_bucket_lock(uint32_t hash, struct dr_ste_htbl *s_htbl)
+{
+	return (dr_ste_hash_to_index(hash, s_htbl) % DR_RULE_LOCK_SPAN) %
+	       NUM_OF_LOCKS;
+}
+
+/*
+ * The send ring a rule is written with. Each s_htbl bucket is written with
+ * the ring of its lock, so the writes to an STE are done in order without
+ * waiting for them. The rehash of s_htbl in steps writes buckets of both
+ * tables, all the rules use ring 0 meanwhile. Moving between rings drains
+ * them, see dr_rule_rehash_set_send_ring().
+ */
+static uint8_t dr_rule_send_ring(struct dr_rule_rx_tx *nic_rule)
+{
+	struct dr_matcher_rx_tx *nic_matcher = nic_rule->nic_matcher;
+
+	if (!nic_matcher->fixed_size && nic_matcher->s_htbl->rehash)
+		return 0;
+
+	return dr_rule_bucket_lock(nic_rule->s_hash, nic_matcher->s_htbl);
+}
+
+/*
+ * Called holding the matcher exclusive once s_htbl was replaced, or starts
+ * or stops being replaced in steps. Other rules write buckets of s_htbl
+ * with other rings from now on, complete what was written so far first.
+ */
+static void dr_rule_rehash_set_send_ring(struct mlx5dv_dr_domain *dmn,
+					 struct dr_rule_rx_tx *nic_rule)
+{
+	dr_send_ring_force_drain(dmn);
+	nic_rule->lock_index = dr_rule_send_ring(nic_rule);
+}
+
+static uint64_t dr_rule_get_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Inserts into different buckets account concurrently */
+static void dr_rule_rehash_account(uint64_t start_ns,
+				   _Atomic(uint64_t) *total_ns,
+				   _Atomic(uint64_t) *max_ns)
+{
+	uint64_t elapsed = dr_rule_get_time_ns() - start_ns;
+	uint64_t max = atomic_load(max_ns);
+
+	atomic_fetch_add(total_ns, elapsed);
+	while (elapsed > max &&
+	       !atomic_compare_exchange_weak(max_ns, &max, elapsed))
+		;
+}
+
+static void dr_rule_rehash_incr_abort(struct dr_ste_htbl_rehash *rehash)
+{
+	if (rehash->old_htbl)
+		rehash->old_htbl->rehash = NULL;
+	rehash->new_htbl->rehash = NULL;
+
+	/* Not connected yet, nothing else refers to the new table */
+	if (rehash->state == DR_STE_HTBL_REHASH_FORMAT)
+		dr_ste_htbl_free(rehash->new_htbl);
+
+	dr_ste_htbl_free(rehash->anchor);
+	free(rehash);
+}
+
+static void dr_rule_rehash_incr_start(struct mlx5dv_dr_matcher *matcher,
+				      struct dr_matcher_rx_tx *nic_matcher,
+				      struct dr_ste_htbl *cur_htbl,
+				      enum dr_icm_chunk_size new_size,
+				      uint8_t send_ring_idx)
+{
+	struct dr_domain_rx_tx *nic_dmn = nic_matcher->nic_tbl->nic_dmn;
+	struct mlx5dv_dr_domain *dmn = matcher->tbl->dmn;
+	struct dr_ste_htbl_rehash *rehash;
+	struct dr_htbl_connect_info info;
+
+	/* On failure the table is rehashed at once when it fills */
+	rehash = calloc(1, sizeof(*rehash));
+	if (!rehash)
+		return;
+
+	rehash->new_htbl = dr_ste_htbl_alloc(dmn->ste_icm_pool,
+					     new_size,
+					     cur_htbl->type,
+					     cur_htbl->lu_type,
+					     cur_htbl->byte_mask);
+	if (!rehash->new_htbl)
+		goto free_rehash;
+
+	/* The anchor sends the misses of the new table to the old one */
+	rehash->anchor = dr_ste_htbl_alloc(dmn->ste_icm_pool,
+					   DR_CHUNK_SIZE_1,
+					   DR_STE_HTBL_TYPE_LEGACY,
+					   DR_STE_LU_TYPE_DONT_CARE,
+					   0);
+	if (!rehash->anchor)
+		goto free_new_htbl;
+
+	info.type = CONNECT_HIT;
+	info.hit_next_htbl = cur_htbl;
+	if (dr_ste_htbl_init_and_postsend(dmn, nic_dmn, rehash->anchor,
+					  &info, true, send_ring_idx)) {
+		dr_dbg(dmn, "Failed writing rehash anchor to HW\n");
+		goto free_anchor;
 	}
 
-	dr_send_fill_and_append_ste_send_info(ste_to_update, DR_STE_SIZE_CTRL,
-					      0, ste_to_update->hw_ste, ste_info,
-					      update_list, false);
+	rehash->state = DR_STE_HTBL_REHASH_FORMAT;
+	rehash->old_htbl = cur_htbl;
+	rehash->send_ring_idx = send_ring_idx;
+	rehash->matcher = matcher;
+	rehash->nic_matcher = nic_matcher;
+	cur_htbl->rehash = rehash;
+	rehash->new_htbl->rehash = rehash;
 
-	return new_htbl;
+	nic_dmn->rehash_stats.num_incr++;
+	return;
 
+free_anchor:
+	dr_ste_htbl_free(rehash->anchor);
 free_new_htbl:
-	dr_ste_htbl_free(new_htbl);
-free_ste_info:
-	free(ste_info);
-	return NULL;
+	dr_ste_htbl_free(rehash->new_htbl);
+free_rehash:
+	free(rehash);
+}
+
+static int dr_rule_rehash_format_step(struct dr_ste_htbl_rehash *rehash)
+{
+	struct dr_domain_rx_tx *nic_dmn = rehash->nic_matcher->nic_tbl->nic_dmn;
+	uint32_t entries = rehash->new_htbl->chunk->num_of_entries;
+	struct mlx5dv_dr_domain *dmn = rehash->matcher->tbl->dmn;
+	uint8_t formated_ste[DR_STE_SIZE] = {};
+	struct dr_htbl_connect_info info;
+	uint32_t num;
+	int ret;
+
+	info.type = CONNECT_MISS;
+	info.miss_icm_addr = dr_icm_pool_get_chunk_icm_addr(rehash->anchor->chunk);
+	dr_ste_set_formated_ste(dmn->ste_ctx,
+				dmn->info.caps.gvmi,
+				nic_dmn->type,
+				rehash->new_htbl,
+				formated_ste,
+				&info);
+
+	num = min_t(uint32_t, entries - rehash->pos, DR_REHASH_STEP_ENTRIES);
+	ret = dr_send_postsend_formated_range(dmn, rehash->new_htbl,
+					      formated_ste, rehash->pos, num,
+					      rehash->send_ring_idx);
+	if (ret)
+		return ret;
+
+	rehash->pos += num;
+	return 0;
+}
+
+/* Moved buckets of the old table always miss, like empty ones */
+static void dr_rule_rehash_set_moved_ste(struct dr_ste_htbl_rehash *rehash,
+					 uint8_t *formated_ste)
+{
+	struct dr_domain_rx_tx *nic_dmn = rehash->nic_matcher->nic_tbl->nic_dmn;
+	struct mlx5dv_dr_domain *dmn = rehash->matcher->tbl->dmn;
+	struct dr_htbl_connect_info info;
+
+	info.type = CONNECT_MISS;
+	info.miss_icm_addr =
+		dr_icm_pool_get_chunk_icm_addr(rehash->nic_matcher->e_anchor->chunk);
+	dr_ste_set_formated_ste(dmn->ste_ctx,
+				dmn->info.caps.gvmi,
+				nic_dmn->type,
+				rehash->old_htbl,
+				formated_ste,
+				&info);
+}
+
+/* Move the miss list of ste, a used bucket of the old table, in order */
+static int dr_rule_rehash_migrate_bucket(struct dr_ste_htbl_rehash *rehash,
+					 struct dr_ste *ste,
+					 uint8_t *formated_ste,
+					 int *moved)
+{
+	struct dr_matcher_rx_tx *nic_matcher = rehash->nic_matcher;
+	struct mlx5dv_dr_matcher *matcher = rehash->matcher;
+	struct mlx5dv_dr_domain *dmn = matcher->tbl->dmn;
+	struct dr_ste *cur_ste, *tmp_ste;
+	uint8_t hw_ste[DR_STE_SIZE];
+	LIST_HEAD(update_list);
+	int ret;
+
+	list_for_each_safe(dr_ste_get_miss_list(ste), cur_ste, tmp_ste,
+			   miss_list_node) {
+		if (!dr_rule_rehash_copy_ste(matcher, nic_matcher,
+					     cur_ste, rehash->new_htbl,
+					     &update_list, true))
+			return errno;
+
+		list_del(&cur_ste->miss_list_node);
+		dr_htbl_put(cur_ste->htbl);
+		(*moved)++;
+
+		/* The new table is live, write the STE before linking it */
+		ret = dr_rule_send_update_list(&update_list, dmn, true,
+					       rehash->send_ring_idx);
+		if (ret)
+			return ret;
+	}
+
+	memcpy(hw_ste, formated_ste, DR_STE_SIZE);
+	return dr_send_postsend_ste(dmn, ste, hw_ste, DR_STE_SIZE, 0,
+				    rehash->send_ring_idx);
+}
+
+static int dr_rule_rehash_migrate_step(struct dr_ste_htbl_rehash *rehash)
+{
+	struct dr_ste_htbl *old_htbl = rehash->old_htbl;
+	uint8_t formated_ste[DR_STE_SIZE] = {};
+	struct dr_ste *ste;
+	uint32_t end;
+	int moved = 0;
+	int ret = 0;
+
+	dr_rule_rehash_set_moved_ste(rehash, formated_ste);
+
+	end = min_t(uint32_t, old_htbl->chunk->num_of_entries,
+		    rehash->pos + DR_REHASH_STEP_ENTRIES);
+
+	/* The last entry moved frees the old table, not before we are done */
+	dr_htbl_get(old_htbl);
+
+	/* Buckets moved ahead of time by inserts are empty by now */
+	for (; rehash->pos < end && moved < DR_REHASH_STEP_STES; rehash->pos++) {
+		ste = &old_htbl->ste_arr[rehash->pos];
+		if (dr_ste_is_not_used(ste))
+			continue;
+
+		ret = dr_rule_rehash_migrate_bucket(rehash, ste, formated_ste,
+						    &moved);
+		if (ret)
+			break;
+	}
+
+	dr_htbl_put(old_htbl);
+	return ret;
+}
+
+/*
+ * Move the old bucket of hash ahead of the migration step. A duplicate of
+ * an entry that was not moved yet is inserted after it this way, and the
+ * older rule keeps matching first.
+ */
+static int dr_rule_rehash_migrate_hash(struct dr_ste_htbl_rehash *rehash,
+				       uint32_t hash)
+{
+	struct dr_ste_htbl *old_htbl = rehash->old_htbl;
+	uint8_t formated_ste[DR_STE_SIZE] = {};
+	struct dr_ste *ste;
+	int moved = 0;
+	int ret;
+
+	ste = &old_htbl->ste_arr[dr_ste_hash_to_index(hash, old_htbl)];
+	if (dr_ste_is_not_used(ste))
+		return 0;
+
+	dr_rule_rehash_set_moved_ste(rehash, formated_ste);
+
+	dr_htbl_get(old_htbl);
+	ret = dr_rule_rehash_migrate_bucket(rehash, ste, formated_ste, &moved);
+	dr_htbl_put(old_htbl);
+
+	return ret;
+}
+
+static int dr_rule_rehash_cleanup_step(struct dr_ste_htbl_rehash *rehash)
+{
+	struct dr_domain_rx_tx *nic_dmn = rehash->nic_matcher->nic_tbl->nic_dmn;
+	struct dr_matcher_rx_tx *nic_matcher = rehash->nic_matcher;
+	struct mlx5dv_dr_domain *dmn = rehash->matcher->tbl->dmn;
+	struct dr_ste_htbl *htbl = rehash->new_htbl;
+	uint8_t formated_ste[DR_STE_SIZE] = {};
+	struct dr_ste_ctx *ste_ctx = dmn->ste_ctx;
+	struct dr_htbl_connect_info info;
+	uint64_t anchor_icm_addr;
+	uint8_t ctrl[DR_STE_SIZE];
+	struct dr_ste *last_ste;
+	uint32_t first, end, i;
+	int ret;
+
+	anchor_icm_addr = dr_icm_pool_get_chunk_icm_addr(rehash->anchor->chunk);
+	info.type = CONNECT_MISS;
+	info.miss_icm_addr =
+		dr_icm_pool_get_chunk_icm_addr(nic_matcher->e_anchor->chunk);
+	dr_ste_set_formated_ste(ste_ctx,
+				dmn->info.caps.gvmi,
+				nic_dmn->type,
+				htbl,
+				formated_ste,
+				&info);
+
+	first = rehash->pos;
+	end = min_t(uint32_t, htbl->chunk->num_of_entries,
+		    rehash->pos + DR_REHASH_STEP_ENTRIES);
+
+	for (i = first; i < end; i++) {
+		if (dr_ste_is_not_used(&htbl->ste_arr[i]))
+			continue;
+
+		/* Rewrite the run of empty entries before this one */
+		if (i != first) {
+			ret = dr_send_postsend_formated_range(dmn, htbl,
+							      formated_ste,
+							      first, i - first,
+							      rehash->send_ring_idx);
+			if (ret)
+				return ret;
+		}
+		first = i + 1;
+
+		last_ste = list_tail(dr_ste_get_miss_list(&htbl->ste_arr[i]),
+				     struct dr_ste, miss_list_node);
+		if (dr_ste_get_miss_addr(ste_ctx, last_ste->hw_ste) != anchor_icm_addr)
+			continue;
+
+		dr_ste_set_miss_addr(ste_ctx, last_ste->hw_ste,
+				     info.miss_icm_addr);
+		memcpy(ctrl, last_ste->hw_ste, DR_STE_SIZE_CTRL);
+		ret = dr_send_postsend_ste(dmn, last_ste, ctrl,
+					   DR_STE_SIZE_CTRL, 0,
+					   rehash->send_ring_idx);
+		if (ret)
+			return ret;
+	}
+
+	if (end != first) {
+		ret = dr_send_postsend_formated_range(dmn, htbl, formated_ste,
+						      first, end - first,
+						      rehash->send_ring_idx);
+		if (ret)
+			return ret;
+	}
+
+	rehash->pos = end;
+	if (rehash->pos == htbl->chunk->num_of_entries) {
+		/* Nothing misses to the anchor anymore */
+		htbl->rehash = NULL;
+		dr_ste_htbl_free(rehash->anchor);
+		free(rehash);
+	}
+
+	return 0;
+}
+
+static bool dr_rule_rehash_incr_ready(struct dr_ste_htbl *htbl)
+{
+	struct dr_ste_htbl_rehash *rehash = htbl->rehash;
+
+	return rehash->state == DR_STE_HTBL_REHASH_FORMAT &&
+	       rehash->pos == rehash->new_htbl->chunk->num_of_entries;
+}
+
+/* Replace cur_htbl by its formatted successor, entries move over later */
+static struct dr_ste_htbl *
+dr_rule_rehash_incr_connect(struct mlx5dv_dr_matcher *matcher,
+			    struct dr_matcher_rx_tx *nic_matcher,
+			    struct dr_ste_htbl *cur_htbl,
+			    uint8_t ste_location,
+			    struct list_head *update_list)
+{
+	struct dr_ste_htbl_rehash *rehash = cur_htbl->rehash;
+	struct dr_ste_htbl *new_htbl = rehash->new_htbl;
+	struct dr_ste_send_info *ste_info;
+
+	ste_info = calloc(1, sizeof(*ste_info));
+	if (!ste_info) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	rehash->state = DR_STE_HTBL_REHASH_MIGRATE;
+	rehash->pos = 0;
+
+	/* The new table lives at least as long as the old one has entries */
+	dr_htbl_get(new_htbl);
+
+	new_htbl->pointing_ste = cur_htbl->pointing_ste;
+	new_htbl->pointing_ste->next_htbl = new_htbl;
+
+	dr_rule_rehash_connect(matcher->tbl->dmn, nic_matcher, cur_htbl,
+			       new_htbl, ste_location, ste_info, update_list);
+
+	return new_htbl;
+}
+
+/* Called when a table that takes part in an incremental rehash is freed */
+void dr_rule_rehash_htbl_free(struct dr_ste_htbl *htbl)
+{
+	struct dr_ste_htbl_rehash *rehash = htbl->rehash;
+	struct dr_matcher_rx_tx *nic_matcher = rehash->nic_matcher;
+	struct mlx5dv_dr_domain *dmn = rehash->matcher->tbl->dmn;
+	struct dr_htbl_connect_info info;
+
+	if (rehash->state != DR_STE_HTBL_REHASH_MIGRATE) {
+		/* The old table emptied, or the new one after it was gone */
+		dr_rule_rehash_incr_abort(rehash);
+		return;
+	}
+
+	/* All entries were moved or removed, stop visiting the old table */
+	htbl->rehash = NULL;
+	rehash->old_htbl = NULL;
+	rehash->state = DR_STE_HTBL_REHASH_CLEANUP;
+	rehash->pos = 0;
+
+	info.type = CONNECT_MISS;
+	info.miss_icm_addr =
+		dr_icm_pool_get_chunk_icm_addr(nic_matcher->e_anchor->chunk);
+	if (dr_ste_htbl_init_and_postsend(dmn, nic_matcher->nic_tbl->nic_dmn,
+					  rehash->anchor, &info, true,
+					  rehash->send_ring_idx))
+		dr_dbg(dmn, "Failed writing rehash anchor to HW\n");
+
+	dr_htbl_put(rehash->new_htbl);
+}
+
+/* Complete or drop the incremental rehash of htbl */
+static int dr_rule_rehash_incr_flush(struct dr_ste_htbl *htbl)
+{
+	struct dr_ste_htbl_rehash *rehash;
+	int ret = 0;
+
+	while ((rehash = htbl->rehash)) {
+		switch (rehash->state) {
+		case DR_STE_HTBL_REHASH_FORMAT:
+			dr_rule_rehash_incr_abort(rehash);
+			return 0;
+		case DR_STE_HTBL_REHASH_MIGRATE:
+			/* Moving the last entry frees the old table */
+			if (rehash->pos == rehash->old_htbl->chunk->num_of_entries)
+				return EBUSY;
+			ret = dr_rule_rehash_migrate_step(rehash);
+			break;
+		case DR_STE_HTBL_REHASH_CLEANUP:
+			ret = dr_rule_rehash_cleanup_step(rehash);
+			break;
+		}
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/* Look for hw_ste among the entries that were not moved to htbl yet */
+static struct dr_ste *dr_rule_rehash_find_ste(struct dr_ste_htbl *htbl,
+					      uint32_t hash,
+					      uint8_t *hw_ste)
+{
+	struct dr_ste_htbl_rehash *rehash = htbl->rehash;
+	struct dr_ste_htbl *old_htbl;
+	struct dr_ste *ste;
+
+	if (!rehash || rehash->state != DR_STE_HTBL_REHASH_MIGRATE)
+		return NULL;
+
+	old_htbl = rehash->old_htbl;
+	ste = &old_htbl->ste_arr[dr_ste_hash_to_index(hash, old_htbl)];
+	if (dr_ste_is_not_used(ste))
+		return NULL;
+
+	return dr_rule_find_ste_in_miss_list(dr_ste_get_miss_list(ste), hw_ste,
+					     dr_ste_tag_sz(ste));
 }
 
 static struct dr_ste_htbl *dr_rule_rehash_htbl(struct mlx5dv_dr_rule *rule,
@@ -534,6 +1050,12 @@ int dr_rule_rehash_matcher_s_anchor(struct mlx5dv_dr_matcher *matcher,
 		return 0;
 	}
 
+	ret = dr_rule_rehash_incr_flush(nic_matcher->s_htbl);
+	if (ret) {
+		dr_dbg(dmn, "Failed completing matcher s_anchor rehash\n");
+		return ret;
+	}
+
 	new_htbl = dr_rule_rehash_htbl_common(matcher, nic_matcher,
 					      nic_matcher->s_htbl,
 					      1, &update_list, new_size, 0);
@@ -559,24 +1081,48 @@ err_out:
 	return ENOTSUP;
 }
 
+static enum dr_icm_chunk_size dr_rule_rehash_new_size(struct dr_ste_htbl *htbl,
+						      struct mlx5dv_dr_domain *dmn)
+{
+	enum dr_icm_chunk_size new_size;
+
+	new_size = dr_icm_next_higher_chunk(htbl->chunk_size);
+	return min_t(uint32_t, new_size, dmn->info.max_log_sw_icm_rehash_sz);
+}
+
 static struct dr_ste_htbl *dr_rule_rehash(struct mlx5dv_dr_rule *rule,
 					  struct dr_rule_rx_tx *nic_rule,
 					  struct dr_ste_htbl *cur_htbl,
 					  uint8_t ste_location,
 					  struct list_head *update_list)
 {
+	struct dr_matcher_rx_tx *nic_matcher = nic_rule->nic_matcher;
+	struct dr_rehash_stats *stats = &nic_matcher->nic_tbl->nic_dmn->rehash_stats;
 	struct mlx5dv_dr_domain *dmn = rule->matcher->tbl->dmn;
 	enum dr_icm_chunk_size new_size;
+	struct dr_ste_htbl *new_htbl;
+	uint64_t start_ns;
 
-	new_size = dr_icm_next_higher_chunk(cur_htbl->chunk_size);
-	new_size = min_t(uint32_t, new_size,
-			 dmn->info.max_log_sw_icm_rehash_sz);
+	/* The new table was already written by the previous inserts */
+	if (cur_htbl->rehash)
+		return dr_rule_rehash_incr_connect(rule->matcher, nic_matcher,
+						   cur_htbl, ste_location,
+						   update_list);
 
+	new_size = dr_rule_rehash_new_size(cur_htbl, dmn);
 	if (new_size == cur_htbl->chunk_size)
 		return NULL; /* Skip rehash, we already at the max size */
 
-	return dr_rule_rehash_htbl(rule, nic_rule, cur_htbl, ste_location,
-				   update_list, new_size);
+	start_ns = dr_rule_get_time_ns();
+	new_htbl = dr_rule_rehash_htbl(rule, nic_rule, cur_htbl, ste_location,
+				       update_list, new_size);
+	if (new_htbl && new_htbl == nic_matcher->s_htbl)
+		dr_rule_rehash_set_send_ring(dmn, nic_rule);
+	stats->num_sync++;
+	dr_rule_rehash_account(start_ns, &stats->sync_total_ns,
+			       &stats->sync_max_ns);
+
+	return new_htbl;
 }
 
 static struct dr_ste *dr_rule_handle_collision(struct mlx5dv_dr_matcher *matcher,
@@ -678,8 +1224,14 @@ void dr_rule_set_last_member(struct dr_rule_rx_tx *nic_rule,
 static struct dr_ste *dr_rule_get_pointed_ste(struct dr_ste *curr_ste)
 {
 	struct dr_ste *first_ste = dr_ste_get_miss_list_top(curr_ste);
+	struct dr_ste_htbl *htbl = first_ste->htbl;
+
+	/* A table being moved is no longer pointed at, its successor is */
+	if (htbl->rehash && htbl->rehash->state == DR_STE_HTBL_REHASH_MIGRATE &&
+	    htbl->rehash->old_htbl == htbl)
+		htbl = htbl->rehash->new_htbl;
 
-	return first_ste->htbl->pointing_ste;
+	return htbl->pointing_ste;
 }
 
 void dr_rule_get_reverse_rule_members(struct dr_ste **ste_arr,
@@ -768,8 +1320,11 @@ static int dr_rule_handle_cross_action_stes(struct mlx5dv_dr_rule *rule,
 	struct dr_ste *action_ste, *cross_dmn_action_ste,
 		      *cross_dmn_rule_ste;
 	bool is_ste_for_cross_dmn;
+	uint64_t miss_icm_addr;
 	int i, k;
 
+	miss_icm_addr = dr_icm_pool_get_chunk_icm_addr(nic_matcher->e_anchor->chunk);
+
 	for (i = num_of_builders, k = 0; i < new_hw_ste_arr_sz; i++, k++) {
 		curr_hw_ste = hw_ste_arr + i * DR_STE_SIZE;
 
@@ -781,7 +1336,8 @@ static int dr_rule_handle_cross_action_stes(struct mlx5dv_dr_rule *rule,
 		if (!is_ste_for_cross_dmn) {
 			action_ste = dr_rule_create_collision_htbl(matcher,
 								   nic_matcher,
-								   curr_hw_ste);
+								   curr_hw_ste,
+								   miss_icm_addr);
 			if (!action_ste)
 				return errno;
 
@@ -850,12 +1406,11 @@ static int dr_rule_handle_cross_action_stes(struct mlx5dv_dr_rule *rule,
 	return 0;
 }
 
-static bool dr_rule_need_enlarge_hash(struct dr_ste_htbl *htbl,
-				      struct mlx5dv_dr_domain *dmn,
-				      struct dr_domain_rx_tx *nic_dmn)
+static bool dr_rule_htbl_over_threshold(struct dr_ste_htbl *htbl,
+					struct mlx5dv_dr_domain *dmn,
+					int threshold)
 {
 	struct dr_ste_htbl_ctrl *ctrl = &htbl->ctrl;
-	int threshold;
 
 	if (dmn->info.max_log_sw_icm_sz <= htbl->chunk_size)
 		return false;
@@ -867,7 +1422,6 @@ static bool dr_rule_need_enlarge_hash(struct dr_ste_htbl *htbl,
 	    dr_get_bits_per_mask(htbl->byte_mask) * CHAR_BIT <= htbl->chunk_size)
 		return false;
 
-	threshold = dr_ste_htbl_increase_threshold(htbl);
 	if (ctrl->num_of_collisions >= threshold &&
 	    (ctrl->num_of_valid_entries - ctrl->num_of_collisions) >= threshold)
 		return true;
@@ -875,6 +1429,102 @@ static bool dr_rule_need_enlarge_hash(struct dr_ste_htbl *htbl,
 	return false;
 }
 
+static bool dr_rule_need_enlarge_hash(struct dr_ste_htbl *htbl,
+				      struct mlx5dv_dr_domain *dmn,
+				      struct dr_domain_rx_tx *nic_dmn)
+{
+	/* A table replaced in steps grows once its successor is written */
+	if (htbl->rehash && !dr_rule_rehash_incr_ready(htbl))
+		return false;
+
+	return dr_rule_htbl_over_threshold(htbl, dmn,
+					   dr_ste_htbl_increase_threshold(htbl));
+}
+
+/*
+ * An incremental rehash starts once a large table is half way to its growth
+ * threshold. The new table is formatted as the table fills up further, so
+ * it is ready by the time the threshold is reached, and from then on every
+ * insert moves or cleans up some more entries.
+ */
+static bool dr_rule_rehash_step_due(struct dr_ste_htbl *htbl,
+				    struct mlx5dv_dr_domain *dmn)
+{
+	struct dr_ste_htbl_rehash *rehash = htbl->rehash;
+	int threshold = dr_ste_htbl_increase_threshold(htbl);
+	uint64_t formatted;
+
+	if (!rehash)
+		return htbl->chunk_size >= DR_REHASH_INCR_MIN_SIZE &&
+		       dr_rule_rehash_new_size(htbl, dmn) != htbl->chunk_size &&
+		       dr_rule_htbl_over_threshold(htbl, dmn, threshold / 2);
+
+	if (rehash->state != DR_STE_HTBL_REHASH_FORMAT)
+		return true;
+
+	if (dr_rule_rehash_incr_ready(htbl))
+		return false;
+
+	formatted = (uint64_t)(threshold - threshold / 2) * rehash->pos /
+		    rehash->new_htbl->chunk->num_of_entries;
+
+	return dr_rule_htbl_over_threshold(htbl, dmn,
+					   threshold / 2 + formatted);
+}
+
+/* Do the next step of the incremental rehash of htbl, or start one */
+static int dr_rule_rehash_step(struct mlx5dv_dr_matcher *matcher,
+			       struct dr_rule_rx_tx *nic_rule,
+			       struct dr_ste_htbl *htbl)
+{
+	struct dr_matcher_rx_tx *nic_matcher = nic_rule->nic_matcher;
+	struct dr_rehash_stats *stats = &nic_matcher->nic_tbl->nic_dmn->rehash_stats;
+	struct dr_ste_htbl_rehash *rehash = htbl->rehash;
+	struct mlx5dv_dr_domain *dmn = matcher->tbl->dmn;
+	uint64_t start_ns;
+	int ret = 0;
+
+	if (!dr_rule_rehash_step_due(htbl, dmn))
+		return 0;
+
+	start_ns = dr_rule_get_time_ns();
+
+	if (!rehash) {
+		dr_rule_rehash_incr_start(matcher, nic_matcher, htbl,
+					  dr_rule_rehash_new_size(htbl, dmn),
+					  nic_rule->lock_index);
+		rehash = htbl->rehash;
+		if (!rehash)
+			return 0;
+		if (htbl == nic_matcher->s_htbl)
+			dr_rule_rehash_set_send_ring(dmn, nic_rule);
+	}
+
+	/* The ring of the bucket changes when s_htbl starts a rehash */
+	rehash->send_ring_idx = nic_rule->lock_index;
+
+	switch (rehash->state) {
+	case DR_STE_HTBL_REHASH_FORMAT:
+		ret = dr_rule_rehash_format_step(rehash);
+		break;
+	case DR_STE_HTBL_REHASH_MIGRATE:
+		ret = dr_rule_rehash_migrate_step(rehash);
+		break;
+	case DR_STE_HTBL_REHASH_CLEANUP:
+		ret = dr_rule_rehash_cleanup_step(rehash);
+		break;
+	}
+
+	if (!htbl->rehash && htbl == nic_matcher->s_htbl)
+		dr_rule_rehash_set_send_ring(dmn, nic_rule);
+
+	stats->num_steps++;
+	dr_rule_rehash_account(start_ns, &stats->step_total_ns,
+			       &stats->step_max_ns);
+
+	return ret;
+}
+
 static int dr_rule_handle_regular_action_stes(struct mlx5dv_dr_rule *rule,
 					      struct dr_rule_rx_tx *nic_rule,
 					      struct list_head *send_ste_list,
@@ -889,6 +1539,7 @@ static int dr_rule_handle_regular_action_stes(struct mlx5dv_dr_rule *rule,
 	struct mlx5dv_dr_domain *dmn = matcher->tbl->dmn;
 	uint8_t *curr_hw_ste, *prev_hw_ste;
 	struct dr_ste *action_ste;
+	uint64_t miss_icm_addr;
 	int i, k, ret;
 
 	/* Two cases:
@@ -901,12 +1552,15 @@ static int dr_rule_handle_regular_action_stes(struct mlx5dv_dr_rule *rule,
 		return 0;
 	}
 
+	miss_icm_addr = dr_icm_pool_get_chunk_icm_addr(nic_matcher->e_anchor->chunk);
+
 	for (i = num_of_builders, k = 0; i < new_hw_ste_arr_sz; i++, k++) {
 		curr_hw_ste = hw_ste_arr + i * DR_STE_SIZE;
 		prev_hw_ste = (i == 0) ? curr_hw_ste : hw_ste_arr + ((i - 1) * DR_STE_SIZE);
 		action_ste = dr_rule_create_collision_htbl(matcher,
 							   nic_matcher,
-							   curr_hw_ste);
+							   curr_hw_ste,
+							   miss_icm_addr);
 		if (!action_ste)
 			return errno;
 
@@ -995,7 +1649,7 @@ static int dr_rule_handle_empty_entry(struct mlx5dv_dr_matcher *matcher,
 	list_add_tail(miss_list, &ste->miss_list_node);
 
 	dr_ste_set_miss_addr(ste_ctx, hw_ste,
-			     dr_icm_pool_get_chunk_icm_addr(nic_matcher->e_anchor->chunk));
+			     dr_ste_htbl_miss_icm_addr(cur_htbl, nic_matcher));
 
 	ste->ste_chain_location = ste_location;
 
@@ -1038,6 +1692,7 @@ static struct dr_ste *dr_rule_handle_ste_branch(struct mlx5dv_dr_rule *rule,
 						struct list_head *send_ste_list,
 						struct dr_ste_htbl *cur_htbl,
 						uint8_t *hw_ste,
+						uint32_t *hw_ste_hash,
 						uint8_t ste_location,
 						struct dr_ste_htbl **put_htbl)
 {
@@ -1048,15 +1703,67 @@ static struct dr_ste *dr_rule_handle_ste_branch(struct mlx5dv_dr_rule *rule,
 	struct dr_ste_htbl *new_htbl;
 	struct list_head *miss_list;
 	struct dr_ste *matched_ste;
-	bool skip_rehash = nic_matcher->fixed_size;
 	struct dr_ste *ste;
+	bool skip_rehash;
+	uint32_t hash;
 	int index;
 
+	/* s_htbl is rehashed only by exclusive holders of the matcher */
+	skip_rehash = nic_matcher->fixed_size ||
+		      (ste_location == 1 &&
+		       nic_rule->lock_mode == DR_RULE_LOCK_SHARED);
+
+	/* A rehashed table keeps the type and byte mask, so the hash holds */
+	hash = hw_ste_hash ? *hw_ste_hash : dr_ste_calc_hash(hw_ste, cur_htbl);
+
+	if (!skip_rehash && dr_rule_rehash_step(matcher, nic_rule, cur_htbl)) {
+		dr_dbg(dmn, "Failed rehash step, htbl-log_size: %d\n",
+		       cur_htbl->chunk_size);
+		return NULL;
+	}
 again:
-	index = dr_ste_calc_hash_index(hw_ste, cur_htbl);
+	index = dr_ste_hash_to_index(hash, cur_htbl);
 	miss_list = &cur_htbl->chunk->miss_list[index];
 	ste = &cur_htbl->ste_arr[index];
 
+	/*
+	 * Check if this ste is in the miss list, or in the table this one
+	 * replaces if it was not moved over yet.
+	 */
+	matched_ste = NULL;
+	if (!dr_ste_is_not_used(ste))
+		matched_ste = dr_rule_find_ste_in_miss_list(miss_list, hw_ste,
+							    dr_ste_tag_sz(ste));
+	if (!matched_ste) {
+		matched_ste = dr_rule_rehash_find_ste(cur_htbl, hash, hw_ste);
+		if (matched_ste &&
+		    dr_ste_is_last_in_rule(nic_matcher, ste_location)) {
+			/* Keep the duplicate behind the entry it repeats */
+			if (dr_rule_rehash_migrate_hash(cur_htbl->rehash, hash)) {
+				dr_dbg(dmn, "Failed moving rehashed bucket\n");
+				return NULL;
+			}
+			goto again;
+		}
+	}
+
+	if (matched_ste) {
+		/*
+		 * if it is last STE in the chain, and has the same tag
+		 * it means that all the previous stes are the same,
+		 * if so, this rule is duplicated.
+		 */
+		if (!dr_ste_is_last_in_rule(nic_matcher, ste_location))
+			return matched_ste;
+
+		if (dmn->flags & DR_DOMAIN_FLAG_DISABLE_DUPLICATE_RULES) {
+			dr_dbg(dmn, "Duplicate rules are not supported\n");
+			errno = EEXIST;
+			return NULL;
+		}
+		dr_dbg(dmn, "Duplicate rule inserted\n");
+	}
+
 	if (dr_ste_is_not_used(ste)) {
 		if (dr_rule_handle_empty_entry(matcher, nic_rule, cur_htbl,
 					       ste, ste_location,
@@ -1064,26 +1771,6 @@ again:
 					       send_ste_list))
 			return NULL;
 	} else {
-		/* Hash table index in use, check if this ste is in the miss list */
-		matched_ste = dr_rule_find_ste_in_miss_list(miss_list, hw_ste,
-							    dr_ste_tag_sz(ste));
-		if (matched_ste) {
-			/*
-			 * if it is last STE in the chain, and has the same tag
-			 * it means that all the previous stes are the same,
-			 * if so, this rule is duplicated.
-			 */
-			if (!dr_ste_is_last_in_rule(nic_matcher, ste_location))
-				return matched_ste;
-
-			if (dmn->flags & DR_DOMAIN_FLAG_DISABLE_DUPLICATE_RULES) {
-				dr_dbg(dmn, "Duplicate rules are not supported\n");
-				errno = EEXIST;
-				return NULL;
-			}
-			dr_dbg(dmn, "Duplicate rule inserted\n");
-		}
-
 		if (!skip_rehash && dr_rule_need_enlarge_hash(cur_htbl, dmn, nic_dmn)) {
 			/* Hash table index in use, try to resize of the hash */
 			skip_rehash = true;
@@ -1120,6 +1807,7 @@ again:
 			}
 		}
 	}
+	ste->hash = hash;
 	return ste;
 }
 
@@ -1233,10 +1921,91 @@ static bool dr_rule_verify(struct mlx5dv_dr_matcher *matcher,
 	return true;
 }
 
+static void dr_rule_unlock(struct dr_rule_rx_tx *nic_rule)
+{
+	struct dr_matcher_rx_tx *nic_matcher = nic_rule->nic_matcher;
+	struct dr_domain_rx_tx *nic_dmn = nic_matcher->nic_tbl->nic_dmn;
+
+	pthread_spin_unlock(&nic_dmn->locks[nic_rule->bucket_lock]);
+	if (nic_rule->lock_mode != DR_RULE_LOCK_FIXED)
+		pthread_rwlock_unlock(&nic_matcher->s_htbl_lock);
+}
+
+static void dr_rule_lock_mode(struct dr_rule_rx_tx *nic_rule, uint8_t *hw_ste,
+			      bool excl)
+{
+	struct dr_matcher_rx_tx *nic_matcher = nic_rule->nic_matcher;
+	struct dr_domain_rx_tx *nic_dmn = nic_matcher->nic_tbl->nic_dmn;
+	bool fixed_size;
+
+again:
+	fixed_size = nic_matcher->fixed_size;
+	if (fixed_size) {
+		nic_rule->lock_mode = DR_RULE_LOCK_FIXED;
+	} else if (excl) {
+		pthread_rwlock_wrlock(&nic_matcher->s_htbl_lock);
+		nic_rule->lock_mode = DR_RULE_LOCK_EXCL;
+	} else {
+		pthread_rwlock_rdlock(&nic_matcher->s_htbl_lock);
+		nic_rule->lock_mode = DR_RULE_LOCK_SHARED;
+	}
+
+	/* The hash does not depend on the size of s_htbl */
+	if (hw_ste)
+		nic_rule->s_hash = dr_ste_calc_hash(hw_ste, nic_matcher->s_htbl);
+
+	nic_rule->bucket_lock = dr_rule_bucket_lock(nic_rule->s_hash,
+						    nic_matcher->s_htbl);
+	pthread_spin_lock(&nic_dmn->locks[nic_rule->bucket_lock]);
+
+	/* The matcher layout may have changed meanwhile */
+	if (fixed_size != nic_matcher->fixed_size ||
+	    nic_rule->bucket_lock != dr_rule_bucket_lock(nic_rule->s_hash,
+							 nic_matcher->s_htbl)) {
+		dr_rule_unlock(nic_rule);
+		goto again;
+	}
+
+	nic_rule->lock_index = dr_rule_send_ring(nic_rule);
+}
+
+/*
+ * Lock the s_htbl bucket of the rule, hw_ste is the first STE of a rule
+ * being added. Rules of resizable matchers are added and removed in
+ * parallel unless s_htbl has to grow, or is being replaced and the old
+ * table could be freed, which is done holding the matcher exclusive.
+ */
+static void dr_rule_lock(struct mlx5dv_dr_matcher *matcher,
+			 struct dr_rule_rx_tx *nic_rule, uint8_t *hw_ste)
+{
+	struct dr_matcher_rx_tx *nic_matcher = nic_rule->nic_matcher;
+	struct dr_domain_rx_tx *nic_dmn = nic_matcher->nic_tbl->nic_dmn;
+	struct mlx5dv_dr_domain *dmn = matcher->tbl->dmn;
+	struct dr_ste_htbl *s_htbl;
+	bool busy;
+
+	dr_rule_lock_mode(nic_rule, hw_ste, false);
+	if (nic_rule->lock_mode != DR_RULE_LOCK_SHARED)
+		return;
+
+	s_htbl = nic_matcher->s_htbl;
+	if (hw_ste)
+		busy = dr_rule_rehash_step_due(s_htbl, dmn) ||
+		       dr_rule_need_enlarge_hash(s_htbl, dmn, nic_dmn);
+	else
+		busy = s_htbl->rehash &&
+		       s_htbl->rehash->state == DR_STE_HTBL_REHASH_MIGRATE;
+
+	if (busy) {
+		dr_rule_unlock(nic_rule);
+		dr_rule_lock_mode(nic_rule, NULL, true);
+	}
+}
+
 static int dr_rule_destroy_rule_nic(struct mlx5dv_dr_rule *rule,
 				    struct dr_rule_rx_tx *nic_rule)
 {
-	dr_rule_lock(nic_rule, NULL);
+	dr_rule_lock(rule->matcher, nic_rule, NULL);
 	dr_rule_clean_rule_members(rule, nic_rule);
 	dr_rule_unlock(nic_rule);
 	return 0;
@@ -1368,7 +2137,7 @@ dr_rule_create_rule_nic(struct mlx5dv_dr_rule *rule,
 		return ret;
 
 	/* Set the lock index, and use the relative lock  */
-	dr_rule_lock(nic_rule, hw_ste_arr);
+	dr_rule_lock(matcher, nic_rule, hw_ste_arr);
 
 	/* Set the actions values/addresses inside the ste array */
 	ret = dr_actions_build_ste_arr(matcher, nic_matcher, actions,
@@ -1395,6 +2164,7 @@ dr_rule_create_rule_nic(struct mlx5dv_dr_rule *rule,
 						&send_ste_list,
 						cur_htbl,
 						cur_hw_ste_ent,
+						!i ? &nic_rule->s_hash : NULL,
 						i + 1,
 						&htbl);
 		if (!ste) {
@@ -1628,6 +2398,41 @@ struct mlx5dv_dr_rule *mlx5dv_dr_rule_create(struct mlx5dv_dr_matcher *matcher,
 	return rule;
 }
 
+int mlx5dv_dr_rule_create_bulk(struct mlx5dv_dr_matcher *matcher,
+			       size_t num_rules,
+			       struct mlx5dv_flow_match_parameters *values[],
+			       size_t num_actions[],
+			       struct mlx5dv_dr_action **actions[],
+			       struct mlx5dv_dr_rule *rules[])
+{
+	bool batch = !dr_is_root_table(matcher->tbl);
+	size_t i;
+	int err;
+
+	if (num_rules > INT_MAX) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	if (batch)
+		dr_send_batch_begin();
+
+	for (i = 0; i < num_rules; i++) {
+		rules[i] = mlx5dv_dr_rule_create(matcher, values[i],
+						 num_actions[i], actions[i]);
+		if (!rules[i])
+			break;
+	}
+
+	if (batch) {
+		err = errno;
+		dr_send_batch_end(matcher->tbl->dmn);
+		errno = err;
+	}
+
+	return i;
+}
+
 int mlx5dv_dr_rule_destroy(struct mlx5dv_dr_rule *rule)
 {
 	struct mlx5dv_dr_matcher *matcher = rule->matcher;
@@ -407,6 +407,8 @@ dr_set_header_modify_arg_update_seg(struct mlx5_wqe_header_modify_argument_updat
 
 static void dr_post_send_db(struct dr_qp *dr_qp, void *ctrl)
 {
+	dr_qp->db_pending = NULL;
+
 	/*
 	 * Make sure that descriptors are written before
 	 * updating doorbell record and ringing the doorbell
@@ -586,20 +588,61 @@ static void dr_rdma_segments(struct dr_qp *dr_qp, uint64_t remote_addr,
 
 	if (send_now)
 		dr_post_send_db(dr_qp, ctrl);
+	else
+		dr_qp->db_pending = ctrl;
 }
 
+/* Set while this thread creates a bulk of rules, see dr_send_batch_begin() */
+static __thread bool dr_send_batch;
+
 static void dr_post_send(struct dr_qp *dr_qp, struct postsend_info *send_info)
 {
+	/*
+	 * In a batch the doorbell is held back, except for signaled WQEs
+	 * since the ring waits for their completion to make progress.
+	 */
+	bool send_now = !dr_send_batch ||
+		((send_info->write.send_flags | send_info->read.send_flags) &
+		 IBV_SEND_SIGNALED);
+
 	if (send_info->type == WRITE_ICM) {
 		/* false, because we delay the post_send_db till the coming READ */
 		dr_rdma_segments(dr_qp, send_info->remote_addr, send_info->rkey,
 				 &send_info->write, MLX5_OPCODE_RDMA_WRITE, false);
-		/* true, because we send WRITE + READ together */
+		/* send WRITE + READ together */
 		dr_rdma_segments(dr_qp, send_info->remote_addr, send_info->rkey,
-				 &send_info->read, MLX5_OPCODE_RDMA_READ, true);
+				 &send_info->read, MLX5_OPCODE_RDMA_READ, send_now);
 	} else { /* GTA_ARG */
 		dr_rdma_segments(dr_qp, send_info->remote_addr, send_info->rkey,
-				 &send_info->write, MLX5_OPCODE_FLOW_TBL_ACCESS, true);
+				 &send_info->write, MLX5_OPCODE_FLOW_TBL_ACCESS,
+				 send_now);
+	}
+}
+
+/*
+ * Hold back the send ring doorbells of this thread, so the ICM writes of
+ * many rules reach the HW with one doorbell per ring.
+ */
+void dr_send_batch_begin(void)
+{
+	dr_send_batch = true;
+}
+
+/* Ring the doorbells held back since dr_send_batch_begin() */
+void dr_send_batch_end(struct mlx5dv_dr_domain *dmn)
+{
+	struct dr_send_ring *send_ring;
+	int i;
+
+	dr_send_batch = false;
+
+	for (i = 0; i < DR_MAX_SEND_RINGS; i++) {
+		send_ring = dmn->send_ring[i];
+
+		pthread_spin_lock(&send_ring->lock);
+		if (send_ring->qp->db_pending)
+			dr_post_send_db(send_ring->qp, send_ring->qp->db_pending);
+		pthread_spin_unlock(&send_ring->lock);
 	}
 }
 
@@ -942,6 +985,55 @@ out_free:
 	return ret;
 }
 
+/* Write num default STEs into htbl starting at entry first */
+int dr_send_postsend_formated_range(struct mlx5dv_dr_domain *dmn,
+				    struct dr_ste_htbl *htbl,
+				    uint8_t *ste_init_data,
+				    uint32_t first, uint32_t num,
+				    uint8_t send_ring_idx)
+{
+	uint32_t max_stes = dmn->info.max_send_size / DR_STE_SIZE;
+	uint8_t *data;
+	uint32_t i;
+	int ret = 0;
+
+	max_stes = min_t(uint32_t, num, max_stes);
+	data = calloc(max_stes, DR_STE_SIZE);
+	if (!data) {
+		errno = ENOMEM;
+		return errno;
+	}
+
+	/* Prepare a copy, callers reuse ste_init_data for several ranges */
+	memcpy(data, ste_init_data, DR_STE_SIZE);
+	dr_ste_prepare_for_postsend(dmn->ste_ctx, data, DR_STE_SIZE);
+
+	/* Copy the same STE on the data buffer */
+	for (i = 1; i < max_stes; i++)
+		memcpy(data + i * DR_STE_SIZE, data, DR_STE_SIZE);
+
+	while (num) {
+		uint32_t num_stes = min_t(uint32_t, num, max_stes);
+		struct postsend_info send_info = {};
+
+		send_info.write.addr	= (uintptr_t) data;
+		send_info.write.length	= num_stes * DR_STE_SIZE;
+		send_info.write.lkey	= 0;
+		send_info.remote_addr	= dr_ste_get_mr_addr(htbl->ste_arr + first);
+		send_info.rkey		= dr_icm_pool_get_chunk_rkey(htbl->chunk);
+
+		ret = dr_postsend_icm_data(dmn, &send_info, send_ring_idx);
+		if (ret)
+			break;
+
+		first += num_stes;
+		num -= num_stes;
+	}
+
+	free(data);
+	return ret;
+}
+
 int dr_send_postsend_action(struct mlx5dv_dr_domain *dmn,
 			    struct mlx5dv_dr_action *action)
 {
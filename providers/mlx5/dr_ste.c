@@ -39,20 +39,15 @@ struct dr_hw_ste_format {
 	uint8_t mask[DR_STE_SIZE_MASK];
 };
 
-uint32_t dr_ste_calc_hash_index(uint8_t *hw_ste_p, struct dr_ste_htbl *htbl)
+uint32_t dr_ste_calc_hash(uint8_t *hw_ste_p, struct dr_ste_htbl *htbl)
 {
 	struct dr_hw_ste_format *hw_ste = (struct dr_hw_ste_format *)hw_ste_p;
 	uint8_t masked[DR_STE_SIZE_TAG] = {};
-	uint32_t crc32, index;
 	uint8_t *p_masked;
 	uint16_t bit;
 	size_t len;
 	int i;
 
-	/* Don't calculate CRC if the result is predicted */
-	if (htbl->chunk->num_of_entries == 1)
-		return 0;
-
 	if (htbl->type == DR_STE_HTBL_TYPE_LEGACY) {
 		if (htbl->byte_mask == 0)
 			return 0;
@@ -72,10 +67,12 @@ uint32_t dr_ste_calc_hash_index(uint8_t *hw_ste_p, struct dr_ste_htbl *htbl)
 		p_masked = hw_ste->tag;
 	}
 
-	crc32 = dr_crc32_slice8_calc(p_masked, len);
-	index = crc32 % htbl->chunk->num_of_entries;
+	return dr_crc32_calc(p_masked, len);
+}
 
-	return index;
+uint32_t dr_ste_hash_to_index(uint32_t hash, struct dr_ste_htbl *htbl)
+{
+	return hash % htbl->chunk->num_of_entries;
 }
 
 uint16_t dr_ste_conv_bit_to_byte_mask(uint8_t *bit_mask)
@@ -124,6 +121,11 @@ void dr_ste_set_miss_addr(struct dr_ste_ctx *ste_ctx, uint8_t *hw_ste_p,
 	ste_ctx->set_miss_addr(hw_ste_p, miss_addr);
 }
 
+uint64_t dr_ste_get_miss_addr(struct dr_ste_ctx *ste_ctx, uint8_t *hw_ste_p)
+{
+	return ste_ctx->get_miss_addr(hw_ste_p);
+}
+
 static void dr_ste_always_miss_addr(struct dr_ste_ctx *ste_ctx,
 				    struct dr_ste *ste,
 				    uint64_t miss_addr,
@@ -164,6 +166,34 @@ uint64_t dr_ste_get_mr_addr(struct dr_ste *ste)
 	       DR_STE_SIZE * index;
 }
 
+/* Where the chain ends of htbl miss to */
+uint64_t dr_ste_htbl_miss_icm_addr(struct dr_ste_htbl *htbl,
+				   struct dr_matcher_rx_tx *nic_matcher)
+{
+	struct dr_ste_htbl_rehash *rehash = htbl->rehash;
+
+	/* Entries not yet moved from the old table are looked up there */
+	if (rehash && rehash->state == DR_STE_HTBL_REHASH_MIGRATE &&
+	    rehash->new_htbl == htbl)
+		return dr_icm_pool_get_chunk_icm_addr(rehash->anchor->chunk);
+
+	return dr_icm_pool_get_chunk_icm_addr(nic_matcher->e_anchor->chunk);
+}
+
+/* Misses to the anchor of a rehash being cleaned up go to the end anchor */
+static uint64_t dr_ste_htbl_fix_miss_addr(struct dr_ste_htbl *htbl,
+					  struct dr_matcher_rx_tx *nic_matcher,
+					  uint64_t miss_addr)
+{
+	struct dr_ste_htbl_rehash *rehash = htbl->rehash;
+
+	if (rehash && rehash->state == DR_STE_HTBL_REHASH_CLEANUP &&
+	    miss_addr == dr_icm_pool_get_chunk_icm_addr(rehash->anchor->chunk))
+		return dr_icm_pool_get_chunk_icm_addr(nic_matcher->e_anchor->chunk);
+
+	return miss_addr;
+}
+
 struct list_head *dr_ste_get_miss_list(struct dr_ste *ste)
 {
 	uint32_t index = ste - ste->htbl->ste_arr;
@@ -226,6 +256,7 @@ bool dr_ste_is_last_in_rule(struct dr_matcher_rx_tx *nic_matcher,
 static void dr_ste_replace(struct dr_ste *dst, struct dr_ste *src)
 {
 	memcpy(dst->hw_ste, src->hw_ste, dst->size);
+	dst->hash = src->hash;
 	dst->next_htbl = src->next_htbl;
 	if (dst->next_htbl)
 		dst->next_htbl->pointing_ste = dst;
@@ -254,8 +285,7 @@ dr_ste_remove_head_ste(struct dr_ste_ctx *ste_ctx,
 		return;
 
 	info.type = CONNECT_MISS;
-	info.miss_icm_addr =
-		dr_icm_pool_get_chunk_icm_addr(nic_matcher->e_anchor->chunk);
+	info.miss_icm_addr = dr_ste_htbl_miss_icm_addr(ste->htbl, nic_matcher);
 	dr_ste_set_formated_ste(ste_ctx,
 				dmn->info.caps.gvmi,
 				nic_dmn->type,
@@ -279,7 +309,8 @@ dr_ste_remove_head_ste(struct dr_ste_ctx *ste_ctx,
  * |_ste_| --> |_next_ste_| -->|__| -->|__| -->/0
  */
 static void
-dr_ste_replace_head_ste(struct dr_matcher_rx_tx *nic_matcher,
+dr_ste_replace_head_ste(struct dr_ste_ctx *ste_ctx,
+			struct dr_matcher_rx_tx *nic_matcher,
 			struct dr_ste *ste, struct dr_ste *next_ste,
 			struct dr_ste_send_info *ste_info_head,
 			struct list_head *send_ste_list,
@@ -298,6 +329,9 @@ dr_ste_replace_head_ste(struct dr_matcher_rx_tx *nic_matcher,
 
 	/* Move data from next into ste */
 	dr_ste_replace(ste, next_ste);
+	ste_ctx->set_miss_addr(ste->hw_ste,
+			       dr_ste_htbl_fix_miss_addr(stats_tbl, nic_matcher,
+							 ste_ctx->get_miss_addr(ste->hw_ste)));
 
 	/* Update the rule on STE change */
 	dr_rule_set_last_member(next_ste->rule_rx_tx, ste, false);
@@ -330,6 +364,7 @@ dr_ste_replace_head_ste(struct dr_matcher_rx_tx *nic_matcher,
  * |__| -->|_prev_ste_|->|_ste_|-->|_next_ste_|
  */
 static void dr_ste_remove_middle_ste(struct dr_ste_ctx *ste_ctx,
+				     struct dr_matcher_rx_tx *nic_matcher,
 				     struct dr_ste *ste,
 				     struct dr_ste_send_info *ste_info,
 				     struct list_head *send_ste_list,
@@ -342,6 +377,7 @@ static void dr_ste_remove_middle_ste(struct dr_ste_ctx *ste_ctx,
 	assert(prev_ste);
 
 	miss_addr = ste_ctx->get_miss_addr(ste->hw_ste);
+	miss_addr = dr_ste_htbl_fix_miss_addr(stats_tbl, nic_matcher, miss_addr);
 	ste_ctx->set_miss_addr(prev_ste->hw_ste, miss_addr);
 
 	dr_send_fill_and_append_ste_send_info(prev_ste, DR_STE_SIZE_CTRL, 0,
@@ -389,13 +425,15 @@ void dr_ste_free(struct dr_ste *ste,
 					       stats_tbl);
 		} else {
 			/* First but not only entry in the list */
-			dr_ste_replace_head_ste(nic_matcher, ste, next_ste,
+			dr_ste_replace_head_ste(ste_ctx, nic_matcher,
+						ste, next_ste,
 						&ste_info_head, &send_ste_list,
 						stats_tbl);
 			put_on_origin_table = false;
 		}
 	} else { /* Ste in the middle of the list */
-		dr_ste_remove_middle_ste(ste_ctx, ste, &ste_info_head,
+		dr_ste_remove_middle_ste(ste_ctx, nic_matcher, ste,
+					 &ste_info_head,
 					 &send_ste_list, stats_tbl);
 	}
 
@@ -593,6 +631,9 @@ int dr_ste_htbl_free(struct dr_ste_htbl *htbl)
 	if (atomic_load(&htbl->refcount))
 		return EBUSY;
 
+	if (htbl->rehash)
+		dr_rule_rehash_htbl_free(htbl);
+
 	dr_icm_free_chunk(htbl->chunk);
 	free(htbl);
 	return 0;
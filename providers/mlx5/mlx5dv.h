@@ -2006,6 +2006,19 @@ void mlx5dv_dr_domain_set_reclaim_device_memory(struct mlx5dv_dr_domain *dmn,
 void mlx5dv_dr_domain_allow_duplicate_rules(struct mlx5dv_dr_domain *domain,
 					    bool allow);
 
+struct mlx5dv_dr_domain_rehash_stats {
+	uint64_t num_sync_rehash;
+	uint64_t sync_rehash_total_ns;
+	uint64_t sync_rehash_max_ns;
+	uint64_t num_incr_rehash;
+	uint64_t num_rehash_steps;
+	uint64_t rehash_step_total_ns;
+	uint64_t rehash_step_max_ns;
+};
+
+int mlx5dv_dr_domain_query_rehash_stats(struct mlx5dv_dr_domain *domain,
+					struct mlx5dv_dr_domain_rehash_stats *stats);
+
 struct mlx5dv_dr_table *
 mlx5dv_dr_table_create(struct mlx5dv_dr_domain *domain, uint32_t level);
 
@@ -2038,6 +2051,13 @@ mlx5dv_dr_rule_create(struct mlx5dv_dr_matcher *matcher,
 		      size_t num_actions,
 		      struct mlx5dv_dr_action *actions[]);
 
+int mlx5dv_dr_rule_create_bulk(struct mlx5dv_dr_matcher *matcher,
+			       size_t num_rules,
+			       struct mlx5dv_flow_match_parameters *values[],
+			       size_t num_actions[],
+			       struct mlx5dv_dr_action **actions[],
+			       struct mlx5dv_dr_rule *rules[]);
+
 int mlx5dv_dr_rule_destroy(struct mlx5dv_dr_rule *rule);
 
 enum mlx5dv_dr_action_flags {
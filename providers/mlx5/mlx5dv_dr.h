@@ -233,6 +233,8 @@ struct dr_ste {
 	uint8_t			*hw_ste;
 	/* refcount: indicates the num of rules that using this ste */
 	atomic_int		refcount;
+	/* CRC of the tag, the hash table index is derived from it */
+	uint32_t		hash;
 
 	/* attached to the miss_list head at each htbl entry */
 	struct list_node	miss_list_node;
@@ -254,10 +256,10 @@ struct dr_ste_htbl_ctrl {
 	/* total number of valid entries belonging to this hash table. This
 	 * includes the non collision and collision entries
 	 */
-	int	num_of_valid_entries;
+	atomic_int	num_of_valid_entries;
 
 	/* total number of collisions entries attached to this table */
-	int	num_of_collisions;
+	atomic_int	num_of_collisions;
 };
 
 enum dr_ste_htbl_type {
@@ -265,6 +267,33 @@ enum dr_ste_htbl_type {
 	DR_STE_HTBL_TYPE_MATCH		= 1,
 };
 
+enum dr_ste_htbl_rehash_state {
+	DR_STE_HTBL_REHASH_FORMAT,
+	DR_STE_HTBL_REHASH_MIGRATE,
+	DR_STE_HTBL_REHASH_CLEANUP,
+};
+
+/*
+ * Incremental rehash of a large table, shared by the old table and the new
+ * one, each step is done by a later insert into the table:
+ * FORMAT  - the new table is written, the old one is still the live table.
+ * MIGRATE - the new table is connected, its misses continue through the
+ *	     anchor to the old table whose buckets are moved over.
+ * CLEANUP - the old table is gone, new table misses to the anchor are
+ *	     redirected to the matcher end anchor.
+ */
+struct dr_ste_htbl_rehash {
+	enum dr_ste_htbl_rehash_state	state;
+	struct dr_ste_htbl		*old_htbl;
+	struct dr_ste_htbl		*new_htbl;
+	struct dr_ste_htbl		*anchor;
+	/* Next entry to handle by the current state */
+	uint32_t			pos;
+	uint8_t				send_ring_idx;
+	struct mlx5dv_dr_matcher	*matcher;
+	struct dr_matcher_rx_tx		*nic_matcher;
+};
+
 struct dr_ste_htbl {
 	enum dr_ste_htbl_type	type;
 	uint16_t		lu_type;
@@ -280,6 +309,7 @@ struct dr_ste_htbl {
 	struct dr_ste		*pointing_ste;
 
 	struct dr_ste_htbl_ctrl ctrl;
+	struct dr_ste_htbl_rehash *rehash;
 };
 
 struct dr_ste_send_info {
@@ -337,9 +367,13 @@ static inline void dr_htbl_get(struct dr_ste_htbl *htbl)
 }
 
 /* STE utils */
-uint32_t dr_ste_calc_hash_index(uint8_t *hw_ste_p, struct dr_ste_htbl *htbl);
+uint32_t dr_ste_calc_hash(uint8_t *hw_ste_p, struct dr_ste_htbl *htbl);
+uint32_t dr_ste_hash_to_index(uint32_t hash, struct dr_ste_htbl *htbl);
+uint64_t dr_ste_htbl_miss_icm_addr(struct dr_ste_htbl *htbl,
+				   struct dr_matcher_rx_tx *nic_matcher);
 void dr_ste_set_miss_addr(struct dr_ste_ctx *ste_ctx, uint8_t *hw_ste_p,
 			  uint64_t miss_addr);
+uint64_t dr_ste_get_miss_addr(struct dr_ste_ctx *ste_ctx, uint8_t *hw_ste_p);
 void dr_ste_set_hit_addr_by_next_htbl(struct dr_ste_ctx *ste_ctx,
 				      uint8_t *hw_ste,
 				      struct dr_ste_htbl *next_htbl);
@@ -1049,12 +1083,26 @@ enum dr_domain_nic_type {
 	DR_DOMAIN_NIC_TYPE_TX,
 };
 
+/* Time spent blocking inserts on hash table growth */
+struct dr_rehash_stats {
+	/* Tables rehashed at once */
+	_Atomic(uint64_t)	num_sync;
+	_Atomic(uint64_t)	sync_total_ns;
+	_Atomic(uint64_t)	sync_max_ns;
+	/* Tables rehashed in steps */
+	_Atomic(uint64_t)	num_incr;
+	_Atomic(uint64_t)	num_steps;
+	_Atomic(uint64_t)	step_total_ns;
+	_Atomic(uint64_t)	step_max_ns;
+};
+
 struct dr_domain_rx_tx {
 	uint64_t		drop_icm_addr;
 	uint64_t		default_icm_addr;
 	enum dr_domain_nic_type	type;
 	/* protect rx/tx domain */
 	pthread_spinlock_t	locks[NUM_OF_LOCKS];
+	struct dr_rehash_stats	rehash_stats;
 };
 
 struct dr_domain_info {
@@ -1182,6 +1230,12 @@ struct dr_matcher_rx_tx {
 	uint64_t			default_icm_addr;
 	struct dr_table_rx_tx		*nic_tbl;
 	bool				fixed_size;
+	/*
+	 * Rules of a resizable matcher are added and removed holding this
+	 * shared and the domain lock of their s_htbl bucket, s_htbl is
+	 * replaced or rehashed only holding it exclusive.
+	 */
+	pthread_rwlock_t		s_htbl_lock;
 };
 
 struct mlx5dv_dr_matcher {
@@ -1360,10 +1414,22 @@ struct dr_htbl_connect_info {
 	};
 };
 
+enum dr_rule_lock_mode {
+	DR_RULE_LOCK_FIXED,
+	DR_RULE_LOCK_SHARED,
+	DR_RULE_LOCK_EXCL,
+};
+
 struct dr_rule_rx_tx {
 	struct dr_matcher_rx_tx		*nic_matcher;
 	struct dr_ste			*last_rule_ste;
+	/* Hash of the first STE, it selects the rule's s_htbl bucket */
+	uint32_t			s_hash;
+	/* Send ring, the same as bucket_lock on fixed size matchers */
 	uint8_t				lock_index;
+	/* Domain lock and matcher lock mode taken by dr_rule_lock() */
+	uint8_t				bucket_lock;
+	uint8_t				lock_mode;
 };
 
 struct mlx5dv_dr_rule {
@@ -1380,36 +1446,6 @@ struct mlx5dv_dr_rule {
 	uint16_t		num_actions;
 };
 
-static inline void
-dr_rule_lock(struct dr_rule_rx_tx *nic_rule, uint8_t *hw_ste)
-{
-	struct dr_matcher_rx_tx *nic_matcher = nic_rule->nic_matcher;
-	struct dr_domain_rx_tx *nic_dmn = nic_matcher->nic_tbl->nic_dmn;
-	uint32_t index;
-
-	if (nic_matcher->fixed_size) {
-		if (hw_ste) {
-			index = dr_ste_calc_hash_index(hw_ste, nic_matcher->s_htbl);
-			nic_rule->lock_index = index % NUM_OF_LOCKS;
-		}
-		pthread_spin_lock(&nic_dmn->locks[nic_rule->lock_index]);
-	} else {
-		pthread_spin_lock(&nic_dmn->locks[0]);
-	}
-}
-
-static inline void
-dr_rule_unlock(struct dr_rule_rx_tx *nic_rule)
-{
-	struct dr_matcher_rx_tx *nic_matcher = nic_rule->nic_matcher;
-	struct dr_domain_rx_tx *nic_dmn = nic_matcher->nic_tbl->nic_dmn;
-
-	if (nic_matcher->fixed_size)
-		pthread_spin_unlock(&nic_dmn->locks[nic_rule->lock_index]);
-	else
-		pthread_spin_unlock(&nic_dmn->locks[0]);
-}
-
 void dr_rule_set_last_member(struct dr_rule_rx_tx *nic_rule,
 			     struct dr_ste *ste,
 			     bool force);
@@ -1609,6 +1645,7 @@ bool dr_domain_set_max_ste_icm_size(struct mlx5dv_dr_domain *dmn,
 int dr_rule_rehash_matcher_s_anchor(struct mlx5dv_dr_matcher *matcher,
 				    struct dr_matcher_rx_tx *nic_matcher,
 				    enum dr_icm_chunk_size new_size);
+void dr_rule_rehash_htbl_free(struct dr_ste_htbl *htbl);
 
 struct dr_icm_pool *dr_icm_pool_create(struct mlx5dv_dr_domain *dmn,
 				       enum dr_icm_type icm_type);
@@ -1642,6 +1679,7 @@ void dr_ste_copy_param(uint8_t match_criteria,
 
 void dr_crc32_init_table(void);
 uint32_t dr_crc32_slice8_calc(const void *input_data, size_t length);
+uint32_t dr_crc32_calc(const void *input_data, size_t length);
 
 struct dr_wq {
 	unsigned	*wqe_head;
@@ -1668,6 +1706,8 @@ struct dr_qp {
 	struct mlx5dv_devx_uar		*uar;
 	struct mlx5dv_devx_umem		*buf_umem;
 	struct mlx5dv_devx_umem		*db_umem;
+	/* Last WQE posted without ringing the doorbell */
+	void				*db_pending;
 	uint8_t nc_uar : 1;
 };
 
@@ -1706,6 +1746,8 @@ struct dr_send_ring {
 int dr_send_ring_alloc(struct mlx5dv_dr_domain *dmn);
 void dr_send_ring_free(struct mlx5dv_dr_domain *dmn);
 int dr_send_ring_force_drain(struct mlx5dv_dr_domain *dmn);
+void dr_send_batch_begin(void);
+void dr_send_batch_end(struct mlx5dv_dr_domain *dmn);
 bool dr_send_allow_fl(struct dr_devx_caps *caps);
 int dr_send_postsend_ste(struct mlx5dv_dr_domain *dmn, struct dr_ste *ste,
 			 uint8_t *data, uint16_t size, uint16_t offset,
@@ -1718,6 +1760,11 @@ int dr_send_postsend_formated_htbl(struct mlx5dv_dr_domain *dmn,
 				   uint8_t *ste_init_data,
 				   bool update_hw_ste,
 				   uint8_t send_ring_idx);
+int dr_send_postsend_formated_range(struct mlx5dv_dr_domain *dmn,
+				    struct dr_ste_htbl *htbl,
+				    uint8_t *ste_init_data,
+				    uint32_t first, uint32_t num,
+				    uint8_t send_ring_idx);
 int dr_send_postsend_action(struct mlx5dv_dr_domain *dmn,
 			    struct mlx5dv_dr_action *action);
 int dr_send_postsend_pattern(struct mlx5dv_dr_domain *dmn,
@@ -1734,7 +1781,9 @@ struct dr_icm_mr;
 struct dr_icm_buddy_mem {
 	unsigned long		**bits;
 	unsigned int		*num_free;
+	/* Non empty words of bits, and of set_bit, for each order */
 	unsigned long		**set_bit;
+	unsigned long		**set_top;
 	uint32_t		max_order;
 	struct list_node	list_node;
 	struct dr_icm_mr	*icm_mr;
@@ -0,0 +1,195 @@
+// SPDX-License-Identifier: (GPL-2.0 OR Linux-OpenIB)
+/*
+ * Check the ICM buddy allocator against a map of the allocated entries
+ * under random allocations and frees, then time allocating and freeing
+ * small chunks from a buddy of the size the STE pool uses.
+ *
+ * Run with -b to also print the benchmark.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../mlx5dv_dr.h"
+
+#define TEST_ORDER	12
+#define TEST_ROUNDS	200000
+#define MAX_ALLOCS	(1 << TEST_ORDER)
+#define BENCH_ORDER	DR_CHUNK_SIZE_1024K
+
+struct alloc {
+	int seg;
+	int order;
+};
+
+static int failed_tests;
+
+static bool range_is(const uint8_t *map, int seg, int order, uint8_t val)
+{
+	int i;
+
+	for (i = 0; i < 1 << order; i++)
+		if (map[seg + i] != val)
+			return false;
+	return true;
+}
+
+static void fail(const char *what, int seg, int order)
+{
+	if (failed_tests++ < 10)
+		printf("  FAIL: %s, seg %d order %d\n", what, seg, order);
+}
+
+static void test_alloc(struct dr_icm_buddy_mem *buddy, uint8_t *map,
+		       struct alloc *allocs, int *num, int order)
+{
+	int seg, i;
+
+	seg = dr_buddy_alloc_mem(buddy, order);
+	if (seg < 0) {
+		/* Only fine if no aligned block of that order is free */
+		for (i = 0; i < 1 << TEST_ORDER; i += 1 << order)
+			if (range_is(map, i, order, 0)) {
+				fail("alloc failed with free memory", i, order);
+				break;
+			}
+		return;
+	}
+
+	if (seg & ((1 << order) - 1) || seg + (1 << order) > 1 << TEST_ORDER ||
+	    !range_is(map, seg, order, 0)) {
+		fail("bad or used block returned", seg, order);
+		return;
+	}
+
+	memset(map + seg, 1, 1 << order);
+	allocs[*num].seg = seg;
+	allocs[*num].order = order;
+	(*num)++;
+}
+
+static void test_random(void)
+{
+	struct dr_icm_buddy_mem buddy = {};
+	struct alloc *allocs;
+	int num = 0, round, i;
+	uint8_t *map;
+
+	allocs = calloc(MAX_ALLOCS, sizeof(*allocs));
+	map = calloc(1, 1 << TEST_ORDER);
+	if (!allocs || !map || dr_buddy_init(&buddy, TEST_ORDER)) {
+		printf("  FAIL: out of memory\n");
+		failed_tests++;
+		goto out;
+	}
+
+	for (round = 0; round < TEST_ROUNDS; round++) {
+		/* Mostly small orders, like the pools see */
+		if (num < MAX_ALLOCS && (num == 0 || random() % 5 < 3)) {
+			test_alloc(&buddy, map, allocs, &num,
+				   random() % 4 ? random() % 4 :
+				   random() % (TEST_ORDER + 1));
+			continue;
+		}
+
+		i = random() % num;
+		memset(map + allocs[i].seg, 0, 1 << allocs[i].order);
+		dr_buddy_free_mem(&buddy, allocs[i].seg, allocs[i].order);
+		allocs[i] = allocs[--num];
+	}
+
+	while (num--)
+		dr_buddy_free_mem(&buddy, allocs[num].seg, allocs[num].order);
+
+	/* Everything merged back into the one block */
+	for (i = 0; i < TEST_ORDER; i++)
+		if (buddy.num_free[i])
+			fail("not merged", -1, i);
+	if (buddy.num_free[TEST_ORDER] != 1 ||
+	    dr_buddy_alloc_mem(&buddy, TEST_ORDER) != 0)
+		fail("whole buddy not free", 0, TEST_ORDER);
+
+	dr_buddy_cleanup(&buddy);
+out:
+	free(map);
+	free(allocs);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Fill the buddy with chunks of the given order and free them in random
+ * order, which leaves the free blocks scattered for the next fill.
+ */
+static void bench(int order)
+{
+	int num = 1 << (BENCH_ORDER - order);
+	struct dr_icm_buddy_mem buddy = {};
+	uint64_t alloc_ns = 0, free_ns = 0;
+	uint64_t start;
+	int *segs;
+	int i, j, round;
+
+	segs = calloc(num, sizeof(*segs));
+	if (!segs || dr_buddy_init(&buddy, BENCH_ORDER)) {
+		free(segs);
+		return;
+	}
+
+	for (round = 0; round < 4; round++) {
+		start = now_ns();
+		for (i = 0; i < num; i++)
+			segs[i] = dr_buddy_alloc_mem(&buddy, order);
+		alloc_ns += now_ns() - start;
+
+		for (i = num - 1; i > 0; i--) {
+			int tmp = segs[i];
+
+			j = random() % (i + 1);
+			segs[i] = segs[j];
+			segs[j] = tmp;
+		}
+
+		start = now_ns();
+		for (i = 0; i < num; i++)
+			dr_buddy_free_mem(&buddy, segs[i], order);
+		free_ns += now_ns() - start;
+	}
+
+	printf("order %d, %7d chunks: %6.2f ns/alloc %6.2f ns/free\n", order,
+	       num, (double)alloc_ns / (4 * num), (double)free_ns / (4 * num));
+
+	dr_buddy_cleanup(&buddy);
+	free(segs);
+}
+
+int main(int argc, char *argv[])
+{
+	bool do_bench = argc > 1 && !strcmp(argv[1], "-b");
+	int order;
+
+	srandom(1);
+
+	test_random();
+	if (failed_tests) {
+		printf("%d tests failed\n", failed_tests);
+		return 1;
+	}
+	printf("dr_buddy tests passed\n");
+
+	if (!do_bench)
+		return 0;
+
+	for (order = DR_CHUNK_SIZE_1; order <= DR_CHUNK_SIZE_8; order++)
+		bench(order);
+	return 0;
+}
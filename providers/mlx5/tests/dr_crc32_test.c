@@ -0,0 +1,124 @@
+// SPDX-License-Identifier: (GPL-2.0 OR Linux-OpenIB)
+/*
+ * Check the CPU specific STE hash CRC32 against the table driven one and a
+ * bitwise reference, then time both on STE tag sized inputs.
+ *
+ * Run with -b to also print the benchmark.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../mlx5dv_dr.h"
+
+#define MAX_LEN		256
+#define BENCH_ITERS	(10 * 1000 * 1000)
+
+static int failed_tests;
+
+/* Bit at a time CRC32 in the byte order dr_crc32_slice8_calc() returns */
+static uint32_t crc32_bitwise(const uint8_t *data, size_t length)
+{
+	uint32_t crc = 0;
+	int j;
+
+	while (length--) {
+		crc ^= *data++;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+	}
+
+	return __builtin_bswap32(crc);
+}
+
+static void test_exact(void)
+{
+	uint8_t buf[MAX_LEN + 16];
+	uint32_t expected;
+	size_t len, off;
+	int round;
+
+	for (round = 0; round < 64; round++) {
+		for (off = 0; off < sizeof(buf); off++)
+			buf[off] = random();
+
+		/* Every length at every alignment within a 16 byte lane */
+		for (len = 1; len <= MAX_LEN; len++) {
+			for (off = 0; off < 16; off++) {
+				expected = crc32_bitwise(buf + off, len);
+				if (dr_crc32_slice8_calc(buf + off, len) != expected ||
+				    dr_crc32_calc(buf + off, len) != expected) {
+					printf("  FAIL: length %zu offset %zu\n",
+					       len, off);
+					failed_tests++;
+				}
+			}
+		}
+	}
+
+	if (dr_crc32_calc(NULL, 16) || dr_crc32_calc(buf, 0)) {
+		printf("  FAIL: empty input\n");
+		failed_tests++;
+	}
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bench(const char *name,
+		  uint32_t (*calc)(const void *input_data, size_t length),
+		  size_t len)
+{
+	uint8_t tag[MAX_LEN];
+	uint32_t sum = 0;
+	uint64_t start;
+	int i;
+
+	for (i = 0; i < MAX_LEN; i++)
+		tag[i] = random();
+
+	start = now_ns();
+	for (i = 0; i < BENCH_ITERS; i++) {
+		/* Feed the result back so the calls can not be overlapped */
+		tag[0] ^= sum;
+		sum = calc(tag, len);
+	}
+	printf("%-8s %3zu bytes: %6.2f ns/hash (%08x)\n", name, len,
+	       (double)(now_ns() - start) / BENCH_ITERS, sum);
+}
+
+int main(int argc, char *argv[])
+{
+	static const size_t lens[] = { DR_STE_SIZE_TAG, DR_STE_SIZE_MATCH_TAG,
+				       64 };
+	bool do_bench = argc > 1 && !strcmp(argv[1], "-b");
+	int i;
+
+	dr_crc32_init_table();
+	srandom(1);
+
+	test_exact();
+	if (failed_tests) {
+		printf("%d tests failed\n", failed_tests);
+		return 1;
+	}
+	printf("dr_crc32 tests passed\n");
+
+	if (!do_bench)
+		return 0;
+
+	for (i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+		bench("slice8", dr_crc32_slice8_calc, lens[i]);
+		bench("dispatch", dr_crc32_calc, lens[i]);
+	}
+	return 0;
+}
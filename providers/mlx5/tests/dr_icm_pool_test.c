@@ -0,0 +1,281 @@
+// SPDX-License-Identifier: (GPL-2.0 OR Linux-OpenIB)
+/*
+ * Tests of the ICM pool, run on the software stand-in of the device in
+ * dr_sw_backend.c.
+ *
+ * Small chunks are taken from the buddies a batch at a time into the
+ * magazine of the thread, and handed back to the hot lists a batch at a
+ * time. The tests follow the memory of the buddies through refills,
+ * flushes, syncs of the hot memory in the background and in place,
+ * dropping the cached chunks on reclaim, and the stop of the sync thread
+ * when the pool is destroyed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "dr_sw_backend.h"
+
+/* The same as dr_icm_pool.c */
+#define MAG_SIZE	16
+#define MAG_REFILL	(MAG_SIZE / 2)
+
+#define MT_THREADS	4
+#define MT_CHUNKS	1000
+#define MT_ROUNDS	50
+
+static int failed_tests;
+
+#define EXPECT_EQ(expected, actual) \
+	({ \
+		typeof(expected) _expected = (expected); \
+		typeof(actual) _actual = (actual); \
+		if (_expected != _actual) { \
+			printf("  FAIL at line %d: %s not %s\n", __LINE__, \
+				#expected, #actual); \
+			printf("\tExpected: %ld\n", (long) _expected); \
+			printf("\t  Actual: %ld\n", (long) _actual); \
+			failed_tests++; \
+		} \
+	})
+
+static size_t chunk_bytes(enum dr_icm_chunk_size size)
+{
+	return dr_icm_pool_chunk_size_to_byte(size, DR_ICM_TYPE_STE);
+}
+
+static int list_len(struct list_head *list)
+{
+	struct dr_icm_chunk *chunk;
+	int len = 0;
+
+	list_for_each(list, chunk, chunk_list)
+		len++;
+	return len;
+}
+
+static int num_threads(void)
+{
+	struct dirent *ent;
+	int num = 0;
+	DIR *dir;
+
+	dir = opendir("/proc/self/task");
+	if (!dir)
+		return -1;
+	while ((ent = readdir(dir)))
+		if (ent->d_name[0] != '.')
+			num++;
+	closedir(dir);
+	return num;
+}
+
+/* Wait for the background sync thread to sync once more than before */
+static bool wait_hw_syncs(unsigned long syncs)
+{
+	int i;
+
+	for (i = 0; i < 5000; i++) {
+		if (dr_sw_stats.hw_syncs > syncs)
+			return true;
+		usleep(1000);
+	}
+	return false;
+}
+
+/*
+ * The first small chunk takes a batch from the buddy, the rest of the
+ * batch is served without it. Frees are handed to the hot list once the
+ * magazine is full, or when the pool is synced.
+ */
+static void test_refill_and_flush(struct mlx5dv_dr_domain *dmn)
+{
+	struct dr_icm_pool *pool = dr_icm_pool_create(dmn, DR_ICM_TYPE_STE);
+	enum dr_icm_chunk_size size = DR_CHUNK_SIZE_8;
+	struct dr_icm_chunk *chunks[MAG_SIZE + 1], *other;
+	struct dr_icm_buddy_mem *buddy;
+	unsigned long syncs, drains;
+	int i;
+
+	chunks[0] = dr_icm_alloc_chunk(pool, size);
+	buddy = chunks[0]->buddy_mem;
+	EXPECT_EQ(1u, dmn->num_buddies[DR_ICM_TYPE_STE]);
+	EXPECT_EQ(MAG_REFILL * chunk_bytes(size), buddy->used_memory);
+	EXPECT_EQ(MAG_REFILL, list_len(&buddy->used_list));
+
+	for (i = 1; i < MAG_REFILL; i++)
+		chunks[i] = dr_icm_alloc_chunk(pool, size);
+	EXPECT_EQ(MAG_REFILL * chunk_bytes(size), buddy->used_memory);
+
+	for (; i <= MAG_SIZE; i++)
+		chunks[i] = dr_icm_alloc_chunk(pool, size);
+	EXPECT_EQ(3 * MAG_REFILL * chunk_bytes(size), buddy->used_memory);
+
+	/* Chunks of other sizes have batches of their own */
+	other = dr_icm_alloc_chunk(pool, DR_CHUNK_SIZE_4);
+	EXPECT_EQ(3 * MAG_REFILL * chunk_bytes(size) +
+		  MAG_REFILL * chunk_bytes(DR_CHUNK_SIZE_4),
+		  buddy->used_memory);
+
+	/* Frees of all sizes share the magazine */
+	dr_icm_free_chunk(other);
+	for (i = 0; i < MAG_SIZE - 2; i++)
+		dr_icm_free_chunk(chunks[i]);
+	EXPECT_EQ(0, list_len(&buddy->hot_list));
+	dr_icm_free_chunk(chunks[i++]);
+	EXPECT_EQ(MAG_SIZE, list_len(&buddy->hot_list));
+	for (; i <= MAG_SIZE; i++)
+		dr_icm_free_chunk(chunks[i]);
+	EXPECT_EQ(MAG_SIZE, list_len(&buddy->hot_list));
+
+	/* The sync flushes the magazine too, then frees the hot memory */
+	syncs = dr_sw_stats.hw_syncs;
+	drains = dr_sw_stats.drains;
+	EXPECT_EQ(0, dr_icm_pool_sync_pool(pool));
+	EXPECT_EQ(1ul, dr_sw_stats.hw_syncs - syncs);
+	EXPECT_EQ(1ul, dr_sw_stats.drains - drains);
+	EXPECT_EQ(0, list_len(&buddy->hot_list));
+
+	/* What is left are the chunks cached and never used */
+	EXPECT_EQ((MAG_REFILL * 3 - MAG_SIZE - 1) * chunk_bytes(size) +
+		  (MAG_REFILL - 1) * chunk_bytes(DR_CHUNK_SIZE_4),
+		  buddy->used_memory);
+
+	dr_icm_pool_destroy(pool);
+}
+
+/*
+ * Large chunks skip the magazines. Hot memory over the threshold of the
+ * pool is synced by a thread created on the first need, and in place
+ * when the thread falls behind. Destroying the pool stops the thread.
+ */
+static void test_sync_thread(struct mlx5dv_dr_domain *dmn)
+{
+	enum dr_icm_chunk_size max = dmn->info.max_log_sw_icm_sz;
+	struct dr_icm_pool *pool = dr_icm_pool_create(dmn, DR_ICM_TYPE_STE);
+	struct dr_icm_chunk *half[2], *full;
+	struct dr_icm_buddy_mem *buddy, *full_buddy;
+	unsigned long syncs;
+	int threads = num_threads();
+
+	/* Each takes half a buddy, the sync threshold of the pool */
+	half[0] = dr_icm_alloc_chunk(pool, max - 1);
+	half[1] = dr_icm_alloc_chunk(pool, max - 1);
+	buddy = half[0]->buddy_mem;
+	EXPECT_EQ(buddy, half[1]->buddy_mem);
+	EXPECT_EQ(chunk_bytes(max), buddy->used_memory);
+	EXPECT_EQ(threads, num_threads());
+
+	syncs = dr_sw_stats.hw_syncs;
+	dr_icm_free_chunk(half[0]);
+	EXPECT_EQ(true, wait_hw_syncs(syncs));
+	EXPECT_EQ(threads + 1, num_threads());
+	EXPECT_EQ(chunk_bytes(max - 1), buddy->used_memory);
+
+	/* Twice the threshold is synced before the free returns */
+	full = dr_icm_alloc_chunk(pool, max);
+	full_buddy = full->buddy_mem;
+	EXPECT_EQ(2u, dmn->num_buddies[DR_ICM_TYPE_STE]);
+	syncs = dr_sw_stats.hw_syncs;
+	dr_icm_free_chunk(full);
+	EXPECT_EQ(1ul, dr_sw_stats.hw_syncs - syncs);
+	EXPECT_EQ(0, list_len(&full_buddy->hot_list));
+
+	dr_icm_free_chunk(half[1]);
+	dr_icm_pool_destroy(pool);
+	EXPECT_EQ(0u, dmn->num_buddies[DR_ICM_TYPE_STE]);
+	EXPECT_EQ(threads, num_threads());
+}
+
+struct mt_thread {
+	pthread_t thread;
+	struct dr_icm_pool *pool;
+	struct dr_icm_chunk *chunks[MT_CHUNKS];
+	unsigned int seed;
+	int failed;
+};
+
+static void *mt_chunks(void *arg)
+{
+	struct mt_thread *mt = arg;
+	int i, round;
+
+	for (round = 0; round < MT_ROUNDS; round++) {
+		for (i = 0; i < MT_CHUNKS; i++) {
+			mt->chunks[i] = dr_icm_alloc_chunk(mt->pool,
+							   rand_r(&mt->seed) %
+							   (DR_CHUNK_SIZE_8 + 1));
+			if (!mt->chunks[i])
+				mt->failed++;
+		}
+		for (i = 0; i < MT_CHUNKS; i++)
+			if (mt->chunks[i])
+				dr_icm_free_chunk(mt->chunks[i]);
+	}
+	return NULL;
+}
+
+/*
+ * Threads allocate and free chunks through their own magazines. With
+ * reclaim set, a sync drops the chunks left in all the magazines, so all
+ * the memory goes back and the buddies are freed.
+ */
+static void test_drop_cache(struct mlx5dv_dr_domain *dmn)
+{
+	struct dr_icm_pool *pool = dr_icm_pool_create(dmn, DR_ICM_TYPE_STE);
+	struct mt_thread mt[MT_THREADS] = {};
+	unsigned long dm_frees;
+	uint32_t buddies;
+	int i;
+
+	for (i = 0; i < MT_THREADS; i++) {
+		mt[i].pool = pool;
+		mt[i].seed = i + 1;
+		if (pthread_create(&mt[i].thread, NULL, mt_chunks, &mt[i]))
+			exit(1);
+	}
+	for (i = 0; i < MT_THREADS; i++) {
+		pthread_join(mt[i].thread, NULL);
+		EXPECT_EQ(0, mt[i].failed);
+	}
+
+	/* Without reclaim the cached chunks stay */
+	EXPECT_EQ(0, dr_icm_pool_sync_pool(pool));
+	buddies = dmn->num_buddies[DR_ICM_TYPE_STE];
+	EXPECT_EQ(true, buddies > 0);
+
+	dm_frees = dr_sw_stats.dm_frees;
+	dmn->flags |= DR_DOMAIN_FLAG_MEMORY_RECLAIM;
+	EXPECT_EQ(0, dr_icm_pool_sync_pool(pool));
+	dmn->flags &= ~DR_DOMAIN_FLAG_MEMORY_RECLAIM;
+	EXPECT_EQ(0u, dmn->num_buddies[DR_ICM_TYPE_STE]);
+	EXPECT_EQ((unsigned long)buddies, dr_sw_stats.dm_frees - dm_frees);
+
+	dr_icm_pool_destroy(pool);
+}
+
+int main(int argc, char **argv)
+{
+	struct mlx5dv_dr_domain *dmn;
+
+	/* The pool of the domain stays empty, the tests use pools of their own */
+	dmn = dr_sw_domain_create(DR_CHUNK_SIZE_1K);
+
+	test_refill_and_flush(dmn);
+	test_sync_thread(dmn);
+	test_drop_cache(dmn);
+
+	dr_sw_domain_destroy(dmn);
+
+	if (failed_tests) {
+		printf("%d tests failed\n", failed_tests);
+		return 1;
+	}
+	printf("all tests passed\n");
+	return 0;
+}
@@ -0,0 +1,291 @@
+// SPDX-License-Identifier: (GPL-2.0 OR Linux-OpenIB)
+/*
+ * Multi threaded software steering rule insertion benchmark.
+ *
+ * Creates one NIC RX matcher on the outer IPv4 addresses and starts N
+ * threads that each add their own drop rules to it, then remove them.
+ * Reports the aggregate rules added and removed per second.
+ *
+ * By default the matcher is resizable, its rules are added in parallel
+ * while the first hash table does not have to grow. With -f the matcher
+ * is given a fixed size hash table of 2^log entries instead.
+ *
+ * Needs an mlx5 device with software steering support.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <infiniband/verbs.h>
+#include <infiniband/mlx5dv.h>
+
+#include "../mlx5_ifc.h"
+
+static const char *dev_name;
+static int nthreads = 4;
+static long nrules = 100000;
+static int fixed_log_size = -1;
+
+struct thread_ctx {
+	pthread_t thread;
+	int id;
+	struct mlx5dv_dr_matcher *matcher;
+	struct mlx5dv_dr_action *action;
+	struct mlx5dv_dr_rule **rules;
+	pthread_barrier_t *barrier;
+	int ret;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct mlx5dv_flow_match_parameters *alloc_match(void)
+{
+	struct mlx5dv_flow_match_parameters *match;
+	size_t sz = DEVX_ST_SZ_BYTES(dr_match_param);
+
+	match = calloc(1, sizeof(*match) + sz);
+	if (match)
+		match->match_sz = sz;
+	return match;
+}
+
+static void *run_thread(void *arg)
+{
+	struct mlx5dv_flow_match_parameters *value;
+	struct mlx5dv_dr_action *actions[1];
+	struct thread_ctx *t = arg;
+	long i;
+
+	value = alloc_match();
+	if (!value) {
+		t->ret = -1;
+		return NULL;
+	}
+	actions[0] = t->action;
+
+	/* Added rules first, removed rules after the second barrier */
+	pthread_barrier_wait(t->barrier);
+	for (i = 0; i < nrules; i++) {
+		DEVX_SET(dr_match_param, value->match_buf, outer.ip_version, 4);
+		DEVX_SET(dr_match_param, value->match_buf, outer.src_ip_31_0,
+			 t->id);
+		DEVX_SET(dr_match_param, value->match_buf, outer.dst_ip_31_0, i);
+		t->rules[i] = mlx5dv_dr_rule_create(t->matcher, value, 1,
+						    actions);
+		if (!t->rules[i]) {
+			perror("create rule");
+			t->ret = -1;
+			break;
+		}
+	}
+
+	pthread_barrier_wait(t->barrier);
+	for (i = 0; i < nrules && t->rules[i]; i++) {
+		if (mlx5dv_dr_rule_destroy(t->rules[i])) {
+			perror("destroy rule");
+			t->ret = -1;
+		}
+	}
+
+	free(value);
+	return NULL;
+}
+
+static int run(struct mlx5dv_dr_matcher *matcher,
+	       struct mlx5dv_dr_action *action)
+{
+	struct thread_ctx *threads;
+	pthread_barrier_t barrier;
+	uint64_t start, add_ns;
+	int i, ret = 0;
+
+	threads = calloc(nthreads, sizeof(*threads));
+	if (!threads)
+		return -1;
+
+	for (i = 0; i < nthreads; i++) {
+		threads[i].rules = calloc(nrules, sizeof(*threads[i].rules));
+		if (!threads[i].rules)
+			goto out;
+	}
+
+	/* The main thread takes part to time both phases */
+	pthread_barrier_init(&barrier, NULL, nthreads + 1);
+	for (i = 0; i < nthreads; i++) {
+		threads[i].id = i;
+		threads[i].matcher = matcher;
+		threads[i].action = action;
+		threads[i].barrier = &barrier;
+		pthread_create(&threads[i].thread, NULL, run_thread,
+			       &threads[i]);
+	}
+
+	pthread_barrier_wait(&barrier);
+	start = now_ns();
+	pthread_barrier_wait(&barrier);
+	add_ns = now_ns() - start;
+	start = now_ns();
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i].thread, NULL);
+		ret |= threads[i].ret;
+	}
+	pthread_barrier_destroy(&barrier);
+
+	if (!ret)
+		printf("%s matcher, %d threads, %ld rules each: %.0f adds per sec, %.0f removes per sec\n",
+		       fixed_log_size < 0 ? "resizable" : "fixed size",
+		       nthreads, nrules, nthreads * nrules * 1e9 / add_ns,
+		       nthreads * nrules * 1e9 / (now_ns() - start));
+out:
+	for (i = 0; i < nthreads; i++)
+		free(threads[i].rules);
+	free(threads);
+	return ret;
+}
+
+static struct ibv_context *open_device(struct ibv_device **list)
+{
+	struct ibv_device *dev = NULL;
+	int i;
+
+	for (i = 0; list[i]; i++) {
+		if (dev_name && strcmp(ibv_get_device_name(list[i]), dev_name))
+			continue;
+		if (!mlx5dv_is_supported(list[i]))
+			continue;
+		dev = list[i];
+		break;
+	}
+	if (!dev) {
+		fprintf(stderr, "no mlx5 device %s found\n",
+			dev_name ? dev_name : "");
+		return NULL;
+	}
+
+	return ibv_open_device(dev);
+}
+
+static void usage(const char *argv0)
+{
+	printf("usage: %s [options]\n", argv0);
+	printf("\t-d device      mlx5 device (default first found)\n");
+	printf("\t-t threads     number of threads (default %d)\n", nthreads);
+	printf("\t-n count       rules per thread (default %ld)\n", nrules);
+	printf("\t-f log         fixed size matcher of 2^log entries\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct mlx5dv_flow_match_parameters *mask = NULL;
+	struct mlx5dv_dr_matcher *matcher = NULL;
+	struct mlx5dv_dr_action *action = NULL;
+	struct mlx5dv_dr_domain *dmn = NULL;
+	struct mlx5dv_dr_table *tbl = NULL;
+	struct ibv_context *ctx = NULL;
+	struct ibv_device **list;
+	int op, ret = 1;
+
+	while ((op = getopt(argc, argv, "d:t:n:f:")) != -1) {
+		switch (op) {
+		case 'd':
+			dev_name = optarg;
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 'n':
+			nrules = atol(optarg);
+			break;
+		case 'f':
+			fixed_log_size = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			exit(1);
+		}
+	}
+
+	if (nthreads < 1 || nrules < 1 || nrules > UINT32_MAX) {
+		fprintf(stderr, "threads and count must be positive\n");
+		exit(1);
+	}
+
+	list = ibv_get_device_list(NULL);
+	if (!list) {
+		perror("get device list");
+		exit(1);
+	}
+
+	ctx = open_device(list);
+	if (!ctx)
+		goto out;
+
+	dmn = mlx5dv_dr_domain_create(ctx, MLX5DV_DR_DOMAIN_TYPE_NIC_RX);
+	if (!dmn) {
+		perror("create domain");
+		goto out;
+	}
+	tbl = mlx5dv_dr_table_create(dmn, 1);
+	if (!tbl) {
+		perror("create table");
+		goto out;
+	}
+
+	mask = alloc_match();
+	if (!mask)
+		goto out;
+	DEVX_SET(dr_match_param, mask->match_buf, outer.ip_version, 0xf);
+	DEVX_SET(dr_match_param, mask->match_buf, outer.src_ip_31_0, 0xffffffff);
+	DEVX_SET(dr_match_param, mask->match_buf, outer.dst_ip_31_0, 0xffffffff);
+
+	/* Outer headers criteria */
+	matcher = mlx5dv_dr_matcher_create(tbl, 0, 1 << 0, mask);
+	if (!matcher) {
+		perror("create matcher");
+		goto out;
+	}
+
+	if (fixed_log_size >= 0) {
+		struct mlx5dv_dr_matcher_layout layout = {
+			.flags = MLX5DV_DR_MATCHER_LAYOUT_NUM_RULE,
+			.log_num_of_rules_hint = fixed_log_size,
+		};
+
+		if (mlx5dv_dr_matcher_set_layout(matcher, &layout)) {
+			perror("set matcher layout");
+			goto out;
+		}
+	}
+
+	action = mlx5dv_dr_action_create_drop();
+	if (!action) {
+		perror("create drop action");
+		goto out;
+	}
+
+	ret = run(matcher, action) ? 1 : 0;
+out:
+	if (action)
+		mlx5dv_dr_action_destroy(action);
+	if (matcher)
+		mlx5dv_dr_matcher_destroy(matcher);
+	free(mask);
+	if (tbl)
+		mlx5dv_dr_table_destroy(tbl);
+	if (dmn)
+		mlx5dv_dr_domain_destroy(dmn);
+	if (ctx)
+		ibv_close_device(ctx);
+	ibv_free_device_list(list);
+	return ret;
+}
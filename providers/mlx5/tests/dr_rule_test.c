@@ -0,0 +1,683 @@
+// SPDX-License-Identifier: (GPL-2.0 OR Linux-OpenIB)
+/*
+ * Tests of SW steering rule insertion, run on the software stand-in of the
+ * device in dr_sw_backend.c.
+ *
+ * Rules of one matcher on the outer destination MAC are added and removed,
+ * the send rings complete their writes out of order against each other,
+ * and every packet is then looked up in the ICM the way the device walks
+ * it, to check it hits the STE of its rule or misses the table.
+ *
+ * Tables of 1K entries and more grow in steps while rules are added and
+ * removed, the tests go through each step checking the lookups. Last,
+ * threads add and remove rules of one matcher at the same time.
+ *
+ * Run with -b to also time adding rules one by one and in bulks.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <ccan/array_size.h>
+
+#include "dr_sw_backend.h"
+#include "../mlx5_ifc.h"
+
+#define TEST_RULES	20000
+#define REHASH_RULES	40000
+#define BULK_SIZE	1000
+#define BENCH_RULES	200000
+/* A key with this bit also matches on a field outside the matcher mask */
+#define BAD_KEY		(1ULL << 63)
+
+static int failed_tests;
+
+#define EXPECT(cond)							\
+	({								\
+		if (!(cond) && failed_tests++ < 10)			\
+			printf("  FAIL at line %d: %s\n", __LINE__, #cond); \
+	})
+
+struct test_rule {
+	struct mlx5dv_dr_rule *rule;
+	uint64_t key;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct mlx5dv_flow_match_parameters *alloc_match(uint64_t dmac)
+{
+	struct mlx5dv_flow_match_parameters *match;
+	size_t sz = DEVX_ST_SZ_BYTES(dr_match_spec);
+
+	match = calloc(1, sizeof(*match) + sz);
+	if (!match)
+		exit(1);
+	match->match_sz = sz;
+	DEVX_SET(dr_match_spec, match->match_buf, dmac_47_16, dmac >> 16);
+	DEVX_SET(dr_match_spec, match->match_buf, dmac_15_0, dmac);
+	if (dmac & BAD_KEY)
+		DEVX_SET(dr_match_spec, match->match_buf, smac_15_0, 1);
+	return match;
+}
+
+static struct mlx5dv_dr_matcher *create_matcher(struct mlx5dv_dr_table *tbl)
+{
+	struct mlx5dv_flow_match_parameters *mask;
+	struct mlx5dv_dr_matcher *matcher;
+
+	mask = alloc_match(0xffffffffffffULL);
+	matcher = mlx5dv_dr_matcher_create(tbl, 0,
+					   DR_MATCHER_CRITERIA_OUTER,
+					   mask);
+	free(mask);
+	if (!matcher) {
+		perror("create matcher");
+		exit(1);
+	}
+	return matcher;
+}
+
+/* A spread of distinct keys, the same for a given seed */
+static uint64_t test_key(unsigned int i, unsigned int seed)
+{
+	uint64_t key = (i + 1) * 0x9e3779b97f4a7c15ULL + seed;
+
+	return (key ^ key >> 29) & 0xffffffffffffULL;
+}
+
+static struct mlx5dv_dr_rule *add_rule(struct mlx5dv_dr_matcher *matcher,
+				       uint64_t key)
+{
+	struct mlx5dv_flow_match_parameters *value = alloc_match(key);
+	struct mlx5dv_dr_rule *rule;
+
+	rule = mlx5dv_dr_rule_create(matcher, value, 0, NULL);
+	free(value);
+	return rule;
+}
+
+/* ICM address of the STE the packet with the key of rule hits */
+static uint64_t lookup(struct mlx5dv_dr_rule *rule)
+{
+	struct dr_ste *ste = rule->rx.last_rule_ste;
+
+	return dr_sw_lookup(rule->matcher->tbl, ste->hw_ste, rule->rx.s_hash);
+}
+
+static bool rule_hits(struct mlx5dv_dr_rule *rule)
+{
+	return lookup(rule) == dr_ste_get_icm_addr(rule->rx.last_rule_ste);
+}
+
+/* A removed rule leaves its tag behind, to check the packet misses now */
+struct gone_rule {
+	uint8_t hw_ste[DR_STE_SIZE];
+	uint32_t hash;
+};
+
+static void remove_rule(struct mlx5dv_dr_rule *rule, struct gone_rule *gone)
+{
+	if (gone) {
+		memcpy(gone->hw_ste, rule->rx.last_rule_ste->hw_ste,
+		       DR_STE_SIZE_REDUCED);
+		gone->hash = rule->rx.s_hash;
+	}
+	EXPECT(!mlx5dv_dr_rule_destroy(rule));
+}
+
+static void check_rules(struct test_rule *rules, int num)
+{
+	int i, miss = 0;
+
+	dr_sw_drain();
+	for (i = 0; i < num; i++)
+		if (rules[i].rule && !rule_hits(rules[i].rule))
+			miss++;
+	EXPECT(!miss);
+	if (miss)
+		printf("\t%d of %d rules are not hit\n", miss, num);
+}
+
+static void check_gone(struct mlx5dv_dr_table *tbl, struct gone_rule *gone,
+		       int num)
+{
+	int i, hit = 0;
+
+	dr_sw_drain();
+	for (i = 0; i < num; i++)
+		if (dr_sw_lookup(tbl, gone[i].hw_ste, gone[i].hash))
+			hit++;
+	EXPECT(!hit);
+	if (hit)
+		printf("\t%d of %d removed rules still match\n", hit, num);
+}
+
+/* Add rules one by one, remove every other one, then the rest */
+static void test_add_remove(struct mlx5dv_dr_domain *dmn)
+{
+	struct mlx5dv_dr_table *tbl = mlx5dv_dr_table_create(dmn, 1);
+	struct mlx5dv_dr_matcher *matcher = create_matcher(tbl);
+	struct test_rule *rules = calloc(TEST_RULES, sizeof(*rules));
+	struct gone_rule *gone = calloc(TEST_RULES, sizeof(*gone));
+	int i;
+
+	for (i = 0; i < TEST_RULES; i++) {
+		rules[i].key = test_key(i, 1);
+		rules[i].rule = add_rule(matcher, rules[i].key);
+		EXPECT(rules[i].rule);
+	}
+	check_rules(rules, TEST_RULES);
+
+	for (i = 0; i < TEST_RULES; i += 2) {
+		remove_rule(rules[i].rule, &gone[i / 2]);
+		rules[i].rule = NULL;
+	}
+	check_rules(rules, TEST_RULES);
+	check_gone(tbl, gone, TEST_RULES / 2);
+
+	for (i = 1; i < TEST_RULES; i += 2)
+		remove_rule(rules[i].rule, NULL);
+
+	EXPECT(!mlx5dv_dr_matcher_destroy(matcher));
+	EXPECT(!mlx5dv_dr_table_destroy(tbl));
+	free(rules);
+	free(gone);
+}
+
+static int add_bulk(struct mlx5dv_dr_matcher *matcher, struct test_rule *rules,
+		    int num)
+{
+	struct mlx5dv_flow_match_parameters *values[BULK_SIZE];
+	struct mlx5dv_dr_rule *created[BULK_SIZE];
+	size_t num_actions[BULK_SIZE] = {};
+	struct mlx5dv_dr_action **actions[BULK_SIZE] = {};
+	int i, ret;
+
+	for (i = 0; i < num; i++)
+		values[i] = alloc_match(rules[i].key);
+
+	ret = mlx5dv_dr_rule_create_bulk(matcher, num, values, num_actions,
+					 actions, created);
+	for (i = 0; i < num; i++) {
+		rules[i].rule = i < ret ? created[i] : NULL;
+		free(values[i]);
+	}
+	return ret;
+}
+
+/*
+ * Rules added in bulks are hit like rules added one by one, and the ring
+ * doorbells of a bulk are rung once at its end.
+ */
+static void test_bulk(struct mlx5dv_dr_domain *dmn)
+{
+	struct mlx5dv_dr_table *tbl = mlx5dv_dr_table_create(dmn, 1);
+	struct mlx5dv_dr_matcher *matcher = create_matcher(tbl);
+	struct test_rule *rules = calloc(TEST_RULES, sizeof(*rules));
+	unsigned long writes, doorbells, batches;
+	int i;
+
+	for (i = 0; i < TEST_RULES; i++)
+		rules[i].key = test_key(i, 2);
+
+	writes = dr_sw_stats.writes;
+	doorbells = dr_sw_stats.doorbells;
+	batches = dr_sw_stats.batches;
+	for (i = 0; i < TEST_RULES; i += BULK_SIZE)
+		EXPECT(add_bulk(matcher, &rules[i], BULK_SIZE) == BULK_SIZE);
+	EXPECT(dr_sw_stats.batches - batches == TEST_RULES / BULK_SIZE);
+	EXPECT(dr_sw_stats.doorbells - doorbells <=
+	       TEST_RULES / BULK_SIZE * DR_MAX_SEND_RINGS);
+	EXPECT(dr_sw_stats.writes - writes >= TEST_RULES);
+	check_rules(rules, TEST_RULES);
+
+	for (i = 0; i < TEST_RULES; i++)
+		remove_rule(rules[i].rule, NULL);
+
+	/* A bulk stops at the first rule that fails, keeping the others */
+	for (i = 0; i < 3; i++)
+		rules[i].key = test_key(i, 3);
+	rules[1].key |= BAD_KEY;
+	errno = 0;
+	EXPECT(add_bulk(matcher, rules, 3) == 1);
+	EXPECT(errno == EINVAL);
+	check_rules(rules, 1);
+	remove_rule(rules[0].rule, NULL);
+
+	EXPECT(!mlx5dv_dr_matcher_destroy(matcher));
+	EXPECT(!mlx5dv_dr_table_destroy(tbl));
+	free(rules);
+}
+
+/* Growing s_htbl is replaced in steps: format, migrate, cleanup */
+#define REHASH_NONE	(-1)
+
+static int rehash_state(struct mlx5dv_dr_matcher *matcher)
+{
+	struct dr_ste_htbl_rehash *rehash = matcher->rx.s_htbl->rehash;
+
+	return rehash ? (int)rehash->state : REHASH_NONE;
+}
+
+/* Add rules till s_htbl gets to state, returns the number of rules */
+static int add_till(struct mlx5dv_dr_matcher *matcher, struct test_rule *rules,
+		    int num, int state, unsigned int seed)
+{
+	for (; num < REHASH_RULES && rehash_state(matcher) != state; num++) {
+		rules[num].key = test_key(num, seed);
+		rules[num].rule = add_rule(matcher, rules[num].key);
+		EXPECT(rules[num].rule);
+	}
+	EXPECT(rehash_state(matcher) == state);
+	return num;
+}
+
+/*
+ * Go through the steps of growing s_htbl twice, checking every rule is
+ * hit after each step. The time taken shows in the domain stats.
+ */
+static void test_rehash_steps(struct mlx5dv_dr_domain *dmn)
+{
+	struct mlx5dv_dr_table *tbl = mlx5dv_dr_table_create(dmn, 1);
+	struct mlx5dv_dr_matcher *matcher = create_matcher(tbl);
+	struct test_rule *rules = calloc(REHASH_RULES, sizeof(*rules));
+	struct dr_rehash_stats *stats = &dmn->info.rx.rehash_stats;
+	uint64_t num_incr = stats->num_incr;
+	uint64_t num_steps = stats->num_steps;
+	int states[] = { DR_STE_HTBL_REHASH_FORMAT, DR_STE_HTBL_REHASH_MIGRATE,
+			 DR_STE_HTBL_REHASH_CLEANUP, REHASH_NONE };
+	unsigned int i;
+	int num = 0, round;
+
+	for (round = 0; round < 2; round++) {
+		for (i = 0; i < ARRAY_SIZE(states); i++) {
+			num = add_till(matcher, rules, num, states[i], 5);
+			check_rules(rules, num);
+		}
+	}
+
+	EXPECT(matcher->rx.s_htbl->chunk_size > DR_CHUNK_SIZE_1K);
+	EXPECT(stats->num_incr - num_incr == 2);
+	EXPECT(stats->num_steps > num_steps);
+	EXPECT(stats->step_max_ns > 0);
+
+	for (i = 0; i < num; i++)
+		remove_rule(rules[i].rule, NULL);
+
+	EXPECT(!mlx5dv_dr_matcher_destroy(matcher));
+	EXPECT(!mlx5dv_dr_table_destroy(tbl));
+	free(rules);
+}
+
+struct dup_rule {
+	struct mlx5dv_dr_rule *rule;
+	struct mlx5dv_dr_rule *orig;
+};
+
+/* The rule a duplicate repeats matches before it */
+static void check_dups(struct dup_rule *dups, int num)
+{
+	int i, wrong = 0;
+
+	dr_sw_drain();
+	for (i = 0; i < num; i++)
+		if (lookup(dups[i].rule) !=
+		    dr_ste_get_icm_addr(dups[i].orig->rx.last_rule_ste))
+			wrong++;
+	EXPECT(!wrong);
+	if (wrong)
+		printf("\t%d of %d duplicates match first\n", wrong, num);
+}
+
+/*
+ * Duplicates of rules that are still in the old table go into the new
+ * one after them, and match once the older rules are removed.
+ */
+static void test_rehash_duplicates(struct mlx5dv_dr_domain *dmn)
+{
+	struct mlx5dv_dr_table *tbl = mlx5dv_dr_table_create(dmn, 1);
+	struct mlx5dv_dr_matcher *matcher = create_matcher(tbl);
+	struct test_rule *rules = calloc(REHASH_RULES, sizeof(*rules));
+	struct dup_rule *dups = calloc(REHASH_RULES, sizeof(*dups));
+	int i, num, num_dups = 0;
+
+	num = add_till(matcher, rules, 0, DR_STE_HTBL_REHASH_MIGRATE, 6);
+
+	/* Each of these moves a few buckets, most rules are not moved yet */
+	for (i = 0; i < num && rehash_state(matcher) ==
+	     DR_STE_HTBL_REHASH_MIGRATE; i += 7, num_dups++) {
+		dups[num_dups].orig = rules[i].rule;
+		dups[num_dups].rule = add_rule(matcher, rules[i].key);
+		EXPECT(dups[num_dups].rule);
+	}
+	check_dups(dups, num_dups);
+	check_rules(rules, num);
+
+	num = add_till(matcher, rules, num, REHASH_NONE, 6);
+	check_dups(dups, num_dups);
+
+	for (i = 0; i < num_dups; i++)
+		remove_rule(dups[i].orig, NULL);
+	dr_sw_drain();
+	for (i = 0; i < num_dups; i++)
+		EXPECT(rule_hits(dups[i].rule));
+	for (i = 0; i < num_dups; i++)
+		remove_rule(dups[i].rule, NULL);
+	for (i = 0; i < num; i++)
+		if (i % 7 || i / 7 >= num_dups)
+			remove_rule(rules[i].rule, NULL);
+
+	EXPECT(!mlx5dv_dr_matcher_destroy(matcher));
+	EXPECT(!mlx5dv_dr_table_destroy(tbl));
+	free(rules);
+	free(dups);
+}
+
+/* Remove every third of the rules that are left */
+static int remove_some(struct test_rule *rules, int num,
+		       struct gone_rule *gone, int num_gone)
+{
+	int i, left = 0;
+
+	for (i = 0; i < num; i++) {
+		if (!rules[i].rule || left++ % 3)
+			continue;
+		remove_rule(rules[i].rule, &gone[num_gone++]);
+		rules[i].rule = NULL;
+	}
+	return num_gone;
+}
+
+/* Rules removed while they are moved to the new table stay removed */
+static void test_rehash_removes(struct mlx5dv_dr_domain *dmn)
+{
+	struct mlx5dv_dr_table *tbl = mlx5dv_dr_table_create(dmn, 1);
+	struct mlx5dv_dr_matcher *matcher = create_matcher(tbl);
+	struct test_rule *rules = calloc(REHASH_RULES, sizeof(*rules));
+	struct gone_rule *gone = calloc(REHASH_RULES, sizeof(*gone));
+	int i, num, num_gone;
+
+	num = add_till(matcher, rules, 0, DR_STE_HTBL_REHASH_MIGRATE, 7);
+	num_gone = remove_some(rules, num, gone, 0);
+	check_rules(rules, num);
+	check_gone(tbl, gone, num_gone);
+
+	num = add_till(matcher, rules, num, DR_STE_HTBL_REHASH_CLEANUP, 7);
+	num_gone = remove_some(rules, num, gone, num_gone);
+	check_rules(rules, num);
+	check_gone(tbl, gone, num_gone);
+
+	num = add_till(matcher, rules, num, REHASH_NONE, 7);
+	check_rules(rules, num);
+	check_gone(tbl, gone, num_gone);
+
+	for (i = 0; i < num; i++)
+		if (rules[i].rule)
+			remove_rule(rules[i].rule, NULL);
+
+	EXPECT(!mlx5dv_dr_matcher_destroy(matcher));
+	EXPECT(!mlx5dv_dr_table_destroy(tbl));
+	free(rules);
+	free(gone);
+}
+
+#define MT_THREADS	4
+#define MT_KEYS		4000
+#define MT_OPS		50000
+
+struct mt_slot {
+	struct mlx5dv_dr_rule *rule;
+	uint64_t key;
+	bool removed;
+	struct gone_rule gone;
+};
+
+struct mt_thread {
+	pthread_t thread;
+	struct mlx5dv_dr_matcher *matcher;
+	struct mt_slot *slots;
+	unsigned int seed;
+	int failed;
+};
+
+static atomic_bool mt_stop;
+
+/* Add and remove rules of the thread's own keys at random */
+static void *mt_rules(void *arg)
+{
+	struct mt_thread *mt = arg;
+	struct mt_slot *slot;
+	int i;
+
+	for (i = 0; i < MT_OPS; i++) {
+		slot = &mt->slots[rand_r(&mt->seed) % MT_KEYS];
+		if (slot->rule) {
+			memcpy(slot->gone.hw_ste, slot->rule->rx.last_rule_ste->hw_ste,
+			       DR_STE_SIZE_REDUCED);
+			slot->gone.hash = slot->rule->rx.s_hash;
+			if (mlx5dv_dr_rule_destroy(slot->rule))
+				mt->failed++;
+			slot->rule = NULL;
+			slot->removed = true;
+		} else {
+			slot->rule = add_rule(mt->matcher, slot->key);
+			if (!slot->rule)
+				mt->failed++;
+			slot->removed = false;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * What mlx5dv_dr_matcher_set_layout() does for a definer matcher: make
+ * the matcher fixed size or resizable again, with s_htbl replaced by one
+ * of size log_size, while rules are added and removed.
+ */
+static void mt_set_layout(struct mlx5dv_dr_matcher *matcher, bool fixed_size,
+			  enum dr_icm_chunk_size log_size)
+{
+	struct mlx5dv_dr_domain *dmn = matcher->tbl->dmn;
+	struct dr_matcher_rx_tx *nic_matcher = &matcher->rx;
+
+	pthread_rwlock_wrlock(&nic_matcher->s_htbl_lock);
+	dr_domain_lock(dmn);
+	EXPECT(!dr_rule_rehash_matcher_s_anchor(matcher, nic_matcher,
+						log_size));
+	nic_matcher->fixed_size = fixed_size;
+	dr_send_ring_force_drain(dmn);
+	dr_domain_unlock(dmn);
+	pthread_rwlock_unlock(&nic_matcher->s_htbl_lock);
+}
+
+static void *mt_layout(void *arg)
+{
+	struct mlx5dv_dr_matcher *matcher = arg;
+	int i;
+
+	for (i = 0; !atomic_load(&mt_stop); i++) {
+		mt_set_layout(matcher, !(i % 2),
+			      DR_CHUNK_SIZE_1K + (i / 2) % 3);
+		sched_yield();
+	}
+	return NULL;
+}
+
+/*
+ * Threads add and remove rules of one matcher, whose s_htbl grows in
+ * shared and exclusive mode while another thread flips it between fixed
+ * size and resizable. Afterwards every rule left must be hit, and every
+ * key removed last must miss.
+ */
+static void test_threads(struct mlx5dv_dr_domain *dmn, bool set_layout)
+{
+	struct mlx5dv_dr_table *tbl = mlx5dv_dr_table_create(dmn, 1);
+	struct mlx5dv_dr_matcher *matcher = create_matcher(tbl);
+	struct mt_thread mt[MT_THREADS] = {};
+	unsigned long ring_writes[DR_MAX_SEND_RINGS];
+	int i, j, miss = 0, hit = 0, rings = 0;
+	pthread_t layout;
+	struct mt_slot *slot;
+
+	for (i = 0; i < DR_MAX_SEND_RINGS; i++)
+		ring_writes[i] = dr_sw_stats.ring_writes[i];
+
+	atomic_store(&mt_stop, false);
+	if (set_layout && pthread_create(&layout, NULL, mt_layout, matcher))
+		exit(1);
+
+	for (i = 0; i < MT_THREADS; i++) {
+		mt[i].matcher = matcher;
+		mt[i].seed = i + 1;
+		mt[i].slots = calloc(MT_KEYS, sizeof(*mt[i].slots));
+		for (j = 0; j < MT_KEYS; j++)
+			mt[i].slots[j].key = test_key(i * MT_KEYS + j, 8);
+		if (pthread_create(&mt[i].thread, NULL, mt_rules, &mt[i]))
+			exit(1);
+	}
+
+	for (i = 0; i < MT_THREADS; i++) {
+		pthread_join(mt[i].thread, NULL);
+		EXPECT(!mt[i].failed);
+	}
+	atomic_store(&mt_stop, true);
+	if (set_layout)
+		pthread_join(layout, NULL);
+
+	dr_sw_drain();
+	for (i = 0; i < MT_THREADS; i++) {
+		for (j = 0; j < MT_KEYS; j++) {
+			slot = &mt[i].slots[j];
+			if (slot->rule && !rule_hits(slot->rule))
+				miss++;
+			if (slot->removed &&
+			    dr_sw_lookup(tbl, slot->gone.hw_ste, slot->gone.hash))
+				hit++;
+		}
+	}
+	EXPECT(!miss);
+	EXPECT(!hit);
+	if (miss || hit)
+		printf("\t%d rules are not hit, %d removed rules match\n",
+		       miss, hit);
+
+	/* Buckets are written with the rings of their locks */
+	for (i = 0; i < DR_MAX_SEND_RINGS; i++)
+		if (dr_sw_stats.ring_writes[i] != ring_writes[i])
+			rings++;
+	EXPECT(rings == DR_MAX_SEND_RINGS);
+
+	for (i = 0; i < MT_THREADS; i++) {
+		for (j = 0; j < MT_KEYS; j++)
+			if (mt[i].slots[j].rule)
+				remove_rule(mt[i].slots[j].rule, NULL);
+		free(mt[i].slots);
+	}
+
+	EXPECT(!mlx5dv_dr_matcher_destroy(matcher));
+	EXPECT(!mlx5dv_dr_table_destroy(tbl));
+}
+
+/*
+ * Time adding and removing rules with the writes applied at once, this is
+ * the CPU cost of insertion without the device.
+ */
+static void bench_insert(struct mlx5dv_dr_domain *dmn, bool bulk)
+{
+	struct mlx5dv_dr_table *tbl = mlx5dv_dr_table_create(dmn, 1);
+	struct mlx5dv_dr_matcher *matcher = create_matcher(tbl);
+	struct test_rule *rules = calloc(BENCH_RULES, sizeof(*rules));
+	unsigned long writes, doorbells;
+	uint64_t start, add_ns;
+	int i;
+
+	for (i = 0; i < BENCH_RULES; i++)
+		rules[i].key = test_key(i, 4);
+
+	writes = dr_sw_stats.writes;
+	doorbells = dr_sw_stats.doorbells;
+	start = now_ns();
+	for (i = 0; i < BENCH_RULES; i += BULK_SIZE) {
+		if (bulk) {
+			add_bulk(matcher, &rules[i], BULK_SIZE);
+			continue;
+		}
+		for (int j = i; j < i + BULK_SIZE; j++)
+			rules[j].rule = add_rule(matcher, rules[j].key);
+	}
+	add_ns = now_ns() - start;
+	writes = dr_sw_stats.writes - writes;
+	doorbells = dr_sw_stats.doorbells - doorbells;
+
+	start = now_ns();
+	for (i = 0; i < BENCH_RULES; i++)
+		mlx5dv_dr_rule_destroy(rules[i].rule);
+
+	printf("%-10s %d rules: %.0f adds per sec, %.0f removes per sec, %.2f ICM writes and %.3f doorbells per rule\n",
+	       bulk ? "bulk" : "one by one", BENCH_RULES,
+	       BENCH_RULES * 1e9 / add_ns,
+	       BENCH_RULES * 1e9 / (now_ns() - start),
+	       (double)writes / BENCH_RULES, (double)doorbells / BENCH_RULES);
+
+	mlx5dv_dr_matcher_destroy(matcher);
+	mlx5dv_dr_table_destroy(tbl);
+	free(rules);
+}
+
+int main(int argc, char **argv)
+{
+	struct mlx5dv_dr_domain *dmn;
+	bool bench = false;
+	int op;
+
+	while ((op = getopt(argc, argv, "b")) != -1) {
+		switch (op) {
+		case 'b':
+			bench = true;
+			break;
+		default:
+			printf("usage: %s [-b]\n", argv[0]);
+			exit(1);
+		}
+	}
+
+	dmn = dr_sw_domain_create(DR_CHUNK_SIZE_64K);
+
+	dr_sw_reorder = true;
+	test_add_remove(dmn);
+	test_bulk(dmn);
+	test_rehash_steps(dmn);
+	test_rehash_duplicates(dmn);
+	test_rehash_removes(dmn);
+	test_threads(dmn, false);
+	test_threads(dmn, true);
+
+	if (bench) {
+		dr_sw_reorder = false;
+		bench_insert(dmn, false);
+		bench_insert(dmn, true);
+	}
+
+	dr_sw_domain_destroy(dmn);
+
+	if (failed_tests) {
+		printf("%d tests failed\n", failed_tests);
+		return 1;
+	}
+	printf("all tests passed\n");
+	return 0;
+}
@@ -0,0 +1,713 @@
+// SPDX-License-Identifier: (GPL-2.0 OR Linux-OpenIB)
+/*
+ * Software stand-in for the device under the SW steering code, see
+ * dr_sw_backend.h. Only what tables, matchers and rules without actions
+ * use on a NIC RX domain is provided.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <ccan/list.h>
+#include <ccan/minmax.h>
+
+#include "dr_sw_backend.h"
+#include "../dr_ste.h"
+
+#define DR_SW_MAX_REGIONS	256
+/* Made up ICM addresses, v0 STEs keep 40 bits of them */
+#define DR_SW_ICM_BASE		(1ULL << 32)
+/* Writes a ring holds before the oldest one must complete */
+#define DR_SW_RING_DEPTH	64
+
+struct dr_sw_stats dr_sw_stats;
+bool dr_sw_reorder;
+
+#ifdef MLX5_DEBUG
+uint32_t mlx5_debug_mask;
+#endif
+
+struct dr_sw_region {
+	uint64_t		icm_addr;
+	size_t			length;
+	uint8_t			*host;
+	struct mlx5_dm		*dm;
+};
+
+struct dr_sw_write {
+	struct list_node	node;
+	uint8_t			*dst;
+	uint32_t		length;
+	uint8_t			data[];
+};
+
+struct dr_sw_ring {
+	struct list_head	queue;
+	unsigned int		queued;
+	bool			db_pending;
+};
+
+static struct {
+	pthread_mutex_t		lock;
+	struct dr_sw_region	regions[DR_SW_MAX_REGIONS];
+	uint64_t		next_icm_addr;
+	struct dr_sw_ring	rings[DR_MAX_SEND_RINGS];
+	unsigned int		seed;
+} dr_sw_dev = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.next_icm_addr = DR_SW_ICM_BASE,
+	.seed = 1,
+};
+
+static __thread bool dr_sw_batch;
+
+static struct dr_sw_region *dr_sw_find_region(uint64_t icm_addr)
+{
+	struct dr_sw_region *region;
+	int i;
+
+	for (i = 0; i < DR_SW_MAX_REGIONS; i++) {
+		region = &dr_sw_dev.regions[i];
+		if (region->host && icm_addr >= region->icm_addr &&
+		    icm_addr < region->icm_addr + region->length)
+			return region;
+	}
+	return NULL;
+}
+
+uint8_t *dr_sw_icm(uint64_t icm_addr)
+{
+	struct dr_sw_region *region;
+	uint8_t *host = NULL;
+
+	pthread_mutex_lock(&dr_sw_dev.lock);
+	region = dr_sw_find_region(icm_addr);
+	if (region)
+		host = region->host + (icm_addr - region->icm_addr);
+	pthread_mutex_unlock(&dr_sw_dev.lock);
+
+	return host;
+}
+
+/* Device memory, the MR of a region has the region index as rkey */
+
+struct ibv_dm *mlx5dv_alloc_dm(struct ibv_context *context,
+			       struct ibv_alloc_dm_attr *dm_attr,
+			       struct mlx5dv_alloc_dm_attr *mlx5_dm_attr)
+{
+	struct dr_sw_region *region = NULL;
+	struct mlx5_dm *dm;
+	uint64_t length;
+	int i;
+
+	dm = calloc(1, sizeof(*dm));
+	if (!dm) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	/* Device memory comes aligned to its power of two size */
+	length = roundup_pow_of_two(dm_attr->length);
+
+	pthread_mutex_lock(&dr_sw_dev.lock);
+	for (i = 1; i < DR_SW_MAX_REGIONS; i++) {
+		if (!dr_sw_dev.regions[i].host) {
+			region = &dr_sw_dev.regions[i];
+			break;
+		}
+	}
+	if (region)
+		region->host = calloc(1, length);
+	if (!region || !region->host) {
+		pthread_mutex_unlock(&dr_sw_dev.lock);
+		free(dm);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	dr_sw_dev.next_icm_addr = align(dr_sw_dev.next_icm_addr, length);
+	region->icm_addr = dr_sw_dev.next_icm_addr;
+	region->length = length;
+	region->dm = dm;
+	dr_sw_dev.next_icm_addr += length;
+	pthread_mutex_unlock(&dr_sw_dev.lock);
+
+	dm->verbs_dm.dm.context = context;
+	dm->verbs_dm.handle = i;
+	dm->length = length;
+	dm->remote_va = region->icm_addr;
+	atomic_fetch_add(&dr_sw_stats.dm_allocs, 1);
+
+	return &dm->verbs_dm.dm;
+}
+
+int mlx5_free_dm(struct ibv_dm *ibdm)
+{
+	struct mlx5_dm *dm = to_mdm(ibdm);
+	struct dr_sw_region *region;
+
+	pthread_mutex_lock(&dr_sw_dev.lock);
+	region = &dr_sw_dev.regions[dm->verbs_dm.handle];
+	free(region->host);
+	memset(region, 0, sizeof(*region));
+	pthread_mutex_unlock(&dr_sw_dev.lock);
+
+	free(dm);
+	atomic_fetch_add(&dr_sw_stats.dm_frees, 1);
+	return 0;
+}
+
+static struct ibv_mr *dr_sw_reg_dm_mr(struct ibv_pd *pd, struct ibv_dm *ibdm,
+				      uint64_t dm_offset, size_t length,
+				      unsigned int access)
+{
+	struct ibv_mr *mr;
+
+	mr = calloc(1, sizeof(*mr));
+	if (!mr) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	/* Zero based, the MR address is the offset into the DM */
+	mr->context = pd->context;
+	mr->pd = pd;
+	mr->addr = (void *)(uintptr_t)dm_offset;
+	mr->length = length;
+	mr->lkey = mr->rkey = to_mdm(ibdm)->verbs_dm.handle;
+
+	return mr;
+}
+
+int ibv_dereg_mr(struct ibv_mr *mr)
+{
+	free(mr);
+	return 0;
+}
+
+/* The send rings */
+
+static void dr_sw_apply(struct dr_sw_ring *ring)
+{
+	struct dr_sw_write *write;
+
+	write = list_pop(&ring->queue, struct dr_sw_write, node);
+	memcpy(write->dst, write->data, write->length);
+	ring->queued--;
+	free(write);
+}
+
+/* Complete some of the queued writes, ring by ring */
+static void dr_sw_progress(void)
+{
+	struct dr_sw_ring *ring;
+	int n;
+
+	ring = &dr_sw_dev.rings[rand_r(&dr_sw_dev.seed) % DR_MAX_SEND_RINGS];
+	n = rand_r(&dr_sw_dev.seed) % 4;
+	while (n-- && ring->queued)
+		dr_sw_apply(ring);
+}
+
+void dr_sw_drain(void)
+{
+	int i;
+
+	pthread_mutex_lock(&dr_sw_dev.lock);
+	for (i = 0; i < DR_MAX_SEND_RINGS; i++)
+		while (dr_sw_dev.rings[i].queued)
+			dr_sw_apply(&dr_sw_dev.rings[i]);
+	pthread_mutex_unlock(&dr_sw_dev.lock);
+}
+
+static int dr_sw_post(uint8_t ring_idx, uint32_t rkey, uint64_t remote_addr,
+		      uint8_t *data, uint32_t length)
+{
+	struct dr_sw_ring *ring = &dr_sw_dev.rings[ring_idx % DR_MAX_SEND_RINGS];
+	struct dr_sw_region *region;
+	struct dr_sw_write *write;
+
+	atomic_fetch_add(&dr_sw_stats.writes, 1);
+	atomic_fetch_add(&dr_sw_stats.bytes, length);
+	atomic_fetch_add(&dr_sw_stats.ring_writes[ring_idx % DR_MAX_SEND_RINGS], 1);
+
+	pthread_mutex_lock(&dr_sw_dev.lock);
+	region = &dr_sw_dev.regions[rkey];
+	if (!rkey || rkey >= DR_SW_MAX_REGIONS || !region->host ||
+	    remote_addr + length > region->length) {
+		pthread_mutex_unlock(&dr_sw_dev.lock);
+		fprintf(stderr, "ICM write out of bounds, rkey %u addr 0x%lx\n",
+			rkey, (unsigned long)remote_addr);
+		abort();
+	}
+
+	if (dr_sw_batch)
+		ring->db_pending = true;
+	else
+		atomic_fetch_add(&dr_sw_stats.doorbells, 1);
+
+	if (!dr_sw_reorder) {
+		memcpy(region->host + remote_addr, data, length);
+		pthread_mutex_unlock(&dr_sw_dev.lock);
+		return 0;
+	}
+
+	write = malloc(sizeof(*write) + length);
+	if (!write) {
+		pthread_mutex_unlock(&dr_sw_dev.lock);
+		errno = ENOMEM;
+		return errno;
+	}
+	write->dst = region->host + remote_addr;
+	write->length = length;
+	memcpy(write->data, data, length);
+	list_add_tail(&ring->queue, &write->node);
+	if (++ring->queued > DR_SW_RING_DEPTH)
+		dr_sw_apply(ring);
+	dr_sw_progress();
+	pthread_mutex_unlock(&dr_sw_dev.lock);
+
+	return 0;
+}
+
+void dr_send_batch_begin(void)
+{
+	dr_sw_batch = true;
+}
+
+void dr_send_batch_end(struct mlx5dv_dr_domain *dmn)
+{
+	int i;
+
+	dr_sw_batch = false;
+	atomic_fetch_add(&dr_sw_stats.batches, 1);
+
+	pthread_mutex_lock(&dr_sw_dev.lock);
+	for (i = 0; i < DR_MAX_SEND_RINGS; i++) {
+		if (dr_sw_dev.rings[i].db_pending) {
+			dr_sw_dev.rings[i].db_pending = false;
+			atomic_fetch_add(&dr_sw_stats.doorbells, 1);
+		}
+	}
+	pthread_mutex_unlock(&dr_sw_dev.lock);
+}
+
+int dr_send_ring_force_drain(struct mlx5dv_dr_domain *dmn)
+{
+	atomic_fetch_add(&dr_sw_stats.drains, 1);
+	dr_sw_drain();
+	return 0;
+}
+
+void dr_send_fill_and_append_ste_send_info(struct dr_ste *ste, uint16_t size,
+					   uint16_t offset, uint8_t *data,
+					   struct dr_ste_send_info *ste_info,
+					   struct list_head *send_list,
+					   bool copy_data)
+{
+	ste_info->size = size;
+	ste_info->ste = ste;
+	ste_info->offset = offset;
+
+	if (copy_data) {
+		memcpy(ste_info->data_cont, data, size);
+		ste_info->data = ste_info->data_cont;
+	} else {
+		ste_info->data = data;
+	}
+
+	list_add_tail(send_list, &ste_info->send_list);
+}
+
+/* The writers below lay out the data like their dr_send.c counterparts */
+
+int dr_send_postsend_ste(struct mlx5dv_dr_domain *dmn, struct dr_ste *ste,
+			 uint8_t *data, uint16_t size, uint16_t offset,
+			 uint8_t ring_idx)
+{
+	dr_ste_prepare_for_postsend(dmn->ste_ctx, data, size);
+
+	return dr_sw_post(ring_idx, dr_icm_pool_get_chunk_rkey(ste->htbl->chunk),
+			  dr_ste_get_mr_addr(ste) + offset, data, size);
+}
+
+int dr_send_postsend_htbl(struct mlx5dv_dr_domain *dmn, struct dr_ste_htbl *htbl,
+			  uint8_t *formated_ste, uint8_t *mask,
+			  uint8_t send_ring_idx)
+{
+	bool legacy_htbl = htbl->type == DR_STE_HTBL_TYPE_LEGACY;
+	uint32_t num_stes = htbl->chunk->num_of_entries;
+	uint8_t ste_sz = htbl->ste_arr->size;
+	uint8_t *data;
+	uint32_t i;
+	int ret;
+
+	data = calloc(num_stes, DR_STE_SIZE);
+	if (!data) {
+		errno = ENOMEM;
+		return errno;
+	}
+
+	dr_ste_prepare_for_postsend(dmn->ste_ctx, formated_ste, DR_STE_SIZE);
+
+	for (i = 0; i < num_stes; i++) {
+		uint8_t *entry = data + i * DR_STE_SIZE;
+
+		if (dr_ste_is_not_used(&htbl->ste_arr[i])) {
+			memcpy(entry, formated_ste, DR_STE_SIZE);
+			continue;
+		}
+
+		memcpy(entry, htbl->ste_arr[i].hw_ste, ste_sz);
+		if (legacy_htbl)
+			memcpy(entry + ste_sz, mask, DR_STE_SIZE_MASK);
+		dr_ste_prepare_for_postsend(dmn->ste_ctx, entry, DR_STE_SIZE);
+	}
+
+	ret = dr_sw_post(send_ring_idx, dr_icm_pool_get_chunk_rkey(htbl->chunk),
+			 dr_ste_get_mr_addr(htbl->ste_arr), data,
+			 num_stes * DR_STE_SIZE);
+	free(data);
+	return ret;
+}
+
+int dr_send_postsend_formated_range(struct mlx5dv_dr_domain *dmn,
+				    struct dr_ste_htbl *htbl,
+				    uint8_t *ste_init_data,
+				    uint32_t first, uint32_t num,
+				    uint8_t send_ring_idx)
+{
+	uint8_t *data;
+	uint32_t i;
+	int ret;
+
+	data = calloc(num, DR_STE_SIZE);
+	if (!data) {
+		errno = ENOMEM;
+		return errno;
+	}
+
+	memcpy(data, ste_init_data, DR_STE_SIZE);
+	dr_ste_prepare_for_postsend(dmn->ste_ctx, data, DR_STE_SIZE);
+	for (i = 1; i < num; i++)
+		memcpy(data + i * DR_STE_SIZE, data, DR_STE_SIZE);
+
+	ret = dr_sw_post(send_ring_idx, dr_icm_pool_get_chunk_rkey(htbl->chunk),
+			 dr_ste_get_mr_addr(htbl->ste_arr + first), data,
+			 num * DR_STE_SIZE);
+	free(data);
+	return ret;
+}
+
+int dr_send_postsend_formated_htbl(struct mlx5dv_dr_domain *dmn,
+				   struct dr_ste_htbl *htbl,
+				   uint8_t *ste_init_data,
+				   bool update_hw_ste,
+				   uint8_t send_ring_idx)
+{
+	uint32_t i;
+
+	if (update_hw_ste)
+		for (i = 0; i < htbl->chunk->num_of_entries; i++)
+			memcpy(htbl->hw_ste_arr + i * htbl->ste_arr->size,
+			       ste_init_data, htbl->ste_arr->size);
+
+	return dr_send_postsend_formated_range(dmn, htbl, ste_init_data, 0,
+					       htbl->chunk->num_of_entries,
+					       send_ring_idx);
+}
+
+int dr_send_postsend_action(struct mlx5dv_dr_domain *dmn,
+			    struct mlx5dv_dr_action *action)
+{
+	errno = EOPNOTSUPP;
+	return errno;
+}
+
+/* Rules are created without actions, the last STE just hits */
+int dr_actions_build_ste_arr(struct mlx5dv_dr_matcher *matcher,
+			     struct dr_matcher_rx_tx *nic_matcher,
+			     struct mlx5dv_dr_action *actions[],
+			     uint32_t num_actions,
+			     uint8_t *ste_arr,
+			     uint32_t *new_hw_ste_arr_sz,
+			     struct cross_dmn_params *cross_dmn_p,
+			     uint8_t send_ring_idx)
+{
+	if (num_actions) {
+		errno = EOPNOTSUPP;
+		return errno;
+	}
+
+	*new_hw_ste_arr_sz = nic_matcher->num_of_builders;
+	return 0;
+}
+
+/* Root tables and everything else that needs a DevX command */
+
+int dr_actions_build_attr(struct mlx5dv_dr_matcher *matcher,
+			  struct mlx5dv_dr_action *actions[],
+			  size_t num_actions,
+			  struct mlx5dv_flow_action_attr *attr,
+			  struct mlx5_flow_action_attr_aux *attr_aux)
+{
+	errno = EOPNOTSUPP;
+	return errno;
+}
+
+struct ibv_flow *
+_mlx5dv_create_flow(struct mlx5dv_flow_matcher *flow_matcher,
+		    struct mlx5dv_flow_match_parameters *match_value,
+		    size_t num_actions,
+		    struct mlx5dv_flow_action_attr actions_attr[],
+		    struct mlx5_flow_action_attr_aux actions_attr_aux[])
+{
+	errno = EOPNOTSUPP;
+	return NULL;
+}
+
+struct mlx5dv_flow_matcher *
+mlx5dv_create_flow_matcher(struct ibv_context *context,
+			   struct mlx5dv_flow_matcher_attr *attr)
+{
+	errno = EOPNOTSUPP;
+	return NULL;
+}
+
+int mlx5dv_destroy_flow_matcher(struct mlx5dv_flow_matcher *flow_matcher)
+{
+	return EOPNOTSUPP;
+}
+
+struct mlx5dv_devx_obj *dr_devx_create_definer(struct ibv_context *ctx,
+					       uint16_t format_id,
+					       uint8_t *match_mask)
+{
+	errno = EOPNOTSUPP;
+	return NULL;
+}
+
+struct mlx5dv_devx_obj *
+dr_devx_create_flow_table(struct ibv_context *ctx,
+			  struct dr_devx_flow_table_attr *table_attr)
+{
+	struct mlx5dv_devx_obj *obj;
+
+	obj = calloc(1, sizeof(*obj));
+	if (!obj)
+		errno = ENOMEM;
+	return obj;
+}
+
+int mlx5dv_devx_obj_destroy(struct mlx5dv_devx_obj *obj)
+{
+	free(obj);
+	return 0;
+}
+
+int dr_devx_sync_steering(struct ibv_context *ctx)
+{
+	atomic_fetch_add(&dr_sw_stats.hw_syncs, 1);
+	return 0;
+}
+
+struct dr_arg_obj *dr_arg_get_obj(struct dr_arg_mngr *mngr,
+				  uint16_t num_of_actions,
+				  uint8_t *data)
+{
+	errno = EOPNOTSUPP;
+	return NULL;
+}
+
+void dr_arg_put_obj(struct dr_arg_mngr *mngr, struct dr_arg_obj *arg_obj)
+{
+}
+
+struct dr_ptrn_obj *
+dr_ptrn_cache_get_pattern(struct dr_ptrn_mngr *mngr,
+			  enum dr_ptrn_type type,
+			  uint16_t num_of_actions,
+			  uint8_t *data)
+{
+	errno = EOPNOTSUPP;
+	return NULL;
+}
+
+void dr_ptrn_cache_put_pattern(struct dr_ptrn_mngr *mngr,
+			       struct dr_ptrn_obj *pattern)
+{
+}
+
+struct dr_devx_vport_cap *dr_vports_table_get_vport_cap(struct dr_devx_caps *caps,
+							uint16_t vport)
+{
+	return NULL;
+}
+
+bool dr_domain_is_support_ste_icm_size(struct mlx5dv_dr_domain *dmn,
+				       uint32_t req_log_icm_sz)
+{
+	return dmn->info.caps.log_icm_size >= req_log_icm_sz + DR_STE_LOG_SIZE;
+}
+
+bool dr_domain_set_max_ste_icm_size(struct mlx5dv_dr_domain *dmn,
+				    uint32_t req_log_icm_sz)
+{
+	if (!dr_domain_is_support_ste_icm_size(dmn, req_log_icm_sz))
+		return false;
+
+	if (dmn->info.max_log_sw_icm_sz < req_log_icm_sz) {
+		dmn->info.max_log_sw_icm_sz = req_log_icm_sz;
+		dr_icm_pool_set_pool_max_log_chunk_sz(dmn->ste_icm_pool,
+						      dmn->info.max_log_sw_icm_sz);
+	}
+	return true;
+}
+
+int mlx5dv_dr_domain_sync(struct mlx5dv_dr_domain *dmn, uint32_t flags)
+{
+	dr_send_ring_force_drain(dmn);
+	dr_devx_sync_steering(dmn->ctx);
+	return dr_icm_pool_sync_pool(dmn->ste_icm_pool);
+}
+
+/* The domain */
+
+struct dr_sw_domain {
+	struct mlx5dv_dr_domain	dmn;
+	struct ibv_pd		pd;
+	struct ibv_dm		*terminal;
+};
+
+struct mlx5dv_dr_domain *dr_sw_domain_create(enum dr_icm_chunk_size log_icm_sz)
+{
+	struct ibv_alloc_dm_attr dm_attr = { .length = DR_STE_SIZE };
+	struct mlx5_context *mctx;
+	struct dr_sw_domain *sw;
+	struct mlx5dv_dr_domain *dmn;
+
+	for (int i = 0; i < DR_MAX_SEND_RINGS; i++)
+		if (!dr_sw_dev.rings[i].queue.n.next)
+			list_head_init(&dr_sw_dev.rings[i].queue);
+
+	mctx = calloc(1, sizeof(*mctx));
+	sw = calloc(1, sizeof(*sw));
+	if (!mctx || !sw)
+		goto err;
+
+	mctx->dbg_fp = stderr;
+	mctx->ibv_ctx.sz = sizeof(mctx->ibv_ctx);
+	mctx->ibv_ctx.context.abi_compat = __VERBS_ABI_IS_EXTENDED;
+	mctx->ibv_ctx.reg_dm_mr = dr_sw_reg_dm_mr;
+	sw->pd.context = &mctx->ibv_ctx.context;
+
+	dmn = &sw->dmn;
+	dmn->ctx = &mctx->ibv_ctx.context;
+	dmn->pd = &sw->pd;
+	dmn->type = MLX5DV_DR_DOMAIN_TYPE_NIC_RX;
+	atomic_init(&dmn->refcount, 1);
+	list_head_init(&dmn->tbl_list);
+	if (pthread_spin_init(&dmn->debug_lock, PTHREAD_PROCESS_PRIVATE) ||
+	    dr_domain_nic_lock_init(&dmn->info.rx) ||
+	    dr_domain_nic_lock_init(&dmn->info.tx))
+		goto err;
+
+	dmn->info.caps.sw_format_ver = MLX5_HW_CONNECTX_5;
+	dmn->info.caps.gvmi = 1;
+	dmn->info.caps.max_ft_level = 64;
+	dmn->info.caps.log_icm_size = DR_CHUNK_SIZE_1024K + DR_STE_LOG_SIZE;
+	dmn->info.supp_sw_steering = true;
+	dmn->info.max_log_sw_icm_sz = log_icm_sz;
+	dmn->info.max_log_sw_icm_rehash_sz = log_icm_sz;
+	dmn->info.max_send_size =
+		dr_icm_pool_chunk_size_to_byte(DR_CHUNK_SIZE_1K, DR_ICM_TYPE_STE);
+	dmn->ste_ctx = dr_ste_get_ctx(MLX5_HW_CONNECTX_5);
+
+	/* Packets that miss the table end up here */
+	sw->terminal = mlx5dv_alloc_dm(dmn->ctx, &dm_attr, NULL);
+	if (!sw->terminal)
+		goto err;
+	dmn->info.rx.type = DR_DOMAIN_NIC_TYPE_RX;
+	dmn->info.rx.default_icm_addr = to_mdm(sw->terminal)->remote_va;
+	dmn->info.rx.drop_icm_addr = dmn->info.rx.default_icm_addr;
+
+	dmn->ste_icm_pool = dr_icm_pool_create(dmn, DR_ICM_TYPE_STE);
+	if (!dmn->ste_icm_pool)
+		goto err;
+
+	dr_crc32_init_table();
+	return dmn;
+
+err:
+	fprintf(stderr, "Failed creating the SW domain\n");
+	exit(1);
+}
+
+void dr_sw_domain_destroy(struct mlx5dv_dr_domain *dmn)
+{
+	struct dr_sw_domain *sw = container_of(dmn, struct dr_sw_domain, dmn);
+
+	dr_sw_drain();
+	dr_icm_pool_destroy(dmn->ste_icm_pool);
+	mlx5_free_dm(sw->terminal);
+	dr_domain_nic_lock_uninit(&dmn->info.rx);
+	dr_domain_nic_lock_uninit(&dmn->info.tx);
+	pthread_spin_destroy(&dmn->debug_lock);
+	free(to_mctx(dmn->ctx));
+	free(sw);
+}
+
+/* Looking up packets */
+
+#define DR_SW_MAX_HOPS	(1 << 16)
+
+static bool dr_sw_is_zero(const uint8_t *p, size_t len)
+{
+	while (len--)
+		if (*p++)
+			return false;
+	return true;
+}
+
+uint64_t dr_sw_lookup(struct mlx5dv_dr_table *tbl, uint8_t *hw_ste,
+		      uint32_t hash)
+{
+	struct mlx5dv_dr_domain *dmn = tbl->dmn;
+	uint64_t addr, base, index, size;
+	uint8_t ste[DR_STE_SIZE];
+	uint8_t *host;
+	int hops;
+
+	addr = dr_icm_pool_get_chunk_icm_addr(tbl->rx.s_anchor->chunk);
+
+	for (hops = 0; hops < DR_SW_MAX_HOPS; hops++) {
+		if (addr == dmn->info.rx.default_icm_addr)
+			return 0;
+
+		/* Regions are whole STEs, so the STE is in the region */
+		host = dr_sw_icm(addr);
+		if (!host || addr % DR_STE_SIZE)
+			return -1;
+		memcpy(ste, host, DR_STE_SIZE);
+
+		if (!dr_sw_is_zero(ste + DR_STE_SIZE_REDUCED, DR_STE_SIZE_MASK)) {
+			/* A rule entry, the packet hits it if the tag matches */
+			if (!memcmp(ste + DR_STE_SIZE_CTRL,
+				    hw_ste + DR_STE_SIZE_CTRL, DR_STE_SIZE_TAG))
+				return addr;
+		} else if (DR_STE_GET(general, ste, next_lu_type) !=
+			   DR_STE_LU_TYPE_DONT_CARE) {
+			/* Always hit, go to the bucket of the next table */
+			index = DR_STE_GET(general, ste, next_table_base_39_32_size) << 27 |
+				DR_STE_GET(general, ste, next_table_base_31_5_size);
+			size = index & -index;
+			base = (index ^ size) << 5;
+			addr = base + (hash & (size - 1)) * DR_STE_SIZE;
+			continue;
+		}
+
+		addr = dr_ste_get_miss_addr(dmn->ste_ctx, ste);
+	}
+
+	return -1;
+}
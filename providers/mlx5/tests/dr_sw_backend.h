@@ -0,0 +1,55 @@
+/* SPDX-License-Identifier: (GPL-2.0 OR Linux-OpenIB) */
+/*
+ * A software stand-in for the device, to run the SW steering code without
+ * an mlx5 device. It takes the place of dr_send.c, the DevX commands and
+ * the device memory calls: ICM is host memory at made up device
+ * addresses, and STE writes are copied into it.
+ *
+ * Each send ring queues its writes, which are applied in ring order but
+ * in any order across rings when dr_sw_reorder is set, like the rings of
+ * the device may complete them. A force drain applies all queued writes.
+ */
+#ifndef DR_SW_BACKEND_H
+#define DR_SW_BACKEND_H
+
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "../mlx5dv_dr.h"
+
+struct dr_sw_stats {
+	atomic_ulong	writes;		/* ICM writes posted */
+	atomic_ulong	bytes;
+	atomic_ulong	ring_writes[DR_MAX_SEND_RINGS];
+	/* Doorbells dr_send.c would ring, held back writes ring once */
+	atomic_ulong	doorbells;
+	atomic_ulong	batches;
+	atomic_ulong	drains;
+	atomic_ulong	hw_syncs;
+	atomic_ulong	dm_allocs;
+	atomic_ulong	dm_frees;
+};
+
+extern struct dr_sw_stats dr_sw_stats;
+extern bool dr_sw_reorder;
+
+/* A NIC RX domain on a ConnectX-5 STE format, ICM of up to log_icm_sz */
+struct mlx5dv_dr_domain *dr_sw_domain_create(enum dr_icm_chunk_size log_icm_sz);
+void dr_sw_domain_destroy(struct mlx5dv_dr_domain *dmn);
+
+/* Apply the writes still queued on the rings */
+void dr_sw_drain(void);
+
+/* Host memory at an ICM address, NULL if the address is not allocated */
+uint8_t *dr_sw_icm(uint64_t icm_addr);
+
+/*
+ * Look up a packet the way the device does from the start anchor of tbl.
+ * hw_ste holds the tag of the packet on the first STE of the matcher and
+ * hash its hash. Returns the ICM address of the STE the packet hits, 0 if
+ * it misses the table, or -1 if the walk goes astray.
+ */
+uint64_t dr_sw_lookup(struct mlx5dv_dr_table *tbl, uint8_t *hw_ste,
+		      uint32_t hash);
+
+#endif /* DR_SW_BACKEND_H */
@@ -58,4 +58,20 @@ DECLARE_DRV_CMD(urxe_modify_srq, IB_USER_VERBS_CMD_MODIFY_SRQ,
 DECLARE_DRV_CMD(urxe_resize_cq, IB_USER_VERBS_CMD_RESIZE_CQ,
 		empty, rxe_resize_cq_resp);
 
+/*
+ * SQ doorbell suppression.  A kernel that supports it reports
+ * RXE_CREATE_QP_RESP_SQ_BUSY in the create QP response and keeps
+ * RXE_SQ_BUSY set in the flags word of the SQ queue header while its
+ * requester is draining the SQ.  It clears the flag and then re-reads the
+ * producer index before going idle, so a WQE published while the flag is
+ * seen set is always picked up without a doorbell.  The word is not read
+ * unless the kernel reported the capability, older kernels get a doorbell
+ * on every post.
+ */
+#define RXE_QUEUE_FLAGS_WORD	0	/* index into rxe_queue_buf.pad_1 */
+
+enum {
+	RXE_SQ_BUSY		= 1 << 0,
+};
+
 #endif /* RXE_ABI_H */
@@ -49,6 +49,8 @@
 #include <pthread.h>
 #include <stddef.h>
 
+#include <ccan/minmax.h>
+
 #include <infiniband/driver.h>
 #include <infiniband/verbs.h>
 
@@ -103,32 +105,144 @@ static struct ibv_pd *rxe_alloc_pd(struct ibv_context *context)
 {
 	struct ibv_alloc_pd cmd;
 	struct ib_uverbs_alloc_pd_resp resp;
-	struct ibv_pd *pd;
+	struct rxe_pd *pd;
 
 	pd = calloc(1, sizeof(*pd));
 	if (!pd)
 		return NULL;
 
-	if (ibv_cmd_alloc_pd(context, pd, &cmd, sizeof(cmd),
+	if (ibv_cmd_alloc_pd(context, &pd->ibv_pd, &cmd, sizeof(cmd),
 					&resp, sizeof(resp))) {
 		free(pd);
 		return NULL;
 	}
 
-	return pd;
+	atomic_init(&pd->refcount, 1);
+
+	return &pd->ibv_pd;
 }
 
-static int rxe_dealloc_pd(struct ibv_pd *pd)
+static int rxe_dealloc_pd(struct ibv_pd *ibpd)
 {
+	struct rxe_pd *pd = to_rpd(ibpd);
 	int ret;
 
-	ret = ibv_cmd_dealloc_pd(pd);
+	if (atomic_load(&pd->refcount) > 1)
+		return EBUSY;
+
+	if (pd->protection_domain) {
+		atomic_fetch_sub(&pd->protection_domain->refcount, 1);
+		if (pd->td)
+			atomic_fetch_sub(&pd->td->refcount, 1);
+		free(pd);
+		return 0;
+	}
+
+	ret = ibv_cmd_dealloc_pd(ibpd);
 	if (!ret)
 		free(pd);
 
 	return ret;
 }
 
+static struct ibv_td *rxe_alloc_td(struct ibv_context *context,
+				   struct ibv_td_init_attr *attr)
+{
+	struct rxe_td *td;
+
+	if (attr->comp_mask) {
+		errno = EOPNOTSUPP;
+		return NULL;
+	}
+
+	td = calloc(1, sizeof(*td));
+	if (!td) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	td->ibv_td.context = context;
+	atomic_init(&td->refcount, 1);
+
+	return &td->ibv_td;
+}
+
+static int rxe_dealloc_td(struct ibv_td *ibtd)
+{
+	struct rxe_td *td = to_rtd(ibtd);
+
+	if (atomic_load(&td->refcount) > 1)
+		return EBUSY;
+
+	free(td);
+
+	return 0;
+}
+
+/*
+ * QPs and CQs created under a parent domain with a thread domain are
+ * only used by one thread at a time, so they skip the spinlocks and rely
+ * on the ordering of the queue indices alone.
+ */
+static struct ibv_pd *
+rxe_alloc_parent_domain(struct ibv_context *context,
+			struct ibv_parent_domain_init_attr *attr)
+{
+	struct rxe_pd *pad;
+
+	if (ibv_check_alloc_parent_domain(attr))
+		return NULL;
+
+	if (attr->comp_mask) {
+		errno = EOPNOTSUPP;
+		return NULL;
+	}
+
+	pad = calloc(1, sizeof(*pad));
+	if (!pad) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	pad->protection_domain = to_rpd(attr->pd);
+	atomic_fetch_add(&pad->protection_domain->refcount, 1);
+	if (attr->td) {
+		pad->td = to_rtd(attr->td);
+		atomic_fetch_add(&pad->td->refcount, 1);
+	}
+
+	atomic_init(&pad->refcount, 1);
+	ibv_initialize_parent_domain(&pad->ibv_pd,
+				     &pad->protection_domain->ibv_pd);
+
+	return &pad->ibv_pd;
+}
+
+static void rxe_spinlock_init(struct rxe_spinlock *lock, struct ibv_pd *ibpd)
+{
+	struct rxe_pd *pad = to_rpad(ibpd);
+
+	lock->need_lock = !(pad && pad->td);
+	if (lock->need_lock)
+		pthread_spin_init(&lock->lock, PTHREAD_PROCESS_PRIVATE);
+}
+
+static struct rxe_pd *rxe_get_parent_domain(struct ibv_pd *ibpd)
+{
+	struct rxe_pd *pad = to_rpad(ibpd);
+
+	if (pad)
+		atomic_fetch_add(&pad->refcount, 1);
+
+	return pad;
+}
+
+static void rxe_put_parent_domain(struct rxe_pd *pad)
+{
+	if (pad)
+		atomic_fetch_sub(&pad->refcount, 1);
+}
+
 static struct ibv_mw *rxe_alloc_mw(struct ibv_pd *ibpd, enum ibv_mw_type type)
 {
 	int ret;
@@ -240,12 +354,13 @@ static int cq_start_poll(struct ibv_cq_ex *current,
 {
 	struct rxe_cq *cq = container_of(current, struct rxe_cq, vcq.cq_ex);
 
-	pthread_spin_lock(&cq->lock);
+	rxe_spin_lock(&cq->lock);
 
 	cq->cur_index = load_consumer_index(cq->queue);
+	cq->prod_index = cq->cur_index;
 
 	if (check_cq_queue_empty(cq)) {
-		pthread_spin_unlock(&cq->lock);
+		rxe_spin_unlock(&cq->lock);
 		errno = ENOENT;
 		return errno;
 	}
@@ -257,21 +372,18 @@ static int cq_start_poll(struct ibv_cq_ex *current,
 	return 0;
 }
 
+/* the consumer index is only published by cq_end_poll */
 static int cq_next_poll(struct ibv_cq_ex *current)
 {
 	struct rxe_cq *cq = container_of(current, struct rxe_cq, vcq.cq_ex);
 
-	struct rxe_queue_buf *q = cq->queue;
-	uint32_t next_index = (cq->cur_index + 1) & q->index_mask;
+	advance_cq_cur_index(cq);
 
-	if (next_index == load_producer_index(q)) {
-		store_consumer_index(cq->queue, cq->cur_index);
-		pthread_spin_unlock(&cq->lock);
+	if (check_cq_queue_empty(cq)) {
 		errno = ENOENT;
 		return errno;
 	}
 
-	cq->cur_index = next_index;
 	cq->wc = addr_from_index(cq->queue, cq->cur_index);
 	cq->vcq.cq_ex.status = cq->wc->status;
 	cq->vcq.cq_ex.wr_id = cq->wc->wr_id;
@@ -283,9 +395,11 @@ static void cq_end_poll(struct ibv_cq_ex *current)
 {
 	struct rxe_cq *cq = container_of(current, struct rxe_cq, vcq.cq_ex);
 
-	advance_cq_cur_index(cq);
+	/* cur_index is consumed unless cq_next_poll ran off the end */
+	if (cq->cur_index != cq->prod_index)
+		advance_cq_cur_index(cq);
 	store_consumer_index(cq->queue, cq->cur_index);
-	pthread_spin_unlock(&cq->lock);
+	rxe_spin_unlock(&cq->lock);
 }
 
 static enum ibv_wc_opcode cq_read_opcode(struct ibv_cq_ex *current)
@@ -396,7 +510,7 @@ static struct ibv_cq *rxe_create_cq(struct ibv_context *context, int cqe,
 	}
 
 	cq->mmap_info = resp.mi;
-	pthread_spin_init(&cq->lock, PTHREAD_PROCESS_PRIVATE);
+	rxe_spinlock_init(&cq->lock, NULL);
 
 	return &cq->vcq.cq;
 }
@@ -426,6 +540,12 @@ static struct ibv_cq_ex *rxe_create_cq_ex(struct ibv_context *context,
 		goto err;
 	}
 
+	if ((attr->comp_mask & IBV_CQ_INIT_ATTR_MASK_PD) &&
+	    !to_rpad(attr->parent_domain)) {
+		errno = EINVAL;
+		goto err;
+	}
+
 	cq = calloc(1, sizeof(*cq));
 	if (!cq)
 		goto err;
@@ -447,7 +567,12 @@ static struct ibv_cq_ex *rxe_create_cq_ex(struct ibv_context *context,
 		goto err_unmap;
 
 	cq->mmap_info = resp.mi;
-	pthread_spin_init(&cq->lock, PTHREAD_PROCESS_PRIVATE);
+	if (attr->comp_mask & IBV_CQ_INIT_ATTR_MASK_PD) {
+		cq->parent_domain = rxe_get_parent_domain(attr->parent_domain);
+		rxe_spinlock_init(&cq->lock, attr->parent_domain);
+	} else {
+		rxe_spinlock_init(&cq->lock, NULL);
+	}
 
 	cq->vcq.cq_ex.start_poll	= cq_start_poll;
 	cq->vcq.cq_ex.next_poll		= cq_next_poll;
@@ -504,12 +629,12 @@ static int rxe_resize_cq(struct ibv_cq *ibcq, int cqe)
 	struct urxe_resize_cq_resp resp;
 	int ret;
 
-	pthread_spin_lock(&cq->lock);
+	rxe_spin_lock(&cq->lock);
 
 	ret = ibv_cmd_resize_cq(ibcq, cqe, &cmd, sizeof(cmd),
 				&resp.ibv_resp, sizeof(resp));
 	if (ret) {
-		pthread_spin_unlock(&cq->lock);
+		rxe_spin_unlock(&cq->lock);
 		return ret;
 	}
 
@@ -520,7 +645,7 @@ static int rxe_resize_cq(struct ibv_cq *ibcq, int cqe)
 			 ibcq->context->cmd_fd, resp.mi.offset);
 
 	ret = errno;
-	pthread_spin_unlock(&cq->lock);
+	rxe_spin_unlock(&cq->lock);
 
 	if ((void *)cq->queue == MAP_FAILED) {
 		cq->queue = NULL;
@@ -544,31 +669,54 @@ static int rxe_destroy_cq(struct ibv_cq *ibcq)
 
 	if (cq->mmap_info.size)
 		munmap(cq->queue, cq->mmap_info.size);
+	rxe_put_parent_domain(cq->parent_domain);
 	free(cq);
 
 	return 0;
 }
 
+/* Copy n completions from consecutive ring slots starting at src */
+static void rxe_copy_cqes(struct rxe_queue_buf *q, struct ibv_wc *wc,
+			  uint8_t *src, uint32_t n)
+{
+	while (n--) {
+		memcpy(wc++, src, sizeof(*wc));
+		src += 1 << q->log2_elem_size;
+	}
+}
+
+/*
+ * Take every completion up to a single producer index snapshot and
+ * release them with a single consumer index update.  The completions
+ * are copied in at most two spans, before and after the ring wraps.
+ * Ring slots are a power of two in size and larger than struct ibv_wc,
+ * so each span is walked with the slot stride.
+ */
 static int rxe_poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_wc *wc)
 {
 	struct rxe_cq *cq = to_rcq(ibcq);
 	struct rxe_queue_buf *q;
+	uint32_t cons, prod, span;
 	int npolled;
-	uint8_t *src;
 
-	pthread_spin_lock(&cq->lock);
+	if (ne <= 0)
+		return 0;
+
+	rxe_spin_lock(&cq->lock);
 	q = cq->queue;
 
-	for (npolled = 0; npolled < ne; ++npolled, ++wc) {
-		if (queue_empty(q))
-			break;
+	cons = load_consumer_index(q);
+	prod = snapshot_producer_index(q);
+	npolled = min_t(uint32_t, ne, (prod - cons) & q->index_mask);
 
-		src = consumer_addr(q);
-		memcpy(wc, src, sizeof(*wc));
-		advance_consumer(q);
-	}
+	span = min_t(uint32_t, npolled, q->index_mask + 1 - cons);
+	rxe_copy_cqes(q, wc, addr_from_index(q, cons), span);
+	rxe_copy_cqes(q, wc + span, addr_from_index(q, 0), npolled - span);
+
+	if (npolled)
+		store_consumer_index(q, (cons + npolled) & q->index_mask);
 
-	pthread_spin_unlock(&cq->lock);
+	rxe_spin_unlock(&cq->lock);
 	return npolled;
 }
 
@@ -605,7 +753,7 @@ static struct ibv_srq *rxe_create_srq(struct ibv_pd *ibpd,
 
 	srq->mmap_info = resp.mi;
 	srq->rq.max_sge = attr->attr.max_sge;
-	pthread_spin_init(&srq->rq.lock, PTHREAD_PROCESS_PRIVATE);
+	rxe_spinlock_init(&srq->rq.lock, NULL);
 
 	return ibsrq;
 }
@@ -644,7 +792,7 @@ static struct ibv_srq *rxe_create_srq_ex(
 
 	srq->mmap_info = resp.mi;
 	srq->rq.max_sge = attr_ex->attr.max_sge;
-	pthread_spin_init(&srq->rq.lock, PTHREAD_PROCESS_PRIVATE);
+	rxe_spinlock_init(&srq->rq.lock, NULL);
 
 	return ibsrq;
 }
@@ -661,7 +809,7 @@ static int rxe_modify_srq(struct ibv_srq *ibsrq,
 	mi.size = 0;
 
 	if (attr_mask & IBV_SRQ_MAX_WR)
-		pthread_spin_lock(&srq->rq.lock);
+		rxe_spin_lock(&srq->rq.lock);
 
 	cmd.mmap_info_addr = (__u64)(uintptr_t) &mi;
 	rc = ibv_cmd_modify_srq(ibsrq, attr, attr_mask,
@@ -687,7 +835,7 @@ static int rxe_modify_srq(struct ibv_srq *ibsrq,
 
 out:
 	if (attr_mask & IBV_SRQ_MAX_WR)
-		pthread_spin_unlock(&srq->rq.lock);
+		rxe_spin_unlock(&srq->rq.lock);
 	return rc;
 }
 
@@ -762,7 +910,7 @@ static int rxe_post_srq_recv(struct ibv_srq *ibsrq,
 	struct rxe_srq *srq = to_rsrq(ibsrq);
 	int rc = 0;
 
-	pthread_spin_lock(&srq->rq.lock);
+	rxe_spin_lock(&srq->rq.lock);
 
 	while (recv_wr) {
 		rc = rxe_post_one_recv(&srq->rq, recv_wr);
@@ -774,7 +922,7 @@ static int rxe_post_srq_recv(struct ibv_srq *ibsrq,
 		recv_wr = recv_wr->next;
 	}
 
-	pthread_spin_unlock(&srq->rq.lock);
+	rxe_spin_unlock(&srq->rq.lock);
 
 	return rc;
 }
@@ -1163,13 +1311,13 @@ static void wr_start(struct ibv_qp_ex *ibqp)
 {
 	struct rxe_qp *qp = container_of(ibqp, struct rxe_qp, vqp.qp_ex);
 
-	pthread_spin_lock(&qp->sq.lock);
+	rxe_spin_lock(&qp->sq.lock);
 
 	qp->err = 0;
 	qp->cur_index = load_producer_index(qp->sq.queue);
 }
 
-static int post_send_db(struct ibv_qp *ibqp);
+static int ring_send_db(struct rxe_qp *qp);
 
 static int wr_complete(struct ibv_qp_ex *ibqp)
 {
@@ -1177,14 +1325,14 @@ static int wr_complete(struct ibv_qp_ex *ibqp)
 	struct rxe_qp *qp = container_of(ibqp, struct rxe_qp, vqp.qp_ex);
 
 	if (qp->err) {
-		pthread_spin_unlock(&qp->sq.lock);
+		rxe_spin_unlock(&qp->sq.lock);
 		return qp->err;
 	}
 
 	store_producer_index(qp->sq.queue, qp->cur_index);
-	ret = post_send_db(&qp->vqp.qp);
+	ret = ring_send_db(qp);
 
-	pthread_spin_unlock(&qp->sq.lock);
+	rxe_spin_unlock(&qp->sq.lock);
 	return ret;
 }
 
@@ -1192,10 +1340,10 @@ static void wr_abort(struct ibv_qp_ex *ibqp)
 {
 	struct rxe_qp *qp = container_of(ibqp, struct rxe_qp, vqp.qp_ex);
 
-	pthread_spin_unlock(&qp->sq.lock);
+	rxe_spin_unlock(&qp->sq.lock);
 }
 
-static int map_queue_pair(int cmd_fd, struct rxe_qp *qp,
+static int map_queue_pair(int cmd_fd, struct rxe_qp *qp, struct ibv_pd *ibpd,
 			  struct ibv_qp_init_attr *attr,
 			  struct rxe_create_qp_resp *resp)
 {
@@ -1212,7 +1360,7 @@ static int map_queue_pair(int cmd_fd, struct rxe_qp *qp,
 			return errno;
 
 		qp->rq_mmap_info = resp->rq_mi;
-		pthread_spin_init(&qp->rq.lock, PTHREAD_PROCESS_PRIVATE);
+		rxe_spinlock_init(&qp->rq.lock, ibpd);
 	}
 
 	qp->sq.max_sge = attr->cap.max_send_sge;
@@ -1227,7 +1375,9 @@ static int map_queue_pair(int cmd_fd, struct rxe_qp *qp,
 	}
 
 	qp->sq_mmap_info = resp->sq_mi;
-	pthread_spin_init(&qp->sq.lock, PTHREAD_PROCESS_PRIVATE);
+	qp->sq_busy_sup = !!(resp->flags & RXE_CREATE_QP_RESP_SQ_BUSY);
+	rxe_spinlock_init(&qp->sq.lock, ibpd);
+	qp->parent_domain = rxe_get_parent_domain(ibpd);
 
 	return 0;
 }
@@ -1249,14 +1399,11 @@ static struct ibv_qp *rxe_create_qp(struct ibv_pd *ibpd,
 	if (ret)
 		goto err_free;
 
-	ret = map_queue_pair(ibpd->context->cmd_fd, qp, attr,
+	ret = map_queue_pair(ibpd->context->cmd_fd, qp, ibpd, attr,
 			     &resp.drv_payload);
 	if (ret)
 		goto err_destroy;
 
-	qp->sq_mmap_info = resp.sq_mi;
-	pthread_spin_init(&qp->sq.lock, PTHREAD_PROCESS_PRIVATE);
-
 	return &qp->vqp.qp;
 
 err_destroy:
@@ -1403,6 +1550,8 @@ static struct ibv_qp *rxe_create_qp_ex(struct ibv_context *context,
 	qp->vqp.comp_mask |= VERBS_QP_EX;
 
 	ret = map_queue_pair(context->cmd_fd, qp,
+			     (attr->comp_mask & IBV_QP_INIT_ATTR_PD) ?
+			     attr->pd : NULL,
 			     (struct ibv_qp_init_attr *)attr,
 			     &resp.drv_payload);
 	if (ret)
@@ -1447,6 +1596,7 @@ static int rxe_destroy_qp(struct ibv_qp *ibqp)
 		if (qp->sq_mmap_info.size)
 			munmap(qp->sq.queue, qp->sq_mmap_info.size);
 
+		rxe_put_parent_domain(qp->parent_domain);
 		free(qp);
 	}
 
@@ -1589,8 +1739,9 @@ static int init_send_wqe(struct rxe_qp *qp, struct rxe_wq *sq,
 	return 0;
 }
 
+/* build a WQE in slot *index and advance it, the caller publishes it */
 static int post_one_send(struct rxe_qp *qp, struct rxe_wq *sq,
-			 struct ibv_send_wr *ibwr)
+			 struct ibv_send_wr *ibwr, uint32_t *index)
 {
 	int err;
 	struct rxe_send_wqe *wqe;
@@ -1607,16 +1758,16 @@ static int post_one_send(struct rxe_qp *qp, struct rxe_wq *sq,
 		return err;
 	}
 
-	wqe = (struct rxe_send_wqe *)producer_addr(sq->queue);
+	wqe = (struct rxe_send_wqe *)addr_from_index(sq->queue, *index);
 
 	err = init_send_wqe(qp, sq, ibwr, length, wqe);
 	if (err)
 		return err;
 
-	if (queue_full(sq->queue))
+	if (queue_full_at(sq->queue, *index))
 		return ENOMEM;
 
-	advance_producer(sq->queue);
+	*index = (*index + 1) & sq->queue->index_mask;
 	rdma_tracepoint(rdma_core_rxe, post_send,
 			qp->vqp.qp.context->device->name,
 			qp->vqp.qp.qp_num,
@@ -1647,6 +1798,15 @@ static int post_send_db(struct ibv_qp *ibqp)
 	return 0;
 }
 
+/* skip the doorbell while the kernel is still draining the SQ */
+static int ring_send_db(struct rxe_qp *qp)
+{
+	if (qp->sq_busy_sup && queue_busy(qp->sq.queue))
+		return 0;
+
+	return post_send_db(&qp->vqp.qp);
+}
+
 /* this API does not make a distinction between
  * restartable and non-restartable errors
  */
@@ -1655,9 +1815,10 @@ static int rxe_post_send(struct ibv_qp *ibqp,
 			 struct ibv_send_wr **bad_wr)
 {
 	int rc = 0;
-	int err;
+	int err = 0;
 	struct rxe_qp *qp = to_rqp(ibqp);
 	struct rxe_wq *sq = &qp->sq;
+	uint32_t start, index;
 
 	if (!bad_wr)
 		return EINVAL;
@@ -1667,10 +1828,11 @@ static int rxe_post_send(struct ibv_qp *ibqp,
 	if (!sq || !wr_list || !sq->queue)
 		return EINVAL;
 
-	pthread_spin_lock(&sq->lock);
+	rxe_spin_lock(&sq->lock);
 
+	start = index = load_producer_index(sq->queue);
 	while (wr_list) {
-		rc = post_one_send(qp, sq, wr_list);
+		rc = post_one_send(qp, sq, wr_list, &index);
 		if (rc) {
 			*bad_wr = wr_list;
 			break;
@@ -1679,9 +1841,14 @@ static int rxe_post_send(struct ibv_qp *ibqp,
 		wr_list = wr_list->next;
 	}
 
-	pthread_spin_unlock(&sq->lock);
+	/* publish the whole list at once */
+	if (index != start)
+		store_producer_index(sq->queue, index);
+
+	rxe_spin_unlock(&sq->lock);
 
-	err =  post_send_db(ibqp);
+	if (index != start)
+		err = ring_send_db(qp);
 	return err ? err : rc;
 }
 
@@ -1705,7 +1872,7 @@ static int rxe_post_recv(struct ibv_qp *ibqp,
 	if (ibqp->state == IBV_QPS_RESET)
 		return EINVAL;
 
-	pthread_spin_lock(&rq->lock);
+	rxe_spin_lock(&rq->lock);
 
 	while (recv_wr) {
 		rc = rxe_post_one_recv(rq, recv_wr);
@@ -1717,7 +1884,7 @@ static int rxe_post_recv(struct ibv_qp *ibqp,
 		recv_wr = recv_wr->next;
 	}
 
-	pthread_spin_unlock(&rq->lock);
+	rxe_spin_unlock(&rq->lock);
 
 	return rc;
 }
@@ -1825,6 +1992,9 @@ static const struct verbs_context_ops rxe_ctx_ops = {
 	.query_port = rxe_query_port,
 	.alloc_pd = rxe_alloc_pd,
 	.dealloc_pd = rxe_dealloc_pd,
+	.alloc_td = rxe_alloc_td,
+	.dealloc_td = rxe_dealloc_td,
+	.alloc_parent_domain = rxe_alloc_parent_domain,
 	.reg_mr = rxe_reg_mr,
 	.dereg_mr = rxe_dereg_mr,
 	.alloc_mw = rxe_alloc_mw,
@@ -37,6 +37,7 @@
 #define RXE_H
 
 #include <infiniband/driver.h>
+#include <stdatomic.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <rdma/rdma_user_rxe.h>
@@ -51,17 +52,38 @@ struct rxe_context {
 	struct verbs_context	ibv_ctx;
 };
 
+/* not taken for objects created under a thread domain */
+struct rxe_spinlock {
+	pthread_spinlock_t	lock;
+	int			need_lock;
+};
+
+struct rxe_td {
+	struct ibv_td		ibv_td;
+	atomic_int		refcount;
+};
+
+struct rxe_pd {
+	struct ibv_pd		ibv_pd;
+	atomic_int		refcount;
+	/* set for a parent domain */
+	struct rxe_pd		*protection_domain;
+	struct rxe_td		*td;
+};
+
 /* common between cq and cq_ex */
 struct rxe_cq {
 	struct verbs_cq		vcq;
 	struct mminfo		mmap_info;
 	struct rxe_queue_buf	*queue;
-	pthread_spinlock_t	lock;
+	struct rxe_spinlock	lock;
+	struct rxe_pd		*parent_domain;
 
 	/* new API support */
 	struct ib_uverbs_wc	*wc;
 	size_t			wc_size;
 	uint32_t		cur_index;
+	uint32_t		prod_index;	/* snapshot, see check_cq_queue_empty */
 };
 
 struct rxe_ah {
@@ -72,7 +94,7 @@ struct rxe_ah {
 
 struct rxe_wq {
 	struct rxe_queue_buf	*queue;
-	pthread_spinlock_t	lock;
+	struct rxe_spinlock	lock;
 	unsigned int		max_sge;
 	unsigned int		max_inline;
 };
@@ -83,10 +105,14 @@ struct rxe_qp {
 	struct rxe_wq		rq;
 	struct mminfo		sq_mmap_info;
 	struct rxe_wq		sq;
+	struct rxe_pd		*parent_domain;
 
 	/* new API support */
 	uint32_t		cur_index;
 	int			err;
+
+	/* kernel maintains RXE_SQ_BUSY, see ring_send_db() */
+	int			sq_busy_sup;
 };
 
 struct rxe_srq {
@@ -108,6 +134,24 @@ static inline struct rxe_device *to_rdev(struct ibv_device *ibdev)
 	return container_of(ibdev, struct rxe_device, ibv_dev.device);
 }
 
+static inline struct rxe_td *to_rtd(struct ibv_td *ibtd)
+{
+	return container_of(ibtd, struct rxe_td, ibv_td);
+}
+
+static inline struct rxe_pd *to_rpd(struct ibv_pd *ibpd)
+{
+	return container_of(ibpd, struct rxe_pd, ibv_pd);
+}
+
+/* returns NULL unless ibpd is a parent domain */
+static inline struct rxe_pd *to_rpad(struct ibv_pd *ibpd)
+{
+	struct rxe_pd *pd = ibpd ? to_rpd(ibpd) : NULL;
+
+	return (pd && pd->protection_domain) ? pd : NULL;
+}
+
 static inline struct rxe_cq *to_rcq(struct ibv_cq *ibcq)
 {
 	return container_of(ibcq, struct rxe_cq, vcq.cq);
@@ -133,4 +177,16 @@ static inline enum ibv_qp_type qp_type(struct rxe_qp *qp)
 	return qp->vqp.qp.qp_type;
 }
 
+static inline void rxe_spin_lock(struct rxe_spinlock *lock)
+{
+	if (lock->need_lock)
+		pthread_spin_lock(&lock->lock);
+}
+
+static inline void rxe_spin_unlock(struct rxe_spinlock *lock)
+{
+	if (lock->need_lock)
+		pthread_spin_unlock(&lock->lock);
+}
+
 #endif /* RXE_H */
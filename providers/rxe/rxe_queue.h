@@ -88,6 +88,16 @@ static inline int queue_full(struct rxe_queue_buf *q)
 	return (cons == ((prod + 1) & q->index_mask));
 }
 
+/* Must hold producer_index lock, index is a slot not yet published */
+static inline int queue_full_at(struct rxe_queue_buf *q, __u32 index)
+{
+	__u32 cons;
+
+	cons = atomic_load_explicit(consumer(q), memory_order_acquire);
+
+	return (cons == ((index + 1) & q->index_mask));
+}
+
 /* Must hold producer_index lock */
 static inline void advance_producer(struct rxe_queue_buf *q)
 {
@@ -123,6 +133,12 @@ static inline void store_producer_index(struct rxe_queue_buf *q, __u32 index)
 	atomic_store_explicit(producer(q), index, memory_order_release);
 }
 
+/* Must hold consumer_index lock, entries up to the result are valid */
+static inline __u32 snapshot_producer_index(struct rxe_queue_buf *q)
+{
+	return atomic_load_explicit(producer(q), memory_order_acquire);
+}
+
 /* Must hold consumer_index lock */
 static inline __u32 load_consumer_index(struct rxe_queue_buf *q)
 {
@@ -156,6 +172,22 @@ static inline void *consumer_addr(struct rxe_queue_buf *q)
 	return q->data + (cons << q->log2_elem_size);
 }
 
+/*
+ * Called after publishing a new producer index.  Returns true if the
+ * kernel is still draining the queue and will see the new index without
+ * a doorbell, see RXE_SQ_BUSY.  Only valid if the kernel reported
+ * RXE_CREATE_QP_RESP_SQ_BUSY for the queue.
+ */
+static inline int queue_busy(struct rxe_queue_buf *q)
+{
+	_atomic_t *flags = (_atomic_t *)&q->pad_1[RXE_QUEUE_FLAGS_WORD];
+
+	/* the producer index store must be visible before reading flags */
+	atomic_thread_fence(memory_order_seq_cst);
+
+	return atomic_load_explicit(flags, memory_order_relaxed) & RXE_SQ_BUSY;
+}
+
 static inline void *addr_from_index(struct rxe_queue_buf *q,
 				    unsigned int index)
 {
@@ -178,14 +210,18 @@ static inline void advance_cq_cur_index(struct rxe_cq *cq)
 	cq->cur_index = (cq->cur_index + 1) & q->index_mask;
 }
 
+/*
+ * Entries up to the last producer index snapshot are known to be valid,
+ * so the shared producer index is only reloaded once they are used up.
+ */
 static inline int check_cq_queue_empty(struct rxe_cq *cq)
 {
 	struct rxe_queue_buf *q = cq->queue;
-	__u32 prod;
 
-	prod = atomic_load_explicit(producer(q), memory_order_acquire);
+	if (cq->cur_index == cq->prod_index)
+		cq->prod_index = snapshot_producer_index(q);
 
-	return (cq->cur_index == prod);
+	return (cq->cur_index == cq->prod_index);
 }
 
 static inline void advance_qp_cur_index(struct rxe_qp *qp)
@@ -70,7 +70,7 @@ static struct ibv_pd *siw_alloc_pd(struct ibv_context *ctx)
 {
 	struct ibv_alloc_pd cmd;
 	struct ib_uverbs_alloc_pd_resp resp;
-	struct ibv_pd *pd;
+	struct siw_pd *pd;
 
 	memset(&cmd, 0, sizeof(cmd));
 
@@ -78,18 +78,32 @@ static struct ibv_pd *siw_alloc_pd(struct ibv_context *ctx)
 	if (!pd)
 		return NULL;
 
-	if (ibv_cmd_alloc_pd(ctx, pd, &cmd, sizeof(cmd), &resp, sizeof(resp))) {
+	if (ibv_cmd_alloc_pd(ctx, &pd->base_pd, &cmd, sizeof(cmd), &resp,
+			     sizeof(resp))) {
 		free(pd);
 		return NULL;
 	}
-	return pd;
+	atomic_init(&pd->refcount, 1);
+
+	return &pd->base_pd;
 }
 
-static int siw_free_pd(struct ibv_pd *pd)
+static int siw_free_pd(struct ibv_pd *base_pd)
 {
+	struct siw_pd *pd = pd_base2siw(base_pd);
 	int rv;
 
-	rv = ibv_cmd_dealloc_pd(pd);
+	if (atomic_load(&pd->refcount) > 1)
+		return EBUSY;
+
+	if (pd->protection_domain) {
+		atomic_fetch_sub(&pd->protection_domain->refcount, 1);
+		if (pd->td)
+			atomic_fetch_sub(&pd->td->refcount, 1);
+		free(pd);
+		return 0;
+	}
+	rv = ibv_cmd_dealloc_pd(base_pd);
 	if (rv)
 		return rv;
 
@@ -97,6 +111,104 @@ static int siw_free_pd(struct ibv_pd *pd)
 	return 0;
 }
 
+static struct ibv_td *siw_alloc_td(struct ibv_context *ctx,
+				   struct ibv_td_init_attr *attr)
+{
+	struct siw_td *td;
+
+	if (attr->comp_mask) {
+		errno = EOPNOTSUPP;
+		return NULL;
+	}
+	td = calloc(1, sizeof(*td));
+	if (!td) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	td->base_td.context = ctx;
+	atomic_init(&td->refcount, 1);
+
+	return &td->base_td;
+}
+
+static int siw_dealloc_td(struct ibv_td *base_td)
+{
+	struct siw_td *td = td_base2siw(base_td);
+
+	if (atomic_load(&td->refcount) > 1)
+		return EBUSY;
+
+	free(td);
+	return 0;
+}
+
+/*
+ * SQ, RQ and CQ of objects created under a parent domain with a thread
+ * domain are only touched by one thread at a time. They skip locking and
+ * rely on the WQE/CQE valid flags shared with the kernel alone.
+ */
+static struct ibv_pd *
+siw_alloc_parent_domain(struct ibv_context *ctx,
+			struct ibv_parent_domain_init_attr *attr)
+{
+	struct siw_pd *pad;
+
+	if (ibv_check_alloc_parent_domain(attr))
+		return NULL;
+
+	if (attr->comp_mask) {
+		errno = EOPNOTSUPP;
+		return NULL;
+	}
+	pad = calloc(1, sizeof(*pad));
+	if (!pad) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	pad->protection_domain = pd_base2siw(attr->pd);
+	atomic_fetch_add(&pad->protection_domain->refcount, 1);
+	if (attr->td) {
+		pad->td = td_base2siw(attr->td);
+		atomic_fetch_add(&pad->td->refcount, 1);
+	}
+	atomic_init(&pad->refcount, 1);
+	ibv_initialize_parent_domain(&pad->base_pd,
+				     &pad->protection_domain->base_pd);
+
+	return &pad->base_pd;
+}
+
+static void siw_spinlock_init(struct siw_spinlock *lock, struct ibv_pd *pd)
+{
+	struct siw_pd *pad = pad_base2siw(pd);
+
+	lock->need_lock = !(pad && pad->td);
+	if (lock->need_lock)
+		pthread_spin_init(&lock->lock, PTHREAD_PROCESS_PRIVATE);
+}
+
+static void siw_spinlock_destroy(struct siw_spinlock *lock)
+{
+	if (lock->need_lock)
+		pthread_spin_destroy(&lock->lock);
+}
+
+static struct siw_pd *siw_get_parent_domain(struct ibv_pd *pd)
+{
+	struct siw_pd *pad = pad_base2siw(pd);
+
+	if (pad)
+		atomic_fetch_add(&pad->refcount, 1);
+
+	return pad;
+}
+
+static void siw_put_parent_domain(struct siw_pd *pad)
+{
+	if (pad)
+		atomic_fetch_sub(&pad->refcount, 1);
+}
+
 static struct ibv_mr *siw_reg_mr(struct ibv_pd *pd, void *addr, size_t len,
 				 uint64_t hca_va, int access)
 {
@@ -132,6 +244,39 @@ static int siw_dereg_mr(struct verbs_mr *base_mr)
 	return 0;
 }
 
+static int siw_map_cq(struct ibv_context *ctx, struct siw_cq *cq,
+		      struct siw_uresp_create_cq *uresp, struct ibv_pd *pd)
+{
+	int cq_size;
+
+	if (uresp->cq_key == SIW_INVAL_UOBJ_KEY) {
+		verbs_err(verbs_get_ctx(ctx),
+			  "libsiw: prepare CQ mapping failed\n");
+		return -1;
+	}
+	siw_spinlock_init(&cq->lock, pd);
+	cq->id = uresp->cq_id;
+	cq->num_cqe = uresp->num_cqe;
+
+	cq_size = uresp->num_cqe * sizeof(struct siw_cqe) +
+		  sizeof(struct siw_cq_ctrl);
+
+	cq->queue = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED, ctx->cmd_fd, uresp->cq_key);
+
+	if (cq->queue == MAP_FAILED) {
+		verbs_err(verbs_get_ctx(ctx), "libsiw: CQ mapping failed: %d",
+			  errno);
+		cq->queue = NULL;
+		siw_spinlock_destroy(&cq->lock);
+		return -1;
+	}
+	cq->ctrl = (struct siw_cq_ctrl *)&cq->queue[cq->num_cqe];
+	cq->ctrl->flags = SIW_NOTIFY_NOT;
+
+	return 0;
+}
+
 static struct ibv_cq *siw_create_cq(struct ibv_context *ctx, int num_cqe,
 				    struct ibv_comp_channel *channel,
 				    int comp_vector)
@@ -139,47 +284,27 @@ static struct ibv_cq *siw_create_cq(struct ibv_context *ctx, int num_cqe,
 	struct siw_cmd_create_cq cmd = {};
 	struct siw_cmd_create_cq_resp resp = {};
 	struct siw_cq *cq;
-	int cq_size, rv;
+	int rv;
 
 	cq = calloc(1, sizeof(*cq));
 	if (!cq)
 		return NULL;
 
-	rv = ibv_cmd_create_cq(ctx, num_cqe, channel, comp_vector, &cq->base_cq,
-			       &cmd.ibv_cmd, sizeof(cmd), &resp.ibv_resp,
-			       sizeof(resp));
+	rv = ibv_cmd_create_cq(ctx, num_cqe, channel, comp_vector,
+			       &cq->base_cq.cq, &cmd.ibv_cmd, sizeof(cmd),
+			       &resp.ibv_resp, sizeof(resp));
 	if (rv) {
 		verbs_err(verbs_get_ctx(ctx),
 			  "libsiw: CQ creation failed: %d\n", rv);
 		free(cq);
 		return NULL;
 	}
-	if (resp.cq_key == SIW_INVAL_UOBJ_KEY) {
-		verbs_err(verbs_get_ctx(ctx),
-			  "libsiw: prepare CQ mapping failed\n");
-		goto fail;
-	}
-	pthread_spin_init(&cq->lock, PTHREAD_PROCESS_PRIVATE);
-	cq->id = resp.cq_id;
-	cq->num_cqe = resp.num_cqe;
-
-	cq_size = resp.num_cqe * sizeof(struct siw_cqe) +
-		  sizeof(struct siw_cq_ctrl);
-
-	cq->queue = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
-			 MAP_SHARED, ctx->cmd_fd, resp.cq_key);
-
-	if (cq->queue == MAP_FAILED) {
-		verbs_err(verbs_get_ctx(ctx), "libsiw: CQ mapping failed: %d",
-			  errno);
+	if (siw_map_cq(ctx, cq, &resp.drv_payload, NULL))
 		goto fail;
-	}
-	cq->ctrl = (struct siw_cq_ctrl *)&cq->queue[cq->num_cqe];
-	cq->ctrl->flags = SIW_NOTIFY_NOT;
 
-	return &cq->base_cq;
+	return &cq->base_cq.cq;
 fail:
-	ibv_cmd_destroy_cq(&cq->base_cq);
+	ibv_cmd_destroy_cq(&cq->base_cq.cq);
 	free(cq);
 
 	return NULL;
@@ -190,7 +315,7 @@ static int siw_destroy_cq(struct ibv_cq *base_cq)
 	struct siw_cq *cq = cq_base2siw(base_cq);
 	int rv;
 
-	assert(pthread_spin_trylock(&cq->lock));
+	assert(!cq->lock.need_lock || pthread_spin_trylock(&cq->lock.lock));
 
 	if (cq->queue)
 		munmap(cq->queue, cq->num_cqe * sizeof(struct siw_cqe) +
@@ -198,10 +323,11 @@ static int siw_destroy_cq(struct ibv_cq *base_cq)
 
 	rv = ibv_cmd_destroy_cq(base_cq);
 	if (rv) {
-		pthread_spin_unlock(&cq->lock);
+		siw_spin_unlock(&cq->lock);
 		return rv;
 	}
-	pthread_spin_destroy(&cq->lock);
+	siw_spinlock_destroy(&cq->lock);
+	siw_put_parent_domain(cq->parent_domain);
 
 	free(cq);
 
@@ -290,41 +416,22 @@ static int siw_destroy_srq(struct ibv_srq *base_srq)
 	return 0;
 }
 
-static struct ibv_qp *siw_create_qp(struct ibv_pd *pd,
-				    struct ibv_qp_init_attr *attr)
+static int siw_map_qp(struct ibv_context *base_ctx, struct siw_qp *qp,
+		      struct siw_uresp_create_qp *uresp, struct ibv_pd *pd,
+		      struct ibv_srq *srq, int sq_sig_all)
 {
-	struct siw_cmd_create_qp cmd = {};
-	struct siw_cmd_create_qp_resp resp = {};
-	struct siw_qp *qp;
-	struct ibv_context *base_ctx = pd->context;
-	int sq_size, rq_size, rv;
-
-	memset(&cmd, 0, sizeof(cmd));
-	memset(&resp, 0, sizeof(resp));
-
-	qp = calloc(1, sizeof(*qp));
-	if (!qp)
-		return NULL;
+	int sq_size, rq_size;
 
-	rv = ibv_cmd_create_qp(pd, &qp->base_qp, attr, &cmd.ibv_cmd,
-			       sizeof(cmd), &resp.ibv_resp, sizeof(resp));
-
-	if (rv) {
-		verbs_err(verbs_get_ctx(pd->context),
-			  "libsiw: QP creation failed\n");
-		free(qp);
-		return NULL;
-	}
-	if (resp.sq_key == SIW_INVAL_UOBJ_KEY ||
-	    resp.rq_key == SIW_INVAL_UOBJ_KEY) {
-		verbs_err(verbs_get_ctx(pd->context),
+	if (uresp->sq_key == SIW_INVAL_UOBJ_KEY ||
+	    uresp->rq_key == SIW_INVAL_UOBJ_KEY) {
+		verbs_err(verbs_get_ctx(base_ctx),
 			  "libsiw: prepare QP mapping failed\n");
-		goto fail;
+		return -1;
 	}
-	qp->id = resp.qp_id;
-	qp->num_sqe = resp.num_sqe;
-	qp->num_rqe = resp.num_rqe;
-	qp->sq_sig_all = attr->sq_sig_all;
+	qp->id = uresp->qp_id;
+	qp->num_sqe = uresp->num_sqe;
+	qp->num_rqe = uresp->num_rqe;
+	qp->sq_sig_all = sq_sig_all;
 
 	/* Init doorbell request structure */
 	qp->db_req.hdr.command = IB_USER_VERBS_CMD_POST_SEND;
@@ -335,51 +442,73 @@ static struct ibv_qp *siw_create_qp(struct ibv_pd *pd,
 	qp->db_req.sge_count = 0;
 	qp->db_req.wqe_size = sizeof(struct ibv_send_wr);
 
-	pthread_spin_init(&qp->sq_lock, PTHREAD_PROCESS_PRIVATE);
-	pthread_spin_init(&qp->rq_lock, PTHREAD_PROCESS_PRIVATE);
-
-	sq_size = resp.num_sqe * sizeof(struct siw_sqe);
+	sq_size = uresp->num_sqe * sizeof(struct siw_sqe);
 
 	qp->sendq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
-			 MAP_SHARED, base_ctx->cmd_fd, resp.sq_key);
+			 MAP_SHARED, base_ctx->cmd_fd, uresp->sq_key);
 
 	if (qp->sendq == MAP_FAILED) {
-		verbs_err(verbs_get_ctx(pd->context),
+		verbs_err(verbs_get_ctx(base_ctx),
 			  "libsiw: SQ mapping failed: %d", errno);
 
 		qp->sendq = NULL;
-		goto fail;
+		return -1;
 	}
-	if (attr->srq) {
-		qp->srq = srq_base2siw(attr->srq);
+	if (srq) {
+		qp->srq = srq_base2siw(srq);
 	} else {
-		rq_size = resp.num_rqe * sizeof(struct siw_rqe);
+		rq_size = uresp->num_rqe * sizeof(struct siw_rqe);
 
 		qp->recvq = mmap(NULL, rq_size, PROT_READ | PROT_WRITE,
-				 MAP_SHARED, base_ctx->cmd_fd, resp.rq_key);
+				 MAP_SHARED, base_ctx->cmd_fd, uresp->rq_key);
 
 		if (qp->recvq == MAP_FAILED) {
-			verbs_err(verbs_get_ctx(pd->context),
+			verbs_err(verbs_get_ctx(base_ctx),
 				  "libsiw: RQ mapping failed: %d\n",
-				  resp.num_rqe);
+				  uresp->num_rqe);
 			qp->recvq = NULL;
-			goto fail;
+			munmap(qp->sendq, sq_size);
+			qp->sendq = NULL;
+			return -1;
 		}
 	}
-	qp->db_req.qp_handle = qp->base_qp.handle;
+	siw_spinlock_init(&qp->sq_lock, pd);
+	siw_spinlock_init(&qp->rq_lock, pd);
+	qp->parent_domain = siw_get_parent_domain(pd);
 
-	return &qp->base_qp;
-fail:
-	ibv_cmd_destroy_qp(&qp->base_qp);
+	qp->db_req.qp_handle = qp->base_qp.qp.handle;
 
-	if (qp->sendq)
-		munmap(qp->sendq, qp->num_sqe * sizeof(struct siw_sqe));
-	if (qp->recvq)
-		munmap(qp->recvq, qp->num_rqe * sizeof(struct siw_rqe));
+	return 0;
+}
 
-	free(qp);
+static struct ibv_qp *siw_create_qp(struct ibv_pd *pd,
+				    struct ibv_qp_init_attr *attr)
+{
+	struct siw_cmd_create_qp cmd = {};
+	struct siw_cmd_create_qp_resp resp = {};
+	struct siw_qp *qp;
+	int rv;
 
-	return NULL;
+	qp = calloc(1, sizeof(*qp));
+	if (!qp)
+		return NULL;
+
+	rv = ibv_cmd_create_qp(pd, &qp->base_qp.qp, attr, &cmd.ibv_cmd,
+			       sizeof(cmd), &resp.ibv_resp, sizeof(resp));
+
+	if (rv) {
+		verbs_err(verbs_get_ctx(pd->context),
+			  "libsiw: QP creation failed\n");
+		free(qp);
+		return NULL;
+	}
+	if (siw_map_qp(pd->context, qp, &resp.drv_payload, pd, attr->srq,
+		       attr->sq_sig_all)) {
+		ibv_cmd_destroy_qp(&qp->base_qp.qp);
+		free(qp);
+		return NULL;
+	}
+	return &qp->base_qp.qp;
 }
 
 static int siw_modify_qp(struct ibv_qp *base_qp, struct ibv_qp_attr *attr,
@@ -391,13 +520,13 @@ static int siw_modify_qp(struct ibv_qp *base_qp, struct ibv_qp_attr *attr,
 
 	memset(&cmd, 0, sizeof(cmd));
 
-	pthread_spin_lock(&qp->sq_lock);
-	pthread_spin_lock(&qp->rq_lock);
+	siw_spin_lock(&qp->sq_lock);
+	siw_spin_lock(&qp->rq_lock);
 
 	rv = ibv_cmd_modify_qp(base_qp, attr, attr_mask, &cmd, sizeof(cmd));
 
-	pthread_spin_unlock(&qp->rq_lock);
-	pthread_spin_unlock(&qp->sq_lock);
+	siw_spin_unlock(&qp->rq_lock);
+	siw_spin_unlock(&qp->sq_lock);
 
 	return rv;
 }
@@ -407,8 +536,8 @@ static int siw_destroy_qp(struct ibv_qp *base_qp)
 	struct siw_qp *qp = qp_base2siw(base_qp);
 	int rv;
 
-	assert(pthread_spin_trylock(&qp->sq_lock));
-	assert(pthread_spin_trylock(&qp->rq_lock));
+	assert(!qp->sq_lock.need_lock || pthread_spin_trylock(&qp->sq_lock.lock));
+	assert(!qp->rq_lock.need_lock || pthread_spin_trylock(&qp->rq_lock.lock));
 
 	if (qp->sendq)
 		munmap(qp->sendq, qp->num_sqe * sizeof(struct siw_sqe));
@@ -417,12 +546,13 @@ static int siw_destroy_qp(struct ibv_qp *base_qp)
 
 	rv = ibv_cmd_destroy_qp(base_qp);
 	if (rv) {
-		pthread_spin_unlock(&qp->rq_lock);
-		pthread_spin_unlock(&qp->sq_lock);
+		siw_spin_unlock(&qp->rq_lock);
+		siw_spin_unlock(&qp->sq_lock);
 		return rv;
 	}
-	pthread_spin_destroy(&qp->rq_lock);
-	pthread_spin_destroy(&qp->sq_lock);
+	siw_spinlock_destroy(&qp->rq_lock);
+	siw_spinlock_destroy(&qp->sq_lock);
+	siw_put_parent_domain(qp->parent_domain);
 
 	free(qp);
 
@@ -571,6 +701,27 @@ static inline int push_send_wqe(struct ibv_qp *base_qp,
 	return 0;
 }
 
+/*
+ * If last WQE pushed before position where current post started is idle,
+ * we assume SQ is not being actively processed. Only then, the doorbell
+ * call will be issued. This may significantly reduce unnecessary doorbell
+ * calls on a busy SQ. We also always ring the doorbell, if the complete
+ * SQ was re-written during current post. Must be called after the new
+ * WQEs were marked valid, but before qp->sq_put is advanced.
+ */
+static int siw_kick_sq(struct siw_qp *qp, uint32_t new_sqe)
+{
+	if (new_sqe < qp->num_sqe) {
+		uint32_t old_idx = (qp->sq_put - 1) % qp->num_sqe;
+		struct siw_sqe *old_sqe = &qp->sendq[old_idx];
+		atomic_ushort *fp = (atomic_ushort *)&old_sqe->flags;
+
+		if (atomic_load(fp) & SIW_WQE_VALID)
+			return 0;
+	}
+	return siw_db(qp);
+}
+
 static int siw_post_send(struct ibv_qp *base_qp, struct ibv_send_wr *wr,
 			 struct ibv_send_wr **bad_wr)
 {
@@ -581,7 +732,7 @@ static int siw_post_send(struct ibv_qp *base_qp, struct ibv_send_wr *wr,
 
 	*bad_wr = NULL;
 
-	pthread_spin_lock(&qp->sq_lock);
+	siw_spin_lock(&qp->sq_lock);
 
 	sq_put = qp->sq_put;
 
@@ -615,34 +766,293 @@ static int siw_post_send(struct ibv_qp *base_qp, struct ibv_send_wr *wr,
 		wr = wr->next;
 	}
 	if (new_sqe) {
-		/*
-		 * If last WQE pushed before position where current post_send
-		 * started is idle, we assume SQ is not being actively
-		 * processed. Only then, the doorbell call will be issued.
-		 * This may significantly reduce unnecessary doorbell calls
-		 * on a busy SQ. We also always ring the doorbell, if the
-		 * complete SQ was re-written during current post_send.
-		 */
-		if (new_sqe < qp->num_sqe) {
-			uint32_t old_idx = (qp->sq_put - 1) % qp->num_sqe;
-			struct siw_sqe *old_sqe = &qp->sendq[old_idx];
-
-			fp = (atomic_ushort *)&old_sqe->flags;
-			if (!(atomic_load(fp) & SIW_WQE_VALID))
-				rv = siw_db(qp);
-		} else {
-			rv = siw_db(qp);
-		}
+		rv = siw_kick_sq(qp, new_sqe);
 		if (rv)
 			*bad_wr = wr;
 
 		qp->sq_put = sq_put;
 	}
-	pthread_spin_unlock(&qp->sq_lock);
+	siw_spin_unlock(&qp->sq_lock);
+
+	return rv;
+}
+
+/*
+ * ibv_qp_ex work request builders. WQEs are written straight into the
+ * mmapped SQ without SIW_WQE_VALID set, so the kernel ignores them until
+ * wr_complete() hands the whole batch over and rings the doorbell once.
+ */
+static struct siw_sqe *siw_wr_next(struct siw_qp *qp, uint8_t opcode)
+{
+	struct ibv_qp_ex *ibqp = &qp->base_qp.qp_ex;
+	struct siw_sqe *sqe;
+	atomic_ushort *fp;
+	uint16_t flags;
+
+	qp->wr_sqe = NULL;
+	if (qp->wr_err)
+		return NULL;
+
+	sqe = &qp->sendq[qp->wr_put % qp->num_sqe];
+	fp = (atomic_ushort *)&sqe->flags;
+
+	if (qp->wr_put - qp->sq_put >= qp->num_sqe ||
+	    atomic_load(fp) & SIW_WQE_VALID) {
+		verbs_err(verbs_get_ctx(ibqp->qp_base.context),
+			  "libsiw: QP[%d]: SQ overflow, idx %d\n",
+			  qp->id, qp->wr_put % qp->num_sqe);
+		qp->wr_err = ENOMEM;
+		return NULL;
+	}
+	flags = map_send_flags(ibqp->wr_flags) &
+		~(SIW_WQE_VALID | SIW_WQE_INLINE);
+	if (qp->sq_sig_all)
+		flags |= SIW_WQE_SIGNALLED;
+
+	sqe->id = ibqp->wr_id;
+	sqe->opcode = opcode;
+	sqe->num_sge = 0;
+	sqe->rkey = 0;
+	sqe->raddr = 0;
+	sqe->flags = flags;
+
+	qp->wr_put++;
+	qp->wr_sqe = sqe;
+
+	return sqe;
+}
+
+static void siw_wr_rdma_read(struct ibv_qp_ex *ibqp, uint32_t rkey,
+			     uint64_t remote_addr)
+{
+	struct siw_sqe *sqe = siw_wr_next(qp_ex2siw(ibqp), SIW_OP_READ);
+
+	if (sqe) {
+		sqe->rkey = rkey;
+		sqe->raddr = remote_addr;
+	}
+}
+
+static void siw_wr_rdma_write(struct ibv_qp_ex *ibqp, uint32_t rkey,
+			      uint64_t remote_addr)
+{
+	struct siw_sqe *sqe = siw_wr_next(qp_ex2siw(ibqp), SIW_OP_WRITE);
+
+	if (sqe) {
+		sqe->rkey = rkey;
+		sqe->raddr = remote_addr;
+	}
+}
+
+static void siw_wr_send(struct ibv_qp_ex *ibqp)
+{
+	siw_wr_next(qp_ex2siw(ibqp), SIW_OP_SEND);
+}
+
+static void siw_wr_send_inv(struct ibv_qp_ex *ibqp, uint32_t invalidate_rkey)
+{
+	struct siw_sqe *sqe = siw_wr_next(qp_ex2siw(ibqp),
+					  SIW_OP_SEND_REMOTE_INV);
+
+	if (sqe)
+		sqe->rkey = invalidate_rkey;
+}
+
+static void siw_wr_set_sge(struct ibv_qp_ex *ibqp, uint32_t lkey,
+			   uint64_t addr, uint32_t length)
+{
+	struct siw_sqe *sqe = qp_ex2siw(ibqp)->wr_sqe;
+
+	if (!sqe)
+		return;
+
+	sqe->sge[0].laddr = addr;
+	sqe->sge[0].length = length;
+	sqe->sge[0].lkey = lkey;
+	sqe->num_sge = 1;
+}
+
+static void siw_wr_set_sge_list(struct ibv_qp_ex *ibqp, size_t num_sge,
+				const struct ibv_sge *sg_list)
+{
+	struct siw_qp *qp = qp_ex2siw(ibqp);
+	struct siw_sqe *sqe = qp->wr_sqe;
+	size_t i;
+
+	if (!sqe)
+		return;
+
+	if (num_sge > SIW_MAX_SGE) {
+		qp->wr_err = EINVAL;
+		return;
+	}
+	for (i = 0; i < num_sge; i++) {
+		sqe->sge[i].laddr = sg_list[i].addr;
+		sqe->sge[i].length = sg_list[i].length;
+		sqe->sge[i].lkey = sg_list[i].lkey;
+	}
+	sqe->num_sge = num_sge;
+}
+
+static void siw_wr_set_inline_data_list(struct ibv_qp_ex *ibqp, size_t num_buf,
+					const struct ibv_data_buf *buf_list)
+{
+	struct siw_qp *qp = qp_ex2siw(ibqp);
+	struct siw_sqe *sqe = qp->wr_sqe;
+	char *data;
+	size_t bytes = 0, i;
+
+	if (!sqe)
+		return;
+
+	/* Inline data is carried in the SGE array, behind sge[0] */
+	data = (char *)&sqe->sge[1];
+	for (i = 0; i < num_buf; i++) {
+		if (bytes + buf_list[i].length > SIW_MAX_INLINE) {
+			verbs_err(verbs_get_ctx(ibqp->qp_base.context),
+				  "libsiw: inline data: %zu:%d\n",
+				  bytes + buf_list[i].length,
+				  (int)SIW_MAX_INLINE);
+			qp->wr_err = EINVAL;
+			return;
+		}
+		memcpy(data + bytes, buf_list[i].addr, buf_list[i].length);
+		bytes += buf_list[i].length;
+	}
+	sqe->sge[0].length = bytes;
+	sqe->num_sge = 1;
+	sqe->flags |= SIW_WQE_INLINE;
+}
+
+static void siw_wr_set_inline_data(struct ibv_qp_ex *ibqp, void *addr,
+				   size_t length)
+{
+	struct ibv_data_buf buf = { .addr = addr, .length = length };
+
+	siw_wr_set_inline_data_list(ibqp, 1, &buf);
+}
+
+static void siw_wr_start(struct ibv_qp_ex *ibqp)
+{
+	struct siw_qp *qp = qp_ex2siw(ibqp);
+
+	siw_spin_lock(&qp->sq_lock);
+
+	qp->wr_put = qp->sq_put;
+	qp->wr_sqe = NULL;
+	qp->wr_err = 0;
+}
+
+static int siw_wr_complete(struct ibv_qp_ex *ibqp)
+{
+	struct siw_qp *qp = qp_ex2siw(ibqp);
+	uint32_t new_sqe = qp->wr_put - qp->sq_put;
+	uint32_t i;
+	int rv = qp->wr_err;
+
+	if (rv || !new_sqe)
+		goto out;
+
+	for (i = qp->sq_put; i != qp->wr_put; i++) {
+		struct siw_sqe *sqe = &qp->sendq[i % qp->num_sqe];
+		atomic_ushort *fp = (atomic_ushort *)&sqe->flags;
+
+		atomic_store(fp, sqe->flags | SIW_WQE_VALID);
+	}
+	if (siw_kick_sq(qp, new_sqe))
+		rv = errno;
+
+	qp->sq_put = qp->wr_put;
+out:
+	qp->wr_sqe = NULL;
+	siw_spin_unlock(&qp->sq_lock);
 
 	return rv;
 }
 
+static void siw_wr_abort(struct ibv_qp_ex *ibqp)
+{
+	struct siw_qp *qp = qp_ex2siw(ibqp);
+
+	qp->wr_sqe = NULL;
+	siw_spin_unlock(&qp->sq_lock);
+}
+
+enum {
+	SIW_QP_EX_SEND_OPS = IBV_QP_EX_WITH_RDMA_WRITE |
+			     IBV_QP_EX_WITH_SEND |
+			     IBV_QP_EX_WITH_RDMA_READ |
+			     IBV_QP_EX_WITH_SEND_WITH_INV,
+};
+
+static void siw_set_qp_send_ops(struct siw_qp *qp, uint64_t flags)
+{
+	struct ibv_qp_ex *ibqp = &qp->base_qp.qp_ex;
+
+	if (flags & IBV_QP_EX_WITH_RDMA_READ)
+		ibqp->wr_rdma_read = siw_wr_rdma_read;
+	if (flags & IBV_QP_EX_WITH_RDMA_WRITE)
+		ibqp->wr_rdma_write = siw_wr_rdma_write;
+	if (flags & IBV_QP_EX_WITH_SEND)
+		ibqp->wr_send = siw_wr_send;
+	if (flags & IBV_QP_EX_WITH_SEND_WITH_INV)
+		ibqp->wr_send_inv = siw_wr_send_inv;
+
+	ibqp->wr_set_inline_data = siw_wr_set_inline_data;
+	ibqp->wr_set_inline_data_list = siw_wr_set_inline_data_list;
+	ibqp->wr_set_sge = siw_wr_set_sge;
+	ibqp->wr_set_sge_list = siw_wr_set_sge_list;
+
+	ibqp->wr_start = siw_wr_start;
+	ibqp->wr_complete = siw_wr_complete;
+	ibqp->wr_abort = siw_wr_abort;
+}
+
+static struct ibv_qp *siw_create_qp_ex(struct ibv_context *ctx,
+				       struct ibv_qp_init_attr_ex *attr)
+{
+	struct siw_cmd_create_qp_ex cmd = {};
+	struct siw_cmd_create_qp_ex_resp resp = {};
+	struct siw_qp *qp;
+	int rv;
+
+	if (attr->comp_mask & ~(IBV_QP_INIT_ATTR_PD |
+				IBV_QP_INIT_ATTR_SEND_OPS_FLAGS)) {
+		errno = EOPNOTSUPP;
+		return NULL;
+	}
+	if ((attr->comp_mask & IBV_QP_INIT_ATTR_SEND_OPS_FLAGS) &&
+	    (attr->send_ops_flags & ~SIW_QP_EX_SEND_OPS)) {
+		errno = EOPNOTSUPP;
+		return NULL;
+	}
+	qp = calloc(1, sizeof(*qp));
+	if (!qp)
+		return NULL;
+
+	rv = ibv_cmd_create_qp_ex2(ctx, &qp->base_qp, attr, &cmd.ibv_cmd,
+				   sizeof(cmd), &resp.ibv_resp, sizeof(resp));
+	if (rv) {
+		verbs_err(verbs_get_ctx(ctx), "libsiw: QP creation failed\n");
+		free(qp);
+		errno = rv;
+		return NULL;
+	}
+	if (siw_map_qp(ctx, qp, &resp.drv_payload,
+		       (attr->comp_mask & IBV_QP_INIT_ATTR_PD) ? attr->pd : NULL,
+		       attr->srq, attr->sq_sig_all)) {
+		ibv_cmd_destroy_qp(&qp->base_qp.qp);
+		free(qp);
+		errno = EINVAL;
+		return NULL;
+	}
+	if (attr->comp_mask & IBV_QP_INIT_ATTR_SEND_OPS_FLAGS) {
+		siw_set_qp_send_ops(qp, attr->send_ops_flags);
+		qp->base_qp.comp_mask |= VERBS_QP_EX;
+	}
+	return &qp->base_qp.qp;
+}
+
 static inline int push_recv_wqe(struct ibv_recv_wr *base_wr,
 				struct siw_rqe *siw_rqe)
 {
@@ -674,7 +1084,7 @@ static int siw_post_recv(struct ibv_qp *base_qp, struct ibv_recv_wr *wr,
 	uint32_t rq_put;
 	int rv = 0;
 
-	pthread_spin_lock(&qp->rq_lock);
+	siw_spin_lock(&qp->rq_lock);
 
 	rq_put = qp->rq_put;
 
@@ -703,7 +1113,7 @@ static int siw_post_recv(struct ibv_qp *base_qp, struct ibv_recv_wr *wr,
 	}
 	qp->rq_put = rq_put;
 
-	pthread_spin_unlock(&qp->rq_lock);
+	siw_spin_unlock(&qp->rq_lock);
 
 	return rv;
 }
@@ -797,34 +1207,219 @@ static inline void copy_cqe(struct siw_cqe *cqe, struct ibv_wc *wc)
 static int siw_poll_cq(struct ibv_cq *ibcq, int num_entries, struct ibv_wc *wc)
 {
 	struct siw_cq *cq = cq_base2siw(ibcq);
-	int new = 0;
+	int new, i;
+
+	if (num_entries > cq->num_cqe)
+		num_entries = cq->num_cqe;
 
-	pthread_spin_lock(&cq->lock);
+	siw_spin_lock(&cq->lock);
 
-	for (; num_entries--; wc++) {
-		struct siw_cqe *cqe = &cq->queue[cq->cq_get % cq->num_cqe];
+	/*
+	 * Scan ahead for the run of valid CQEs first. A single acquire
+	 * fence then orders all CQE reads after their valid flags, and a
+	 * single release fence keeps the kernel from reusing a slot before
+	 * it was copied out.
+	 */
+	for (new = 0; new < num_entries; new++) {
+		struct siw_cqe *cqe =
+			&cq->queue[(cq->cq_get + new) % cq->num_cqe];
 		atomic_uchar *fp = (atomic_uchar *)&cqe->flags;
 
-		if (atomic_load(fp) & SIW_WQE_VALID) {
-			copy_cqe(cqe, wc);
-			atomic_store(fp, 0);
-			cq->cq_get++;
-			new++;
-		} else
+		if (!(atomic_load_explicit(fp, memory_order_relaxed) &
+		      SIW_WQE_VALID))
 			break;
 	}
-	pthread_spin_unlock(&cq->lock);
+	if (new) {
+		atomic_thread_fence(memory_order_acquire);
+
+		for (i = 0; i < new; i++)
+			copy_cqe(&cq->queue[(cq->cq_get + i) % cq->num_cqe],
+				 &wc[i]);
+
+		atomic_thread_fence(memory_order_release);
+
+		for (i = 0; i < new; i++) {
+			struct siw_cqe *cqe =
+				&cq->queue[(cq->cq_get + i) % cq->num_cqe];
+
+			atomic_store_explicit((atomic_uchar *)&cqe->flags, 0,
+					      memory_order_relaxed);
+		}
+		cq->cq_get += new;
+	}
+	siw_spin_unlock(&cq->lock);
 
 	return new;
 }
 
+static inline struct siw_cqe *siw_cq_peek(struct siw_cq *cq)
+{
+	struct siw_cqe *cqe = &cq->queue[cq->cq_get % cq->num_cqe];
+	atomic_uchar *fp = (atomic_uchar *)&cqe->flags;
+
+	return (atomic_load(fp) & SIW_WQE_VALID) ? cqe : NULL;
+}
+
+static inline void siw_cq_load(struct siw_cq *cq, struct siw_cqe *cqe)
+{
+	cq->cur_cqe = cqe;
+	cq->base_cq.cq_ex.wr_id = cqe->id;
+	cq->base_cq.cq_ex.status = map_cqe_status[cqe->status].base;
+}
+
+static inline void siw_cq_release(struct siw_cq *cq)
+{
+	atomic_store((atomic_uchar *)&cq->cur_cqe->flags, 0);
+	cq->cq_get++;
+	cq->cur_cqe = NULL;
+}
+
+static int siw_start_poll(struct ibv_cq_ex *ibcq,
+			  struct ibv_poll_cq_attr *attr)
+{
+	struct siw_cq *cq = cq_ex2siw(ibcq);
+	struct siw_cqe *cqe;
+
+	if (attr->comp_mask)
+		return EINVAL;
+
+	siw_spin_lock(&cq->lock);
+
+	cqe = siw_cq_peek(cq);
+	if (!cqe) {
+		siw_spin_unlock(&cq->lock);
+		return ENOENT;
+	}
+	siw_cq_load(cq, cqe);
+
+	return 0;
+}
+
+static int siw_next_poll(struct ibv_cq_ex *ibcq)
+{
+	struct siw_cq *cq = cq_ex2siw(ibcq);
+	struct siw_cqe *cqe;
+
+	siw_cq_release(cq);
+
+	cqe = siw_cq_peek(cq);
+	if (!cqe)
+		return ENOENT;
+
+	siw_cq_load(cq, cqe);
+
+	return 0;
+}
+
+static void siw_end_poll(struct ibv_cq_ex *ibcq)
+{
+	struct siw_cq *cq = cq_ex2siw(ibcq);
+
+	if (cq->cur_cqe)
+		siw_cq_release(cq);
+
+	siw_spin_unlock(&cq->lock);
+}
+
+static enum ibv_wc_opcode siw_cq_read_opcode(struct ibv_cq_ex *ibcq)
+{
+	return map_cqe_opcode[cq_ex2siw(ibcq)->cur_cqe->opcode].base;
+}
+
+static uint32_t siw_cq_read_vendor_err(struct ibv_cq_ex *ibcq)
+{
+	return 0;
+}
+
+static uint32_t siw_cq_read_byte_len(struct ibv_cq_ex *ibcq)
+{
+	return cq_ex2siw(ibcq)->cur_cqe->bytes;
+}
+
+static uint32_t siw_cq_read_qp_num(struct ibv_cq_ex *ibcq)
+{
+	return (uint32_t)cq_ex2siw(ibcq)->cur_cqe->qp_id;
+}
+
+static unsigned int siw_cq_read_wc_flags(struct ibv_cq_ex *ibcq)
+{
+	/* No immediate data supported yet */
+	return 0;
+}
+
+enum {
+	SIW_SUP_WC_EX_FLAGS = IBV_WC_EX_WITH_BYTE_LEN | IBV_WC_EX_WITH_QP_NUM,
+};
+
+static struct ibv_cq_ex *siw_create_cq_ex(struct ibv_context *ctx,
+					  struct ibv_cq_init_attr_ex *attr)
+{
+	struct siw_cmd_create_cq_ex cmd = {};
+	struct siw_cmd_create_cq_ex_resp resp = {};
+	struct ibv_pd *pd = NULL;
+	struct ibv_cq_ex *ibcq;
+	struct siw_cq *cq;
+	int rv;
+
+	if (attr->wc_flags & ~SIW_SUP_WC_EX_FLAGS) {
+		errno = EOPNOTSUPP;
+		return NULL;
+	}
+	if (attr->comp_mask & IBV_CQ_INIT_ATTR_MASK_PD) {
+		if (!pad_base2siw(attr->parent_domain)) {
+			errno = EINVAL;
+			return NULL;
+		}
+		pd = attr->parent_domain;
+	}
+	cq = calloc(1, sizeof(*cq));
+	if (!cq)
+		return NULL;
+
+	rv = ibv_cmd_create_cq_ex(ctx, attr, &cq->base_cq, &cmd.ibv_cmd,
+				  sizeof(cmd), &resp.ibv_resp, sizeof(resp), 0);
+	if (rv) {
+		verbs_err(verbs_get_ctx(ctx),
+			  "libsiw: CQ creation failed: %d\n", rv);
+		free(cq);
+		errno = rv;
+		return NULL;
+	}
+	if (siw_map_cq(ctx, cq, &resp.drv_payload, pd)) {
+		ibv_cmd_destroy_cq(&cq->base_cq.cq);
+		free(cq);
+		errno = EINVAL;
+		return NULL;
+	}
+	cq->parent_domain = siw_get_parent_domain(pd);
+	ibcq = &cq->base_cq.cq_ex;
+
+	ibcq->start_poll = siw_start_poll;
+	ibcq->next_poll = siw_next_poll;
+	ibcq->end_poll = siw_end_poll;
+	ibcq->read_opcode = siw_cq_read_opcode;
+	ibcq->read_vendor_err = siw_cq_read_vendor_err;
+	ibcq->read_wc_flags = siw_cq_read_wc_flags;
+	if (attr->wc_flags & IBV_WC_EX_WITH_BYTE_LEN)
+		ibcq->read_byte_len = siw_cq_read_byte_len;
+	if (attr->wc_flags & IBV_WC_EX_WITH_QP_NUM)
+		ibcq->read_qp_num = siw_cq_read_qp_num;
+
+	return ibcq;
+}
+
 static const struct verbs_context_ops siw_context_ops = {
+	.alloc_parent_domain = siw_alloc_parent_domain,
 	.alloc_pd = siw_alloc_pd,
+	.alloc_td = siw_alloc_td,
 	.async_event = siw_async_event,
 	.create_cq = siw_create_cq,
+	.create_cq_ex = siw_create_cq_ex,
 	.create_qp = siw_create_qp,
+	.create_qp_ex = siw_create_qp_ex,
 	.create_srq = siw_create_srq,
 	.dealloc_pd = siw_free_pd,
+	.dealloc_td = siw_dealloc_td,
 	.dereg_mr = siw_dereg_mr,
 	.destroy_cq = siw_destroy_cq,
 	.destroy_qp = siw_destroy_qp,
@@ -9,6 +9,7 @@
 #include <pthread.h>
 #include <inttypes.h>
 #include <stddef.h>
+#include <stdatomic.h>
 
 #include <infiniband/driver.h>
 #include <infiniband/kern-abi.h>
@@ -17,6 +18,25 @@ struct siw_device {
 	struct verbs_device base_dev;
 };
 
+/* Not taken for objects created under a thread domain */
+struct siw_spinlock {
+	pthread_spinlock_t lock;
+	int need_lock;
+};
+
+struct siw_td {
+	struct ibv_td base_td;
+	atomic_int refcount;
+};
+
+struct siw_pd {
+	struct ibv_pd base_pd;
+	atomic_int refcount;
+	/* Set for a parent domain only */
+	struct siw_pd *protection_domain;
+	struct siw_td *td;
+};
+
 struct siw_srq {
 	struct ibv_srq base_srq;
 	struct siw_rqe *recvq;
@@ -30,13 +50,14 @@ struct siw_mr {
 };
 
 struct siw_qp {
-	struct ibv_qp base_qp;
+	struct verbs_qp base_qp;
 	struct siw_device *siw_dev;
 
 	uint32_t id;
 
-	pthread_spinlock_t sq_lock;
-	pthread_spinlock_t rq_lock;
+	struct siw_spinlock sq_lock;
+	struct siw_spinlock rq_lock;
+	struct siw_pd *parent_domain;
 
 	struct ibv_post_send db_req;
 	struct ib_uverbs_post_send_resp db_resp;
@@ -46,6 +67,11 @@ struct siw_qp {
 	int sq_sig_all;
 	struct siw_sqe *sendq;
 
+	/* ibv_wr_* builder state, between wr_start and wr_complete */
+	uint32_t wr_put;
+	struct siw_sqe *wr_sqe;
+	int wr_err;
+
 	uint32_t num_rqe;
 	uint32_t rq_put;
 	struct siw_rqe *recvq;
@@ -53,7 +79,7 @@ struct siw_qp {
 };
 
 struct siw_cq {
-	struct ibv_cq base_cq;
+	struct verbs_cq base_cq;
 	struct siw_device *siw_dev;
 	uint32_t id;
 
@@ -65,7 +91,11 @@ struct siw_cq {
 	int num_cqe;
 	uint32_t cq_get;
 	struct siw_cqe *queue;
-	pthread_spinlock_t lock;
+	struct siw_spinlock lock;
+	struct siw_pd *parent_domain;
+
+	/* CQE being read between start_poll and end_poll */
+	struct siw_cqe *cur_cqe;
 };
 
 struct siw_context {
@@ -78,14 +108,42 @@ static inline struct siw_context *ctx_ibv2siw(struct ibv_context *base)
 	return container_of(base, struct siw_context, base_ctx.context);
 }
 
+static inline struct siw_td *td_base2siw(struct ibv_td *base)
+{
+	return container_of(base, struct siw_td, base_td);
+}
+
+static inline struct siw_pd *pd_base2siw(struct ibv_pd *base)
+{
+	return container_of(base, struct siw_pd, base_pd);
+}
+
+/* Returns NULL unless base is a parent domain */
+static inline struct siw_pd *pad_base2siw(struct ibv_pd *base)
+{
+	struct siw_pd *pd = base ? pd_base2siw(base) : NULL;
+
+	return (pd && pd->protection_domain) ? pd : NULL;
+}
+
 static inline struct siw_qp *qp_base2siw(struct ibv_qp *base)
 {
-	return container_of(base, struct siw_qp, base_qp);
+	return container_of(base, struct siw_qp, base_qp.qp);
+}
+
+static inline struct siw_qp *qp_ex2siw(struct ibv_qp_ex *base)
+{
+	return container_of(base, struct siw_qp, base_qp.qp_ex);
 }
 
 static inline struct siw_cq *cq_base2siw(struct ibv_cq *base)
 {
-	return container_of(base, struct siw_cq, base_cq);
+	return container_of(base, struct siw_cq, base_cq.cq);
+}
+
+static inline struct siw_cq *cq_ex2siw(struct ibv_cq_ex *base)
+{
+	return container_of(base, struct siw_cq, base_cq.cq_ex);
 }
 
 static inline struct siw_mr *mr_base2siw(struct verbs_mr *base)
@@ -98,9 +156,21 @@ static inline struct siw_srq *srq_base2siw(struct ibv_srq *base)
 	return container_of(base, struct siw_srq, base_srq);
 }
 
+static inline void siw_spin_lock(struct siw_spinlock *lock)
+{
+	if (lock->need_lock)
+		pthread_spin_lock(&lock->lock);
+}
+
+static inline void siw_spin_unlock(struct siw_spinlock *lock)
+{
+	if (lock->need_lock)
+		pthread_spin_unlock(&lock->lock);
+}
+
 static inline int siw_db(struct siw_qp *qp)
 {
-	int rv = write(qp->base_qp.context->cmd_fd, &qp->db_req,
+	int rv = write(qp->base_qp.qp.context->cmd_fd, &qp->db_req,
 		       sizeof(qp->db_req));
 
 	return rv == sizeof(qp->db_req) ? 0 : rv;